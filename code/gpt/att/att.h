@@ -34,7 +34,8 @@ struct TAttentionInfo
     {
         Spans.push_back(span);
     }
-    void AddSpans(const TVector<TAttentionSpan> &vec)
+    template <class TSpanVec>
+    void AddSpans(const TSpanVec &vec)
     {
         for (const TAttentionSpan &span : vec) {
             AddSpan(span);
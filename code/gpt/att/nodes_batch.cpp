@@ -15,17 +15,3 @@ void TNodesBatch::Init(yint attentionWidthCount)
     }
 }
 
-
-void TNodesBatch::AddSample(int idx, const TVector<TLabelIndex> &labels, const TVector<TVector<TAttentionSpan>> &attSpansArr)
-{
-    SampleIndex.push_back(idx);
-    LabelArr.insert(LabelArr.end(), labels.begin(), labels.end());
-    LabelPtr.push_back(YSize(LabelArr));
-    Y_VERIFY(YSize(AttArr) == YSize(attSpansArr));
-    for (yint k = 0; k < YSize(AttArr); ++k) {
-        AttArr[k].AddSpans(attSpansArr[k]);
-        AttArr[k].AddSample();
-    }
-}
-
-
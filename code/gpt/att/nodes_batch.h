@@ -29,7 +29,18 @@ struct TNodesBatch
     TVector<TAttentionInfo> AttArr;
 
     void Init(yint attentionWidthCount);
-    void AddSample(int idx, const TVector<TLabelIndex> &labels, const TVector<TVector<TAttentionSpan>> &attSpansArr);
+    template <class TLabelVec, class TSpanVecVec>
+    void AddSample(int idx, const TLabelVec &labels, const TSpanVecVec &attSpansArr)
+    {
+        SampleIndex.push_back(idx);
+        LabelArr.insert(LabelArr.end(), labels.begin(), labels.end());
+        LabelPtr.push_back(YSize(LabelArr));
+        Y_VERIFY(YSize(AttArr) == YSize(attSpansArr));
+        for (yint k = 0; k < YSize(AttArr); ++k) {
+            AttArr[k].AddSpans(attSpansArr[k]);
+            AttArr[k].AddSample();
+        }
+    }
     yint GetNodeCount() const { return YSize(SampleIndex); }
 };
 
@@ -1,13 +1,14 @@
 #include "stdafx.h"
 #include "sliding_window.h"
 #include <gpt/data/data.h>
+#include <util/arena.h>
 
 
 const yint HASH_VOCAB_SIZE_LN = 11;
 const yint HASH_VOCAB_SIZE = 1ull << HASH_VOCAB_SIZE_LN;
 const yint HASH_VOCAB_COUNT = 3;
 
-static void AddToken(bool hashedVocab, TVector<TLabelIndex> *p, yint token)
+static void AddToken(bool hashedVocab, TArenaVector<TLabelIndex> *p, yint token)
 {
     if (hashedVocab) {
         ui64 hh = 0x9ae16a3b2f90404fULL;
@@ -63,7 +64,7 @@ yint GetNodeCount(yint len)
 }
 
 
-static void AddAttSpans(yint docStart, yint nodeId, yint limitWindow, TVector<TVector<TAttentionSpan>> *pAtt)
+static void AddAttSpans(yint docStart, yint nodeId, yint limitWindow, TArenaVector<TArenaVector<TAttentionSpan>> *pAtt)
 {
     yint attStart = Max<yint>(docStart, nodeId - limitWindow);
     yint attFinish = nodeId - 1;
@@ -80,9 +81,9 @@ static void AddAttSpans(yint docStart, yint nodeId, yint limitWindow, TVector<TV
 static void GenerateAttentionGraph(
     const TModelDim &modelDim, TXRng &rng, float tokenDrop,
     const TFragment &frag, yint lossType,
-    TVector<TVector<TLabelIndex>> *pLabels,
-    TVector<TVector<TVector<TAttentionSpan>>> *pAttArr,
-    TVector<TNodeTarget> *pTargetArr, TVector<yint> *pNodeToSampleIndex)
+    TArenaVector<TArenaVector<TLabelIndex>> *pLabels,
+    TArenaVector<TArenaVector<TArenaVector<TAttentionSpan>>> *pAttArr,
+    TArenaVector<TNodeTarget> *pTargetArr, TArenaVector<yint> *pNodeToSampleIndex)
 {
     bool isHashedVocab = IsHashedVocab(modelDim);
     yint len = YSize(frag.Text);
@@ -210,30 +211,36 @@ static void GenerateAttentionGraph(
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // make train/test contexts
 
+// per fragment graph data is allocated from per thread arena
+static thread_local TArena LabelDataArena;
+
 void InitLabelData(const TModelDim &modelDim, TXRng &rng, float tokenDrop,
     const TVector<TFragment> &fragArr, yint lossType,
     TNodesBatch *pNodes)
 {
     pNodes->Init(modelDim.GetAttentionWidthCount());
 
+    TArenaScope arenaScope(&LabelDataArena);
     for (const TFragment &frag : fragArr) {
         yint ptr = pNodes->GetNodeCount();
 
-        TVector<TVector<TLabelIndex>> fragLabels;
-        TVector<TVector<TVector<TAttentionSpan>>> fragAttSpansArr;
-        TVector<TNodeTarget> fragTargets;
-        TVector<yint> fragNodeToSampleIndex;
+        // previous fragment data is destroyed
+        LabelDataArena.Reset();
+        TArenaVector<TArenaVector<TLabelIndex>> fragLabels;
+        TArenaVector<TArenaVector<TArenaVector<TAttentionSpan>>> fragAttSpansArr;
+        TArenaVector<TNodeTarget> fragTargets;
+        TArenaVector<yint> fragNodeToSampleIndex;
         GenerateAttentionGraph(modelDim, rng, tokenDrop,
             frag, lossType,
             &fragLabels, &fragAttSpansArr, &fragTargets, &fragNodeToSampleIndex);
 
         yint nodeCount = YSize(fragLabels);
         for (yint t = 0; t < nodeCount; ++t) {
-            TVector<TVector<TAttentionSpan>> rrArr;
+            TArenaVector<TArenaVector<TAttentionSpan>> rrArr;
             rrArr.resize(YSize(fragAttSpansArr));
             for (yint wa = 0; wa < YSize(fragAttSpansArr); ++wa) {
                 Y_ASSERT(nodeCount == YSize(fragAttSpansArr[wa]));
-                TVector<TAttentionSpan> rr = fragAttSpansArr[wa][t];
+                TArenaVector<TAttentionSpan> rr = fragAttSpansArr[wa][t];
                 for (TAttentionSpan &span : rr) {
                     span.Shift(ptr);
                 }
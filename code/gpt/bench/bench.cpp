@@ -0,0 +1,418 @@
+#include "stdafx.h"
+#include <gpt/data/data.h>
+#include <gpt/data/bpe.h>
+#include <gpt/data/ppm_window.h>
+#include <gpt/att/sliding_window.h>
+#include <gpt/compute/par_matrix.h>
+#include <gpt/model_params/model_params.h>
+#include <gpt/model_params/sse_utils.h>
+#include <gpt/rng/xrng.h>
+#include <lib/config/config.h>
+#include <lib/hp_timer/hp_timer.h>
+
+
+// microbenchmarks of cpu hot kernels
+// all inputs are synthetic with fixed seeds, results are printed as json
+// -o file - save results, -b file - compare with saved baseline, -f substr - run matching benchmarks only
+// -r ratio - slowdown considered regression (default 1.1), exit code is 1 if any benchmark regressed
+// -i isa - force kernels isa (sse41, avx2, avx_vnni, avx512_vnni), kernels of all supported isa are checked before run
+
+using NCuda::TModelMatrix;
+using NCuda::TModelMatrixScale;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct TBenchResult
+{
+    TString Name;
+    double Ns = 0; // per call
+    double Items = 0; // per call, to get throughput
+};
+
+static TVector<TBenchResult> ResultArr;
+static TString NameFilter;
+
+// best of several rounds, round is long enough to make timer overhead negligible
+template <class TFunc>
+static void RunBench(const TString &name, double items, TFunc func)
+{
+    const yint ROUND_COUNT = 5;
+    const double ROUND_TIME = 0.05;
+    if (!NameFilter.empty() && strstr(name.c_str(), NameFilter.c_str()) == 0) {
+        return;
+    }
+    func(); // warmup
+    yint callCount = 1;
+    for (;;) {
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        for (yint k = 0; k < callCount; ++k) {
+            func();
+        }
+        if (NHPTimer::GetTimePassed(&tStart) > ROUND_TIME) {
+            break;
+        }
+        callCount *= 2;
+    }
+    double best = 1e38;
+    for (yint round = 0; round < ROUND_COUNT; ++round) {
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        for (yint k = 0; k < callCount; ++k) {
+            func();
+        }
+        best = Min(best, NHPTimer::GetTimePassed(&tStart) / callCount);
+    }
+    TBenchResult res;
+    res.Name = name;
+    res.Ns = best * 1e9;
+    res.Items = items;
+    ResultArr.push_back(res);
+    fprintf(stderr, "%-32s %14.1f ns %10.3f ns per item\n", name.c_str(), res.Ns, res.Ns / items);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// synthetic data
+// text of words with skewed frequencies, repeated phrases give ppm something to find
+static void MakeSyntheticText(TXRng &rng, yint len, TVector<char> *pRes)
+{
+    const yint WORD_COUNT = 4000;
+    TVector<TString> words;
+    for (yint k = 0; k < WORD_COUNT; ++k) {
+        TString word;
+        yint wordLen = 1 + rng.Uniform(9);
+        for (yint t = 0; t < wordLen; ++t) {
+            word.push_back('a' + rng.Uniform(26));
+        }
+        if (rng.Uniform(8) == 0) {
+            word[0] += 'A' - 'a';
+        }
+        words.push_back(word);
+    }
+    TVector<char> &res = *pRes;
+    res.resize(0);
+    while (YSize(res) < len) {
+        if (YSize(res) > 1000 && rng.Uniform(16) == 0) {
+            yint start = rng.Uniform(YSize(res) - 200);
+            res.insert(res.end(), res.begin() + start, res.begin() + start + 10 + rng.Uniform(100));
+            continue;
+        }
+        // roughly zipf distribution
+        yint id = (yint)(WORD_COUNT * pow(rng.GenRandReal3(), 3.));
+        const TString &word = words[Min<yint>(id, WORD_COUNT - 1)];
+        res.insert(res.end(), word.begin(), word.end());
+        res.push_back(rng.Uniform(12) == 0 ? '.' : ' ');
+    }
+    res.resize(len);
+}
+
+
+static void FillRandom(TXRng &rng, TArray2D<float> *p, float scale)
+{
+    for (yint y = 0; y < p->GetYSize(); ++y) {
+        for (yint x = 0; x < p->GetXSize(); ++x) {
+            (*p)[y][x] = (rng.GenRandReal3() * 2 - 1) * scale;
+        }
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static void BenchDotInt8(TXRng &rng)
+{
+    for (yint dim : { 256, 4096 }) {
+        TVector<i8> a;
+        TVector<i8> b;
+        for (yint k = 0; k < dim; ++k) {
+            a.push_back(rng.Uniform(255) - 127);
+            b.push_back(rng.Uniform(255) - 127);
+        }
+        volatile i32 sink = 0;
+        RunBench(Sprintf("dot_int8_%d", (int)dim), dim, [&]() {
+            sink = sink + DotInt8(a, b);
+        });
+    }
+}
+
+
+static void BenchSoftMax(TXRng &rng)
+{
+    for (yint dim : { 1024, 50000 }) {
+        TVector<float> logits;
+        for (yint k = 0; k < dim; ++k) {
+            logits.push_back(rng.GenRandReal3() * 20 - 10);
+        }
+        TSoftMaxBuf buf;
+        for (float x : logits) {
+            buf.Add(x);
+        }
+        RunBench(Sprintf("softmax_exp2_%d", (int)dim), dim, [&]() {
+            memcpy(buf.Buf.data(), logits.data(), sizeof(float) * dim);
+            buf.SoftMax();
+        });
+    }
+}
+
+
+static void BenchModelMatrix(TXRng &rng)
+{
+    const yint X_SIZE = 512;
+    const yint Y_SIZE = 4096;
+    const float DELTA_ROW_SCALE = 1e-3f;
+    TArray2D<float> data;
+    data.SetSizes(X_SIZE, Y_SIZE);
+    FillRandom(rng, &data, 1);
+    TModelMatrixRowDisp rowDispData;
+    rowDispData.SetMatrix(data);
+
+    // random int8 delta as devices deliver it
+    TVector<i8> deltaArr;
+    TVector<float> deltaRowScale;
+    for (yint k = 0; k < X_SIZE * Y_SIZE; ++k) {
+        deltaArr.push_back(rng.Uniform(255) - 127);
+    }
+    for (yint y = 0; y < Y_SIZE; ++y) {
+        deltaRowScale.push_back(DELTA_ROW_SCALE);
+    }
+    TModelMatrixInt8Delta int8Delta(deltaArr.data(), X_SIZE, deltaRowScale.data(), X_SIZE, Y_SIZE);
+    TModelMatrixHalfDelta halfDelta;
+    halfDelta.Init(X_SIZE, Y_SIZE);
+    Copy(&halfDelta, int8Delta);
+    double paramCount = X_SIZE * Y_SIZE;
+
+    RunBench("sum_delta", paramCount, [&]() {
+        Add(&halfDelta, int8Delta);
+    });
+    Copy(&halfDelta, int8Delta);
+
+    {
+        TIntrusivePtr<TModelMatrixScale> matrixScale = new TModelMatrixScale(1);
+        TIntrusivePtr<TModelMatrix> matrix = new TModelMatrix();
+        matrix->Allocate(0, matrixScale, MODEL_DISCR_SCALE, X_SIZE, Y_SIZE, MM_DISP_ROW, NCuda::MM_QUANT_NONE, NCuda::MM_SYNC_GRADIENT);
+        matrix->SetData(rowDispData);
+        RunBench("matrix_convert", paramCount, [&]() {
+            matrix->ConvertRows(0, Y_SIZE);
+        });
+    }
+
+    for (EModelMatrixUseRowDisp useRowDisp : { MM_DISP_ROW, MM_DISP_MATRIX }) {
+        const char *suffix = (useRowDisp == MM_DISP_ROW) ? "row_disp" : "matrix_disp";
+        TModelMatrixData matr;
+        matr.Init(X_SIZE, Y_SIZE, useRowDisp);
+        if (useRowDisp == MM_DISP_ROW) {
+            matr.SetData(rowDispData);
+        } else {
+            matr.SetData(data);
+        }
+        RunBench(Sprintf("add_delta_%s", suffix), paramCount, [&]() {
+            matr.AddDelta(halfDelta, 0.99f, 0.01f, 0.999f);
+        });
+
+        TArray2D<float> deltaTail;
+        deltaTail.SetSizes(X_SIZE, Y_SIZE);
+        deltaTail.FillZero();
+        TModelMatrixBitDelta bitDelta;
+        RunBench(Sprintf("compress_delta_%s", suffix), paramCount, [&]() {
+            matr.CompressDelta(halfDelta, &bitDelta, &deltaTail);
+        });
+
+        TModelMatrixBitDelta bitDelta2;
+        TArray2D<float> deltaTail2;
+        deltaTail2.SetSizes(X_SIZE, Y_SIZE);
+        FillRandom(rng, &deltaTail2, DELTA_ROW_SCALE * 100);
+        matr.CompressDelta(halfDelta, &bitDelta2, &deltaTail2);
+        TModelMatrixBitDeltaTail sumTail;
+        sumTail.Init(X_SIZE, Y_SIZE, useRowDisp == MM_DISP_ROW);
+        TModelMatrixBitDelta sumRes;
+        RunBench(Sprintf("sum_bit_delta_%s", suffix), paramCount, [&]() {
+            SumBitDelta(bitDelta, bitDelta2, &sumTail, &sumRes);
+        });
+    }
+}
+
+
+static void BenchPackModelParams(TXRng &rng)
+{
+    const yint VOCAB_SIZE = 8000;
+    TModelDim modelDim;
+    InitModelDim(&modelDim, "e256tt128d4w512", ALIBI_V3, VOCAB_SIZE, MPF_NOFLAGS);
+    TVector<float> biasArr;
+    ClearPodArray(&biasArr, VOCAB_SIZE);
+    TModelParams params;
+    InitModel(&params, rng, modelDim, COMBINER_INIT_RANDOM, biasArr);
+    double paramCount = CountModelSize(params);
+
+    TMemStream packed;
+    RunBench("pack_model_params", paramCount, [&]() {
+        packed.Seek(0);
+        TBufferedStream f(packed, false);
+        PackModelParams(f, params);
+    });
+    TModelParams unpacked;
+    RunBench("unpack_model_params", paramCount, [&]() {
+        packed.Seek(0);
+        TBufferedStream f(packed, true);
+        UnpackModelParams(&unpacked, f);
+    });
+}
+
+
+static void BenchData(TXRng &rng)
+{
+    const yint TEXT_SIZE = 1 << 20;
+    const yint TOKEN_COUNT = 4000;
+    const yint FRAG_LEN = 512;
+    const yint BATCH_SIZE = 16;
+
+    TVector<TVector<char>> textArr;
+    textArr.resize(1);
+    MakeSyntheticText(rng, TEXT_SIZE, &textArr[0]);
+    const TVector<char> &text = textArr[0];
+
+    TTokenizer tokenizer;
+    TVector<TString> words;
+    CollectFrequentWords(textArr, &words, TOKEN_COUNT);
+    CreateWordsetTokenizer(&tokenizer, words, TTokenizer::TK_GREEDY);
+    TVector<TBPEToken> tokens;
+    RunBench("tokenize_greedy", TEXT_SIZE, [&]() {
+        tokens.resize(0);
+        tokenizer.GenWords(text, 0, YSize(text), &tokens);
+    });
+
+    TVector<TBPEToken> ppm;
+    RunBench("window_ppm", YSize(tokens), [&]() {
+        ComputeWindowPPM(tokens, &ppm, tokenizer.GetDocStartToken());
+    });
+
+    TDataset dataset;
+    {
+        TIntrusivePtr<TDatasetBuilder> db = new TDatasetBuilder(&dataset, true, tokenizer);
+        AddDocset(db, tokenizer, textArr, 1, 0.01f);
+    }
+    TXRng fragRng(1313);
+    TVector<TFragment> fragArr;
+    fragArr.resize(BATCH_SIZE);
+    RunBench("make_fragment", FRAG_LEN, [&]() {
+        dataset.MakeFragment(TDataset::TRAIN, fragRng, FRAG_LEN, &fragArr[0]);
+    });
+    for (TFragment &frag : fragArr) {
+        dataset.MakeFragment(TDataset::TRAIN, fragRng, FRAG_LEN, &frag);
+    }
+
+    TModelDim modelDim;
+    InitModelDim(&modelDim, "e256tt128d4w512", ALIBI_V3, tokenizer.GetVocabSize(), MPF_PPM);
+    TXRng graphRng(1313);
+    TNodesBatch nodes;
+    RunBench("attention_graph", FRAG_LEN * BATCH_SIZE, [&]() {
+        InitLabelData(modelDim, graphRng, 0.9f, fragArr, ATT_GRAPH_TRAIN_LOSS, &nodes);
+    });
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static void GetResultJson(TString *pRes)
+{
+    TString &res = *pRes;
+    res = "{\"benchmarks\":[\n";
+    for (yint k = 0; k < YSize(ResultArr); ++k) {
+        const TBenchResult &br = ResultArr[k];
+        res += Sprintf("  {\"name\":\"%s\", \"ns\":%.1f, \"items\":%.0f}%s\n", br.Name.c_str(), br.Ns, br.Items, (k + 1 < YSize(ResultArr)) ? "," : "");
+    }
+    res += "]}\n";
+}
+
+
+// parse json written by GetResultJson()
+static void ParseResultJson(const TVector<char> &json, THashMap<TString, double> *pRes)
+{
+    TString str(json.begin(), json.end());
+    const char *NAME = "\"name\":\"";
+    const char *NS = "\"ns\":";
+    for (const char *ptr = strstr(str.c_str(), NAME); ptr; ptr = strstr(ptr, NAME)) {
+        ptr += strlen(NAME);
+        const char *nameFin = strchr(ptr, '"');
+        const char *ns = strstr(ptr, NS);
+        if (nameFin == 0 || ns == 0) {
+            break;
+        }
+        (*pRes)[TString(ptr, nameFin)] = atof(ns + strlen(NS));
+    }
+}
+
+
+// returns number of regressed benchmarks
+static yint CompareWithBaseline(const TString &fileName, double maxRatio)
+{
+    TVector<char> json;
+    Y_VERIFY(ReadWholeFile(fileName, &json) && "baseline not found");
+    THashMap<TString, double> baseline;
+    ParseResultJson(json, &baseline);
+    yint regressCount = 0;
+    fprintf(stderr, "\ncompare with %s\n", fileName.c_str());
+    for (const TBenchResult &br : ResultArr) {
+        auto it = baseline.find(br.Name);
+        if (it == baseline.end() || it->second <= 0) {
+            fprintf(stderr, "%-32s no baseline\n", br.Name.c_str());
+            continue;
+        }
+        double ratio = br.Ns / it->second;
+        bool isRegression = ratio > maxRatio;
+        regressCount += isRegression;
+        fprintf(stderr, "%-32s %8.3fx%s\n", br.Name.c_str(), ratio, isRegression ? "  REGRESSION" : "");
+    }
+    return regressCount;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    TString outFile;
+    TString baselineFile;
+    double maxRatio = 1.1;
+    TOpt cmdline("o:b:f:r:i:", argc, argv);
+    for (const TOpt::TParam &param : cmdline.Params) {
+        if (param.Name == "o") {
+            outFile = param.Args[0];
+        } else if (param.Name == "b") {
+            baselineFile = param.Args[0];
+        } else if (param.Name == "f") {
+            NameFilter = param.Args[0];
+        } else if (param.Name == "r") {
+            maxRatio = atof(param.Args[0].c_str());
+        } else if (param.Name == "i") {
+            ECpuIsa isa = ISA_SSE41;
+            Y_VERIFY(ParseCpuIsa(param.Args[0], &isa) && "unknown isa");
+            Y_VERIFY(SetCpuIsa(isa) && "isa is not supported by cpu");
+        }
+    }
+    fprintf(stderr, "kernels isa %s, best supported %s\n", GetCpuIsaName(GetCpuIsa()), GetCpuIsaName(DetectCpuIsa()));
+    yint isaErrCount = CheckIsaKernels();
+    if (isaErrCount > 0) {
+        fprintf(stderr, "%d isa kernel checks failed\n", (int)isaErrCount);
+        return 1;
+    }
+
+    TXRng rng(1313);
+    BenchDotInt8(rng);
+    BenchSoftMax(rng);
+    BenchModelMatrix(rng);
+    BenchPackModelParams(rng);
+    BenchData(rng);
+
+    TString json;
+    GetResultJson(&json);
+    printf("%s", json.c_str());
+    if (!outFile.empty()) {
+        TOFStream f(outFile.c_str());
+        f << json.c_str();
+    }
+    if (!baselineFile.empty()) {
+        yint regressCount = CompareWithBaseline(baselineFile, maxRatio);
+        if (regressCount > 0) {
+            fprintf(stderr, "%d benchmarks regressed\n", (int)regressCount);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -430,6 +430,23 @@ static void NormalizeStateBackward(const TArray2D<T1> &state, const TArray2D<T2>
 }
 
 
+// zero dropped channels, channel x is kept if bit (x & 31) of dropTable[x / 32] is set
+template <class T>
+static void ApplyDropout(TArray2D<T> *p, const TVector<ui32> &dropTable)
+{
+    yint len = p->GetYSize();
+    yint dim = p->GetXSize();
+    Y_ASSERT(YSize(dropTable) * 32 == dim);
+    for (yint t = 0; t < len; ++t) {
+        for (yint x = 0; x < dim; ++x) {
+            if ((dropTable[x / 32] & (1u << (x & 31))) == 0) {
+                (*p)[t][x] = 0;
+            }
+        }
+    }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Attention
 
@@ -601,7 +618,7 @@ struct TAttentionFB
 static void AddLookupProduct(
     const TModelDim &modelDim,
     const TVector<const TAttentionParams *> &layerAtt,
-    const TVector<TAttentionFB> &attFBArr,
+    const TVector<TAttentionFB> &attFBArr, const TVector<ui32> &dropTable,
     const TFragmentStates &prevState, TArray2D<TFastFloat> *pWideState, TFragmentStates *pState)
 {
     int dim = modelDim.Dim;
@@ -610,8 +627,10 @@ static void AddLookupProduct(
     yint len = prevState.State.GetYSize();
     Y_ASSERT(dim == prevState.State.GetXSize());
 
+    TArray2D<TFloat> dropState = prevState.State;
+    ApplyDropout(&dropState, dropTable);
     TArray2D<TFastFloat> normState;
-    NormalizeState(&normState, prevState.State, DISCR_I8);
+    NormalizeState(&normState, dropState, DISCR_I8);
 
     pState->State = prevState.State;
     for (const TAttentionParams *pAtt: layerAtt) {
@@ -657,7 +676,7 @@ static void AddLookupProduct(
 static void AddLookupProductBackprop(
     const TModelDim &modelDim,
     const TVector<const TAttentionParams *> &layerAtt,
-    const TVector<TAttentionFB> &attFBArr,
+    const TVector<TAttentionFB> &attFBArr, const TVector<ui32> &dropTable,
     const TFragmentStates &prevState, const TArray2D<TFastFloat> &wideState,
     TFragmentStates *pGrad, TFragmentStates *pWideGrad
     )
@@ -667,8 +686,10 @@ static void AddLookupProductBackprop(
     yint qDim = modelDim.QDim;
     yint ttDim = modelDim.TTDim;
 
+    TArray2D<TFloat> dropState = prevState.State;
+    ApplyDropout(&dropState, dropTable);
     TArray2D<TFastFloat> normState;
-    NormalizeState(&normState, prevState.State, DISCR_I8);
+    NormalizeState(&normState, dropState, DISCR_I8);
 
     TArray2D<TFastFloat> dNormState;
     InitDeltaMatrix(&dNormState, normState);
@@ -760,13 +781,201 @@ static void AddLookupProductBackprop(
         pAtt->V->ApplyDelta(deltaV);
     }
     TArray2D<TFloat> stateGrad;
-    NormalizeStateBackward(prevState.State, dNormState, &stateGrad);
+    NormalizeStateBackward(dropState, dNormState, &stateGrad);
+    ApplyDropout(&stateGrad, dropTable);
     AddScaledMatrix(&pGrad->State, stateGrad, 1);
 
     // can normalize pGrad, all deltas are normalized anyway
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// sampled softmax
+// candidates are sampleCount draws from exp2(bias) shared by all nodes and targets of all nodes
+// softmax of a node is computed over sampled candidates and its own target, other targets are not part of it
+// sampled candidate logit is corrected by -log2 of its probability to get into the sample, own target is always present and is not corrected
+struct TSampledCandidates
+{
+    TVector<int> CandArr; // token of candidate
+    TVector<int> TokenCand; // candidate of token, -1 if token is not a candidate
+    TVector<bool> IsSampled;
+    TVector<float> CandBias; // bias with inclusion correction for sampled candidates, bias for others
+};
+
+static void SampleCandidates(TXRng &rng, const TVector<float> &bias, yint sampleCount, const TVector<TNodeTarget> &targetArr, TSampledCandidates *p)
+{
+    yint vocabSize = YSize(bias);
+
+    // proposal distribution
+    float maxBias = -1e38f;
+    for (float b : bias) {
+        maxBias = Max(maxBias, b);
+    }
+    TVector<double> cdf;
+    cdf.resize(vocabSize);
+    double sumWeight = 0;
+    for (yint k = 0; k < vocabSize; ++k) {
+        sumWeight += exp2(bias[k] - maxBias);
+        cdf[k] = sumWeight;
+    }
+
+    // unique candidates
+    p->CandArr.resize(0);
+    p->IsSampled.resize(0);
+    p->TokenCand.resize(0);
+    p->TokenCand.resize(vocabSize, -1);
+    auto addCand = [&](int token, bool isSampled) {
+        if (p->TokenCand[token] < 0) {
+            p->TokenCand[token] = YSize(p->CandArr);
+            p->CandArr.push_back(token);
+            p->IsSampled.push_back(false);
+        }
+        if (isSampled) {
+            p->IsSampled[p->TokenCand[token]] = true;
+        }
+    };
+    for (yint s = 0; s < sampleCount; ++s) {
+        double x = rng.GenRandReal3() * sumWeight;
+        yint token = lower_bound(cdf.begin(), cdf.end(), x) - cdf.begin();
+        addCand(Min<yint>(token, vocabSize - 1), true);
+    }
+    for (const TNodeTarget &nt : targetArr) {
+        addCand(nt.TargetId, false);
+    }
+
+    yint candCount = YSize(p->CandArr);
+    p->CandBias.resize(candCount);
+    for (yint c = 0; c < candCount; ++c) {
+        int token = p->CandArr[c];
+        p->CandBias[c] = bias[token];
+        if (p->IsSampled[c]) {
+            double q = exp2(bias[token] - maxBias) / sumWeight;
+            double sampleProb = -expm1(sampleCount * log1p(-Min(q, 1 - 1e-12)));
+            p->CandBias[c] -= log2(Max(sampleProb, 1e-30));
+        }
+    }
+}
+
+// logitArr[node][cand] is log2 scale logit without bias, pGrad[node][cand] gets target one hot minus prediction
+// returns sum of target log probabilities
+static double ComputeSampledSoftmaxGrad(const TSampledCandidates &cands, const TVector<float> &bias, const TVector<TNodeTarget> &targetArr,
+    const TArray2D<TFastFloat> &logitArr, TArray2D<TFastFloat> *pGrad)
+{
+    yint candCount = YSize(cands.CandArr);
+    TVector<double> weight;
+    weight.resize(candCount);
+    double sumLogProb = 0;
+    for (const TNodeTarget &nt : targetArr) {
+        yint t = nt.Node;
+        yint targetCand = cands.TokenCand[nt.TargetId];
+        double maxLogit = logitArr[t][targetCand] + bias[nt.TargetId];
+        for (yint c = 0; c < candCount; ++c) {
+            if (cands.IsSampled[c] && c != targetCand) {
+                maxLogit = Max<double>(maxLogit, logitArr[t][c] + cands.CandBias[c]);
+            }
+        }
+        double sumWeight = 0;
+        for (yint c = 0; c < candCount; ++c) {
+            double w = 0;
+            if (c == targetCand) {
+                w = exp2(logitArr[t][c] + bias[nt.TargetId] - maxLogit);
+            } else if (cands.IsSampled[c]) {
+                w = exp2(logitArr[t][c] + cands.CandBias[c] - maxLogit);
+            }
+            weight[c] = w;
+            sumWeight += w;
+        }
+        for (yint c = 0; c < candCount; ++c) {
+            (*pGrad)[t][c] += -weight[c] / sumWeight;
+        }
+        (*pGrad)[t][targetCand] += 1;
+        sumLogProb += log(weight[targetCand] / sumWeight);
+    }
+    return sumLogProb;
+}
+
+
+double CheckSampledSoftmaxGrad(const TVector<float> &bias, yint sampleCount, yint drawCount)
+{
+    const yint NODE_COUNT = 256;
+    const double LOGIT_DISP = 2;
+    TXRng rng(1313);
+    yint vocabSize = YSize(bias);
+
+    // random logits, targets are drawn from the model prediction
+    TArray2D<TFastFloat> logitArr;
+    logitArr.SetSizes(vocabSize, NODE_COUNT);
+    TArray2D<double> fullGrad;
+    fullGrad.SetSizes(vocabSize, NODE_COUNT);
+    TVector<TNodeTarget> targetArr;
+    for (yint t = 0; t < NODE_COUNT; ++t) {
+        TVector<double> prob;
+        prob.resize(vocabSize);
+        double maxLogit = -1e38;
+        for (yint k = 0; k < vocabSize; ++k) {
+            logitArr[t][k] = GenNormal(rng) * LOGIT_DISP;
+            maxLogit = Max<double>(maxLogit, logitArr[t][k] + bias[k]);
+        }
+        double sumWeight = 0;
+        for (yint k = 0; k < vocabSize; ++k) {
+            prob[k] = exp2(logitArr[t][k] + bias[k] - maxLogit);
+            sumWeight += prob[k];
+        }
+        double x = rng.GenRandReal3() * sumWeight;
+        yint target = vocabSize - 1;
+        for (yint k = 0; k < vocabSize; ++k) {
+            x -= prob[k];
+            if (x < 0) {
+                target = k;
+                break;
+            }
+        }
+        for (yint k = 0; k < vocabSize; ++k) {
+            fullGrad[t][k] = -prob[k] / sumWeight;
+        }
+        fullGrad[t][target] += 1;
+        targetArr.push_back(TNodeTarget(t, target));
+    }
+
+    // average sampled gradient over draws
+    TArray2D<double> avrgGrad;
+    avrgGrad.SetSizes(vocabSize, NODE_COUNT);
+    avrgGrad.FillZero();
+    TSampledCandidates cands;
+    for (yint iter = 0; iter < drawCount; ++iter) {
+        SampleCandidates(rng, bias, sampleCount, targetArr, &cands);
+        yint candCount = YSize(cands.CandArr);
+        TArray2D<TFastFloat> candLogit;
+        candLogit.SetSizes(candCount, NODE_COUNT);
+        for (yint t = 0; t < NODE_COUNT; ++t) {
+            for (yint c = 0; c < candCount; ++c) {
+                candLogit[t][c] = logitArr[t][cands.CandArr[c]];
+            }
+        }
+        TArray2D<TFastFloat> gradArr;
+        gradArr.SetSizes(candCount, NODE_COUNT);
+        gradArr.FillZero();
+        ComputeSampledSoftmaxGrad(cands, bias, targetArr, candLogit, &gradArr);
+        for (yint t = 0; t < NODE_COUNT; ++t) {
+            for (yint c = 0; c < candCount; ++c) {
+                avrgGrad[t][cands.CandArr[c]] += gradArr[t][c] / drawCount;
+            }
+        }
+    }
+
+    // relative l2 distance
+    double sum2diff = 0;
+    double sum2 = 0;
+    for (yint t = 0; t < NODE_COUNT; ++t) {
+        for (yint k = 0; k < vocabSize; ++k) {
+            sum2diff += Sqr(avrgGrad[t][k] - fullGrad[t][k]);
+            sum2 += Sqr(fullGrad[t][k]);
+        }
+    }
+    return sqrt(sum2diff / sum2);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 //
 class TComputeContext : public IComputeContext
@@ -784,8 +993,14 @@ class TComputeContext : public IComputeContext
     bool HasAsyncOps = false;
     TNodesBatch Nodes;
     TVector<ui32> DropTable;
+    TVector<ui32> KeepDropTable;
+    double SumTrainErr = 0;
+    double SumTrainCount = 0;
+    yint SampledSoftmaxCount = 0;
+    TXRng Rng;
 public:
-    TComputeContext(TIntrusivePtr<IModel> model, yint nodeCount) : Model(model), MaxNodeCount(nodeCount)
+    TComputeContext(TIntrusivePtr<IModel> model, yint nodeCount, yint sampledSoftmaxCount)
+        : Model(model), MaxNodeCount(nodeCount), SampledSoftmaxCount(sampledSoftmaxCount), Rng(1313)
     {
         TModelDim modelDim = Model->GetModelDim();
         LayerArr.resize(YSize(modelDim.Layers));
@@ -839,8 +1054,8 @@ public:
     void Init(yint deviceId) override
     {
         Y_ASSERT(deviceId == 0);
-        Y_ASSERT(DropTable[0] == 0xffffffff); // TODO support dropout in cpu implementation
         TModelDim modelDim = Model->GetModelDim();
+        Y_VERIFY(YSize(DropTable) == CalcDropTableSize(modelDim));
         yint len = Nodes.GetNodeCount();
         Y_ASSERT(len <= MaxNodeCount);
         yint depth = YSize(modelDim.Layers);
@@ -851,6 +1066,7 @@ public:
         LabelArr = Nodes.LabelArr;
         LabelPtr = Nodes.LabelPtr;
         KeepTarget = Nodes.Target;
+        KeepDropTable = DropTable;
         yint attentionWidthCount = modelDim.GetAttentionWidthCount();
         AttArr.resize(attentionWidthCount);
         for (yint wa = 0; wa < attentionWidthCount; ++wa) {
@@ -891,7 +1107,7 @@ public:
         // apply layers
         for (yint d = 0; d < YSize(LayerArr); ++d) {
             AllStates[d + 1] = AllStates[d];
-            AddLookupProduct(modelDim, LayerArr[d], AttArr, AllStates[d], &WideState, &AllStates[d + 1]);
+            AddLookupProduct(modelDim, LayerArr[d], AttArr, KeepDropTable, AllStates[d], &WideState, &AllStates[d + 1]);
         }
 
         NormalizeState(&FinalNormState, AllStates.back().State, DISCR_NONE);
@@ -932,10 +1148,67 @@ public:
         return sum / count;
     }
 
+    // average target log prob over Backprop() calls since previous call
     float GetAvrgTrainErr() override
     {
-        Y_ASSERT(0 && "not implemented");
-        return 0;
+        float res = (SumTrainCount > 0) ? SumTrainErr / SumTrainCount : 0;
+        SumTrainErr = 0;
+        SumTrainCount = 0;
+        return res;
+    }
+
+
+    // sampled softmax final layer gradient, see SampleCandidates()
+    // used only if SampledSoftmaxCount is below vocab size, full softmax is computed otherwise
+    void BackpropFinalLayerSampled(TArray2D<TFastFloat> *pNormStateGrad)
+    {
+        TModelDim modelDim = Model->GetModelDim();
+        yint len = YSize(LabelPtr) - 1;
+        yint dim = modelDim.Dim;
+        yint vocabSize = modelDim.VocabSize;
+        const TVector<float> &bias = Model->GetBias();
+
+        TSampledCandidates cands;
+        SampleCandidates(Rng, bias, SampledSoftmaxCount, KeepTarget, &cands);
+        const TVector<int> &candArr = cands.CandArr;
+        yint candCount = YSize(candArr);
+
+        // candidate logits
+        const TArray2D<float> &finalLayer = GetData(Model->GetFinalLayer());
+        TArray2D<TFastFloat> candLayer;
+        candLayer.SetSizes(dim, candCount);
+        for (yint c = 0; c < candCount; ++c) {
+            int token = candArr[c];
+            for (yint x = 0; x < dim; ++x) {
+                candLayer[c][x] = finalLayer[token][x];
+            }
+        }
+        TArray2D<TFastFloat> logitArr;
+        MulForward(FinalNormState, candLayer, &logitArr);
+        ScaleMatrix(&logitArr, CalcDotScaleFinalLayer(dim));
+
+        TArray2D<TFastFloat> gradArr;
+        gradArr.SetSizes(candCount, len);
+        gradArr.FillZero();
+        SumTrainErr += ComputeSampledSoftmaxGrad(cands, bias, KeepTarget, logitArr, &gradArr);
+        SumTrainCount += YSize(KeepTarget);
+        ScaleMatrix(&gradArr, CalcDotScaleFinalLayer(dim) * LOG2);
+
+        MulBackwardWithAccum(pNormStateGrad, candLayer, gradArr);
+
+        if (modelDim.HasFlag(MPF_TUNE_FINAL_LAYER)) {
+            TArray2D<float> deltaCand;
+            SumRankOne(FinalNormState, &deltaCand, gradArr);
+            TArray2D<float> deltaFinalLayer;
+            deltaFinalLayer.SetSizes(dim, vocabSize);
+            deltaFinalLayer.FillZero();
+            for (yint c = 0; c < candCount; ++c) {
+                for (yint x = 0; x < dim; ++x) {
+                    deltaFinalLayer[candArr[c]][x] = deltaCand[c][x];
+                }
+            }
+            Model->GetFinalLayer()->ApplyDelta(deltaFinalLayer);
+        }
     }
 
 
@@ -944,17 +1217,27 @@ public:
         TModelDim modelDim = Model->GetModelDim();
         yint len = YSize(LabelPtr) - 1;
         int dim = modelDim.Dim;
+        bool useSampledSoftmax = SampledSoftmaxCount > 0 && SampledSoftmaxCount < modelDim.VocabSize;
 
         TVector<TVector<float>> predArr;
-        ComputeForward(&predArr, 0);
-        Y_ASSERT(YSize(predArr) == len);
+        if (useSampledSoftmax) {
+            ComputeForward(0, 0);
+        } else {
+            ComputeForward(&predArr, 0);
+            Y_ASSERT(YSize(predArr) == len);
+        }
 
         Y_ASSERT(!HasAsyncOps);
         Model->StartIteration(step, addToModel);
 
         TFragmentStates grad;
         grad.SetLength(len, modelDim.Dim);
-        {
+        if (useSampledSoftmax) {
+            TArray2D<TFastFloat> normStateGrad;
+            InitDeltaMatrix(&normStateGrad, FinalNormState);
+            BackpropFinalLayerSampled(&normStateGrad);
+            NormalizeStateBackward(AllStates.back().State, normStateGrad, &grad.State);
+        } else {
             // final soft max gradient
             TArray2D<TFastFloat> gradArr;
             gradArr.SetSizes(modelDim.VocabSize, len);
@@ -964,6 +1247,8 @@ public:
                     gradArr[nt.Node][q] += -predArr[nt.Node][q];
                 }
                 gradArr[nt.Node][nt.TargetId] += 1;
+                SumTrainErr += log(predArr[nt.Node][nt.TargetId]);
+                SumTrainCount += 1;
             }
 
             // can be omitted, gradient scale does not change anything due to gradient normalization
@@ -987,7 +1272,7 @@ public:
         TFragmentStates wideGrad = grad;
         wideGrad.Clear();
         for (yint d = YSize(LayerArr) - 1; d >= 0; --d) {
-            AddLookupProductBackprop(modelDim, LayerArr[d], AttArr, AllStates[d], WideState, &grad, &wideGrad);
+            AddLookupProductBackprop(modelDim, LayerArr[d], AttArr, KeepDropTable, AllStates[d], WideState, &grad, &wideGrad);
         }
 
         // modify embedding
@@ -1010,8 +1295,8 @@ public:
     }
 };
 
-TIntrusivePtr<IComputeContext> CreateContext(TIntrusivePtr<IModel> pModel, yint nodeCount)
+TIntrusivePtr<IComputeContext> CreateContext(TIntrusivePtr<IModel> pModel, yint nodeCount, yint sampledSoftmaxCount)
 {
-    return new TComputeContext(pModel, nodeCount);
+    return new TComputeContext(pModel, nodeCount, sampledSoftmaxCount);
 }
 }
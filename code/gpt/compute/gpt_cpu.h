@@ -3,5 +3,8 @@
 
 namespace NCPU_GPT
 {
-TIntrusivePtr<IComputeContext> CreateContext(TIntrusivePtr<IModel> pModel, yint nodeCount);
+// sampledSoftmaxCount > 0 enables sampled softmax in Backprop(), final layer gradient uses targets and sampledSoftmaxCount negatives only
+TIntrusivePtr<IComputeContext> CreateContext(TIntrusivePtr<IModel> pModel, yint nodeCount, yint sampledSoftmaxCount = 0);
+// relative l2 distance between sampled softmax logit gradient averaged over drawCount samples and full softmax gradient on random logits
+double CheckSampledSoftmaxGrad(const TVector<float> &bias, yint sampleCount, yint drawCount);
 }
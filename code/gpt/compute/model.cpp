@@ -85,6 +85,8 @@ class TModel : public IModel
             quant = MM_QUANT_2BIT;
         } else if (ModelDim.HasFlag(MPF_SIM_QUANT_4BIT)) {
             quant = MM_QUANT_4BIT;
+        } else if (ModelDim.HasFlag(MPF_SIM_QUANT_158BIT)) {
+            quant = MM_QUANT_158BIT;
         }
 
         MatrixScale = new TModelMatrixScale(maxMatrixCount);
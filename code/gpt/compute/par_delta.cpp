@@ -95,14 +95,11 @@ inline void AddRow(TModelMatrixHalfDelta::TRow &row, yint xSize, ui16 *dstArg, c
 }
 
 
-void Copy(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta)
+void Copy(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta, yint yBeg, yint yFin)
 {
     yint xSize = delta.XSize;
-    yint ySize = delta.YSize;
-    p->Delta.resize(xSize * ySize);
-    p->Rows.resize(ySize);
-    for (yint y = 0; y < ySize; ++y) {
-        TModelMatrixHalfDelta::TRow &row = p->Rows[y];
+    Y_ASSERT(YSize(p->Delta) == xSize * delta.YSize && YSize(p->Rows) == delta.YSize);
+    for (yint y = yBeg; y < yFin; ++y) {
         const i8 *src = delta.GetRow(y);
         ui16 *dst = &p->Delta[y * xSize];
         float rowScale = delta.RowScale[y];
@@ -110,12 +107,18 @@ void Copy(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta)
     }
 }
 
+void Copy(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta)
+{
+    p->Delta.resize(delta.XSize * delta.YSize);
+    p->Rows.resize(delta.YSize);
+    Copy(p, delta, 0, delta.YSize);
+}
 
-void Add(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta)
+
+void Add(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta, yint yBeg, yint yFin)
 {
     yint xSize = delta.XSize;
-    yint ySize = delta.YSize;
-    for (yint y = 0; y < ySize; ++y) {
+    for (yint y = yBeg; y < yFin; ++y) {
         TModelMatrixHalfDelta::TRow &row = p->Rows[y];
         const i8 *src = delta.GetRow(y);
         ui16 *dst = &p->Delta[y * xSize];
@@ -130,6 +133,11 @@ void Add(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta)
     }
 }
 
+void Add(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta)
+{
+    Add(p, delta, 0, delta.YSize);
+}
+
 
 void Compress(TModelMatrixInt8Delta *p, const TArray2D<float> &data)
 {
@@ -228,29 +236,47 @@ void SumBitDelta(const TModelMatrixBitDelta &a, const TModelMatrixBitDelta &b, T
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-bool TModelMatrixData::AddDelta(const TModelMatrixHalfDelta &delta, float rowDispDecay, float step, float shrinkMult)
+bool TModelMatrixData::BeginAddDelta(const TModelMatrixHalfDelta &delta, float rowDispDecay, float step, float shrinkMult)
 {
-    yint xSize = Matr.GetXSize();
-    yint ySize = Matr.GetYSize();
-
+    TAddDeltaParams &p = AddDeltaParams;
+    p.RowDispDecay = rowDispDecay;
+    p.Step = step;
+    p.ShrinkMult = shrinkMult;
     if (HasRowDisp()) {
         SumWeight = SumWeight * rowDispDecay + 1;
-        float m2scale = 1 / SumWeight;
-        for (int y = 0; y < ySize; ++y) {
-            RowDisp[y] *= rowDispDecay;
-            RowSum2Cache[y] *= Sqr(shrinkMult);
-            RowScale[y] *= shrinkMult;
+        p.Scale = 1 / SumWeight;
+    } else {
+        float sum2 = delta.CalcSum2();
+        if (sum2 == 0 && shrinkMult == 1) {
+            return false;
         }
-        for (yint y = 0; y < ySize; ++y) {
+        p.Scale = (sum2 > 0) ? step / sqrtf(sum2) : 0;
+        RowSum2Cache.yresize(Matr.GetYSize());
+    }
+    return true;
+}
+
+
+// single pass over the rows, row dispersion decay, normalization and delta apply are fused
+void TModelMatrixData::AddDeltaRows(const TModelMatrixHalfDelta &delta, yint yBeg, yint yFin)
+{
+    const TAddDeltaParams &p = AddDeltaParams;
+    yint xSize = Matr.GetXSize();
+
+    if (HasRowDisp()) {
+        float m2scale = p.Scale;
+        for (yint y = yBeg; y < yFin; ++y) {
             const TModelMatrixHalfDelta::TRow &row = delta.Rows[y];
             float deltaSum2 = row.Sum2;
+            RowDisp[y] *= p.RowDispDecay;
+            RowScale[y] *= p.ShrinkMult;
             if (deltaSum2 > 0) {
                 RowDisp[y] += deltaSum2;
                 // add row
                 __m256 rowSum2 = _mm256_setzero_ps();
                 const __m128i *deltaPtr = (const __m128i *)delta.GetRow(y);
                 __m256 *matrPtr = (__m256 *) & Matr[y][0];
-                __m256 scale = _mm256_set1_ps(row.Scale * step / sqrt(RowDisp[y] * m2scale));
+                __m256 scale = _mm256_set1_ps(row.Scale * p.Step / sqrt(RowDisp[y] * m2scale));
                 __m256 shrink = _mm256_set1_ps(RowScale[y]);
                 for (yint x8 = 0; x8 < xSize / 8; ++x8) {
                     __m256 deltaVal = _mm256_cvtph_ps(deltaPtr[x8]);
@@ -260,35 +286,46 @@ bool TModelMatrixData::AddDelta(const TModelMatrixHalfDelta &delta, float rowDis
                 }
                 RowSum2Cache[y] = HorizontalSum(rowSum2);
                 RowScale[y] = 1;
+            } else {
+                RowSum2Cache[y] *= Sqr(p.ShrinkMult);
             }
         }
-        Sum2 = CalcSum2Cached();
 
     } else {
-        float sum2 = delta.CalcSum2();
-        if (sum2 == 0 && shrinkMult == 1) {
-            return false;
-        }
         // fast add delta
-        float globalScale = (sum2 > 0) ? step / sqrtf(sum2) : 0;
-        __m256 shrink = _mm256_set1_ps(shrinkMult);
-        __m256 newSum2 = _mm256_setzero_ps();
-        for (int y = 0; y < ySize; ++y) {
+        __m256 shrink = _mm256_set1_ps(p.ShrinkMult);
+        for (yint y = yBeg; y < yFin; ++y) {
             const TModelMatrixHalfDelta::TRow &row = delta.Rows[y];
-            __m256 scale = _mm256_set1_ps(globalScale * row.Scale);
+            __m256 scale = _mm256_set1_ps(p.Scale * row.Scale);
             __m256 rowSum2 = _mm256_setzero_ps();
             const __m128i *deltaPtr = (const __m128i *)delta.GetRow(y);
             __m256 *matrPtr = (__m256 *) & Matr[y][0];
-            for (int x8 = 0; x8 < xSize / 8; ++x8) {
+            for (yint x8 = 0; x8 < xSize / 8; ++x8) {
                 __m256 deltaVal = _mm256_cvtph_ps(deltaPtr[x8]);
                 __m256 val = _mm256_add_ps(_mm256_mul_ps(matrPtr[x8], shrink), _mm256_mul_ps(deltaVal, scale));
                 matrPtr[x8] = val;
                 rowSum2 = _mm256_add_ps(rowSum2, _mm256_mul_ps(val, val));
             }
-            newSum2 = _mm256_add_ps(newSum2, rowSum2);
+            RowSum2Cache[y] = HorizontalSum(rowSum2);
         }
-        Sum2 = HorizontalSum(newSum2);
     }
+}
+
+
+void TModelMatrixData::EndAddDelta()
+{
+    // sum row stats in fixed order, result does not depend on row ranges split
+    Sum2 = CalcSum2Cached();
+}
+
+
+bool TModelMatrixData::AddDelta(const TModelMatrixHalfDelta &delta, float rowDispDecay, float step, float shrinkMult)
+{
+    if (!BeginAddDelta(delta, rowDispDecay, step, shrinkMult)) {
+        return false;
+    }
+    AddDeltaRows(delta, 0, Matr.GetYSize());
+    EndAddDelta();
     return true;
 }
 
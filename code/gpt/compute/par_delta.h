@@ -52,7 +52,9 @@ public:
 };
 
 void Copy(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta);
+void Copy(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta, yint yBeg, yint yFin); // p should be allocated
 void Add(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta);
+void Add(TModelMatrixHalfDelta *p, const TModelMatrixInt8Delta &delta, yint yBeg, yint yFin);
 void Compress(TModelMatrixInt8Delta *p, const TArray2D<float> &data);
 
 
@@ -118,6 +120,15 @@ class TModelMatrixData
     TVector<float> RowScale;
     float Sum2 = 0;
     TVector<float> RowSum2Cache;
+
+    struct TAddDeltaParams
+    {
+        float RowDispDecay = 0;
+        float Step = 0;
+        float ShrinkMult = 0;
+        float Scale = 0; // inverse sum weight with row disp, global delta scale otherwise
+    };
+    TAddDeltaParams AddDeltaParams;
 public:
     SAVELOAD(Matr, SumWeight, RowDisp, RowScale);
 
@@ -163,6 +174,15 @@ private:
         }
     }
 
+    // copy in place, keep memory placement of Matr
+    void CopyMatrix(const TArray2D<float> &data)
+    {
+        yint xSize = Matr.GetXSize();
+        for (yint y = 0; y < Matr.GetYSize(); ++y) {
+            memcpy(Matr.GetRow(y), data.GetRow(y), sizeof(float) * xSize);
+        }
+    }
+
     void OnDataUpdate()
     {
         if (HasRowDisp()) {
@@ -215,14 +235,14 @@ public:
     {
         Y_VERIFY(!HasRowDisp());
         Y_VERIFY(data.GetXSize() == Matr.GetXSize() && data.GetYSize() == Matr.GetYSize());
-        Matr = data;
+        CopyMatrix(data);
         OnDataUpdate();
     }
     void SetData(const TModelMatrixRowDisp &data)
     {
         Y_VERIFY(HasRowDisp());
         Y_VERIFY(data.GetXSize() == Matr.GetXSize() && data.GetYSize() == Matr.GetYSize());
-        Matr = data.GetMatrix();
+        CopyMatrix(data.GetMatrix());
         RowDisp = data.GetRowDisp();
         SumWeight = data.GetSumWeight();
         OnDataUpdate();
@@ -230,6 +250,11 @@ public:
 
     // delta ops
     bool AddDelta(const TModelMatrixHalfDelta &delta, float rowDispDecay, float step, float shrinkMult);
+    // row range parallel AddDelta(), AddDeltaRows() can be called concurrently for disjoint row ranges
+    // BeginAddDelta() returns false if there is nothing to add
+    bool BeginAddDelta(const TModelMatrixHalfDelta &delta, float rowDispDecay, float step, float shrinkMult);
+    void AddDeltaRows(const TModelMatrixHalfDelta &delta, yint yBeg, yint yFin);
+    void EndAddDelta();
     bool AddBitDelta(const TModelMatrixBitDelta &bitDelta, float rowDispDecay, float step, float shrinkMult);
     void CompressDelta(const TModelMatrixHalfDelta &delta, TModelMatrixBitDelta *pBitDelta, TArray2D<float> *pDeltaTail);
 };
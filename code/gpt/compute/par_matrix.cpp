@@ -1,6 +1,11 @@
 #include "stdafx.h"
 #include "par_matrix.h"
+#include <gpt/model_params/model_params.h>
 #include <gpt/model_params/sse_utils.h>
+#include <gpt/model_params/sim_quant.h>
+#include <gpt/rng/xrng.h>
+#include <lib/hp_timer/hp_timer.h>
+#include <lib/prof/prof.h>
 #include <immintrin.h>
 
 
@@ -8,6 +13,21 @@ const float ROW_DISP_DECAY = 0.99f;
 
 
 yint MatrixAddWorkerThreadCount = 0;
+EMatrixAddNuma MatrixAddNuma = MA_NUMA_NONE;
+
+bool ParseMatrixAddNuma(const TString &name, EMatrixAddNuma *p)
+{
+    if (name == "none") {
+        *p = MA_NUMA_NONE;
+    } else if (name == "local") {
+        *p = MA_NUMA_LOCAL;
+    } else if (name == "interleave") {
+        *p = MA_NUMA_INTERLEAVE;
+    } else {
+        return false;
+    }
+    return true;
+}
 
 namespace NCuda
 {
@@ -39,22 +59,8 @@ static struct TInitBitTable
     TInitBitTable()
     {
         for (yint a = 0; a < 256; ++a) {
-            i8 x = a;
-            if (x < -24) {
-                QBitRecode2bit[a] = -36;
-            } else if (x < 0) {
-                QBitRecode2bit[a] = -12;
-            } else if (x <= 24) {
-                QBitRecode2bit[a] = 12;
-            } else {
-                QBitRecode2bit[a] = 36;
-            }
-        }
-        for (yint a = 0; a < 256; ++a) {
-            i8 x = a;
-            yint xx = x;
-            yint bitVal = ClampVal<yint>((xx + 4 + 9 * 8) / 9, 0, 15); // 4.88512
-            QBitRecode4bit[a] = bitVal * 9 + 4 - 9 * 8;
+            QBitRecode2bit[a] = SimQuant2bit(a);
+            QBitRecode4bit[a] = SimQuant4bit(a);
         }
     }
 } initBitTable;
@@ -67,14 +73,7 @@ static void ConvertToFastMatrixFloat(i8 *dst, const float *src, __m256 mult, int
     if (quant == MM_QUANT_158BIT) {
         // 1.58 bit
         for (yint x = 0; x < xSize; ++x) {
-            //dst[x] = (src[x] > 0) ? 32 : -32;
-            if (dst[x] < -15) {
-                dst[x] = -32;
-            } else if (dst[x] > 15) {
-                dst[x] = 32;
-            } else {
-                dst[x] = 0;
-            }
+            dst[x] = SimQuant158bit(dst[x]);
         }
     } else if (quant == MM_QUANT_2BIT) {
         for (yint x = 0; x < xSize; ++x) {
@@ -155,20 +154,37 @@ void TModelMatrix::AddDeviceToSumDelta(yint deviceId)
 }
 
 
-void TModelMatrix::Convert()
+void TModelMatrix::AddDeviceToSumDelta(yint deviceId, yint yBeg, yint yFin)
+{
+    TModelMatrixInt8Delta delta = DeviceArr[deviceId]->GetDelta();
+    if (HasDelta) {
+        Add(&SumDelta, delta, yBeg, yFin);
+    } else {
+        Copy(&SumDelta, delta, yBeg, yFin);
+    }
+}
+
+
+void TModelMatrix::PrepareConvert()
 {
     yint xSize = Matr.GetXSize();
     yint ySize = Matr.GetYSize();
 
     float sko = sqrt(Matr.GetSum2() / (xSize * ySize));
     float discrScale = sko * DiscrScale;
-    __m256 mult = _mm256_set1_ps((sko == 0) ? 0 : (1 / discrScale));
+    ConvertMult = (sko == 0) ? 0 : (1 / discrScale);
 
     MatrixScale->SetScale(MatrixScaleIndex, discrScale);
+}
 
+
+void TModelMatrix::ConvertRows(yint yBeg, yint yFin)
+{
+    yint xSize = Matr.GetXSize();
+    __m256 mult = _mm256_set1_ps(ConvertMult);
     TMemoryBlob fastMem = FastHost.GetHostMem();
     bool hasRowDisp = Matr.HasRowDisp();
-    for (yint y = 0; y < ySize; ++y) {
+    for (yint y = yBeg; y < yFin; ++y) {
         __m256 rowMult = mult;
         if (hasRowDisp) { // always predicted correctly
             rowMult = _mm256_mul_ps(mult, _mm256_set1_ps(Matr.GetRowScale(y)));
@@ -180,6 +196,13 @@ void TModelMatrix::Convert()
 }
 
 
+void TModelMatrix::Convert()
+{
+    PrepareConvert();
+    ConvertRows(0, Matr.GetYSize());
+}
+
+
 void TModelMatrix::AddDelta(const TTrainingStep &step)
 {
     Y_ASSERT(HasDelta);
@@ -194,6 +217,38 @@ void TModelMatrix::AddDelta(const TTrainingStep &step)
 }
 
 
+bool TModelMatrix::BeginAddDelta(const TTrainingStep &step)
+{
+    Y_ASSERT(HasDelta);
+    Y_ASSERT(*OpPointer == OP_ADD_DELTA);
+    if (!Matr.BeginAddDelta(SumDelta, ROW_DISP_DECAY, step.Rate, step.GetShrinkMult())) {
+        SetOp(OP_NONE);
+        return false;
+    }
+    return true;
+}
+
+
+void TModelMatrix::AddDeltaRows(yint yBeg, yint yFin)
+{
+    Matr.AddDeltaRows(SumDelta, yBeg, yFin);
+}
+
+
+void TModelMatrix::EndAddDelta()
+{
+    Matr.EndAddDelta();
+    PrepareConvert();
+}
+
+
+void TModelMatrix::OnAddDeltaComplete()
+{
+    SetOp(OP_NONE);
+    HasDelta = false;
+}
+
+
 void TModelMatrix::AddBitDelta(const TTrainingStep &step)
 {
     Y_ASSERT(*OpPointer == OP_ADD_BIT_DELTA);
@@ -213,6 +268,25 @@ void TModelMatrix::ExtractDelta(TModelMatrixBitDelta *pBitDelta, TArray2D<float>
 }
 
 
+// pinned host buffers can not be moved, they are placed by allocating matrix on a thread bound to the node
+void TModelMatrix::SetNumaPlacement(EMatrixAddNuma numa, yint node)
+{
+    yint xSize = Matr.GetXSize();
+    yint ySize = Matr.GetYSize();
+    void *matrPtr = Matr.GetRow(0);
+    yint matrSize = xSize * ySize * sizeof(float);
+    void *deltaPtr = SumDelta.Delta.data();
+    yint deltaSize = YSize(SumDelta.Delta) * sizeof(SumDelta.Delta[0]);
+    if (numa == MA_NUMA_LOCAL) {
+        SetMemoryNumaNode(matrPtr, matrSize, node);
+        SetMemoryNumaNode(deltaPtr, deltaSize, node);
+    } else if (numa == MA_NUMA_INTERLEAVE) {
+        SetMemoryInterleaved(matrPtr, matrSize);
+        SetMemoryInterleaved(deltaPtr, deltaSize);
+    }
+}
+
+
 void TModelMatrix::GetFastFloatData(TArray2D<float> *p) const
 {
     yint xSize = Matr.GetXSize();
@@ -280,12 +354,160 @@ void TModelMatrix::ApplyDelta(const TArray2D<float> &data)
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
+// work stealing scheduler
+// each matrix is polled by a single worker, new ops are converted to tasks
+// delta summation and delta add are split into row ranges, largest tasks run first, idle workers steal tasks of others
+// delta add is performed in two phases, conversion to fast matrix needs sum2 of the whole updated matrix
+void TCPUMatrixAdd::AddRowTasks(yint k, ETask taskType, yint deviceId, TVector<TTask> *pRes)
+{
+    TModelMatrix *matrix = MatrixArr[k].Get();
+    yint xSize = matrix->GetXSize();
+    yint ySize = matrix->GetYSize();
+    yint rowCount = WorkStealing ? Max<yint>(1, ROW_TASK_PARAM_COUNT / xSize) : ySize;
+    yint taskCount = DivCeil(ySize, rowCount);
+    TMatrixState &ms = *MatrixStateArr[k];
+    ms.IsBusy = true;
+    ms.TaskCount = taskCount;
+    for (yint yBeg = 0; yBeg < ySize; yBeg += rowCount) {
+        TTask task;
+        task.Type = taskType;
+        task.Matrix = k;
+        task.DeviceId = deviceId;
+        task.YBeg = yBeg;
+        task.YFin = Min(ySize, yBeg + rowCount);
+        task.ParamCount = (task.YFin - task.YBeg) * xSize;
+        pRes->push_back(task);
+    }
+}
+
+
+void TCPUMatrixAdd::OnSumDeltaComplete(yint k)
+{
+    MatrixArr[k]->OnSumDeltaComplete();
+    // count if all devices are ready
+    yint deviceCount = YSize(DeviceArr);
+    if (deviceCount > 1) {
+        if (++MatrixReadyDeviceCount[k] < deviceCount) {
+            return;
+        }
+        MatrixReadyDeviceCount[k] = 0;
+    }
+    volatile int &op = MatrixOpArr[k];
+    Y_VERIFY(op == TModelMatrix::OP_NONE);
+    if (AddToModel == GRADIENT_ACCUMULATE) {
+        return;
+    }
+    op = TModelMatrix::OP_NEW_DELTA;
+}
+
+
+void TCPUMatrixAdd::PushTasks(yint workerId, TVector<TTask> *pTasks)
+{
+    TWorkerData &w = *WorkerArr[workerId];
+    // owner and thieves take the oldest task from the top, push largest tasks first so they run first
+    Sort(pTasks->begin(), pTasks->end(), [](const TTask &a, const TTask &b) { return a.ParamCount > b.ParamCount; });
+    for (const TTask &task : *pTasks) {
+        if (!w.TaskQueue.Push(task)) {
+            RunTask(workerId, task);
+        }
+    }
+}
+
+
+void TCPUMatrixAdd::RunTask(yint workerId, const TTask &task)
+{
+    yint k = task.Matrix;
+    TModelMatrix *matrix = MatrixArr[k].Get();
+    TMatrixState &ms = *MatrixStateArr[k];
+    bool isLast = true;
+    if (task.Type == TASK_SUM_DELTA) {
+        {
+            PROF_SCOPE("sum_delta");
+            matrix->AddDeviceToSumDelta(task.DeviceId, task.YBeg, task.YFin);
+        }
+        isLast = (ms.TaskCount.fetch_add(-1) == 1);
+        if (isLast) {
+            OnSumDeltaComplete(k);
+        }
+    } else if (task.Type == TASK_ADD_DELTA_ROWS) {
+        {
+            PROF_SCOPE("add_delta");
+            matrix->AddDeltaRows(task.YBeg, task.YFin);
+        }
+        isLast = (ms.TaskCount.fetch_add(-1) == 1);
+        if (isLast) {
+            // all rows are updated, start conversion
+            matrix->EndAddDelta();
+            TVector<TTask> convertTasks;
+            AddRowTasks(k, TASK_CONVERT_ROWS, 0, &convertTasks);
+            PushTasks(workerId, &convertTasks);
+            return;
+        }
+    } else if (task.Type == TASK_CONVERT_ROWS) {
+        {
+            PROF_SCOPE("convert");
+            matrix->ConvertRows(task.YBeg, task.YFin);
+        }
+        isLast = (ms.TaskCount.fetch_add(-1) == 1);
+        if (isLast) {
+            matrix->OnAddDeltaComplete();
+        }
+    } else if (task.Type == TASK_ADD_BIT_DELTA) {
+        PROF_SCOPE("add_bit_delta");
+        matrix->AddBitDelta(Step);
+        ms.TaskCount = 0;
+    } else {
+        Y_VERIFY(0 && "unknown task");
+    }
+    if (isLast) {
+        ms.IsBusy = false;
+    }
+}
+
+
+// run own tasks or steal one, returns false if there was nothing to do
+bool TCPUMatrixAdd::RunTasks(yint workerId)
+{
+    TWorkerData &w = *WorkerArr[workerId];
+    TTask task;
+    bool res = false;
+    while (w.TaskQueue.PopOldest(&task)) {
+        RunTask(workerId, task);
+        res = true;
+    }
+    if (res || !WorkStealing) {
+        return res;
+    }
+    yint workerCount = YSize(WorkerArr);
+    for (yint k = 1; k < workerCount; ++k) {
+        TWorkerData &victim = *WorkerArr[(workerId + k) % workerCount];
+        if (victim.NumaNode != w.NumaNode) {
+            continue;
+        }
+        if (victim.TaskQueue.Steal(&task)) {
+            RunTask(workerId, task);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// poll matrices of this worker and schedule tasks for new ops, returns true if all ops are complete
 bool TCPUMatrixAdd::PerformAllOps(yint workerId)
 {
+    TWorkerData &w = *WorkerArr[workerId];
     volatile int *matrixOpArr = MatrixOpArr.data();
     bool res = true;
     yint deviceCount = YSize(DeviceArr);
-    for (yint k : WorkerArr[workerId]->WorkerMatrices) {
+    TVector<TTask> &newTasks = w.NewTasks;
+    newTasks.resize(0);
+    for (yint k : w.WorkerMatrices) {
+        TMatrixState &ms = *MatrixStateArr[k];
+        if (ms.IsBusy) {
+            res = false;
+            continue;
+        }
         volatile int &op = matrixOpArr[k];
         for (yint deviceId = 0; deviceId < deviceCount; ++deviceId) {
             TDeviceData &dev = *DeviceArr[deviceId];
@@ -294,22 +516,15 @@ bool TCPUMatrixAdd::PerformAllOps(yint workerId)
             if (newCudaFlag != dev.PrevCudaAddDeltaFlag[k]) {
                 // avoid modifying cudaAddDeltaFlag from cpu & gpu concurrently
                 dev.PrevCudaAddDeltaFlag[k] = newCudaFlag;
-                // sum delta from this device
-                MatrixArr[k]->AddDeviceToSumDelta(deviceId);
-                // count if all devices are ready
-                if (deviceCount > 1) {
-                    if (++MatrixReadyDeviceCount[k] < deviceCount) {
-                        continue;
-                    }
-                    MatrixReadyDeviceCount[k] = 0;
-                }
-                Y_VERIFY(op == TModelMatrix::OP_NONE);
-                if (AddToModel == GRADIENT_ACCUMULATE) {
-                    continue;
-                }
-                op = TModelMatrix::OP_NEW_DELTA;
+                // sum delta from this device, deltas from different devices are summed one after another
+                AddRowTasks(k, TASK_SUM_DELTA, deviceId, &newTasks);
+                break;
             }
         }
+        if (ms.IsBusy) {
+            res = false;
+            continue;
+        }
         if (op == TModelMatrix::OP_NEW_DELTA) {
             if (DeltaHookArr[k].Get()) {
                 DeltaHookArr[k]->OnDelta();
@@ -318,12 +533,26 @@ bool TCPUMatrixAdd::PerformAllOps(yint workerId)
             }
         }
         if (op == TModelMatrix::OP_ADD_DELTA) {
-            MatrixArr[k]->AddDelta(Step);
+            if (MatrixArr[k]->BeginAddDelta(Step)) {
+                AddRowTasks(k, TASK_ADD_DELTA_ROWS, 0, &newTasks);
+                res = false;
+                continue;
+            }
         } else if (op == TModelMatrix::OP_ADD_BIT_DELTA) {
-            MatrixArr[k]->AddBitDelta(Step);
+            TModelMatrix *matrix = MatrixArr[k].Get();
+            TTask task;
+            task.Type = TASK_ADD_BIT_DELTA;
+            task.Matrix = k;
+            task.ParamCount = matrix->GetXSize() * matrix->GetYSize();
+            ms.IsBusy = true;
+            ms.TaskCount = 1;
+            newTasks.push_back(task);
+            res = false;
+            continue;
         }
         res &= (op == TModelMatrix::OP_NONE);
     }
+    PushTasks(workerId, &newTasks);
     return res;
 }
 
@@ -332,17 +561,27 @@ void TCPUMatrixAdd::WorkerThread()
 {
     yint workerId = WorkerCount.fetch_add(1);
     TWorkerData *data = WorkerArr[workerId].Get();
+    NProf::SetThreadName(Sprintf("matrix add %d", (int)workerId));
+    if (data->NumaNode >= 0) {
+        TVector<int> cpuList;
+        GetNumaNodeCpuList(data->NumaNode, &cpuList);
+        SetThreadAffinity(cpuList);
+    }
     while (!Exit) {
         TVector<TJob> jobArr;
         if (data->JobQueue.DequeueAll(&jobArr)) {
             // the only job is to wait all ops completion
             while (!PerformAllOps(workerId)) {
-                _mm_pause();
+                if (!RunTasks(workerId)) {
+                    _mm_pause();
+                }
             }
             JobCount.fetch_add(-YSize(jobArr));
         } else {
             PerformAllOps(workerId);
-            _mm_pause();
+            if (!RunTasks(workerId)) {
+                _mm_pause();
+            }
         }
     }
 }
@@ -351,6 +590,10 @@ void TCPUMatrixAdd::WorkerThread()
 TCPUMatrixAdd::~TCPUMatrixAdd()
 {
     Exit = true;
+    // workers steal from each other, stop all of them before releasing task queues
+    for (TIntrusivePtr<TWorkerData> &w : WorkerArr) {
+        w->Thr.Join();
+    }
 }
 
 
@@ -369,6 +612,10 @@ TCPUMatrixAdd::TCPUMatrixAdd(yint deviceCount, yint maxDeltaMatrices, IMMDeltaHo
     }
     ClearPodArray(&MatrixOpArr, maxDeltaMatrices);
     ClearPodArray(&MatrixReadyDeviceCount, maxDeltaMatrices);
+    MatrixStateArr.resize(maxDeltaMatrices);
+    for (yint k = 0; k < maxDeltaMatrices; ++k) {
+        MatrixStateArr[k] = new TMatrixState();
+    }
     yint workerCount = BASE_WORKER_COUNT + deviceCount * PER_GPU_WORKER_COUNT;
     if (MatrixAddWorkerThreadCount > 0) {
         workerCount = MatrixAddWorkerThreadCount;
@@ -377,14 +624,50 @@ TCPUMatrixAdd::TCPUMatrixAdd(yint deviceCount, yint maxDeltaMatrices, IMMDeltaHo
     for (yint workerId = 0; workerId < workerCount; ++workerId) {
         WorkerArr[workerId] = new TWorkerData();
     }
+    ClearPodArray(&MatrixNumaNode, maxDeltaMatrices);
+    SetNuma(MatrixAddNuma);
 }
 
 
-void TCPUMatrixAdd::AddMatrix(TIntrusivePtr<TModelMatrix> p)
+void TCPUMatrixAdd::SetNuma(EMatrixAddNuma numa)
+{
+    Y_VERIFY(MatrixCount == 0);
+    Numa = numa;
+    yint nodeCount = (numa == MA_NUMA_LOCAL) ? GetNumaNodeCount() : 0;
+    ClearPodArray(&NumaNodeParamCount, nodeCount);
+    // need at least one worker per node
+    while (YSize(WorkerArr) < nodeCount) {
+        WorkerArr.push_back(new TWorkerData());
+    }
+    for (yint workerId = 0; workerId < YSize(WorkerArr); ++workerId) {
+        WorkerArr[workerId]->NumaNode = (nodeCount > 0) ? workerId % nodeCount : -1;
+    }
+}
+
+
+// place matrix on the least loaded node
+yint TCPUMatrixAdd::AssignNumaNode(yint paramCount)
+{
+    if (NumaNodeParamCount.empty()) {
+        return -1;
+    }
+    yint res = 0;
+    for (yint node = 1; node < YSize(NumaNodeParamCount); ++node) {
+        if (NumaNodeParamCount[node] < NumaNodeParamCount[res]) {
+            res = node;
+        }
+    }
+    NumaNodeParamCount[res] += paramCount;
+    return res;
+}
+
+
+void TCPUMatrixAdd::AddMatrix(TIntrusivePtr<TModelMatrix> p, yint numaNode)
 {
     yint idx = MatrixCount++;
     Y_VERIFY(idx < YSize(MatrixArr));
     MatrixArr[idx] = p;
+    MatrixNumaNode[idx] = numaNode;
     TVector<TCudaPOD<int>> cudaLaunchFlagArr;
     for (yint deviceId = 0; deviceId < YSize(DeviceArr); ++deviceId) {
         cudaLaunchFlagArr.push_back(DeviceArr[deviceId]->CudaAddDeltaFlag.GetElement(idx));
@@ -404,7 +687,7 @@ struct TCPUMatrixWeight
 
 void TCPUMatrixAdd::LaunchWorkers()
 {
-    // load balance, assign matrix to the least loaded worker
+    // load balance, assign matrix to the least loaded worker on the node of the matrix
     TVector<TCPUMatrixWeight> mwArr;
     mwArr.resize(MatrixCount);
     for (yint k = 0; k < MatrixCount; ++k) {
@@ -415,14 +698,18 @@ void TCPUMatrixAdd::LaunchWorkers()
     Sort(mwArr.begin(), mwArr.end(), [](const TCPUMatrixWeight &a, const TCPUMatrixWeight &b) { return a.Weight > b.Weight; });
     for (const TCPUMatrixWeight &mw : mwArr) {
         float minParamCount = 1e38f;
-        TWorkerData *minWorker = WorkerArr[0].Get();
+        TWorkerData *minWorker = nullptr;
         for (yint workerId = 0; workerId < YSize(WorkerArr); ++workerId) {
             TWorkerData *p = WorkerArr[workerId].Get();
+            if (p->NumaNode != MatrixNumaNode[mw.Index]) {
+                continue;
+            }
             if (p->ParamCount < minParamCount) {
                 minParamCount = p->ParamCount;
                 minWorker = p;
             }
         }
+        Y_VERIFY(minWorker);
         minWorker->ParamCount += mw.Weight;
         minWorker->WorkerMatrices.push_back(mw.Index);
     }
@@ -472,15 +759,105 @@ void TCPUMatrixAdd::ResetIterCount()
 }
 
 
+void TCPUMatrixAdd::SimulateDeviceDelta(yint deviceId)
+{
+    volatile int *cudaAddDeltaFlag = DeviceArr[deviceId]->CudaAddDeltaFlag.GetHostPtr();
+    for (yint k = 0; k < MatrixCount; ++k) {
+        cudaAddDeltaFlag[k] += 1;
+    }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 TIntrusivePtr<TModelMatrix> CreateModelMatrix(TIntrusivePtr<TCPUMatrixAdd> cpuAdd, TIntrusivePtr<TModelMatrixScale> pScale,
     float discrScale, yint xSize, yint ySize,
     EModelMatrixUseRowDisp useRowDisp, EModelMatrixQuant quant, EModelMatrixStaleGradient staleGrad)
 {
     TIntrusivePtr<TModelMatrix> res = new TModelMatrix();
-    res->Allocate(cpuAdd->GetDeviceCount(), pScale, discrScale, xSize, ySize, useRowDisp, quant, staleGrad);
-    cpuAdd->AddMatrix(res);
+    EMatrixAddNuma numa = cpuAdd->GetNuma();
+    yint node = cpuAdd->AssignNumaNode(xSize * ySize);
+    auto allocate = [&]() {
+        res->Allocate(cpuAdd->GetDeviceCount(), pScale, discrScale, xSize, ySize, useRowDisp, quant, staleGrad);
+        res->SetNumaPlacement(numa, node);
+    };
+    if (node >= 0) {
+        RunOnNumaNode(node, allocate);
+    } else {
+        allocate();
+    }
+    cpuAdd->AddMatrix(res, node);
     return res;
 }
 
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// host side delta add benchmark on the matrix set of the model, all devices deliver deltas at once
+static void FillRandomDelta(TXRng &rng, TModelMatrix *p, yint deviceId)
+{
+    THost2DPtr<i8> delta = p->GetDelta(deviceId).GetHostPtr();
+    float *rowScale = p->GetRowScale(deviceId).GetHostPtr();
+    for (yint y = 0; y < p->GetYSize(); ++y) {
+        for (yint x = 0; x < p->GetXSize(); ++x) {
+            delta[y][x] = (i8)(rng.GenRand() % 255 - 127);
+        }
+        rowScale[y] = 1.0f / 127;
+    }
+}
+
+static double MeasureMatrixAdd(const TModelDim &modelDim, yint deviceCount, yint iterCount, bool workStealing, EMatrixAddNuma numa)
+{
+    yint maxMatrixCount = modelDim.GetAttentionCount() * 5 + 2;
+    TIntrusivePtr<TModelMatrixScale> matrixScale = new TModelMatrixScale(maxMatrixCount);
+    TIntrusivePtr<TCPUMatrixAdd> matrixAdd = new TCPUMatrixAdd(deviceCount, maxMatrixCount, nullptr);
+    matrixAdd->SetWorkStealing(workStealing);
+    matrixAdd->SetNuma(numa);
+    TVector<TIntrusivePtr<TModelMatrix>> matrixArr;
+    const TModelDim &md = modelDim;
+    matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, md.Dim, md.VocabSize, MM_DISP_ROW, MM_QUANT_NONE, MM_SYNC_GRADIENT));
+    matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, md.Dim, md.LabelCount, MM_DISP_ROW, MM_QUANT_NONE, MM_STALE_GRADIENT));
+    for (yint d = 0; d < YSize(md.Layers); ++d) {
+        for (yint at = 0; at < YSize(md.Layers[d]); ++at) {
+            matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, md.Dim, md.QDim, MM_DISP_MATRIX, MM_QUANT_NONE, MM_SYNC_GRADIENT));
+            matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, md.Dim, md.QDim, MM_DISP_MATRIX, MM_QUANT_NONE, MM_SYNC_GRADIENT));
+            matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, md.Dim, md.TTDim, MM_DISP_MATRIX, MM_QUANT_NONE, MM_SYNC_GRADIENT));
+            matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, md.Dim, md.TTDim, MM_DISP_MATRIX, MM_QUANT_NONE, MM_SYNC_GRADIENT));
+            matrixArr.push_back(CreateModelMatrix(matrixAdd, matrixScale, MODEL_DISCR_SCALE, GetCombinerWidth(md.TTDim), md.Dim, MM_DISP_MATRIX, MM_QUANT_NONE, MM_SYNC_GRADIENT));
+        }
+    }
+    TXRng rng(1313);
+    for (TIntrusivePtr<TModelMatrix> &p : matrixArr) {
+        for (yint deviceId = 0; deviceId < deviceCount; ++deviceId) {
+            FillRandomDelta(rng, p.Get(), deviceId);
+        }
+    }
+    matrixAdd->LaunchWorkers();
+    TTrainingStep step(0.01f, 0);
+    double sumTime = 0;
+    for (yint iter = -1; iter < iterCount; ++iter) {
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        matrixAdd->StartIteration(step, GRADIENT_APPLY);
+        for (yint deviceId = 0; deviceId < deviceCount; ++deviceId) {
+            matrixAdd->SimulateDeviceDelta(deviceId);
+        }
+        matrixAdd->Wait();
+        double t = NHPTimer::GetTimePassed(&tStart);
+        if (iter >= 0) {
+            sumTime += t; // first iteration is warmup
+        }
+    }
+    return sumTime / Max<yint>(1, iterCount);
+}
+
+void BenchmarkMatrixAdd(const TModelDim &modelDim, yint deviceCount, yint iterCount)
+{
+    double staticTime = MeasureMatrixAdd(modelDim, deviceCount, iterCount, false, MatrixAddNuma);
+    double stealTime = MeasureMatrixAdd(modelDim, deviceCount, iterCount, true, MatrixAddNuma);
+    DebugPrintf("matrix add, %g devices, static %g ms, work stealing %g ms per iteration\n", deviceCount * 1., staticTime * 1000, stealTime * 1000);
+    if (GetNumaNodeCount() > 1) {
+        double localTime = MeasureMatrixAdd(modelDim, deviceCount, iterCount, true, MA_NUMA_LOCAL);
+        double interleaveTime = MeasureMatrixAdd(modelDim, deviceCount, iterCount, true, MA_NUMA_INTERLEAVE);
+        DebugPrintf("matrix add, %g numa nodes, local %g ms, interleaved %g ms per iteration\n", GetNumaNodeCount() * 1., localTime * 1000, interleaveTime * 1000);
+    }
+}
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include <lib/cuda/cuda_arrays.h>
 #include "par_delta.h"
+#include <gpt/model_params/model_dim.h>
 #include <gpt/train_config/train_step.h>
 #include <util/thread.h>
 
@@ -21,6 +22,19 @@ struct IMMDeltaHook : public TThrRefBase
     virtual void OnDelta() = 0;
 };
 
+// host side matrix memory placement
+enum EMatrixAddNuma
+{
+    MA_NUMA_NONE,
+    MA_NUMA_LOCAL, // each matrix is placed on a numa node and processed by workers pinned to this node
+    MA_NUMA_INTERLEAVE, // host matrix memory is interleaved across numa nodes
+};
+
+extern EMatrixAddNuma MatrixAddNuma;
+// "none", "local" or "interleave"
+bool ParseMatrixAddNuma(const TString &name, EMatrixAddNuma *p);
+
+
 struct IMMDeltaHookGen : public TThrRefBase
 {
     virtual IMMDeltaHook *CreateDeltaHook(yint idx, TIntrusivePtr<NCuda::TModelMatrix> p) = 0;
@@ -101,7 +115,9 @@ private:
     bool StaleGradientAllowed = false;
     EModelMatrixQuant Quantization;
     volatile int *OpPointer = nullptr;
+    float ConvertMult = 0;
 
+    void PrepareConvert();
     void Convert();
 
 public:
@@ -126,9 +142,18 @@ public:
     //
     void AddToSumDelta(const TModelMatrixInt8Delta &delta);
     void AddDeviceToSumDelta(yint deviceId);
+    void AddDeviceToSumDelta(yint deviceId, yint yBeg, yint yFin); // call OnSumDeltaComplete() after all rows are added
+    void OnSumDeltaComplete() { HasDelta = true; }
     //
     void AddDelta(const TTrainingStep &step);
     void AddBitDelta(const TTrainingStep &step);
+    // row range parallel AddDelta()
+    // BeginAddDelta(), AddDeltaRows() over all rows, EndAddDelta(), ConvertRows() over all rows, OnAddDeltaComplete()
+    bool BeginAddDelta(const TTrainingStep &step);
+    void AddDeltaRows(yint yBeg, yint yFin);
+    void EndAddDelta();
+    void ConvertRows(yint yBeg, yint yFin);
+    void OnAddDeltaComplete();
     void ExtractDelta(TModelMatrixBitDelta *pBitDelta, TArray2D<float> *pDeltaTail);
     bool HasRowDisp() const { return Matr.HasRowDisp(); }
     bool CanUseStaleGradient() const { return StaleGradientAllowed; }
@@ -141,6 +166,7 @@ public:
     void GetDeltaData(TArray2D<float> *p) const;
     void GetDeltaData(TModelMatrixRowDisp *p) const;
     void ApplyDelta(const TArray2D<float> &data);
+    void SetNumaPlacement(EMatrixAddNuma numa, yint node);
     TCuda2DArray<TFastMatrixFloat> &GetFastHost() { return FastHost; }
     TModelMatrixBitDelta &GetBitDelta() { return BitDelta; }
     TCuda2DArray<i8> &GetDelta(yint deviceId) { return DeviceArr[deviceId]->Delta; }
@@ -155,6 +181,8 @@ class TCPUMatrixAdd : public TThrRefBase
     enum {
         BASE_WORKER_COUNT = 2,
         PER_GPU_WORKER_COUNT = 2,
+        TASK_QUEUE_LOG_SIZE = 12,
+        ROW_TASK_PARAM_COUNT = 1 << 18, // matrix ops are split into row ranges of this size
     };
 
     struct TJob
@@ -162,18 +190,48 @@ class TCPUMatrixAdd : public TThrRefBase
         int Op = 0;
     };
 
+    enum ETask
+    {
+        TASK_SUM_DELTA,
+        TASK_ADD_DELTA_ROWS,
+        TASK_CONVERT_ROWS,
+        TASK_ADD_BIT_DELTA,
+    };
+
+    struct TTask
+    {
+        int Type = TASK_SUM_DELTA;
+        int Matrix = 0;
+        int DeviceId = 0;
+        int YBeg = 0;
+        int YFin = 0;
+        yint ParamCount = 0;
+    };
+
     struct TDeviceData : public TThrRefBase
     {
         TCudaVector<int> CudaAddDeltaFlag;
         TVector<int> PrevCudaAddDeltaFlag;
     };
 
+    // matrix ops are performed by tasks, matrix is not polled while it has tasks in flight
+    struct TMatrixState : public TThrRefBase
+    {
+        std::atomic<int> TaskCount;
+        std::atomic<bool> IsBusy;
+
+        TMatrixState() : TaskCount(0), IsBusy(false) {}
+    };
+
     struct TWorkerData : public TThrRefBase
     {
         TSingleConsumerJobQueue<TJob> JobQueue;
+        TWorkStealingDeque<TTask, TASK_QUEUE_LOG_SIZE> TaskQueue;
+        TVector<TTask> NewTasks;
         TThread Thr;
-        TVector<int> WorkerMatrices;
+        TVector<int> WorkerMatrices; // matrices polled by this worker
         float ParamCount = 0;
+        int NumaNode = -1;
     };
 
 private:
@@ -181,6 +239,10 @@ private:
     TVector<TIntrusivePtr<TDeviceData>> DeviceArr;
     TVector<int> MatrixOpArr;
     TVector<int> MatrixReadyDeviceCount;
+    TVector<TIntrusivePtr<TMatrixState>> MatrixStateArr;
+    TVector<int> MatrixNumaNode;
+    TVector<float> NumaNodeParamCount;
+    EMatrixAddNuma Numa = MA_NUMA_NONE;
     TVector<TIntrusivePtr<TModelMatrix>> MatrixArr;
     TIntrusivePtr<IMMDeltaHookGen> DeltaHookGen;
     TVector<TIntrusivePtr<IMMDeltaHook>> DeltaHookArr;
@@ -188,20 +250,31 @@ private:
     std::atomic<yint> WorkerCount;
     std::atomic<yint> JobCount;
     yint MatrixCount = 0;
+    bool WorkStealing = true;
     volatile bool Exit = false;
     TTrainingStep Step;
     EAddToModel AddToModel = GRADIENT_APPLY;
 
+    void AddRowTasks(yint k, ETask taskType, yint deviceId, TVector<TTask> *pRes);
+    void OnSumDeltaComplete(yint k);
+    void PushTasks(yint workerId, TVector<TTask> *pTasks);
+    void RunTask(yint workerId, const TTask &task);
+    bool RunTasks(yint workerId);
     bool PerformAllOps(yint workerId);
     ~TCPUMatrixAdd();
 
 public:
     TCPUMatrixAdd(yint deviceCount, yint maxDeltaMatrices, IMMDeltaHookGen *deltaHookGen);
-    void AddMatrix(TIntrusivePtr<TModelMatrix> p);
+    void SetWorkStealing(bool b) { WorkStealing = b; } // call before LaunchWorkers()
+    void SetNuma(EMatrixAddNuma numa); // call before adding matrices
+    EMatrixAddNuma GetNuma() const { return Numa; }
+    yint AssignNumaNode(yint paramCount);
+    void AddMatrix(TIntrusivePtr<TModelMatrix> p, yint numaNode);
     void LaunchWorkers();
     void StartIteration(const TTrainingStep &step, EAddToModel addToModel); // assume no pending ops at this moment
     void Wait();
     void ResetIterCount();
+    void SimulateDeviceDelta(yint deviceId); // mark deltas of all matrices as computed by device, used in benchmarks
     yint GetDeviceCount() const { return YSize(DeviceArr); }
 
 public:
@@ -213,4 +286,5 @@ TIntrusivePtr<TModelMatrix> CreateModelMatrix(TIntrusivePtr<TCPUMatrixAdd> cpuAd
     float discrScale, yint xSize, yint ySize,
     EModelMatrixUseRowDisp useRowDisp, EModelMatrixQuant quant, EModelMatrixStaleGradient staleGrad);
 
+void BenchmarkMatrixAdd(const TModelDim &modelDim, yint deviceCount, yint iterCount);
 }
@@ -0,0 +1,1046 @@
+#include "stdafx.h"
+#include "cpu_infer.h"
+#include <gpt/model_params/sse_utils.h>
+#include <gpt/model_params/sim_quant.h>
+#include <emmintrin.h>
+
+
+// optimize
+//   DISCR_SCALE <- can use shift for certain discr_scale values
+//   mmap-able model params
+
+namespace NCPUInfer
+{
+
+static i8 ConvertToInt8(float x)
+{
+    int res = _mm_cvtss_si32(_mm_set_ss(x));
+    return ClampVal<int>(res, -127, 127); // -128 is incompatible with signed * unsigned ops
+}
+
+static float ConvertMatrix(const TArray2D<float> &data, TArray2D<i8> *p)
+{
+    yint xSize = data.GetXSize();
+    yint ySize = data.GetYSize();
+    float sum2 = 0;
+    for (yint y = 0; y < ySize; ++y) {
+        for (yint x = 0; x < xSize; ++x) {
+            sum2 += Sqr(data[y][x]);
+        }
+    }
+    float sko = sqrt(sum2 / (xSize * ySize));
+    float discrScale = sko * MODEL_DISCR_SCALE;
+    float mult = (sko == 0) ? 0 : (1 / discrScale);
+    p->SetSizes(xSize, ySize);
+    for (yint y = 0; y < ySize; ++y) {
+        for (yint x = 0; x < xSize; ++x) {
+            (*p)[y][x] = ConvertToInt8(data[y][x] * mult);
+        }
+    }
+    return discrScale;
+}
+
+// values are indices to sorted distinct values, format with enough levels is used if row length allows
+static void PackMatrix(const TArray2D<i8> &src, bool packWeights, TWeightMatrix *p)
+{
+    yint xSize = src.GetXSize();
+    yint ySize = src.GetYSize();
+    TVector<bool> hasValue;
+    hasValue.resize(256, false);
+    for (yint y = 0; y < ySize; ++y) {
+        for (yint x = 0; x < xSize; ++x) {
+            hasValue[src[y][x] + 128] = true;
+        }
+    }
+    TVector<i8> levels;
+    TVector<ui8> valueIndex;
+    ClearPodArray(&valueIndex, 256);
+    for (yint k = 0; k < 256; ++k) {
+        if (hasValue[k]) {
+            valueIndex[k] = YSize(levels);
+            levels.push_back(k - 128);
+        }
+    }
+    p->Format = WF_INT8;
+    if (packWeights && YSize(levels) <= 4 && (xSize % PACK2_CHUNK) == 0) {
+        p->Format = WF_PACK2;
+    } else if (packWeights && YSize(levels) <= 16 && (xSize % PACK4_CHUNK) == 0) {
+        p->Format = WF_PACK4;
+    }
+    p->RowLen = xSize;
+    p->RowCount = ySize;
+    p->RowBytes = (p->Format == WF_PACK2) ? xSize / 4 : (p->Format == WF_PACK4) ? xSize / 2 : xSize;
+    p->Weights = new TWeightData;
+    TVector<ui8> &data = p->Weights->Data;
+    ClearPodArray(&data, ySize * p->RowBytes);
+    if (p->Format == WF_INT8) {
+        for (yint y = 0; y < ySize; ++y) {
+            memcpy(&data[y * p->RowBytes], &src[y][0], xSize);
+        }
+        return;
+    }
+    p->Weights->Levels = levels;
+    p->Weights->Levels.resize(16, 0);
+    TVector<ui8> idx;
+    idx.resize(xSize);
+    for (yint y = 0; y < ySize; ++y) {
+        for (yint x = 0; x < xSize; ++x) {
+            idx[x] = valueIndex[src[y][x] + 128];
+        }
+        if (p->Format == WF_PACK2) {
+            PackIndices2(&data[y * p->RowBytes], idx.data(), xSize);
+        } else {
+            PackIndices4(&data[y * p->RowBytes], idx.data(), xSize);
+        }
+    }
+}
+
+// simQuant rounds values same way as training forward pass does
+static float ConvertMatrix(const TArray2D<float> &data, i8 (*simQuant)(i8), bool packWeights, TWeightMatrix *p)
+{
+    TArray2D<i8> matr;
+    float discrScale = ConvertMatrix(data, &matr);
+    if (simQuant) {
+        for (yint y = 0; y < matr.GetYSize(); ++y) {
+            for (yint x = 0; x < matr.GetXSize(); ++x) {
+                matr[y][x] = simQuant(matr[y][x]);
+            }
+        }
+    }
+    PackMatrix(matr, packWeights, p);
+    return discrScale;
+}
+
+static float ConvertMatrix(TModelMatrixRowDisp &data, TWeightMatrix *p)
+{
+    return ConvertMatrix(data.GetMatrix(), nullptr, false, p);
+}
+
+static void ConvertAtt(const TModelParams::TAttentionMatrices &att, i8 (*simQuant)(i8), bool packWeights, TCPUModelParams::TAttentionMatrices *p)
+{
+    ConvertMatrix(att.QK, simQuant, packWeights, &p->QK);
+    p->QVScale = ConvertMatrix(att.QV, simQuant, packWeights, &p->QV);
+    ConvertMatrix(att.K, simQuant, packWeights, &p->K);
+    p->VScale = ConvertMatrix(att.V, simQuant, packWeights, &p->V);
+    p->CombinerScale = ConvertMatrix(att.Combiner, simQuant, packWeights, &p->Combiner);
+}
+
+static void PrecomputeStart(TCPUModelParams *p);
+
+void ConvertModel(TModelParams &params, TCPUModelParams *p, bool packWeights)
+{
+    p->ModelDim = params.ModelDim;
+    // same precedence as in training
+    i8 (*simQuant)(i8) = nullptr;
+    if (params.ModelDim.HasFlag(MPF_SIM_QUANT_2BIT)) {
+        simQuant = SimQuant2bit;
+    } else if (params.ModelDim.HasFlag(MPF_SIM_QUANT_4BIT)) {
+        simQuant = SimQuant4bit;
+    } else if (params.ModelDim.HasFlag(MPF_SIM_QUANT_158BIT)) {
+        simQuant = SimQuant158bit;
+    }
+    p->LabelEmbedScale = ConvertMatrix(params.LabelEmbed, &p->LabelEmbed);
+    p->LayerArr.resize(YSize(params.LayerArr));
+    for (yint layerId = 0; layerId < YSize(params.LayerArr); ++layerId) {
+        yint cc = YSize(params.LayerArr[layerId]);
+        p->LayerArr[layerId].resize(cc);
+        for (yint k = 0; k < cc; ++k) {
+            TCPUModelParams::TAttentionMatrices &resAtt = p->LayerArr[layerId][k];
+            ConvertAtt(params.LayerArr[layerId][k], simQuant, packWeights, &resAtt);
+            // pick up width
+            const TModelDim::TAttentionPosParams &attPosParams = params.ModelDim.Layers[layerId][k];
+            Y_VERIFY(attPosParams.AlibiHyper == 0 && attPosParams.AlibiSlope == 0); // need support if used
+            Y_VERIFY((attPosParams.AttentionWidthId & (ATT_ID_CREATE_WIDE_FLAG | ATT_ID_USE_WIDE_FLAG)) == 0); // yoco not supported
+            resAtt.AttentionWidth = params.ModelDim.AttentionWidthArr[attPosParams.AttentionWidthId];
+        }
+    }
+    p->FinalLayerScale = ConvertMatrix(params.FinalLayer, &p->FinalLayer);
+    p->Bias = params.Bias;
+
+    // top-k bounds
+    yint vocabSize = YSize(p->Bias);
+    yint dim = p->FinalLayer.GetXSize();
+    p->FinalOrder.resize(vocabSize);
+    for (yint k = 0; k < vocabSize; ++k) {
+        p->FinalOrder[k] = k;
+    }
+    const TVector<float> &bias = p->Bias;
+    Sort(p->FinalOrder.begin(), p->FinalOrder.end(), [&](int a, int b) { return bias[a] > bias[b]; });
+    yint blockCount = DivCeil(vocabSize, FINAL_BLOCK);
+    ClearPodArray(&p->FinalSuffixMaxNorm, blockCount);
+    for (yint blk = blockCount - 1; blk >= 0; --blk) {
+        float maxNorm = (blk + 1 < blockCount) ? p->FinalSuffixMaxNorm[blk + 1] : 0;
+        for (yint k = blk * FINAL_BLOCK, kFinish = Min(vocabSize, k + FINAL_BLOCK); k < kFinish; ++k) {
+            const i8 *row = p->FinalLayer.GetInt8Row(p->FinalOrder[k]);
+            float sum2 = 0;
+            for (yint x = 0; x < dim; ++x) {
+                sum2 += Sqr((float)row[x]);
+            }
+            maxNorm = Max<float>(maxNorm, sqrt(sum2));
+        }
+        p->FinalSuffixMaxNorm[blk] = maxNorm;
+    }
+
+    PrecomputeStart(p);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// linear algebra
+template <class T>
+void PrintVec(const TVector<T> &vec)
+{
+    yint sz = Min<yint>(128, YSize(vec));
+    for (yint i = 0; i < sz; ++i) {
+        DebugPrintf("cpu vec[%g] = %g\n", i * 1., vec[i] * 1.);
+    }
+}
+
+// res[z] = row y + z @ vec
+static void DotRows4(const i8 *vec, const TWeightMatrix &matr, yint y, i32 *res)
+{
+    yint dim = matr.GetXSize();
+    const ui8 *row = matr.GetRow(y);
+    yint stride = matr.RowBytes;
+    if (matr.Format == WF_PACK4) {
+        DotPacked4x4(vec, row, row + stride, row + stride * 2, row + stride * 3, matr.GetLevels(), dim, res);
+    } else if (matr.Format == WF_PACK2) {
+        DotPacked2x4(vec, row, row + stride, row + stride * 2, row + stride * 3, matr.GetLevels(), dim, res);
+    } else {
+        const i8 *row8 = (const i8 *)row;
+        DotInt8x4(vec, row8, row8 + stride, row8 + stride * 2, row8 + stride * 3, dim, res);
+    }
+}
+
+// no single row packed kernels, row is repeated
+static i32 DotRow(const i8 *vec, const TWeightMatrix &matr, yint y)
+{
+    const ui8 *row = matr.GetRow(y);
+    i32 res[4];
+    if (matr.Format == WF_PACK4) {
+        DotPacked4x4(vec, row, row, row, row, matr.GetLevels(), matr.GetXSize(), res);
+    } else if (matr.Format == WF_PACK2) {
+        DotPacked2x4(vec, row, row, row, row, matr.GetLevels(), matr.GetXSize(), res);
+    } else {
+        return DotInt8(vec, (const i8 *)row, matr.GetXSize());
+    }
+    return res[0];
+}
+
+// resArr = kqv @ vecArr
+static void MulForward(const TVector<i8> &vec, const TWeightMatrix &kqv, TVector<i32> *resArr)
+{
+    yint dim = YSize(vec);
+    yint rDim = kqv.GetYSize();
+    Y_ASSERT(dim == kqv.GetXSize());
+    resArr->resize(rDim);
+    i32 *res = resArr->data();
+    yint k = 0;
+    for (; k + 4 <= rDim; k += 4) {
+        DotRows4(vec.data(), kqv, k, res + k);
+    }
+    for (; k < rDim; ++k) {
+        res[k] = DotRow(vec.data(), kqv, k);
+    }
+}
+
+
+static void AddScaled(TVector<float> *pRes, const TVector<i32> &delta, float scale)
+{
+    yint sz = YSize(*pRes);
+    Y_ASSERT(sz == YSize(delta));
+    for (yint k = 0; k < sz; ++k) {
+        (*pRes)[k] += delta[k] * scale;
+    }
+}
+
+
+static void KVProduct(const TVector<i8> &kState, const TVector<float> &valLookup,
+    TVector<i8> *pKVState)
+{
+    yint ttDim = YSize(kState);
+    Y_ASSERT(YSize(valLookup) == ttDim);
+    pKVState->resize(GetCombinerWidth(ttDim));
+    for (int blk = 0; blk < COMBINER_REP; ++blk) {
+        yint base = blk * ttDim;
+        for (yint k = 0; k < ttDim; ++k) {
+            i8 keyShfl = kState[k ^ blk];
+            float value = valLookup[k];
+            (*pKVState)[base + k] = ConvertToInt8(keyShfl * value);
+        }
+    }
+}
+
+
+static void SoftMax(const TVector<float> &bias, const TVector<i32> &vec1, float vecScale1, const TVector<i32> &vec2, float vecScale2, TVector<float> *pPrediction)
+{
+    yint dim = YSize(bias);
+    Y_ASSERT(YSize(vec1) == dim);
+    Y_ASSERT(YSize(vec2) == dim);
+    TSoftMaxBuf buf; // can be static
+    for (yint k = 0; k < dim; ++k) {
+        float w = vec1[k] * vecScale1 + vec2[k] * vecScale2 + bias[k]; // can be vectorized
+        buf.Add(w);
+    }
+    buf.SoftMax();
+    pPrediction->resize(dim);
+    for (yint k = 0; k < dim; ++k) {
+        (*pPrediction)[k] = buf.Buf[k] * buf.Scale;
+    }
+}
+
+
+template <class TSrc>
+static float NormalizeState(TVector<i8> *pRes, const TVector<TSrc> &state)
+{
+    yint dim = YSize(state);
+    pRes->resize(dim);
+    float sum2 = 0;
+    for (yint x = 0; x < dim; ++x) {
+        sum2 += Sqr((float)state[x]);
+    }
+    if (sum2 == 0) {
+        for (yint x = 0; x < dim; ++x) {
+            (*pRes)[x] = 0;
+        }
+        return 0;
+    } else {
+        float sko = sqrt(sum2 / dim);
+        float discrScale = sko * MODEL_DISCR_SCALE;
+        float mult = 1 / discrScale;
+        for (yint x = 0; x < dim; ++x) {
+            (*pRes)[x] = ConvertToInt8(state[x] * mult);
+        }
+        return discrScale;
+    }
+}
+
+
+template <class TSrc>
+static float NormalizeState2(TVector<i8> *pRes1, TVector<i8> *pRes2, const TVector<TSrc> &state)
+{
+    yint dim = YSize(state);
+    pRes1->resize(dim);
+    pRes2->resize(dim);
+    float sum2 = 0;
+    for (yint x = 0; x < dim; ++x) {
+        sum2 += Sqr((float)state[x]);
+    }
+    if (sum2 == 0) {
+        for (yint x = 0; x < dim; ++x) {
+            (*pRes1)[x] = 0;
+            (*pRes2)[x] = 0;
+        }
+        return 0;
+    } else {
+        float sko = sqrt(sum2 / dim);
+        float discrScale = sko * MODEL_DISCR_SCALE;
+        float mult = 1 / discrScale;
+        for (yint x = 0; x < dim; ++x) {
+            float val = state[x] * mult;
+            i8 res1 = ConvertToInt8(val);
+            i8 res2 = ConvertToInt8((val - res1) * 128);
+            (*pRes1)[x] = res1;
+            (*pRes2)[x] = res2;
+        }
+        return discrScale;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Attention
+
+// attend to first len history vectors, position 0 (start token) is attention sink and is always visible
+// attention weights are converted to i8 with common scale and value vectors are summed in integers
+static void ComputeValLookup(yint width, yint qDim, yint ttDim,
+    const TAttentionVecHistory &history, yint len,
+    const TVector<i8> &qkState,
+    TVector<float> *pValLookup)
+{
+    // visible positions are sink + [from, len)
+    yint from = Max<yint>(0, len - width);
+    bool useSink = (from > 0);
+    yint count = len - from;
+
+    TSoftMaxBuf softMax;
+    softMax.Add(0);
+    float attDotScale = CalcDotScaleAttention(qDim);
+    if (useSink) {
+        i32 qProduct = DotInt8(qkState.data(), history.GetQV(0), qDim);
+        softMax.Add(qProduct * history.QVStateScale[0] * attDotScale * MODEL_DISCR_SCALE);
+    }
+    for (yint to = from; to < len; ++to) {
+        i32 qProduct = DotInt8(qkState.data(), history.GetQV(to), qDim);
+        softMax.Add(qProduct * history.QVStateScale[to] * attDotScale * MODEL_DISCR_SCALE);
+    }
+    softMax.SoftMax();
+
+    // i8 weights, scale is picked to map max weight to 127
+    yint sinkOffset = useSink ? 1 : 0;
+    float maxWeight = 0;
+    for (yint z = 1; z <= count + sinkOffset; ++z) {
+        maxWeight = Max(maxWeight, softMax.Buf[z]);
+    }
+    TVector<i32> acc;
+    ClearPodArray(&acc, ttDim);
+    float weightScale = 0;
+    if (maxWeight > 0) {
+        float mult = 127 / maxWeight;
+        weightScale = softMax.Scale * MODEL_DISCR_SCALE / mult;
+        if (useSink) {
+            i8 sinkWeight = ConvertToInt8(softMax.Buf[1] * mult);
+            AddWeightedRowsInt8(&sinkWeight, history.GetV(0), 1, ttDim, acc.data());
+        }
+        const yint WEIGHT_BLOCK = 1024;
+        i8 weightArr[WEIGHT_BLOCK];
+        for (yint blk = 0; blk < count; blk += WEIGHT_BLOCK) {
+            yint blkCount = Min(WEIGHT_BLOCK, count - blk);
+            for (yint z = 0; z < blkCount; ++z) {
+                weightArr[z] = ConvertToInt8(softMax.Buf[blk + z + 1 + sinkOffset] * mult);
+            }
+            AddWeightedRowsInt8(weightArr, history.GetV(from + blk), blkCount, ttDim, acc.data());
+        }
+    }
+
+    TVector<float> &valLookup = *pValLookup;
+    valLookup.resize(ttDim);
+    for (yint x = 0; x < ttDim; ++x) {
+        valLookup[x] = acc[x] * weightScale;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// add product
+
+static void AddLookupProduct(
+    const TModelDim &modelDim,
+    const TVector<TCPUModelParams::TAttentionMatrices> &layerAtt,
+    TVector<TAttentionVecHistory> *pKVCache,
+    TVector<float> *pState)
+{
+    yint dim = modelDim.Dim;
+    yint qDim = modelDim.QDim;
+    yint ttDim = modelDim.TTDim;
+    Y_ASSERT(dim == YSize(*pState));
+    TVector<TAttentionVecHistory> &kvCache = *pKVCache;
+
+    TVector<i8> normState;
+    NormalizeState(&normState, *pState);
+
+    yint attCount = YSize(layerAtt);
+    Y_ASSERT(YSize(kvCache) == attCount);
+    for (yint z = 0; z < attCount; ++z) {
+        const TCPUModelParams::TAttentionMatrices &att = layerAtt[z];
+
+        TVector<i32> qkSrc;
+        MulForward(normState, att.QK, &qkSrc);
+        TVector<i32> qvSrc;
+        MulForward(normState, att.QV, &qvSrc);
+        TVector<i32> kSrc;
+        MulForward(normState, att.K, &kSrc);
+        TVector<i32> vSrc;
+        MulForward(normState, att.V, &vSrc);
+
+        TVector<i8> qk;
+        NormalizeState(&qk, qkSrc);
+        TVector<i8> qv;
+        float qvScale = NormalizeState(&qv, qvSrc) * att.QVScale * MODEL_DISCR_SCALE;
+        TVector<i8> k;
+        NormalizeState(&k, kSrc);
+        TVector<i8> v;
+        NormalizeState(&v, vSrc);
+        //PrintVec(k);
+
+        TVector<float> valLookup;
+        ComputeValLookup(att.AttentionWidth, qDim, ttDim, kvCache[z], kvCache[z].GetLength(), qk, &valLookup);
+
+        kvCache[z].AddVectors(qv, qvScale, v);
+
+        TVector<i8> kv;
+        KVProduct(k, valLookup, &kv);
+        TVector<i32> deltaState;
+        MulForward(kv, att.Combiner, &deltaState);
+        AddScaled(pState, deltaState, att.CombinerScale * MODEL_DISCR_SCALE);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+static void ComputeEmbedding(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TVector<float> *pState)
+{
+    yint dim = params.ModelDim.Dim;
+    TVector<float> &state = *pState;
+    ClearPodArray(&state, dim);
+    for (TLabelIndex label : labels) {
+        const i8 *labelRow = params.LabelEmbed.GetInt8Row(label);
+        for (yint x = 0; x < dim; ++x) {
+            state[x] += labelRow[x] * params.LabelEmbedScale;
+        }
+    }
+}
+
+
+void ComputeFinalPrediction(const TCPUModelParams &params, const TVector<float> &state, TVector<float> *pResPrediction)
+{
+    yint dim = params.ModelDim.Dim;
+    TVector<i8> finalState1;
+    TVector<i8> finalState2;
+    NormalizeState2(&finalState1, &finalState2, state);
+
+    TVector<i32> prediction1;
+    MulForward(finalState1, params.FinalLayer, &prediction1);
+    TVector<i32> prediction2;
+    MulForward(finalState2, params.FinalLayer, &prediction2);
+
+    float finalScale1 = CalcDotScaleFinalLayer(dim) * params.FinalLayerScale * MODEL_DISCR_SCALE;
+    float finalScale2 = finalScale1 / 128;
+    SoftMax(params.Bias, prediction1, finalScale1, prediction2, finalScale2, pResPrediction);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// top-k final layer
+// exact top-k logits without evaluating whole vocab, tokens are scanned by descending bias
+// logit is bounded by bias + |row| * (|state1| * scale1 + |state2| * scale2), scan stops when bound is below k-th best logit
+struct TTokenLogit
+{
+    int Token = 0;
+    float Logit = 0;
+};
+
+static void SelectTop(TVector<TTokenLogit> *p, yint topK)
+{
+    Sort(p->begin(), p->end(), [](const TTokenLogit &a, const TTokenLogit &b) { return a.Logit > b.Logit; });
+    if (YSize(*p) > topK) {
+        p->resize(topK);
+    }
+}
+
+static float CalcNorm(const TVector<i8> &vec)
+{
+    float sum2 = 0;
+    for (i8 x : vec) {
+        sum2 += Sqr((float)x);
+    }
+    return sqrt(sum2);
+}
+
+// pRes gets topK most probable tokens with softmax over them only, in descending order
+void ComputeFinalTopK(const TCPUModelParams &params, const TVector<float> &state, yint topK, TVector<TTokenProb> *pRes)
+{
+    yint dim = params.ModelDim.Dim;
+    yint vocabSize = YSize(params.Bias);
+    // non positive topK selects all tokens, result is full softmax
+    if (topK <= 0 || topK > vocabSize) {
+        topK = vocabSize;
+    }
+    TVector<i8> finalState1;
+    TVector<i8> finalState2;
+    NormalizeState2(&finalState1, &finalState2, state);
+    float finalScale1 = CalcDotScaleFinalLayer(dim) * params.FinalLayerScale * MODEL_DISCR_SCALE;
+    float finalScale2 = finalScale1 / 128;
+    // small margin to keep bound valid under float rounding
+    float boundMult = (CalcNorm(finalState1) * fabs(finalScale1) + CalcNorm(finalState2) * fabs(finalScale2)) * 1.001f;
+
+    TVector<TTokenLogit> top;
+    float threshold = -1e38f;
+    for (yint blk = 0; blk * FINAL_BLOCK < vocabSize; ++blk) {
+        yint beg = blk * FINAL_BLOCK;
+        float bound = params.Bias[params.FinalOrder[beg]] + params.FinalSuffixMaxNorm[blk] * boundMult;
+        if (bound < threshold) {
+            break;
+        }
+        for (yint k = beg, kFinish = Min(vocabSize, beg + FINAL_BLOCK); k < kFinish; ++k) {
+            int token = params.FinalOrder[k];
+            const i8 *row = params.FinalLayer.GetInt8Row(token);
+            i32 prediction1 = DotInt8(finalState1.data(), row, dim);
+            i32 prediction2 = DotInt8(finalState2.data(), row, dim);
+            float w = prediction1 * finalScale1 + prediction2 * finalScale2 + params.Bias[token];
+            if (w > threshold) {
+                TTokenLogit tl;
+                tl.Token = token;
+                tl.Logit = w;
+                top.push_back(tl);
+                if (YSize(top) >= 2 * topK) {
+                    SelectTop(&top, topK);
+                    threshold = top.back().Logit;
+                }
+            }
+        }
+    }
+    SelectTop(&top, topK);
+
+    TSoftMaxBuf buf;
+    for (const TTokenLogit &tl : top) {
+        buf.Add(tl.Logit);
+    }
+    buf.SoftMax();
+    pRes->resize(YSize(top));
+    for (yint k = 0; k < YSize(top); ++k) {
+        (*pRes)[k].Token = top[k].Token;
+        (*pRes)[k].Prob = buf.Buf[k] * buf.Scale;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// start token
+// context always begins with start token, its vectors do not depend on anything and are computed once in ConvertModel
+static bool IsStartPosition(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, const TCPUInferContext &ctx)
+{
+    return !params.StartState.empty() && YSize(labels) == 1 && labels[0] == 0 && ctx.GetLength() == 0;
+}
+
+static void AddStartPosition(const TCPUModelParams &params, TCPUInferContext *pCtx, TVector<float> *pState)
+{
+    for (yint d = 0; d < YSize(params.LayerArr); ++d) {
+        for (yint z = 0; z < YSize(params.LayerArr[d]); ++z) {
+            const TCPUModelParams::TAttentionMatrices &att = params.LayerArr[d][z];
+            pCtx->KVcacheArr[d][z].AddVectors(att.StartQV, att.StartQVScale, att.StartV);
+        }
+    }
+    *pState = params.StartState;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+void ComputeFinalState(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TCPUInferContext *pCtx, TVector<float> *pState)
+{
+    TModelDim modelDim = params.ModelDim;
+
+    if (IsStartPosition(params, labels, *pCtx)) {
+        AddStartPosition(params, pCtx, pState);
+        return;
+    }
+
+    // embedding
+    ComputeEmbedding(params, labels, pState);
+
+    // apply layers
+    for (yint d = 0; d < YSize(params.LayerArr); ++d) {
+        AddLookupProduct(modelDim, params.LayerArr[d], &pCtx->KVcacheArr[d], pState);
+    }
+}
+
+
+void ComputePrediction(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TCPUInferContext *pCtx, TVector<float> *pResPrediction)
+{
+    TVector<float> state;
+    ComputeFinalState(params, labels, pCtx, &state);
+    if (pResPrediction) {
+        ComputeFinalPrediction(params, state, pResPrediction);
+    }
+}
+
+
+// probabilities are normalized over returned topK tokens
+void ComputePredictionTopK(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TCPUInferContext *pCtx, yint topK, TVector<TTokenProb> *pRes)
+{
+    TVector<float> state;
+    ComputeFinalState(params, labels, pCtx, &state);
+    ComputeFinalTopK(params, state, topK, pRes);
+}
+
+
+static void PrecomputeStart(TCPUModelParams *p)
+{
+    p->StartState.clear();
+    TCPUInferContext ctx;
+    ctx.Init(*p);
+    TVector<TLabelIndex> labels;
+    labels.push_back(0);
+    TVector<float> state;
+    ComputeFinalState(*p, labels, &ctx, &state);
+    for (yint d = 0; d < YSize(p->LayerArr); ++d) {
+        for (yint z = 0; z < YSize(p->LayerArr[d]); ++z) {
+            TCPUModelParams::TAttentionMatrices &att = p->LayerArr[d][z];
+            const TAttentionVecHistory &history = ctx.KVcacheArr[d][z];
+            att.StartQV = history.QVState;
+            att.StartQVScale = history.QVStateScale[0];
+            att.StartV = history.VState;
+        }
+    }
+    p->StartState = state;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// batched prefill
+// whole prompt is processed layer by layer, projections are matrix-matrix products
+// per position arithmetic is the same as in ComputePrediction, kv cache and prediction are bit exact to token by token feeding
+const yint MUL_ROW_BLOCK = 32;
+
+// rows [rBeg, rFin) as int8, packed rows are unpacked once for all vectors of the batch
+static void GetRows(const TWeightMatrix &matr, yint rBeg, yint rFin, TVector<i8> *pBuf, TVector<const i8 *> *pRowPtr)
+{
+    yint dim = matr.GetXSize();
+    pRowPtr->resize(0);
+    if (matr.Format == WF_INT8) {
+        for (yint y = rBeg; y < rFin; ++y) {
+            pRowPtr->push_back(matr.GetInt8Row(y));
+        }
+        return;
+    }
+    pBuf->yresize((rFin - rBeg) * dim);
+    for (yint y = rBeg; y < rFin; ++y) {
+        i8 *dst = pBuf->data() + (y - rBeg) * dim;
+        if (matr.Format == WF_PACK4) {
+            UnpackIndices4(dst, matr.GetRow(y), matr.GetLevels(), dim);
+        } else {
+            UnpackIndices2(dst, matr.GetRow(y), matr.GetLevels(), dim);
+        }
+        pRowPtr->push_back(dst);
+    }
+}
+
+// resArr[t] = kqv @ vecArr[t]
+static void MulForward(TThreadPool *pool, const TVector<TVector<i8>> &vecArr, const TWeightMatrix &kqv, TVector<TVector<i32>> *pResArr)
+{
+    yint len = YSize(vecArr);
+    yint dim = kqv.GetXSize();
+    yint rDim = kqv.GetYSize();
+    TVector<TVector<i32>> &resArr = *pResArr;
+    resArr.resize(len);
+    for (yint t = 0; t < len; ++t) {
+        Y_ASSERT(YSize(vecArr[t]) == dim);
+        resArr[t].resize(rDim);
+    }
+    // block of matrix rows is kept in cache while all vectors are multiplied by it
+    auto mulBlock = [&](yint blk) {
+        yint rBeg = blk * MUL_ROW_BLOCK;
+        yint rFin = Min(rDim, rBeg + MUL_ROW_BLOCK);
+        TVector<i8> buf;
+        TVector<const i8 *> rowPtr;
+        GetRows(kqv, rBeg, rFin, &buf, &rowPtr);
+        const i8 *const *rows = rowPtr.data() - rBeg;
+        for (yint t = 0; t < len; ++t) {
+            const i8 *vec = vecArr[t].data();
+            i32 *res = resArr[t].data();
+            yint k = rBeg;
+            for (; k + 4 <= rFin; k += 4) {
+                DotInt8x4(vec, rows[k], rows[k + 1], rows[k + 2], rows[k + 3], dim, res + k);
+            }
+            for (; k < rFin; ++k) {
+                res[k] = DotInt8(vec, rows[k], dim);
+            }
+        }
+    };
+    ParallelFor(pool, 0, DivCeil(rDim, MUL_ROW_BLOCK), mulBlock);
+}
+
+
+// normalized attention vectors of several positions
+struct TAttentionVectors
+{
+    TVector<TVector<i8>> QK;
+    TVector<TVector<i8>> QV;
+    TVector<float> QVScale;
+    TVector<TVector<i8>> K;
+    TVector<TVector<i8>> V;
+};
+
+static void ComputeAttentionVectors(TThreadPool *pool,
+    const TCPUModelParams::TAttentionMatrices &att,
+    const TVector<TVector<i8>> &normState,
+    TAttentionVectors *p)
+{
+    yint len = YSize(normState);
+    TVector<TVector<i32>> qkSrc;
+    MulForward(pool, normState, att.QK, &qkSrc);
+    TVector<TVector<i32>> qvSrc;
+    MulForward(pool, normState, att.QV, &qvSrc);
+    TVector<TVector<i32>> kSrc;
+    MulForward(pool, normState, att.K, &kSrc);
+    TVector<TVector<i32>> vSrc;
+    MulForward(pool, normState, att.V, &vSrc);
+
+    p->QK.resize(len);
+    p->QV.resize(len);
+    p->QVScale.resize(len);
+    p->K.resize(len);
+    p->V.resize(len);
+    ParallelFor(pool, 0, len, [&](yint t) {
+        NormalizeState(&p->QK[t], qkSrc[t]);
+        p->QVScale[t] = NormalizeState(&p->QV[t], qvSrc[t]) * att.QVScale * MODEL_DISCR_SCALE;
+        NormalizeState(&p->K[t], kSrc[t]);
+        NormalizeState(&p->V[t], vSrc[t]);
+    });
+}
+
+static void AddCombinerBatch(TThreadPool *pool,
+    const TCPUModelParams::TAttentionMatrices &att,
+    const TVector<TVector<i8>> &kv,
+    TVector<TVector<float>> *pStateArr)
+{
+    TVector<TVector<i32>> deltaState;
+    MulForward(pool, kv, att.Combiner, &deltaState);
+    ParallelFor(pool, 0, YSize(kv), [&](yint t) {
+        AddScaled(&(*pStateArr)[t], deltaState[t], att.CombinerScale * MODEL_DISCR_SCALE);
+    });
+}
+
+
+static void AddLookupProductBatch(TThreadPool *pool,
+    const TModelDim &modelDim,
+    const TVector<TCPUModelParams::TAttentionMatrices> &layerAtt,
+    TVector<TAttentionVecHistory> *pKVCache,
+    TVector<TVector<float>> *pStateArr)
+{
+    yint qDim = modelDim.QDim;
+    yint ttDim = modelDim.TTDim;
+    TVector<TAttentionVecHistory> &kvCache = *pKVCache;
+    TVector<TVector<float>> &stateArr = *pStateArr;
+    yint len = YSize(stateArr);
+
+    TVector<TVector<i8>> normState(len);
+    ParallelFor(pool, 0, len, [&](yint t) {
+        NormalizeState(&normState[t], stateArr[t]);
+    });
+
+    yint attCount = YSize(layerAtt);
+    Y_ASSERT(YSize(kvCache) == attCount);
+    for (yint z = 0; z < attCount; ++z) {
+        const TCPUModelParams::TAttentionMatrices &att = layerAtt[z];
+        TAttentionVectors vecs;
+        ComputeAttentionVectors(pool, att, normState, &vecs);
+
+        // fill history for all positions first, position t attends to its prefix only
+        TAttentionVecHistory &history = kvCache[z];
+        yint historyStart = history.GetLength();
+        for (yint t = 0; t < len; ++t) {
+            history.AddVectors(vecs.QV[t], vecs.QVScale[t], vecs.V[t]);
+        }
+
+        TVector<TVector<i8>> kv(len);
+        ParallelFor(pool, 0, len, [&](yint t) {
+            TVector<float> valLookup;
+            ComputeValLookup(att.AttentionWidth, qDim, ttDim, history, historyStart + t, vecs.QK[t], &valLookup);
+            KVProduct(vecs.K[t], valLookup, &kv[t]);
+        });
+        AddCombinerBatch(pool, att, kv, &stateArr);
+    }
+}
+
+
+// feed labelsArr positions to context at once, pResPrediction gets prediction after the last one
+void ComputePrefill(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr, TCPUInferContext *pCtx, TVector<float> *pResPrediction)
+{
+    TModelDim modelDim = params.ModelDim;
+    yint len = YSize(labelsArr);
+    if (len == 0) {
+        return;
+    }
+
+    yint start = 0;
+    if (IsStartPosition(params, labelsArr[0], *pCtx)) {
+        TVector<float> startState;
+        AddStartPosition(params, pCtx, &startState);
+        if (len == 1) {
+            if (pResPrediction) {
+                ComputeFinalPrediction(params, startState, pResPrediction);
+            }
+            return;
+        }
+        start = 1;
+    }
+
+    TVector<TVector<float>> stateArr(len - start);
+    for (yint t = start; t < len; ++t) {
+        ComputeEmbedding(params, labelsArr[t], &stateArr[t - start]);
+    }
+
+    for (yint d = 0; d < YSize(params.LayerArr); ++d) {
+        AddLookupProductBatch(pool, modelDim, params.LayerArr[d], &pCtx->KVcacheArr[d], &stateArr);
+    }
+
+    if (pResPrediction) {
+        ComputeFinalPrediction(params, stateArr.back(), pResPrediction);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// batched decoding
+// new positions of several contexts, contexts share projections and final layer matrix-matrix products
+// context can get several consecutive positions, they are added to history first like in prefill
+// per position arithmetic is the same as in ComputePrediction, results are bit exact
+static void AddLookupProductDecodeBatch(TThreadPool *pool,
+    const TModelDim &modelDim,
+    yint d,
+    const TVector<TCPUModelParams::TAttentionMatrices> &layerAtt,
+    const TVector<TCPUInferContext *> &ctxArr,
+    TVector<TVector<float>> *pStateArr)
+{
+    yint qDim = modelDim.QDim;
+    yint ttDim = modelDim.TTDim;
+    TVector<TVector<float>> &stateArr = *pStateArr;
+    yint len = YSize(stateArr);
+
+    TVector<TVector<i8>> normState(len);
+    ParallelFor(pool, 0, len, [&](yint t) {
+        NormalizeState(&normState[t], stateArr[t]);
+    });
+
+    yint attCount = YSize(layerAtt);
+    for (yint z = 0; z < attCount; ++z) {
+        const TCPUModelParams::TAttentionMatrices &att = layerAtt[z];
+        TAttentionVectors vecs;
+        ComputeAttentionVectors(pool, att, normState, &vecs);
+
+        // each position attends to prefix in history of its own context
+        TVector<yint> posArr(len);
+        for (yint t = 0; t < len; ++t) {
+            TAttentionVecHistory &history = ctxArr[t]->KVcacheArr[d][z];
+            posArr[t] = history.GetLength();
+            history.AddVectors(vecs.QV[t], vecs.QVScale[t], vecs.V[t]);
+        }
+        TVector<TVector<i8>> kv(len);
+        ParallelFor(pool, 0, len, [&](yint t) {
+            const TAttentionVecHistory &history = ctxArr[t]->KVcacheArr[d][z];
+            TVector<float> valLookup;
+            ComputeValLookup(att.AttentionWidth, qDim, ttDim, history, posArr[t], vecs.QK[t], &valLookup);
+            KVProduct(vecs.K[t], valLookup, &kv[t]);
+        });
+        AddCombinerBatch(pool, att, kv, &stateArr);
+    }
+}
+
+
+void ComputeDecodeBatch(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr, const TVector<TCPUInferContext *> &ctxArr, TVector<TVector<float>> *pStateArr)
+{
+    yint count = YSize(ctxArr);
+    Y_VERIFY(YSize(labelsArr) == count);
+    TVector<TVector<float>> &resStateArr = *pStateArr;
+    resStateArr.resize(count);
+
+    // start positions are precomputed, the rest is computed together
+    TVector<yint> posArr;
+    TVector<TCPUInferContext *> computeCtxArr;
+    TVector<TVector<float>> stateArr;
+    for (yint k = 0; k < count; ++k) {
+        if (IsStartPosition(params, labelsArr[k], *ctxArr[k])) {
+            AddStartPosition(params, ctxArr[k], &resStateArr[k]);
+        } else {
+            posArr.push_back(k);
+            computeCtxArr.push_back(ctxArr[k]);
+            stateArr.resize(YSize(stateArr) + 1);
+            ComputeEmbedding(params, labelsArr[k], &stateArr.back());
+        }
+    }
+    if (posArr.empty()) {
+        return;
+    }
+
+    for (yint d = 0; d < YSize(params.LayerArr); ++d) {
+        AddLookupProductDecodeBatch(pool, params.ModelDim, d, params.LayerArr[d], computeCtxArr, &stateArr);
+    }
+    for (yint i = 0; i < YSize(posArr); ++i) {
+        resStateArr[posArr[i]].swap(stateArr[i]);
+    }
+}
+
+
+void ComputeFinalPredictionBatch(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<float>> &stateArr, TVector<TVector<float>> *pResPredArr)
+{
+    yint dim = params.ModelDim.Dim;
+    yint count = YSize(stateArr);
+    TVector<TVector<i8>> finalState1(count);
+    TVector<TVector<i8>> finalState2(count);
+    ParallelFor(pool, 0, count, [&](yint t) {
+        NormalizeState2(&finalState1[t], &finalState2[t], stateArr[t]);
+    });
+
+    TVector<TVector<i32>> prediction1;
+    MulForward(pool, finalState1, params.FinalLayer, &prediction1);
+    TVector<TVector<i32>> prediction2;
+    MulForward(pool, finalState2, params.FinalLayer, &prediction2);
+
+    float finalScale1 = CalcDotScaleFinalLayer(dim) * params.FinalLayerScale * MODEL_DISCR_SCALE;
+    float finalScale2 = finalScale1 / 128;
+    pResPredArr->resize(count);
+    ParallelFor(pool, 0, count, [&](yint t) {
+        SoftMax(params.Bias, prediction1[t], finalScale1, prediction2[t], finalScale2, &(*pResPredArr)[t]);
+    });
+}
+
+
+int SampleFromDistr(TXRng &rng, const TVector<float> &distr, float temperature)
+{
+    // use gumbel max trick
+    float best = -1e38f;
+    yint res = 0;
+    for (yint k = 0; k < YSize(distr); ++k) {
+        //float score = distr[k] / -log(rng.GenRandReal3());
+        float score = log(distr[k]) / temperature - log(-log(rng.GenRandReal3()));
+        if (score > best) {
+            best = score;
+            res = k;
+        }
+    }
+    return res;
+}
+
+
+int SampleFromTopK(TXRng &rng, const TVector<TTokenProb> &top, float temperature)
+{
+    float best = -1e38f;
+    yint res = 0;
+    for (const TTokenProb &tp : top) {
+        float score = log(tp.Prob) / temperature - log(-log(rng.GenRandReal3()));
+        if (score > best) {
+            best = score;
+            res = tp.Token;
+        }
+    }
+    return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// memory footprint
+yint GetMatrixBytes(const TWeightMatrix &m)
+{
+    return YSize(m.Weights->Data) + YSize(m.Weights->Levels);
+}
+
+void GetModelMatrices(TCPUModelParams *p, TVector<TWeightMatrix *> *pRes)
+{
+    pRes->push_back(&p->LabelEmbed);
+    for (TVector<TCPUModelParams::TAttentionMatrices> &layer : p->LayerArr) {
+        for (TCPUModelParams::TAttentionMatrices &att : layer) {
+            pRes->push_back(&att.QK);
+            pRes->push_back(&att.QV);
+            pRes->push_back(&att.K);
+            pRes->push_back(&att.V);
+            pRes->push_back(&att.Combiner);
+        }
+    }
+    pRes->push_back(&p->FinalLayer);
+}
+
+yint CalcModelBytes(const TCPUModelParams &params)
+{
+    yint res = GetMatrixBytes(params.LabelEmbed) + GetMatrixBytes(params.FinalLayer) + YSize(params.Bias) * sizeof(float);
+    for (const TVector<TCPUModelParams::TAttentionMatrices> &layer : params.LayerArr) {
+        for (const TCPUModelParams::TAttentionMatrices &att : layer) {
+            res += GetMatrixBytes(att.QK) + GetMatrixBytes(att.QV) + GetMatrixBytes(att.K) + GetMatrixBytes(att.V) + GetMatrixBytes(att.Combiner);
+        }
+    }
+    return res;
+}
+
+yint CalcKVCacheBytes(const TCPUInferContext &ctx)
+{
+    yint res = 0;
+    for (const TVector<TAttentionVecHistory> &layer : ctx.KVcacheArr) {
+        for (const TAttentionVecHistory &history : layer) {
+            res += YSize(history.QVState) + YSize(history.VState) + YSize(history.QVStateScale) * sizeof(float);
+        }
+    }
+    return res;
+}
+}
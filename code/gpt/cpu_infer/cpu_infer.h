@@ -0,0 +1,219 @@
+#pragma once
+#include <gpt/att/nodes_batch.h>
+#include <gpt/model_params/model_dim.h>
+#include <gpt/model_params/model_params.h>
+#include <gpt/rng/xrng.h>
+#include <util/thread.h>
+
+
+// int8 inference of trained model on cpu with kv cache
+namespace NCPUInfer
+{
+// tokens by descending bias are split in FINAL_BLOCK blocks for top-k early exit
+const yint FINAL_BLOCK = 64;
+
+// attention matrix rows are int8 or indices to levels table packed by 4 or 2 bits (see PackIndices4())
+// matrices of models trained with simulated quantization have few distinct values and are packed losslessly
+enum EWeightFormat
+{
+    WF_INT8,
+    WF_PACK4,
+    WF_PACK2,
+};
+
+// matrix content, immutable after conversion and shared by models with identical matrices (see TWeightStore)
+struct TWeightData : public TThrRefBase
+{
+    TVector<ui8> Data;
+    TVector<i8> Levels; // 16 entries for packed formats
+};
+
+struct TWeightMatrix
+{
+    EWeightFormat Format = WF_INT8;
+    yint RowLen = 0;
+    yint RowCount = 0;
+    yint RowBytes = 0;
+    TIntrusivePtr<TWeightData> Weights;
+
+    yint GetXSize() const { return RowLen; }
+    yint GetYSize() const { return RowCount; }
+    const ui8 *GetRow(yint y) const { return &Weights->Data[y * RowBytes]; }
+    const i8 *GetInt8Row(yint y) const
+    {
+        Y_ASSERT(Format == WF_INT8);
+        return (const i8 *)GetRow(y);
+    }
+    const i8 *GetLevels() const { return Weights->Levels.data(); }
+};
+
+struct TCPUModelParams
+{
+    struct TAttentionMatrices
+    {
+        TWeightMatrix QK;
+        TWeightMatrix QV;
+        TWeightMatrix K;
+        TWeightMatrix V;
+        TWeightMatrix Combiner;
+        float QVScale = 0;
+        float VScale = 0;
+        float CombinerScale = 0;
+        int AttentionWidth = 0;
+        // start token vectors, start token is at position 0 of every context
+        TVector<i8> StartQV;
+        float StartQVScale = 0;
+        TVector<i8> StartV;
+    };
+    TModelDim ModelDim;
+    TWeightMatrix LabelEmbed;
+    float LabelEmbedScale = 0;
+    TVector<TVector<TAttentionMatrices>> LayerArr;
+    TWeightMatrix FinalLayer;
+    float FinalLayerScale = 0;
+    TVector<float> Bias;
+    // tokens by descending bias, split in FINAL_BLOCK blocks
+    // max final layer row norm over block and all following blocks bounds logits for top-k early exit
+    TVector<int> FinalOrder;
+    TVector<float> FinalSuffixMaxNorm;
+    // state after all layers for start token
+    TVector<float> StartState;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Attention
+// vectors of all positions are kept in contiguous arrays
+struct TAttentionVecHistory
+{
+    yint QDim = 0;
+    yint TTDim = 0;
+    TVector<i8> QVState;
+    TVector<float> QVStateScale;
+    TVector<i8> VState;
+
+    void AddVectors(const TVector<i8> &qv, float qvScale, const TVector<i8> &v)
+    {
+        if (QVStateScale.empty()) {
+            QDim = YSize(qv);
+            TTDim = YSize(v);
+        }
+        Y_ASSERT(YSize(qv) == QDim && YSize(v) == TTDim);
+        QVState.insert(QVState.end(), qv.begin(), qv.end());
+        QVStateScale.push_back(qvScale);
+        VState.insert(VState.end(), v.begin(), v.end());
+    }
+    yint GetLength() const { return YSize(QVStateScale); }
+    void Truncate(yint len)
+    {
+        Y_ASSERT(len <= GetLength());
+        QVState.resize(len * QDim);
+        QVStateScale.resize(len);
+        VState.resize(len * TTDim);
+    }
+    // append positions [from, to) of src
+    void AddRange(const TAttentionVecHistory &src, yint from, yint to)
+    {
+        Y_ASSERT(from <= to && to <= src.GetLength());
+        if (QVStateScale.empty()) {
+            QDim = src.QDim;
+            TTDim = src.TTDim;
+        }
+        Y_ASSERT(QDim == src.QDim && TTDim == src.TTDim);
+        QVState.insert(QVState.end(), src.QVState.begin() + from * QDim, src.QVState.begin() + to * QDim);
+        QVStateScale.insert(QVStateScale.end(), src.QVStateScale.begin() + from, src.QVStateScale.begin() + to);
+        VState.insert(VState.end(), src.VState.begin() + from * TTDim, src.VState.begin() + to * TTDim);
+    }
+    const i8 *GetQV(yint t) const { return &QVState[t * QDim]; }
+    const i8 *GetV(yint t) const { return &VState[t * TTDim]; }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// context of one sequence
+struct TCPUInferContext
+{
+    TVector<TVector<TAttentionVecHistory>> KVcacheArr;
+
+public:
+    void Init(const TCPUModelParams &params)
+    {
+        yint depth = YSize(params.LayerArr);
+        KVcacheArr.resize(depth);
+        for (yint d = 0; d < depth; ++d) {
+            yint count = YSize(params.LayerArr[d]);
+            KVcacheArr[d].resize(count);
+        }
+    }
+    // empty context of the same model as src
+    void InitLike(const TCPUInferContext &src)
+    {
+        yint depth = YSize(src.KVcacheArr);
+        KVcacheArr.resize(depth);
+        for (yint d = 0; d < depth; ++d) {
+            KVcacheArr[d].resize(YSize(src.KVcacheArr[d]));
+        }
+    }
+    yint GetLength() const
+    {
+        if (KVcacheArr.empty() || KVcacheArr[0].empty()) {
+            return 0;
+        }
+        return KVcacheArr[0][0].GetLength();
+    }
+    // drop positions starting from len, used to roll back rejected speculative tokens
+    void Truncate(yint len)
+    {
+        for (TVector<TAttentionVecHistory> &layer : KVcacheArr) {
+            for (TAttentionVecHistory &history : layer) {
+                history.Truncate(len);
+            }
+        }
+    }
+    // append positions [from, to) of src, used to fork from cached prefix
+    void AddRange(const TCPUInferContext &src, yint from, yint to)
+    {
+        Y_ASSERT(YSize(KVcacheArr) == YSize(src.KVcacheArr));
+        for (yint d = 0; d < YSize(KVcacheArr); ++d) {
+            for (yint z = 0; z < YSize(KVcacheArr[d]); ++z) {
+                KVcacheArr[d][z].AddRange(src.KVcacheArr[d][z], from, to);
+            }
+        }
+    }
+};
+
+
+struct TTokenProb
+{
+    int Token = 0;
+    float Prob = 0;
+};
+
+
+// matrices of simulated quantization models are packed unless packWeights is false
+void ConvertModel(TModelParams &params, TCPUModelParams *p, bool packWeights = true);
+
+// all weight matrices of the model
+void GetModelMatrices(TCPUModelParams *p, TVector<TWeightMatrix *> *pRes);
+
+// label 0 is start token, token t has label t + 2
+void ComputeFinalState(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TCPUInferContext *pCtx, TVector<float> *pState);
+void ComputeFinalPrediction(const TCPUModelParams &params, const TVector<float> &state, TVector<float> *pResPrediction);
+// pRes gets topK most probable tokens with softmax over them only, in descending order, all tokens if topK <= 0
+void ComputeFinalTopK(const TCPUModelParams &params, const TVector<float> &state, yint topK, TVector<TTokenProb> *pRes);
+void ComputePrediction(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TCPUInferContext *pCtx, TVector<float> *pResPrediction);
+void ComputePredictionTopK(const TCPUModelParams &params, const TVector<TLabelIndex> &labels, TCPUInferContext *pCtx, yint topK, TVector<TTokenProb> *pRes);
+// feed labelsArr positions to context at once, pResPrediction gets prediction after the last one
+void ComputePrefill(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr, TCPUInferContext *pCtx, TVector<float> *pResPrediction);
+// new position for each entry of ctxArr, context can repeat in consecutive entries to add several positions
+// pStateArr gets final states
+void ComputeDecodeBatch(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr, const TVector<TCPUInferContext *> &ctxArr, TVector<TVector<float>> *pStateArr);
+void ComputeFinalPredictionBatch(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<float>> &stateArr, TVector<TVector<float>> *pResPredArr);
+
+int SampleFromDistr(TXRng &rng, const TVector<float> &distr, float temperature);
+int SampleFromTopK(TXRng &rng, const TVector<TTokenProb> &top, float temperature);
+
+yint GetMatrixBytes(const TWeightMatrix &m);
+yint CalcModelBytes(const TCPUModelParams &params);
+yint CalcKVCacheBytes(const TCPUInferContext &ctx);
+}
@@ -0,0 +1,178 @@
+#include "stdafx.h"
+#include "prefix_cache.h"
+
+namespace NCPUInfer
+{
+// hash of prefix is hash of previous blocks prefix combined with block labels
+static ui64 CalcBlockHash(ui64 prevHash, const TVector<TVector<TLabelIndex>> &labelsArr, yint from, yint to)
+{
+    ui64 h = prevHash;
+    for (yint t = from; t < to; ++t) {
+        const TVector<TLabelIndex> &labels = labelsArr[t];
+        h = (h ^ YSize(labels)) * 0x9e3779b97f4a7c15ull;
+        for (TLabelIndex x : labels) {
+            h = (h ^ x) * 0xc3a5c85c97cb3127ull;
+            h ^= h >> 29;
+        }
+    }
+    return h;
+}
+
+
+static bool IsSameLabels(const TVector<TVector<TLabelIndex>> &blockLabels, const TVector<TVector<TLabelIndex>> &labelsArr, yint from)
+{
+    for (yint t = 0; t < YSize(blockLabels); ++t) {
+        const TVector<TLabelIndex> &a = blockLabels[t];
+        const TVector<TLabelIndex> &b = labelsArr[from + t];
+        if (YSize(a) != YSize(b)) {
+            return false;
+        }
+        for (yint k = 0; k < YSize(a); ++k) {
+            if (a[k] != b[k]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// hash chain of each model starts from its own seed
+static ui64 CalcModelHash(yint modelKey)
+{
+    return (modelKey + 1) * 0x9e3779b97f4a7c15ull;
+}
+
+
+TPrefixCache::TPrefixCache(yint blockLen, yint memoryBudget)
+    : Lock(0), BlockLen(blockLen), MemoryBudget(memoryBudget)
+{
+    Y_VERIFY(BlockLen > 0);
+}
+
+
+yint TPrefixCache::AddModel()
+{
+    TGuard<TAtomic> gg(Lock);
+    return ModelCounter++;
+}
+
+
+void TPrefixCache::RemoveModel(yint modelKey)
+{
+    TGuard<TAtomic> gg(Lock);
+    TVector<ui64> delArr;
+    for (auto it = BlockHash.begin(); it != BlockHash.end(); ++it) {
+        if (it->second->ModelKey == modelKey) {
+            delArr.push_back(it->first);
+            TotalBytes -= it->second->Bytes;
+        }
+    }
+    for (ui64 h : delArr) {
+        BlockHash.erase(h);
+    }
+}
+
+
+yint TPrefixCache::Fork(yint modelKey, const TVector<TVector<TLabelIndex>> &labelsArr, yint maxLen, TCPUInferContext *pCtx)
+{
+    Y_VERIFY(pCtx->GetLength() == 0);
+    TGuard<TAtomic> gg(Lock);
+    ++UseCounter;
+    yint len = Min<yint>(maxLen, YSize(labelsArr));
+    ui64 h = CalcModelHash(modelKey);
+    yint ptr = 0;
+    while (ptr + BlockLen <= len) {
+        h = CalcBlockHash(h, labelsArr, ptr, ptr + BlockLen);
+        auto it = BlockHash.find(h);
+        if (it == BlockHash.end() || it->second->ModelKey != modelKey || !IsSameLabels(it->second->Labels, labelsArr, ptr)) {
+            break;
+        }
+        TBlock *blk = it->second.Get();
+        blk->LastUse = UseCounter;
+        pCtx->AddRange(blk->KV, 0, BlockLen);
+        ptr += BlockLen;
+    }
+    LookupPosCount += len;
+    HitPosCount += ptr;
+    return ptr;
+}
+
+
+void TPrefixCache::Add(yint modelKey, const TVector<TVector<TLabelIndex>> &labelsArr, yint len, const TCPUInferContext &ctx)
+{
+    Y_VERIFY(len <= YSize(labelsArr) && len <= ctx.GetLength());
+    TGuard<TAtomic> gg(Lock);
+    ++UseCounter;
+    ui64 h = CalcModelHash(modelKey);
+    for (yint ptr = 0; ptr + BlockLen <= len; ptr += BlockLen) {
+        h = CalcBlockHash(h, labelsArr, ptr, ptr + BlockLen);
+        auto it = BlockHash.find(h);
+        if (it != BlockHash.end()) {
+            it->second->LastUse = UseCounter;
+            continue;
+        }
+        TIntrusivePtr<TBlock> blk = new TBlock;
+        blk->Hash = h;
+        blk->ModelKey = modelKey;
+        blk->Start = ptr;
+        blk->Labels.insert(blk->Labels.end(), labelsArr.begin() + ptr, labelsArr.begin() + ptr + BlockLen);
+        blk->KV.InitLike(ctx);
+        blk->KV.AddRange(ctx, ptr, ptr + BlockLen);
+        blk->Bytes = CalcKVCacheBytes(blk->KV);
+        blk->LastUse = UseCounter;
+        BlockHash[h] = blk;
+        TotalBytes += blk->Bytes;
+    }
+    Evict();
+}
+
+
+yint TPrefixCache::GetBlockCount() const
+{
+    TGuard<TAtomic> gg(Lock);
+    return YSize(BlockHash);
+}
+
+
+yint TPrefixCache::GetBytes() const
+{
+    TGuard<TAtomic> gg(Lock);
+    return TotalBytes;
+}
+
+
+double TPrefixCache::GetHitRate() const
+{
+    TGuard<TAtomic> gg(Lock);
+    return HitPosCount / Max<double>(1, LookupPosCount);
+}
+
+
+// called with lock held
+// least recently used blocks go first, longer prefix first among blocks used together
+// prefix blocks are used not later then their continuations so continuations are evicted before them
+void TPrefixCache::Evict()
+{
+    if (TotalBytes <= MemoryBudget) {
+        return;
+    }
+    TVector<TBlock *> candidates;
+    for (auto it = BlockHash.begin(); it != BlockHash.end(); ++it) {
+        candidates.push_back(it->second.Get());
+    }
+    Sort(candidates.begin(), candidates.end(), [](const TBlock *a, const TBlock *b) {
+        if (a->LastUse != b->LastUse) {
+            return a->LastUse < b->LastUse;
+        }
+        return a->Start > b->Start;
+    });
+    for (TBlock *blk : candidates) {
+        if (TotalBytes <= MemoryBudget) {
+            break;
+        }
+        TotalBytes -= blk->Bytes;
+        BlockHash.erase(blk->Hash);
+    }
+}
+}
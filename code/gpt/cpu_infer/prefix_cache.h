@@ -0,0 +1,56 @@
+#pragma once
+#include "cpu_infer.h"
+
+namespace NCPUInfer
+{
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// kv cache of prompt prefixes shared by sessions of all models, memory budget is common for all models
+// each model gets its own key, blocks of different models never match
+// prefixes are split in blocks of BlockLen positions, block is found by hash of all labels from prompt start to its end
+// new session copies kv cache of the longest cached prefix instead of computing it
+// sessions own their copy, so blocks are evicted in lru order when memory budget is exceeded regardless of sessions forked from them
+class TPrefixCache : public TThrRefBase
+{
+public:
+    struct TBlock : public TThrRefBase
+    {
+        ui64 Hash = 0;
+        yint ModelKey = 0;
+        yint Start = 0; // first position
+        TVector<TVector<TLabelIndex>> Labels; // positions of the block, compared on lookup to rule out hash collisions
+        TCPUInferContext KV; // kv cache of the block positions
+        yint Bytes = 0;
+        yint LastUse = 0;
+    };
+
+private:
+    TAtomic Lock;
+    yint BlockLen = 0;
+    yint MemoryBudget = 0;
+    THashMap<ui64, TIntrusivePtr<TBlock>> BlockHash;
+    yint TotalBytes = 0;
+    yint UseCounter = 0;
+    yint ModelCounter = 0;
+    yint LookupPosCount = 0;
+    yint HitPosCount = 0;
+
+    void Evict();
+
+public:
+    TPrefixCache(yint blockLen, yint memoryBudget);
+    // key for new model, methods can be called from several threads
+    yint AddModel();
+    // drop blocks of the model that is not used any more
+    void RemoveModel(yint modelKey);
+    // appends kv cache of the longest cached block aligned prefix of labelsArr not longer then maxLen to empty pCtx
+    // returns prefix length
+    yint Fork(yint modelKey, const TVector<TVector<TLabelIndex>> &labelsArr, yint maxLen, TCPUInferContext *pCtx);
+    // add complete blocks of first len positions, ctx has kv cache of them
+    void Add(yint modelKey, const TVector<TVector<TLabelIndex>> &labelsArr, yint len, const TCPUInferContext &ctx);
+    yint GetBlockLen() const { return BlockLen; }
+    yint GetBlockCount() const;
+    yint GetBytes() const;
+    // fraction of looked up prompt positions found in cache
+    double GetHitRate() const;
+};
+}
@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "weight_store.h"
+
+namespace NCPUInfer
+{
+static ui64 CalcMatrixHash(const TWeightMatrix &matr)
+{
+    ui64 h = (matr.Format * 0x9e3779b97f4a7c15ull) ^ matr.RowLen;
+    h = (h ^ matr.RowCount) * 0x9e3779b97f4a7c15ull;
+    for (i8 x : matr.Weights->Levels) {
+        h = (h ^ (ui8)x) * 0xc3a5c85c97cb3127ull;
+    }
+    const TVector<ui8> &data = matr.Weights->Data;
+    yint sz = YSize(data);
+    yint ptr = 0;
+    for (; ptr + 8 <= sz; ptr += 8) {
+        ui64 x;
+        memcpy(&x, &data[ptr], 8);
+        h = (h ^ x) * 0xc3a5c85c97cb3127ull;
+        h ^= h >> 29;
+    }
+    for (; ptr < sz; ++ptr) {
+        h = (h ^ data[ptr]) * 0xc3a5c85c97cb3127ull;
+    }
+    return h;
+}
+
+
+static bool IsSameMatrix(const TWeightMatrix &a, const TWeightMatrix &b)
+{
+    if (a.Format != b.Format || a.RowLen != b.RowLen || a.RowCount != b.RowCount) {
+        return false;
+    }
+    const TWeightData &wa = *a.Weights;
+    const TWeightData &wb = *b.Weights;
+    if (YSize(wa.Data) != YSize(wb.Data) || YSize(wa.Levels) != YSize(wb.Levels)) {
+        return false;
+    }
+    return memcmp(wa.Levels.data(), wb.Levels.data(), YSize(wa.Levels)) == 0 && memcmp(wa.Data.data(), wb.Data.data(), YSize(wa.Data)) == 0;
+}
+
+
+yint TWeightStore::AddModel(TCPUModelParams *p)
+{
+    TVector<TWeightMatrix *> matrArr;
+    GetModelMatrices(p, &matrArr);
+    // hashing is done without lock, models can be added from several threads
+    TVector<ui64> hashArr;
+    for (TWeightMatrix *m : matrArr) {
+        hashArr.push_back(CalcMatrixHash(*m));
+    }
+    TGuard<TAtomic> gg(Lock);
+    yint newBytes = 0;
+    for (yint k = 0; k < YSize(matrArr); ++k) {
+        TWeightMatrix *m = matrArr[k];
+        TVector<TWeightMatrix> &entryArr = MatrHash[hashArr[k]];
+        bool isFound = false;
+        for (const TWeightMatrix &e : entryArr) {
+            if (IsSameMatrix(e, *m)) {
+                m->Weights = e.Weights;
+                isFound = true;
+                break;
+            }
+        }
+        if (!isFound) {
+            entryArr.push_back(*m);
+            yint bytes = GetMatrixBytes(*m);
+            newBytes += bytes;
+            TotalBytes += bytes;
+            ++MatrixCount;
+        }
+    }
+    return newBytes;
+}
+
+
+void TWeightStore::Collect()
+{
+    TGuard<TAtomic> gg(Lock);
+    TVector<ui64> emptyArr;
+    for (auto it = MatrHash.begin(); it != MatrHash.end(); ++it) {
+        TVector<TWeightMatrix> &entryArr = it->second;
+        yint dst = 0;
+        for (yint k = 0; k < YSize(entryArr); ++k) {
+            const TWeightMatrix &e = entryArr[k];
+            // referenced by store only
+            if (e.Weights->RefCount() == 1) {
+                TotalBytes -= GetMatrixBytes(e);
+                --MatrixCount;
+            } else {
+                entryArr[dst++] = e;
+            }
+        }
+        entryArr.resize(dst);
+        if (entryArr.empty()) {
+            emptyArr.push_back(it->first);
+        }
+    }
+    for (ui64 h : emptyArr) {
+        MatrHash.erase(h);
+    }
+}
+
+
+yint TWeightStore::GetBytes() const
+{
+    TGuard<TAtomic> gg(Lock);
+    return TotalBytes;
+}
+
+
+yint TWeightStore::GetMatrixCount() const
+{
+    TGuard<TAtomic> gg(Lock);
+    return MatrixCount;
+}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "cpu_infer.h"
+
+namespace NCPUInfer
+{
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// weight matrices of several models, matrices with the same content are stored once
+// variants of one base model (fine-tunes with frozen layers, A/B variants) share their common matrices
+// matrix is found by content hash and compared on lookup to rule out hash collisions
+// store references all its matrices, matrices not used by any model are dropped by Collect()
+class TWeightStore : public TThrRefBase
+{
+    TAtomic Lock;
+    THashMap<ui64, TVector<TWeightMatrix>> MatrHash;
+    yint TotalBytes = 0;
+    yint MatrixCount = 0;
+
+public:
+    TWeightStore() : Lock(0) {}
+    // matrices of p are replaced with stored copies, new matrices are added to store
+    // returns bytes of matrices that were not in store
+    yint AddModel(TCPUModelParams *p);
+    void Collect();
+    // store is modified by model loading threads
+    yint GetBytes() const;
+    yint GetMatrixCount() const;
+};
+}
@@ -124,7 +124,7 @@ private:
     ETokenizer TokenizerType = TK_WORD;
     yint TokenCount = 0;
     TVector<int> Letters;
-    THashMap<TString, int> Word2Id;
+    TFlatHashMap<TString, int> Word2Id;
     TVector<TString> Words;
     int DocStartToken = -1;
     int CapitalWordToken = -1;
@@ -139,7 +139,7 @@ private:
             yint clen = Utf8CodeLength[c];
             Y_VERIFY(k + clen <= len);
             if (clen > 1) {
-                auto itWord = Word2Id.find(word.substr(k, clen));
+                auto itWord = Word2Id.find(TStringView(word.data() + k, clen));
                 if (itWord != Word2Id.end() && itWord->second >= 0) {
                     res->push_back(itWord->second);
                     k += clen;
@@ -174,8 +174,7 @@ private:
             yint bestLen = 1;
             yint tokenLen = Utf8CodeLength[c];
             if (tokenLen > 1) {
-                TString sub = str.substr(start, tokenLen);
-                auto itWord = Word2Id.find(sub);
+                auto itWord = Word2Id.find(TStringView(str.data() + start, tokenLen));
                 if (itWord != Word2Id.end() && itWord->second >= 0) {
                     bestToken = itWord->second;
                     bestLen = tokenLen;
@@ -191,8 +190,7 @@ private:
             for (yint ptr = start + bestLen; ptr < strLen;) {
                 ptr += Utf8CodeLength[(ui8)str[ptr]];
                 Y_ASSERT(ptr <= strLen);
-                TString sub = str.substr(start, ptr - start);
-                auto itWord = Word2Id.find(sub);
+                auto itWord = Word2Id.find(TStringView(str.data() + start, ptr - start));
                 if (itWord != Word2Id.end()) {
                     if (itWord->second >= 0) {
                         bestToken = itWord->second;
@@ -2,6 +2,7 @@
 #include "bpe.h"
 #include "ppm_window.h"
 #include <gpt/rng/xrng.h>
+#include <lib/prof/prof.h>
 
 
 void GenerateArithmetic();
@@ -162,6 +163,7 @@ class TDataset
                     p->Target.push_back(buf[t + 1]);
                 }
                 if (usePPM) {
+                    PROF_SCOPE("ppm");
                     PPMReader->Read(offset, fragLen, &p->PPM1);
                 }
             }
@@ -39,6 +39,8 @@ struct TTrainDataConfig
                 modelFlags |= MPF_SIM_QUANT_2BIT;
             } else if (flag == "MPF_SIM_QUANT_4BIT") {
                 modelFlags |= MPF_SIM_QUANT_4BIT;
+            } else if (flag == "MPF_SIM_QUANT_158BIT") {
+                modelFlags |= MPF_SIM_QUANT_158BIT;
             } else if (flag == "MPF_GROK_BINARY_OP") {
                 modelFlags |= MPF_GROK_BINARY_OP;
             } else if (flag == "MPF_COMBINE_LAYERS") {
@@ -62,3 +62,155 @@ void AddPackedModelParamsScaled(TModelParams *pParams, TWeightedModelParamsPkt &
     bufIO.Read(&weight, sizeof(weight));
     AddPackedModelParamsScaled(pParams, bufIO, scale, rowDispScale);
 }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TFedDeltaAccumulator::TFedDeltaAccumulator(TModelParams *pParams, yint workerCount) : Params(pParams), WorkerCount(0), JobCount(0), Exit(false)
+{
+    Y_VERIFY(workerCount > 0);
+    GetModelMatrices(pParams, &MatrixArr);
+    // split matrices into row ranges
+    TVector<TRowRange> rangeArr;
+    for (yint k = 0; k < YSize(MatrixArr); ++k) {
+        const TArray2D<float> &m = *MatrixArr[k];
+        yint xSize = m.GetXSize();
+        yint ySize = m.GetYSize();
+        yint rangeRows = Max<yint>(1, ROW_RANGE_PARAMS / Max<yint>(1, xSize));
+        for (yint yFrom = 0; yFrom < ySize; yFrom += rangeRows) {
+            TRowRange rr;
+            rr.MatrixId = k;
+            rr.YFrom = yFrom;
+            rr.YTo = Min<yint>(ySize, yFrom + rangeRows);
+            rangeArr.push_back(rr);
+        }
+    }
+    // load balance, assign largest ranges first to the least loaded worker
+    // assignment is deterministic and each range is owned by a single worker
+    Sort(rangeArr.begin(), rangeArr.end(), [this](const TRowRange &a, const TRowRange &b) {
+        yint wa = (a.YTo - a.YFrom) * MatrixArr[a.MatrixId]->GetXSize();
+        yint wb = (b.YTo - b.YFrom) * MatrixArr[b.MatrixId]->GetXSize();
+        if (wa != wb) {
+            return wa > wb;
+        }
+        if (a.MatrixId != b.MatrixId) {
+            return a.MatrixId < b.MatrixId;
+        }
+        return a.YFrom < b.YFrom;
+    });
+    WorkerArr.resize(workerCount);
+    for (yint workerId = 0; workerId < workerCount; ++workerId) {
+        WorkerArr[workerId] = new TWorkerData();
+    }
+    WorkerArr[0]->AddRowDisp = true;
+    for (const TRowRange &rr : rangeArr) {
+        TWorkerData *minWorker = WorkerArr[0].Get();
+        for (yint workerId = 1; workerId < workerCount; ++workerId) {
+            TWorkerData *p = WorkerArr[workerId].Get();
+            if (p->ParamCount < minWorker->ParamCount) {
+                minWorker = p;
+            }
+        }
+        minWorker->ParamCount += (rr.YTo - rr.YFrom) * MatrixArr[rr.MatrixId]->GetXSize();
+        minWorker->RangeArr.push_back(rr);
+    }
+    // launch workers
+    for (TIntrusivePtr<TWorkerData> &w : WorkerArr) {
+        w->Thr.Create(this);
+    }
+}
+
+
+TFedDeltaAccumulator::~TFedDeltaAccumulator()
+{
+    Wait();
+    Exit = true;
+    for (TIntrusivePtr<TWorkerData> &w : WorkerArr) {
+        Wake(w.Get());
+    }
+    for (TIntrusivePtr<TWorkerData> &w : WorkerArr) {
+        w->Thr.Join();
+    }
+}
+
+
+void TFedDeltaAccumulator::AddDelta(TWorkerData *data, const TDelta &delta)
+{
+    const ui8 *buf = delta.Data.data();
+    for (const TRowRange &rr : data->RangeArr) {
+        AddPackedMatrixRowsScaled(MatrixArr[rr.MatrixId], delta.Index.MatrixArr[rr.MatrixId], buf, rr.YFrom, rr.YTo, delta.Scale);
+    }
+    if (data->AddRowDisp) {
+        AddPackedRowDispScaled(Params, delta.Index, buf, delta.Scale, delta.RowDispScale);
+    }
+}
+
+
+// delta queued after the check is signalled since parked flag is visible to Wake()
+void TFedDeltaAccumulator::Park(TWorkerData *data)
+{
+    std::unique_lock<std::mutex> lock(data->ParkLock);
+    data->IsParked = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!Exit && data->JobQueue.IsEmpty()) {
+        data->ParkCond.wait(lock);
+    }
+    data->IsParked = false;
+}
+
+
+void TFedDeltaAccumulator::Wake(TWorkerData *data)
+{
+    // pairs with fence in Park(), either parking worker finds the delta or we see it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (data->IsParked.load()) {
+        std::lock_guard<std::mutex> lock(data->ParkLock);
+        data->ParkCond.notify_one();
+    }
+}
+
+
+void TFedDeltaAccumulator::WorkerThread()
+{
+    yint workerId = WorkerCount.fetch_add(1);
+    TWorkerData *data = WorkerArr[workerId].Get();
+    while (!Exit) {
+        TVector<TIntrusivePtr<TDelta>> deltaArr;
+        if (data->JobQueue.DequeueAll(&deltaArr)) {
+            // DequeueAll() returns newest first, apply in arrival order
+            for (yint k = YSize(deltaArr) - 1; k >= 0; --k) {
+                AddDelta(data, *deltaArr[k]);
+                JobCount.fetch_add(-1);
+            }
+        } else {
+            Park(data);
+        }
+    }
+}
+
+
+void TFedDeltaAccumulator::AddDelta(TWeightedModelParamsPkt &pkt, float scale, float rowDispScale)
+{
+    yint workerCount = YSize(WorkerArr);
+    // limit memory held by queued deltas
+    while (JobCount.load() > MAX_PENDING_DELTAS * workerCount) {
+        SchedYield();
+    }
+    TIntrusivePtr<TDelta> delta = new TDelta();
+    pkt.Swap(&delta->Data);
+    IndexPackedModelParams(&delta->Index, *Params, &delta->Data, sizeof(float));
+    delta->Scale = scale;
+    delta->RowDispScale = rowDispScale;
+    for (yint workerId = 0; workerId < workerCount; ++workerId) {
+        JobCount.fetch_add(1);
+        WorkerArr[workerId]->JobQueue.Enqueue(delta);
+        Wake(WorkerArr[workerId].Get());
+    }
+}
+
+
+void TFedDeltaAccumulator::Wait()
+{
+    while (JobCount.load() != 0) {
+        SchedYield();
+    }
+}
@@ -5,6 +5,7 @@
 #include <gpt/train_config/train_config.h>
 #include <util/fast_io.h>
 #include <util/mem_io.h>
+#include <util/thread.h>
 
 
 extern TGuid FedToken;
@@ -74,3 +75,68 @@ void UnpackModelParams(TModelParams *pParams, TWeightedModelParamsPkt &pkt);
 void SetWeight(TWeightedModelParamsPkt &pkt, float weight);
 float GetWeight(TWeightedModelParamsPkt &pkt);
 void AddPackedModelParamsScaled(TModelParams *pParams, TWeightedModelParamsPkt &pkt, float scale, float rowDispScale);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// sum weighted deltas in worker threads
+// every worker owns fixed row ranges and adds deltas to them in arrival order,
+// so the sum is bit exact with serial AddPackedModelParamsScaled() for any worker count
+// idle workers park on condition variable until delta is queued
+class TFedDeltaAccumulator : public TThrRefBase
+{
+    enum {
+        ROW_RANGE_PARAMS = 1 << 20,
+        MAX_PENDING_DELTAS = 8,
+    };
+
+    struct TDelta : public TThrRefBase
+    {
+        TVector<ui8> Data;
+        TPackedModelParamsIndex Index;
+        float Scale = 0;
+        float RowDispScale = 0;
+    };
+
+    struct TRowRange
+    {
+        int MatrixId = 0;
+        yint YFrom = 0;
+        yint YTo = 0;
+    };
+
+    struct TWorkerData : public TThrRefBase
+    {
+        TSingleConsumerJobQueue<TIntrusivePtr<TDelta>> JobQueue;
+        TThread Thr;
+        TVector<TRowRange> RangeArr;
+        bool AddRowDisp = false;
+        yint ParamCount = 0;
+        std::mutex ParkLock;
+        std::condition_variable ParkCond;
+        std::atomic<bool> IsParked;
+
+        TWorkerData() : IsParked(false) {}
+    };
+
+private:
+    TModelParams *Params = 0;
+    TVector<TArray2D<float> *> MatrixArr;
+    TVector<TIntrusivePtr<TWorkerData>> WorkerArr;
+    std::atomic<yint> WorkerCount;
+    std::atomic<yint> JobCount;
+    std::atomic<bool> Exit;
+
+    void AddDelta(TWorkerData *data, const TDelta &delta);
+    void Park(TWorkerData *data);
+    void Wake(TWorkerData *data);
+    ~TFedDeltaAccumulator();
+
+public:
+    TFedDeltaAccumulator(TModelParams *pParams, yint workerCount);
+    void AddDelta(TWeightedModelParamsPkt &pkt, float scale, float rowDispScale); // takes pkt data
+
+    void Wait();
+
+public:
+    void WorkerThread();
+};
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include <lib/net/tcp_net.h>
 #include <gpt/fed_lib/fed_lib.h>
+#include <gpt/model_params/checkpoint_writer.h>
 #include <gpt/data_config/data_config.h>
 #include "gpt/train_config/train_config.h"
 #include <lib/hp_timer/hp_timer.h>
@@ -43,9 +44,12 @@ TString FED_SCRIPT =
 
 
 const TString ModelFileExtension = ".m8";
+const TString CheckpointChainFolder = "chain/";
 const TString MasterStateFile = "users.bin";
 const TString NewMasterStateFile = "users_new.bin";
 
+const yint FED_LOAD_TEST_PORT = 18189;
+
 const ui32 LOG_ID = 0xc280fe2c;
 USE_LOG(LOG_ID);
 
@@ -179,6 +183,11 @@ class TFedMasterScriptParser : public TTrainDataConfigParser
     float DeltaCollectTimeout = 10 * 60; // in seconds
     float DeltaCollectMinInterval = 10; // in seconds
     yint KeepModelCount = 50;
+    yint DeltaAddThreadCount = 4;
+    yint CheckpointFullInterval = 0; // save .m8 models if 0, keep checkpoint chain otherwise
+    TCheckpointChain Chain;
+    yint CheckpointQueue = 2;
+    TIntrusivePtr<TCheckpointWriter> CkptWriter;
     yint Version = 1;
 
 private:
@@ -272,6 +281,18 @@ private:
     // save/load model checkpoints
     void LoadLastCheckpoint(const TString &folder)
     {
+        if (CheckpointFullInterval > 0) {
+            MakeDirectory(folder + CheckpointChainFolder);
+            Chain.Open(folder + CheckpointChainFolder, CheckpointFullInterval);
+            if (!Chain.IsEmpty()) {
+                Version = Chain.GetLastId();
+                Log("load model version %d from checkpoint chain", (int)Version);
+                Data.StartParams = new TModelParamsHolder();
+                Y_VERIFY(Chain.Load(Version, &Data.StartParams->Params));
+                ++Version;
+            }
+            return;
+        }
         TVector<TFindFileResult> dir;
         FindAllFiles(folder, &dir);
         TString modelFile;
@@ -312,18 +333,53 @@ private:
         }
     }
 
-    void SaveModel(TWeightedModelParamsPkt &wbp, const TString &folder)
+    // runs on checkpoint writer thread
+    struct TModelSaveJob : public ICheckpointJob
     {
-        TString tmpName = folder + "model.tmp";
-        wbp.Write(tmpName);
-        RenameFile(tmpName, Sprintf("%smodel_%d%s", folder.c_str(), (int)Version++, ModelFileExtension.c_str()));
-        Log("model saved");
-        if (KeepModelCount > 0) {
-            TString oldFile = Sprintf("%smodel_%d%s", folder.c_str(), (int)(Version - KeepModelCount - 1), ModelFileExtension.c_str());
-            if (DoesFileExist(oldFile)) {
-                EraseFile(oldFile);
+        TVector<ui8> Data;
+        TString Folder;
+        yint Version = 0;
+        yint KeepModelCount = 0;
+        TCheckpointChain *Chain = 0;
+
+        void Run() override
+        {
+            if (Chain) {
+                TModelParams params;
+                TWeightedModelParamsPkt wbp(&Data);
+                UnpackModelParams(&params, wbp);
+                Chain->Save(Version, params);
+                if (KeepModelCount > 0) {
+                    Chain->Compact(Version + 1 - KeepModelCount);
+                }
+                Log("model %d saved to checkpoint chain", (int)Version);
+                return;
+            }
+            WriteFileAtomic(Sprintf("%smodel_%d%s", Folder.c_str(), (int)Version, ModelFileExtension.c_str()), Data);
+            Log("model %d saved", (int)Version);
+            if (KeepModelCount > 0) {
+                TString oldFile = Sprintf("%smodel_%d%s", Folder.c_str(), (int)(Version - KeepModelCount), ModelFileExtension.c_str());
+                if (DoesFileExist(oldFile)) {
+                    EraseFile(oldFile);
+                }
             }
         }
+    };
+
+    void SaveModel(TWeightedModelParamsPkt &wbp, const TString &folder)
+    {
+        TIntrusivePtr<TModelSaveJob> job = new TModelSaveJob();
+        // copy model, basepoint packet is kept to send to workers
+        TVector<ui8> data;
+        wbp.Swap(&data);
+        job->Data = data;
+        wbp.Swap(&data);
+        job->Folder = folder;
+        job->Version = Version++;
+        job->KeepModelCount = KeepModelCount;
+        job->Chain = (CheckpointFullInterval > 0) ? &Chain : nullptr;
+        CkptWriter->Save(job.Get());
+        Log("model %d queued for save, stall %g sec", (int)job->Version, CkptWriter->GetLastStallTime());
     }
 
 
@@ -365,6 +421,7 @@ private:
 
         // checkpoint
         LoadLastCheckpoint(folder);
+        CkptWriter = new TCheckpointWriter(CheckpointQueue);
 
         // verify model params
         Y_VERIFY(!Data.StartParams->Params.IsEmpty());
@@ -381,6 +438,7 @@ private:
         }
         Scale(&sumDelta->Params, 0, 0);
         float sumDeltaWeight = 0;
+        TIntrusivePtr<TFedDeltaAccumulator> deltaAdd = new TFedDeltaAccumulator(&sumDelta->Params, DeltaAddThreadCount);
 
         // worker params
         TFedParams fedParams;
@@ -496,7 +554,7 @@ private:
                     delta.Swap(&recvPkt->Data);
                     // add delta
                     float deltaWeight = GetWeight(delta);
-                    AddPackedModelParamsScaled(&sumDelta->Params, delta, deltaWeight, deltaWeight);
+                    deltaAdd->AddDelta(delta, deltaWeight, deltaWeight);
                     sumDeltaWeight += deltaWeight;
                     // update worker
                     Y_VERIFY(workerSet.find(recvPkt->Conn) != workerSet.end());
@@ -541,6 +599,7 @@ private:
                 if (collectTime >= DeltaCollectMinInterval) {
                     collectTime = 0;
                     Log("delta collected, model version %d", (int)Version);
+                    deltaAdd->Wait();
                     {
                         // add sum delta to basepoint
                         TWeightedModelParamsPkt wbp;
@@ -585,6 +644,111 @@ private:
     }
 
 
+    // replay synthetic worker deltas over loopback, compare parallel sum with serial one
+    void RunDeltaLoadTest(yint deltaCount)
+    {
+        const yint DISTINCT_DELTAS = 4;
+        Y_VERIFY(!Data.StartParams->Params.IsEmpty());
+        TModelParams &startParams = Data.StartParams->Params;
+        TXRng rng(1313);
+
+        // synthetic deltas
+        TVector<TVector<ui8>> deltaArr;
+        for (yint k = 0; k < DISTINCT_DELTAS; ++k) {
+            TModelParams delta = startParams;
+            TVector<TArray2D<float> *> allMatrices;
+            GetModelMatrices(&delta, &allMatrices);
+            for (TArray2D<float> *p : allMatrices) {
+                for (yint y = 0; y < p->GetYSize(); ++y) {
+                    for (yint x = 0; x < p->GetXSize(); ++x) {
+                        (*p)[y][x] = rng.GenRandReal3() - 0.5f;
+                    }
+                }
+            }
+            TWeightedModelParamsPkt pkt;
+            PackModelParams(&pkt, delta, 1 + rng.Uniform(8));
+            deltaArr.push_back();
+            pkt.Swap(&deltaArr.back());
+        }
+        yint pktSize = YSize(deltaArr[0]);
+
+        // loopback connection
+        TIntrusivePtr<ITcpSendRecv> net = CreateTcpSendRecv();
+        TIntrusivePtr<ITcpAccept> accept = net->StartAccept(FED_LOAD_TEST_PORT, FedToken);
+        TIntrusivePtr<TTcpRecvQueue> recvQueue = new TTcpRecvQueue();
+        TIntrusivePtr<TTcpRecvQueue> clientQueue = new TTcpRecvQueue();
+        TIntrusivePtr<ITcpConnection> clientConn = Connect("localhost", FED_LOAD_TEST_PORT, FedToken);
+        net->StartSendRecv(clientConn, clientQueue);
+        TIntrusivePtr<ITcpConnection> serverConn;
+        while (!accept->GetNewConnection(&serverConn)) {
+            SchedYield();
+        }
+        net->StartSendRecv(serverConn, recvQueue);
+
+        // parallel sum of received deltas
+        TModelParams sumDelta = startParams;
+        Scale(&sumDelta, 0, 0);
+        TModelParams refSumDelta = sumDelta;
+        TIntrusivePtr<TFedDeltaAccumulator> deltaAdd = new TFedDeltaAccumulator(&sumDelta, DeltaAddThreadCount);
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        for (yint k = 0; k < deltaCount; ++k) {
+            TIntrusivePtr<TTcpPacket> pkt = new TTcpPacket;
+            pkt->Data = deltaArr[k % DISTINCT_DELTAS];
+            net->Send(clientConn, pkt);
+        }
+        for (yint k = 0; k < deltaCount;) {
+            TIntrusivePtr<TTcpPacketReceived> recvPkt;
+            if (recvQueue->RecvList.DequeueFirst(&recvPkt)) {
+                TWeightedModelParamsPkt delta;
+                delta.Swap(&recvPkt->Data);
+                float deltaWeight = GetWeight(delta);
+                deltaAdd->AddDelta(delta, deltaWeight, deltaWeight);
+                ++k;
+            } else {
+                SchedYield();
+            }
+        }
+        deltaAdd->Wait();
+        double totalTime = NHPTimer::GetTimePassed(&tStart);
+
+        // serial reference
+        NHPTimer::STime tSerial;
+        NHPTimer::GetTime(&tSerial);
+        for (yint k = 0; k < deltaCount; ++k) {
+            TVector<ui8> buf = deltaArr[k % DISTINCT_DELTAS];
+            TWeightedModelParamsPkt delta(&buf);
+            float deltaWeight = GetWeight(delta);
+            AddPackedModelParamsScaled(&refSumDelta, delta, deltaWeight, deltaWeight);
+        }
+        double serialTime = NHPTimer::GetTimePassed(&tSerial);
+
+        // compare
+        TVector<TArray2D<float> *> sumMatrices;
+        GetModelMatrices(&sumDelta, &sumMatrices);
+        TVector<TArray2D<float> *> refMatrices;
+        GetModelMatrices(&refSumDelta, &refMatrices);
+        yint mismatchCount = 0;
+        for (yint k = 0; k < YSize(sumMatrices); ++k) {
+            const TArray2D<float> &a = *sumMatrices[k];
+            const TArray2D<float> &b = *refMatrices[k];
+            for (yint y = 0; y < a.GetYSize(); ++y) {
+                mismatchCount += (memcmp(&a[y][0], &b[y][0], a.GetXSize() * sizeof(float)) != 0);
+            }
+        }
+        mismatchCount += (sumDelta.LabelEmbed.GetRowDisp() != refSumDelta.LabelEmbed.GetRowDisp());
+        mismatchCount += (sumDelta.FinalLayer.GetRowDisp() != refSumDelta.FinalLayer.GetRowDisp());
+        double gb = deltaCount * pktSize / 1e9;
+        DebugPrintf("%g deltas of %g mb, %d threads\n", deltaCount * 1., pktSize / 1e6, (int)DeltaAddThreadCount);
+        DebugPrintf("loopback recv + parallel add %g sec, %g GB/sec\n", totalTime, gb / totalTime);
+        DebugPrintf("serial add %g sec, %g GB/sec\n", serialTime, gb / serialTime);
+        DebugPrintf("mismatched rows %g (should be 0)\n", mismatchCount * 1.);
+        clientConn->Stop();
+        serverConn->Stop();
+        accept->Stop();
+    }
+
+
     void ParseScriptOp(const TConfigFile::TOp &op) override
     {
         if (op.Op == CFG_OP_ASSIGNMENT) {
@@ -594,6 +758,12 @@ private:
                 DeltaCollectMinInterval = atof(op.Args[0].c_str());
             } else if (op.Dst == "KEEP_MODEL_COUNT") {
                 KeepModelCount = atof(op.Args[0].c_str());
+            } else if (op.Dst == "CHECKPOINT_FULL_INTERVAL") {
+                CheckpointFullInterval = atof(op.Args[0].c_str());
+            } else if (op.Dst == "CHECKPOINT_QUEUE") {
+                CheckpointQueue = atof(op.Args[0].c_str());
+            } else if (op.Dst == "DELTA_ADD_THREAD_COUNT") {
+                DeltaAddThreadCount = atof(op.Args[0].c_str());
             } else {
                 DebugPrintf("unknown config variable %s\n", op.Dst.c_str());
                 abort();
@@ -608,6 +778,12 @@ private:
                     folder += '/';
                 }
                 RunFedMaster(folder);
+            } else if (op.Dst == "delta_load_test") {
+                Y_VERIFY(YSize(op.Args) == 1);
+                RunDeltaLoadTest(atoi(op.Args[0].c_str()));
+            } else if (op.Dst == "compact_params_test") {
+                Y_VERIFY(!Data.StartParams->Params.IsEmpty());
+                BenchmarkCompactModelParams(Data.StartParams->Params);
             } else {
                 DebugPrintf("unknown function %s\n", op.Dst.c_str());
                 abort();
@@ -99,7 +99,7 @@ int main(int argc, char **argv)
         DebugPrintf("user %s key loaded from %s\n", login.UserName.c_str(), configFilename.c_str());
     }
 
-    TOpt cmdline("c:b:d:u:t:", argc, argv);
+    TOpt cmdline("c:b:d:u:t:n:", argc, argv);
     for (const TOpt::TParam &param : cmdline.Params) {
         if (param.Name == "c") {
             masterAddr = param.Args[0];
@@ -111,6 +111,9 @@ int main(int argc, char **argv)
             login.UserName = param.Args[0];
         } else if (param.Name == "t") {
             MatrixAddWorkerThreadCount = atoi(param.Args[0].c_str());
+        } else if (param.Name == "n") {
+            // numa placement of host matrices, "none", "local" or "interleave"
+            Y_VERIFY(ParseMatrixAddNuma(param.Args[0], &MatrixAddNuma) && "unknown numa placement, expected none, local or interleave");
         }
     }
 
@@ -0,0 +1,281 @@
+#include "stdafx.h"
+#include "decode_scheduler.h"
+#include <lib/prof/prof.h>
+
+using namespace NCPUInfer;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TDecodeScheduler::TDecodeScheduler(const TCPUModelParams &params, yint maxBatch, yint prefillChunk, TThreadPool *pool,
+    const TCPUModelParams *draftParams, TIntrusivePtr<TPrefixCache> prefixCache)
+    : Params(params), DraftParams(draftParams), PrefixCache(prefixCache), Pool(pool), MaxBatch(maxBatch), PrefillChunk(prefillChunk)
+    , StepCount(0), DecodeCount(0), DraftCount(0), AcceptCount(0)
+{
+    Y_VERIFY(MaxBatch > 0 && PrefillChunk > 0);
+    Y_VERIFY(DraftParams == nullptr || YSize(DraftParams->Bias) == YSize(Params.Bias));
+    if (PrefixCache.Get()) {
+        PrefixModelKey = PrefixCache->AddModel();
+    }
+    Thr.Create(this);
+}
+
+
+TDecodeScheduler::~TDecodeScheduler()
+{
+    Stop();
+    if (PrefixCache.Get()) {
+        PrefixCache->RemoveModel(PrefixModelKey);
+    }
+}
+
+
+void TDecodeScheduler::Stop()
+{
+    Exit = true;
+    Thr.Join();
+}
+
+
+void TDecodeScheduler::Submit(TIntrusivePtr<TGenerateRequest> req)
+{
+    Y_VERIFY(!req->Prompt.empty() && req->MaxTokens > 0);
+    Y_VERIFY(req->Draft != DRAFT_MODEL || DraftParams != nullptr);
+    TSubmit sub;
+    sub.Req = req;
+    NHPTimer::GetTime(&sub.SubmitTime);
+    SubmitQueue.Enqueue(sub);
+}
+
+
+// first come first served, sessions leave between steps and free slots are filled immediately
+// new session starts from the longest cached prompt prefix, last prompt position is left for decode
+void TDecodeScheduler::Admit()
+{
+    TVector<TSubmit> newArr;
+    if (SubmitQueue.DequeueAll(&newArr)) {
+        // DequeueAll() returns newest first
+        for (yint k = YSize(newArr) - 1; k >= 0; --k) {
+            Waiting.push_back(newArr[k]);
+        }
+    }
+    yint admitCount = Min<yint>(YSize(Waiting), MaxBatch - YSize(Active));
+    for (yint k = 0; k < admitCount; ++k) {
+        const TSubmit &sub = Waiting[k];
+        TIntrusivePtr<TSession> sess = new TSession(sub.Req, Params, DraftParams, sub.SubmitTime);
+        if (PrefixCache.Get()) {
+            const TVector<TVector<TLabelIndex>> &prompt = sub.Req->Prompt;
+            sess->PromptPtr = PrefixCache->Fork(PrefixModelKey, prompt, YSize(prompt) - 1, &sess->Ctx);
+        }
+        Active.push_back(sess);
+    }
+    Waiting.erase(Waiting.begin(), Waiting.begin() + admitCount);
+}
+
+
+// all prompt positions except the last one are added to context in chunks
+// the last one goes to decode batch since its prediction is needed for sampling
+void TDecodeScheduler::Prefill()
+{
+    yint budget = PrefillChunk;
+    for (TIntrusivePtr<TSession> &sess : Active) {
+        if (budget == 0) {
+            break;
+        }
+        if (!sess->IsPrefill()) {
+            continue;
+        }
+        const TVector<TVector<TLabelIndex>> &prompt = sess->Req->Prompt;
+        yint count = Min<yint>(budget, YSize(prompt) - 1 - sess->PromptPtr);
+        TVector<TVector<TLabelIndex>> chunk(prompt.begin() + sess->PromptPtr, prompt.begin() + sess->PromptPtr + count);
+        ComputePrefill(Pool.Get(), Params, chunk, &sess->Ctx, nullptr);
+        sess->PromptPtr += count;
+        budget -= count;
+        // sessions with the same prompt prefix admitted later can fork from it
+        if (PrefixCache.Get()) {
+            PrefixCache->Add(PrefixModelKey, prompt, sess->PromptPtr, sess->Ctx);
+        }
+    }
+}
+
+
+// prompt and generated tokens of finished session, next turn of conversation can fork from them
+void TDecodeScheduler::AddToPrefixCache(TSession *sess)
+{
+    const TGenerateRequest &req = *sess->Req;
+    TVector<TVector<TLabelIndex>> labelsArr = req.Prompt;
+    for (int token : req.Result) {
+        labelsArr.resize(YSize(labelsArr) + 1);
+        labelsArr.back().push_back(token + 1 + 1);
+    }
+    // the last generated token is not in context
+    yint len = Min<yint>(YSize(labelsArr) - 1, sess->Ctx.GetLength());
+    PrefixCache->Add(PrefixModelKey, labelsArr, len, sess->Ctx);
+}
+
+
+// draft is not longer then remaining token budget
+void TDecodeScheduler::Propose(TSession *sess)
+{
+    TGenerateRequest &req = *sess->Req;
+    yint draftLen = Max<yint>(0, Min<yint>(req.DraftLen, req.MaxTokens - YSize(req.Result) - 1));
+    if (sess->PPMDraft.Get()) {
+        sess->PPMDraft->Propose(draftLen, &sess->Draft);
+    } else {
+        sess->ModelDraft->Propose(Pool.Get(), sess->Rng, req.Sampling, sess->History, draftLen, &sess->Draft);
+    }
+}
+
+
+void TDecodeScheduler::Decode()
+{
+    TVector<TSession *> batch;
+    TVector<yint> startArr; // first entry of each session
+    TVector<TCPUInferContext *> ctxArr;
+    TVector<TVector<TLabelIndex>> labelsArr;
+    for (TIntrusivePtr<TSession> &sess : Active) {
+        if (sess->IsPrefill()) {
+            continue;
+        }
+        TGenerateRequest &req = *sess->Req;
+        batch.push_back(sess.Get());
+        startArr.push_back(YSize(ctxArr));
+        ctxArr.push_back(&sess->Ctx);
+        labelsArr.resize(YSize(labelsArr) + 1);
+        if (sess->PromptPtr < YSize(req.Prompt)) {
+            labelsArr.back() = req.Prompt[sess->PromptPtr++];
+        } else {
+            labelsArr.back().push_back(req.Result.back() + 1 + 1);
+        }
+        // draft tokens are verified in the same pass
+        if (sess->IsSpeculative()) {
+            Propose(sess.Get());
+            for (int token : sess->Draft.Tokens) {
+                ctxArr.push_back(&sess->Ctx);
+                labelsArr.resize(YSize(labelsArr) + 1);
+                labelsArr.back().push_back(token + 1 + 1);
+            }
+        }
+    }
+    yint count = YSize(batch);
+    if (count == 0) {
+        return;
+    }
+    PROF_SCOPE("decode_step");
+    TVector<TVector<float>> stateArr;
+    ComputeDecodeBatch(Pool.Get(), Params, labelsArr, ctxArr, &stateArr);
+
+    // full distribution sessions share final layer product, top-k sessions use early exit each
+    // speculative sessions need full distribution at each draft position
+    TVector<yint> fullArr;
+    TVector<yint> topArr;
+    TVector<yint> specArr;
+    TVector<TVector<float>> fullStateArr;
+    TVector<yint> predPtr(count); // first prediction of each session
+    for (yint k = 0; k < count; ++k) {
+        TSession *sess = batch[k];
+        predPtr[k] = YSize(fullStateArr);
+        if (sess->IsSpeculative()) {
+            specArr.push_back(k);
+            for (yint j = 0; j <= YSize(sess->Draft.Tokens); ++j) {
+                fullStateArr.push_back(stateArr[startArr[k] + j]);
+            }
+        } else if (GetTopCandidateCount(sess->Req->Sampling) > 0) {
+            topArr.push_back(k);
+        } else {
+            fullArr.push_back(k);
+            fullStateArr.push_back(stateArr[startArr[k]]);
+        }
+    }
+    TVector<TVector<int>> tokenArr;
+    tokenArr.resize(count);
+    if (!fullStateArr.empty()) {
+        TVector<TVector<float>> predArr;
+        ComputeFinalPredictionBatch(Pool.Get(), Params, fullStateArr, &predArr);
+        for (yint k : fullArr) {
+            TSession *sess = batch[k];
+            tokenArr[k].push_back(SampleToken(sess->Rng, predArr[predPtr[k]], sess->Req->Sampling, sess->History));
+        }
+        ParallelFor(Pool.Get(), 0, YSize(specArr), [&](yint i) {
+            TSession *sess = batch[specArr[i]];
+            const TSamplingParams &sp = sess->Req->Sampling;
+            const TDraft &draft = sess->Draft;
+            yint draftLen = YSize(draft.Tokens);
+            // target distribution after j draft tokens
+            TVector<int> history(sess->History.begin() + Max<yint>(0, YSize(sess->History) - sp.RepetitionWindow), sess->History.end());
+            TVector<TVector<float>> targetArr(draftLen + 1);
+            for (yint j = 0; j <= draftLen; ++j) {
+                ComputeSampleDistr(predArr[predPtr[specArr[i]] + j], sp, history, &targetArr[j]);
+                if (j < draftLen) {
+                    history.push_back(draft.Tokens[j]);
+                }
+            }
+            yint accepted = AcceptDraft(sess->Rng, draft, targetArr, &tokenArr[specArr[i]]);
+            // rejected positions leave context
+            sess->Ctx.Truncate(sess->Ctx.GetLength() - (draftLen - accepted));
+            sess->Req->DraftCount += draftLen;
+            sess->Req->AcceptCount += accepted;
+            DraftCount.fetch_add(draftLen);
+            AcceptCount.fetch_add(accepted);
+        });
+    }
+    ParallelFor(Pool.Get(), 0, YSize(topArr), [&](yint i) {
+        TSession *sess = batch[topArr[i]];
+        TVector<TTokenProb> top;
+        ComputeFinalTopK(Params, stateArr[startArr[topArr[i]]], GetTopCandidateCount(sess->Req->Sampling), &top);
+        tokenArr[topArr[i]].push_back(SampleToken(sess->Rng, top, sess->Req->Sampling, sess->History));
+    });
+
+    for (yint k = 0; k < count; ++k) {
+        TSession *sess = batch[k];
+        TGenerateRequest &req = *sess->Req;
+        for (int token : tokenArr[k]) {
+            req.Result.push_back(token);
+            sess->AddToken(token);
+            if (sess->ModelDraft.Get()) {
+                TVector<TLabelIndex> labels;
+                labels.push_back(token + 1 + 1);
+                sess->ModelDraft->AddPosition(labels);
+            }
+            if (YSize(req.Result) == 1) {
+                req.FirstTokenTime = sess->GetTimeSinceSubmit();
+            }
+            if (token == req.StopToken || YSize(req.Result) >= req.MaxTokens) {
+                break;
+            }
+        }
+    }
+    StepCount.fetch_add(1);
+    DecodeCount.fetch_add(count);
+}
+
+
+void TDecodeScheduler::WorkerThread()
+{
+    NProf::SetThreadName("decode scheduler");
+    while (!Exit) {
+        Admit();
+        if (Active.empty()) {
+            SleepSeconds(0.001);
+            continue;
+        }
+        Prefill();
+        Decode();
+        // finished sessions leave the batch
+        yint dst = 0;
+        for (yint k = 0; k < YSize(Active); ++k) {
+            TIntrusivePtr<TSession> sess = Active[k];
+            TGenerateRequest &req = *sess->Req;
+            bool isFinished = !req.Result.empty() && (req.Result.back() == req.StopToken || YSize(req.Result) >= req.MaxTokens);
+            if (isFinished) {
+                if (PrefixCache.Get()) {
+                    AddToPrefixCache(sess.Get());
+                }
+                req.TotalTime = sess->GetTimeSinceSubmit();
+                req.Finished = true;
+            } else {
+                Active[dst++] = sess;
+            }
+        }
+        Active.resize(dst);
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "sample_model.h"
+#include "speculative.h"
+#include <gpt/cpu_infer/cpu_infer.h>
+#include <gpt/cpu_infer/prefix_cache.h>
+#include <lib/hp_timer/hp_timer.h>
+#include <util/thread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct TGenerateRequest : public TThrRefBase
+{
+    TVector<TVector<TLabelIndex>> Prompt; // first position is start token
+    yint MaxTokens = 0;
+    int StopToken = -1; // generation stops after this token, -1 for none
+    TSamplingParams Sampling;
+    ui32 Seed = 0;
+    EDraftType Draft = DRAFT_NONE;
+    yint DraftLen = 4; // draft tokens verified per step
+    // filled by scheduler
+    TVector<int> Result;
+    double FirstTokenTime = 0; // from submit
+    double TotalTime = 0;
+    yint DraftCount = 0;
+    yint AcceptCount = 0;
+    std::atomic<bool> Finished;
+
+    TGenerateRequest() : Finished(false) {}
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// continuous batching
+// worker thread evaluates one new position of every active session per step with single batched forward pass
+// sessions join and leave between steps, prompts are fed in chunks so they do not stall decoding of other sessions
+// speculative sessions add draft positions to the same batch and roll back rejected ones
+class TDecodeScheduler : public TThrRefBase
+{
+    struct TSession : public TThrRefBase
+    {
+        TIntrusivePtr<TGenerateRequest> Req;
+        NCPUInfer::TCPUInferContext Ctx;
+        TXRng Rng;
+        yint PromptPtr = 0; // prompt positions added to Ctx
+        TVector<int> History; // prompt and generated tokens for repetition penalty
+        TIntrusivePtr<TPPMDraft> PPMDraft;
+        TIntrusivePtr<TModelDraft> ModelDraft;
+        TDraft Draft; // current step proposal
+        NHPTimer::STime SubmitTime;
+
+        TSession(TIntrusivePtr<TGenerateRequest> req, const NCPUInfer::TCPUModelParams &params, const NCPUInfer::TCPUModelParams *draftParams, NHPTimer::STime submitTime)
+            : Req(req), Rng(req->Seed), SubmitTime(submitTime)
+        {
+            Ctx.Init(params);
+            if (req->Draft == DRAFT_PPM) {
+                PPMDraft = new TPPMDraft;
+            } else if (req->Draft == DRAFT_MODEL) {
+                ModelDraft = new TModelDraft(*draftParams);
+            }
+            for (const TVector<TLabelIndex> &labels : req->Prompt) {
+                if (labels[0] >= 2) {
+                    AddToken(labels[0] - 2);
+                }
+                if (ModelDraft.Get()) {
+                    ModelDraft->AddPosition(labels);
+                }
+            }
+        }
+        // GetTimePassed() resets its argument, SubmitTime is copied
+        double GetTimeSinceSubmit() const
+        {
+            NHPTimer::STime t = SubmitTime;
+            return NHPTimer::GetTimePassed(&t);
+        }
+        bool IsPrefill() const { return PromptPtr < YSize(Req->Prompt) - 1; }
+        bool IsSpeculative() const { return Req->Draft != DRAFT_NONE; }
+        void AddToken(int token)
+        {
+            History.push_back(token);
+            if (PPMDraft.Get()) {
+                PPMDraft->AddToken(token);
+            }
+        }
+    };
+
+    struct TSubmit
+    {
+        TIntrusivePtr<TGenerateRequest> Req;
+        NHPTimer::STime SubmitTime;
+    };
+
+    const NCPUInfer::TCPUModelParams &Params;
+    const NCPUInfer::TCPUModelParams *DraftParams = nullptr;
+    TIntrusivePtr<NCPUInfer::TPrefixCache> PrefixCache;
+    yint PrefixModelKey = 0;
+    TIntrusivePtr<TThreadPool> Pool;
+    yint MaxBatch = 0;
+    yint PrefillChunk = 0;
+    TSingleConsumerJobQueue<TSubmit> SubmitQueue;
+    TThread Thr;
+    volatile bool Exit = false;
+    // worker thread only
+    TVector<TSubmit> Waiting;
+    TVector<TIntrusivePtr<TSession>> Active;
+    std::atomic<yint> StepCount;
+    std::atomic<yint> DecodeCount;
+    std::atomic<yint> DraftCount;
+    std::atomic<yint> AcceptCount;
+
+    ~TDecodeScheduler();
+    void Admit();
+    void Prefill();
+    void Decode();
+    void Propose(TSession *sess);
+    void AddToPrefixCache(TSession *sess);
+
+public:
+    // maxBatch sessions are decoded together, prefillChunk prompt positions are added per step
+    // draftParams is optional draft model for DRAFT_MODEL requests, must have the same vocabulary
+    // pool and prefixCache can be shared by schedulers of several models, prefixCache is optional
+    TDecodeScheduler(const NCPUInfer::TCPUModelParams &params, yint maxBatch, yint prefillChunk, TThreadPool *pool,
+        const NCPUInfer::TCPUModelParams *draftParams = nullptr, TIntrusivePtr<NCPUInfer::TPrefixCache> prefixCache = nullptr);
+    void Submit(TIntrusivePtr<TGenerateRequest> req);
+    void Stop();
+    bool HasDraftModel() const { return DraftParams != nullptr; }
+    double GetAvrgBatch() const { return DecodeCount.load() / Max<double>(1, StepCount.load()); }
+    double GetAcceptRate() const { return AcceptCount.load() / Max<double>(1, DraftCount.load()); }
+
+public:
+    void WorkerThread();
+};
@@ -1,8 +1,15 @@
 #include "stdafx.h"
 #include "sample_model.h"
+#include "model_registry.h"
+#include <gpt/att/sliding_window.h>
 #include <lib/net/http_server.h>
 #include <lib/net/http_request.h>
+#include <lib/net/http_client.h>
 #include <lib/net/html_compose.h>
+#include <lib/config/config.h>
+#include <lib/file/dir.h>
+#include <lib/hp_timer/hp_timer.h>
+#include <lib/math/matrix_utils.h>
 #include <util/string.h>
 
 
@@ -100,7 +107,314 @@ static void RenderRootPage(TString *pRes, const TString &modelName)
 }
 
 
-int main()
+///////////////////////////////////////////////////////////////////////////////////////////////////
+const yint CONT_TOKEN_COUNT = 16; // tokens generated per cont query
+const yint DEFAULT_MAX_TOKENS = 64;
+const yint MAX_DRAFT_LEN = 16;
+const char *DEFAULT_MODEL_NAME = "default";
+
+
+// model names are used in urls and json as is
+static bool IsValidModelName(const TString &name)
+{
+    if (name.empty()) {
+        return false;
+    }
+    for (char c : name) {
+        if (!isalnum((ui8)c) && c != '_' && c != '-' && c != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// incomplete utf8 char at the end is cut, capital word token upcases next letter
+static TString DecodeTokens(const TTokenizer &tokenizer, const TVector<int> &tokens, bool *pHasStop)
+{
+    TString res;
+    TString letter;
+    bool isCapital = false;
+    *pHasStop = false;
+    for (int token : tokens) {
+        if (tokenizer.HasDocStartToken() && token == tokenizer.GetDocStartToken()) {
+            *pHasStop = true;
+            break;
+        }
+        if (token == tokenizer.GetCapitalWordToken()) {
+            isCapital = true;
+            continue;
+        }
+        letter += tokenizer.GetWord(token);
+        yint utf8len = Utf8CodeLength[(ui8)letter[0]];
+        if (utf8len != 255 && YSize(letter) < utf8len) {
+            continue;
+        }
+        res += isCapital ? UpcaseFirstLetter(letter) : letter;
+        letter.clear();
+        isCapital = false;
+    }
+    return res;
+}
+
+
+static TString RenderGenJSON(const TTokenizer &tokenizer, const TGenerateRequest &req)
+{
+    bool hasStop = false;
+    TString text = DecodeTokens(tokenizer, req.Result, &hasStop);
+    TString res = "{";
+    res += Sprintf("\"text\":\"%s\",", EncodeJSON(text).c_str());
+    res += Sprintf("\"token_count\":%d,", (int)YSize(req.Result));
+    res += Sprintf("\"stop\":%s,", hasStop ? "true" : "false");
+    res += Sprintf("\"first_token_ms\":%g,", req.FirstTokenTime * 1000);
+    res += Sprintf("\"total_ms\":%g,", req.TotalTime * 1000);
+    res += Sprintf("\"draft_tokens\":%d,", (int)req.DraftCount);
+    res += Sprintf("\"accepted_tokens\":%d,", (int)req.AcceptCount);
+    res += "\"tokens\":[";
+    for (yint k = 0; k < YSize(req.Result); ++k) {
+        res += Sprintf(k == 0 ? "%d" : ",%d", req.Result[k]);
+    }
+    res += "]}";
+    return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// loopback load generator, client threads query gen on this server
+struct TLoadClient : public TThrRefBase
+{
+    TString Host;
+    std::atomic<yint> *NextRequest = nullptr;
+    yint RequestCount = 0;
+    TString DraftParam; // speculative decoding params appended to each query
+    TString SharedPrompt; // prepended to each prompt
+    TVector<TString> ModelNames; // requests go to models in turn
+    TThread Thr;
+    TVector<double> LatencyArr;
+    TVector<double> FirstTokenArr;
+    yint TokenCount = 0;
+    yint ErrCount = 0;
+    std::atomic<bool> Done;
+
+    TLoadClient(const TString &host, std::atomic<yint> *nextRequest, yint requestCount, const TString &draftParam, const TString &sharedPrompt,
+        const TVector<TString> &modelNames)
+        : Host(host), NextRequest(nextRequest), RequestCount(requestCount), DraftParam(draftParam), SharedPrompt(sharedPrompt), ModelNames(modelNames), Done(false)
+    {
+        Thr.Create(this);
+    }
+
+    void WorkerThread()
+    {
+        static const char *prompts[] = { "the future will ", "Seven plus eleven equals ", "Сегодня самый лучший день ", "\n176 * 871 =" };
+        for (;;) {
+            yint id = NextRequest->fetch_add(1);
+            if (id >= RequestCount) {
+                break;
+            }
+            // mix of sampling params and lengths, every request has its own
+            TString prompt = SharedPrompt;
+            for (yint k = 0; k <= id % 5; ++k) {
+                prompt += prompts[(id + k) % (sizeof(prompts) / sizeof(prompts[0]))];
+            }
+            yint maxTokens = 16 + (id % 4) * 16;
+            TString url = Sprintf("/gen?prompt=%s&max_tokens=%d&temperature=%g&top_k=%d&top_p=%g&repetition_penalty=%g&seed=%d",
+                EncodeCGI(prompt).c_str(), (int)maxTokens, (id % 3) * 0.5, (id % 2) ? 40 : 0, (id % 5 == 0) ? 0.9 : 1., (id % 7 == 0) ? 1.2 : 1., (int)id);
+            url += DraftParam;
+            url += "&model=" + ModelNames[id % YSize(ModelNames)];
+            NHPTimer::STime tStart;
+            NHPTimer::GetTime(&tStart);
+            TVector<char> reply;
+            if (!NNet::Fetch(Host.c_str(), url.c_str(), TVector<char>(), &reply)) {
+                ++ErrCount;
+                continue;
+            }
+            LatencyArr.push_back(NHPTimer::GetTimePassed(&tStart));
+            TString str(reply.begin(), reply.end());
+            size_t ptr = str.find("\"token_count\":");
+            if (ptr == TString::npos) {
+                ++ErrCount;
+                continue;
+            }
+            TokenCount += atoi(str.c_str() + ptr + strlen("\"token_count\":"));
+            ptr = str.find("\"first_token_ms\":");
+            if (ptr != TString::npos) {
+                FirstTokenArr.push_back(atof(str.c_str() + ptr + strlen("\"first_token_ms\":")) / 1000);
+            }
+        }
+        Done = true;
+    }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// speculative decoding check, greedy output must match plain greedy decoding token by token
+// requests run one at a time to compare single stream decode speed
+static yint CheckSpeculativeDecode(TCPUSampler *p, yint draftLen)
+{
+    const yint GEN_LEN = 128;
+    static const char *prompts[] = {
+        "the cat sat on the mat. the cat sat on the mat. the cat sat on the mat. the cat",
+        "for (int i = 0; i < n; ++i) {\n    sum += a[i];\n}\nfor (int i = 0; i < n; ++i) {\n    sum += b[i];\n}\nfor (int i = 0; ",
+        "Seven plus eleven equals ",
+    };
+    TVector<EDraftType> draftArr;
+    draftArr.push_back(DRAFT_NONE);
+    draftArr.push_back(DRAFT_PPM);
+    if (p->Scheduler->HasDraftModel()) {
+        draftArr.push_back(DRAFT_MODEL);
+    }
+    static const char *draftNames[] = { "none", "ppm", "model" };
+    yint promptCount = sizeof(prompts) / sizeof(prompts[0]);
+    yint errCount = 0;
+    for (float temperature : { 0.f, 1.f }) {
+        TVector<TVector<int>> refResult;
+        for (EDraftType draft : draftArr) {
+            TSamplingParams sp;
+            sp.Temperature = temperature;
+            yint tokenCount = 0;
+            yint draftCount = 0;
+            yint acceptCount = 0;
+            bool isSame = true;
+            NHPTimer::STime tStart;
+            NHPTimer::GetTime(&tStart);
+            for (yint k = 0; k < promptCount; ++k) {
+                TIntrusivePtr<TGenerateRequest> req = p->MakeRequest(prompts[k], GEN_LEN, sp, 1313 + k);
+                req->Draft = draft;
+                req->DraftLen = draftLen;
+                p->Scheduler->Submit(req);
+                while (!req->Finished) {
+                    SleepSeconds(0.0001);
+                }
+                tokenCount += YSize(req->Result);
+                draftCount += req->DraftCount;
+                acceptCount += req->AcceptCount;
+                if (draft == DRAFT_NONE) {
+                    refResult.push_back(req->Result);
+                } else if (temperature == 0) {
+                    isSame &= (YSize(req->Result) == YSize(refResult[k]));
+                    for (yint t = 0; isSame && t < YSize(req->Result); ++t) {
+                        isSame &= (req->Result[t] == refResult[k][t]);
+                    }
+                }
+            }
+            double elapsed = NHPTimer::GetTimePassed(&tStart);
+            DebugPrintf("temperature %g, draft %-5s: %4d tokens, %6.1f tokens/sec, accepted %5.1f%% of %4d draft tokens%s\n",
+                temperature, draftNames[draft], (int)tokenCount, tokenCount / elapsed, acceptCount * 100. / Max<yint>(1, draftCount), (int)draftCount,
+                (temperature == 0 && draft != DRAFT_NONE) ? (isSame ? ", same as greedy: ok" : ", same as greedy: FAILED") : "");
+            errCount += !isSame;
+        }
+    }
+    return errCount;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// weight sharing check
+// variant of base model with last layerCount layers changed, the rest is the same as base
+static void MakeModelVariant(const TModelParams &base, yint layerCount, TModelParams *p)
+{
+    *p = base;
+    yint depth = YSize(p->LayerArr);
+    for (yint d = Max<yint>(0, depth - layerCount); d < depth; ++d) {
+        for (TModelParams::TAttentionMatrices &att : p->LayerArr[d]) {
+            for (TArray2D<float> *matr : { &att.QK, &att.QV, &att.K, &att.V, &att.Combiner }) {
+                for (yint y = 0; y < matr->GetYSize(); ++y) {
+                    for (yint x = 0; x < matr->GetXSize(); ++x) {
+                        (*matr)[y][x] = -(*matr)[y][x];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static TVector<int> Generate(TCPUSampler *p, const TString &prompt, float temperature, ui32 seed)
+{
+    TSamplingParams sp;
+    sp.Temperature = temperature;
+    TIntrusivePtr<TGenerateRequest> req = p->MakeRequest(prompt, 64, sp, seed);
+    p->Scheduler->Submit(req);
+    while (!req->Finished) {
+        SleepSeconds(0.0001);
+    }
+    return req->Result;
+}
+
+static yint CheckWeightCount(const char *stage, yint bytes, yint expectedBytes)
+{
+    bool isOk = (bytes == expectedBytes);
+    DebugPrintf("%s: weight store %g mb, expected %g mb: %s\n", stage, bytes / 1e6, expectedBytes / 1e6, isOk ? "ok" : "FAILED");
+    return !isOk;
+}
+
+// variant with changed last layer shares all other matrices with base
+// variant output must match the same variant converted alone, memory of unloaded variant must be released
+static yint CheckWeightSharing(const TTokenizer &tokenizer, TModelParams &modelParams, yint maxBatch)
+{
+    TModelParams variantParams;
+    MakeModelVariant(modelParams, 1, &variantParams);
+    TIntrusivePtr<TThreadPool> pool = new TThreadPool(Max<yint>(1, GetCpuCount() - 1));
+    TCPUSampler alone;
+    alone.Init(variantParams, nullptr, tokenizer, maxBatch, pool.Get(), nullptr, nullptr);
+    yint modelBytes = NCPUInfer::CalcModelBytes(alone.Params);
+    yint layerBytes = 0;
+    for (const NCPUInfer::TCPUModelParams::TAttentionMatrices &att : alone.Params.LayerArr.back()) {
+        for (const NCPUInfer::TWeightMatrix *matr : { &att.QK, &att.QV, &att.K, &att.V, &att.Combiner }) {
+            layerBytes += NCPUInfer::GetMatrixBytes(*matr);
+        }
+    }
+    yint matrBytes = modelBytes - YSize(alone.Params.Bias) * sizeof(float);
+
+    yint errCount = 0;
+    TModelRegistry registry(tokenizer, maxBatch, 0);
+    registry.Add("base", modelParams, nullptr);
+    registry.Add("variant", variantParams, nullptr);
+    errCount += CheckWeightCount("base and variant", registry.GetWeightStore().GetBytes(), matrBytes + layerBytes);
+
+    static const char *prompts[] = { "the cat sat on the mat. ", "Seven plus eleven equals " };
+    for (const char *prompt : prompts) {
+        for (float temperature : { 0.f, 1.f }) {
+            TVector<int> res = Generate(registry.GetModel("variant").Get(), prompt, temperature, 1313);
+            TVector<int> ref = Generate(&alone, prompt, temperature, 1313);
+            bool isSame = (res == ref);
+            DebugPrintf("temperature %g, %d tokens, shared variant same as variant alone: %s\n", temperature, (int)YSize(res), isSame ? "ok" : "FAILED");
+            errCount += !isSame;
+        }
+    }
+    alone.Scheduler->Stop();
+
+    // unloaded variant is destroyed on update, its last layer is dropped from store
+    registry.Unload("variant");
+    registry.Update();
+    errCount += CheckWeightCount("variant unloaded", registry.GetWeightStore().GetBytes(), matrBytes);
+
+    // hot load from file in background
+    TString fname = "weight_sharing_check.bin";
+    Serialize(false, fname, variantParams);
+    registry.StartLoad("variant", fname, "");
+    while (registry.IsLoading()) {
+        SleepSeconds(0.01);
+        registry.Update();
+    }
+    EraseFile(fname);
+    errCount += (registry.GetModel("variant").Get() == nullptr);
+    errCount += CheckWeightCount("variant loaded from file", registry.GetWeightStore().GetBytes(), matrBytes + layerBytes);
+    return errCount;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct TPendingReply
+{
+    SOCKET Sock = INVALID_SOCKET;
+    TIntrusivePtr<TCPUSampler> Model; // unloaded model is kept until reply
+    TIntrusivePtr<TGenerateRequest> Req;
+    bool IsCont = false;
+    TContState Cont;
+};
+
+
+int main(int argc, char **argv)
 {
 #ifdef _MSC_VER
     SetConsoleCP(CP_UTF8);
@@ -108,26 +422,211 @@ int main()
 #endif
     TXRng rng(GetCycleCount());
 
-    const TString tokenizerFilename = "d:/tokenizers/50k.bin";
-    const TString modelFilename = "D:/models/rus_big/eden_gpt_274k.bin";
+    TString tokenizerFilename = "d:/tokenizers/50k.bin";
+    TString modelFilename = "D:/models/rus_big/eden_gpt_274k.bin";
+    TString randomModelDims;
+    TString draftModelName;
+    yint draftLen = 0;
+    bool checkSpeculative = false;
+    yint prefixCacheMB = 256;
+    yint sharedPromptLen = 0;
+    int port = 11311;
+    yint maxBatch = 16;
+    yint loadClientCount = 0;
+    yint loadRequestCount = 256;
+    bool useGpu = false;
+    TVector<TString> variantNameArr;
+    TVector<TString> variantModelArr;
+    bool checkWeightSharing = false;
+    TOpt cmdline("m:t:r:d:k:z:a:p:b:l:n:v:gscw", argc, argv);
+    for (const TOpt::TParam &param : cmdline.Params) {
+        if (param.Name == "m") {
+            modelFilename = param.Args[0];
+        } else if (param.Name == "t") {
+            tokenizerFilename = param.Args[0];
+        } else if (param.Name == "r") {
+            // random model with byte tokenizer, for testing
+            randomModelDims = param.Args[0];
+        } else if (param.Name == "d") {
+            // draft model for speculative decoding, dims of random draft model with -r
+            draftModelName = param.Args[0];
+        } else if (param.Name == "k") {
+            // load generator uses speculative decoding with this draft length
+            draftLen = atoi(param.Args[0].c_str());
+        } else if (param.Name == "c") {
+            checkSpeculative = true;
+        } else if (param.Name == "z") {
+            // prompt prefix cache budget in megabytes, 0 disables it
+            prefixCacheMB = atoi(param.Args[0].c_str());
+        } else if (param.Name == "a") {
+            // load generator prepends shared prompt of this many chars to every request
+            sharedPromptLen = atoi(param.Args[0].c_str());
+        } else if (param.Name == "p") {
+            port = atoi(param.Args[0].c_str());
+        } else if (param.Name == "b") {
+            maxBatch = atoi(param.Args[0].c_str());
+        } else if (param.Name == "l") {
+            loadClientCount = atoi(param.Args[0].c_str());
+        } else if (param.Name == "n") {
+            loadRequestCount = atoi(param.Args[0].c_str());
+        } else if (param.Name == "v") {
+            // additional model name=filename, with -r name=N is random model with last N layers changed
+            TString arg = param.Args[0];
+            size_t ptr = arg.find('=');
+            Y_VERIFY(ptr != TString::npos && IsValidModelName(arg.substr(0, ptr)) && "expected -v name=model");
+            variantNameArr.push_back(arg.substr(0, ptr));
+            variantModelArr.push_back(arg.substr(ptr + 1));
+        } else if (param.Name == "w") {
+            checkWeightSharing = true;
+        } else if (param.Name == "g") {
+            useGpu = true;
+        } else if (param.Name == "s") {
+            // sampler distribution checks and timing
+            yint errCount = CheckSampler();
+            errCount += CheckSpeculative();
+            BenchSampler();
+            return errCount > 0 ? 1 : 0;
+        }
+    }
 
     TTokenizer tokenizer;
-    Serialize(true, tokenizerFilename, tokenizer);
-
-    TSamplingModel model;
-    {
-        TModelParams modelParams;
+    TModelParams modelParams;
+    TModelParams draftModelParams;
+    if (randomModelDims.empty()) {
+        Serialize(true, tokenizerFilename, tokenizer);
         Serialize(true, modelFilename, modelParams);
-        model.Init(modelParams, tokenizer);
+        if (!draftModelName.empty()) {
+            Serialize(true, draftModelName, draftModelParams);
+        }
+    } else {
+        tokenizer.MakeByteEncoder(TTokenizer::TK_CHAR);
+        auto makeRandomModel = [&](const TString &dims, TModelParams *p) {
+            TModelDim modelDim;
+            InitModelDim(&modelDim, dims, ALIBI_V3, tokenizer.GetVocabSize(), MPF_NOFLAGS);
+            TVector<float> biasArr;
+            ClearPodArray(&biasArr, tokenizer.GetVocabSize());
+            TXRng initRng(1313);
+            InitModel(p, initRng, modelDim, COMBINER_INIT_RANDOM, biasArr);
+        };
+        makeRandomModel(randomModelDims, &modelParams);
+        if (!draftModelName.empty()) {
+            makeRandomModel(draftModelName, &draftModelParams);
+        }
+        modelFilename = "random " + randomModelDims;
     }
 
+    // cpu inference is default, models it can not serve fall back to gpu if only gpu features are requested
+    bool needCpu = loadClientCount > 0 || checkSpeculative || checkWeightSharing || !variantNameArr.empty() || !draftModelName.empty();
+    if (!useGpu) {
+        TString err;
+        if (!CanServeModel(modelParams, tokenizer, &err)) {
+            if (needCpu) {
+                DebugPrintf("can not serve %s: %s\n", modelFilename.c_str(), err.c_str());
+                return 1;
+            }
+            DebugPrintf("%s, using gpu\n", err.c_str());
+            useGpu = true;
+        } else if (!draftModelName.empty() && !CanServeModel(draftModelParams, tokenizer, &err)) {
+            DebugPrintf("can not use draft model %s: %s\n", draftModelName.c_str(), err.c_str());
+            return 1;
+        }
+    }
+    Y_VERIFY((!useGpu || (loadClientCount == 0 && !checkSpeculative && variantNameArr.empty())) && "load generator, speculative decoding and multiple models need cpu inference");
+    Y_VERIFY(draftLen >= 0 && draftLen <= MAX_DRAFT_LEN);
+    if (checkWeightSharing) {
+        yint errCount = CheckWeightSharing(tokenizer, modelParams, maxBatch);
+        return errCount > 0 ? 1 : 0;
+    }
+
+    // legacy path, one query at a time on gpu
+    TSamplingModel gpuModel;
+    TModelRegistry registry(tokenizer, maxBatch, prefixCacheMB * 1000000);
+    if (useGpu) {
+        gpuModel.Init(modelParams, tokenizer);
+    } else {
+        registry.Add(DEFAULT_MODEL_NAME, modelParams, draftModelName.empty() ? nullptr : &draftModelParams);
+        for (yint k = 0; k < YSize(variantNameArr); ++k) {
+            if (randomModelDims.empty()) {
+                registry.StartLoad(variantNameArr[k], variantModelArr[k], "");
+            } else {
+                TModelParams variantParams;
+                MakeModelVariant(modelParams, atoi(variantModelArr[k].c_str()), &variantParams);
+                registry.Add(variantNameArr[k], variantParams, nullptr);
+            }
+        }
+        while (registry.IsLoading()) {
+            SleepSeconds(0.01);
+            registry.Update();
+        }
+    }
+    if (checkSpeculative) {
+        TIntrusivePtr<TCPUSampler> defaultModel = registry.GetModel(DEFAULT_MODEL_NAME);
+        yint errCount = CheckSpeculativeDecode(defaultModel.Get(), draftLen > 0 ? draftLen : 4);
+        defaultModel->Scheduler->Stop();
+        return errCount > 0 ? 1 : 0;
+    }
 
     // serve queries
-    THttpServer srv(11311);
-    DebugPrintf("start serving queries\n");
+    THttpServer srv(port);
+    DebugPrintf("start serving queries on port %d, %s\n", port, useGpu ? "gpu" : Sprintf("cpu max batch %d", (int)maxBatch).c_str());
+    // speculative decoding with draft model is available for default model only
+    TVector<TString> loadModelNames = registry.GetModelNames();
+    if (draftLen > 0 && !draftModelName.empty()) {
+        loadModelNames.resize(0);
+        loadModelNames.push_back(DEFAULT_MODEL_NAME);
+    }
+    std::atomic<yint> nextLoadRequest(0);
+    TVector<TIntrusivePtr<TLoadClient>> loadClients;
+    TString loadDraftParam;
+    if (draftLen > 0) {
+        loadDraftParam = Sprintf("&draft=%s&draft_len=%d", draftModelName.empty() ? "ppm" : "model", (int)draftLen);
+    }
+    TString sharedPrompt;
+    while (YSize(sharedPrompt) < sharedPromptLen) {
+        sharedPrompt += "You are a helpful assistant. Answer briefly and precisely, cite sources when possible. ";
+    }
+    sharedPrompt.resize(sharedPromptLen);
+    for (yint k = 0; k < loadClientCount; ++k) {
+        loadClients.push_back(new TLoadClient(Sprintf("127.0.0.1:%d", port), &nextLoadRequest, loadRequestCount, loadDraftParam, sharedPrompt, loadModelNames));
+    }
+    NHPTimer::STime tStart;
+    NHPTimer::GetTime(&tStart);
+    TVector<TPendingReply> pendingArr;
     for (;;) {
+        // reply finished queries
+        yint dst = 0;
+        for (yint k = 0; k < YSize(pendingArr); ++k) {
+            TPendingReply &pr = pendingArr[k];
+            if (!pr.Req->Finished) {
+                pendingArr[dst++] = pr;
+                continue;
+            }
+            if (pr.IsCont) {
+                bool hasStop = false;
+                pr.Cont.Cont += DecodeTokens(pr.Model->Tokenizer, pr.Req->Result, &hasStop);
+                pr.Cont.Finished = hasStop;
+                TStateXML xml;
+                xml.Render(pr.Cont);
+                HttpReplyXML(pr.Sock, xml.XML);
+            } else {
+                HttpReplyJSON(pr.Sock, RenderGenJSON(pr.Model->Tokenizer, *pr.Req));
+            }
+        }
+        pendingArr.resize(dst);
+        registry.Update();
+
+        if (!loadClients.empty()) {
+            bool allDone = true;
+            for (TIntrusivePtr<TLoadClient> &cl : loadClients) {
+                allDone &= cl->Done.load();
+            }
+            if (allDone) {
+                break;
+            }
+        }
+
         THttpRequest req;
-        if (!srv.CanAccept(0.1f)) {
+        if (!srv.CanAccept(pendingArr.empty() ? 0.1f : 0.001f)) {
             continue;
         }
         SOCKET s = srv.AcceptNonBlocking(&req);
@@ -138,20 +637,128 @@ int main()
             TString html;
             RenderRootPage(&html, modelFilename);
             HttpReplyHTML(s, html);
-        } else if (req.Req == "cont") {
+        } else if (req.Req == "cont" && useGpu) {
             TContState cs;
             cs.Prompt = DecodeCGI(req.GetParam("prompt"));
             cs.Cont = DecodeCGI(req.GetParam("cont"));
-            TString next = SampleFromModel(rng, model, cs.Prompt + cs.Cont);
+            TString next = SampleFromModel(rng, gpuModel, cs.Prompt + cs.Cont, TSamplingParams());
             cs.Finished = next.empty(); // stop if EOT was generated
             cs.Cont += next;
             TStateXML xml;
             xml.Render(cs);
             HttpReplyXML(s, xml.XML);
             //DebugPrintf("query prompt %s, cont %s\n", cs.Prompt.c_str(), cs.Cont.c_str());
+        } else if (req.Req == "models" && !useGpu) {
+            HttpReplyJSON(s, registry.RenderJSON());
+        } else if (req.Req == "load" && !useGpu) {
+            // load?name=variant&model=filename&tokenizer=filename, tokenizer is optional
+            TString name = DecodeCGI(req.GetParam("name"));
+            TString fname = DecodeCGI(req.GetParam("model"));
+            if (!IsValidModelName(name) || fname.empty()) {
+                ReplyBadRequest(s);
+                continue;
+            }
+            registry.StartLoad(name, fname, DecodeCGI(req.GetParam("tokenizer")));
+            HttpReplyJSON(s, registry.RenderJSON());
+        } else if (req.Req == "unload" && !useGpu) {
+            // unload?name=variant
+            if (!registry.Unload(DecodeCGI(req.GetParam("name")))) {
+                ReplyNotFound(s);
+                continue;
+            }
+            HttpReplyJSON(s, registry.RenderJSON());
+        } else if (req.Req == "cont") {
+            TPendingReply pr;
+            pr.Model = registry.GetModel(req.HasParam("model") ? DecodeCGI(req.GetParam("model")) : DEFAULT_MODEL_NAME);
+            if (pr.Model.Get() == nullptr) {
+                ReplyNotFound(s);
+                continue;
+            }
+            pr.Sock = s;
+            pr.IsCont = true;
+            pr.Cont.Prompt = DecodeCGI(req.GetParam("prompt"));
+            pr.Cont.Cont = DecodeCGI(req.GetParam("cont"));
+            pr.Req = pr.Model->MakeRequest(pr.Cont.Prompt + pr.Cont.Cont, CONT_TOKEN_COUNT, TSamplingParams(), rng.GenRand());
+            pr.Model->Scheduler->Submit(pr.Req);
+            pendingArr.push_back(pr);
+        } else if (req.Req == "gen" && !useGpu) {
+            // gen?prompt=text&model=default&max_tokens=64&temperature=1&top_k=0&top_p=1&repetition_penalty=1&seed=1&draft=ppm&draft_len=4
+            TIntrusivePtr<TCPUSampler> model = registry.GetModel(req.HasParam("model") ? DecodeCGI(req.GetParam("model")) : DEFAULT_MODEL_NAME);
+            if (model.Get() == nullptr) {
+                ReplyNotFound(s);
+                continue;
+            }
+            TSamplingParams sp;
+            if (req.HasParam("temperature")) {
+                sp.Temperature = atof(req.GetParam("temperature").c_str());
+            }
+            sp.TopK = req.GetIntParam("top_k");
+            if (req.HasParam("top_p")) {
+                sp.TopP = atof(req.GetParam("top_p").c_str());
+            }
+            if (req.HasParam("repetition_penalty")) {
+                sp.RepetitionPenalty = atof(req.GetParam("repetition_penalty").c_str());
+            }
+            yint maxTokens = req.HasParam("max_tokens") ? req.GetIntParam("max_tokens") : DEFAULT_MAX_TOKENS;
+            ui32 seed = req.HasParam("seed") ? req.GetIntParam("seed") : rng.GenRand();
+            EDraftType draft = DRAFT_NONE;
+            bool isValidDraft = !req.HasParam("draft") || ParseDraftType(req.GetParam("draft"), &draft);
+            isValidDraft &= (draft != DRAFT_MODEL || model->Scheduler->HasDraftModel());
+            yint reqDraftLen = req.HasParam("draft_len") ? req.GetIntParam("draft_len") : 4;
+            // temperature 0 is greedy, nan fails all comparisons
+            bool isValidSampling = (sp.Temperature >= 0 && sp.Temperature < 1e6) && (sp.TopP > 0 && sp.TopP <= 1) &&
+                (sp.RepetitionPenalty > 0 && sp.RepetitionPenalty < 1e6) && sp.TopK >= 0;
+            if (maxTokens <= 0 || !isValidSampling || !isValidDraft || reqDraftLen < 0 || reqDraftLen > MAX_DRAFT_LEN) {
+                ReplyBadRequest(s);
+                continue;
+            }
+            TPendingReply pr;
+            pr.Sock = s;
+            pr.Model = model;
+            pr.Req = model->MakeRequest(DecodeCGI(req.GetParam("prompt")), maxTokens, sp, seed);
+            pr.Req->Draft = draft;
+            pr.Req->DraftLen = reqDraftLen;
+            model->Scheduler->Submit(pr.Req);
+            pendingArr.push_back(pr);
         } else {
             ReplyNotFound(s);
         }
     }
+
+    // load generator report
+    double elapsed = NHPTimer::GetTimePassed(&tStart);
+    TVector<double> latencyArr;
+    TVector<double> firstTokenArr;
+    yint tokenCount = 0;
+    yint errCount = 0;
+    for (TIntrusivePtr<TLoadClient> &cl : loadClients) {
+        cl->Thr.Join();
+        latencyArr.insert(latencyArr.end(), cl->LatencyArr.begin(), cl->LatencyArr.end());
+        firstTokenArr.insert(firstTokenArr.end(), cl->FirstTokenArr.begin(), cl->FirstTokenArr.end());
+        tokenCount += cl->TokenCount;
+        errCount += cl->ErrCount;
+    }
+    DebugPrintf("%g clients, %g requests, %g errors, max batch %g\n",
+        loadClientCount * 1., YSize(latencyArr) * 1., errCount * 1., maxBatch * 1.);
+    DebugPrintf("%g tokens/sec, %g requests/sec, latency p50 %g ms, p90 %g ms, p99 %g ms\n",
+        tokenCount / elapsed, YSize(latencyArr) / elapsed,
+        GetPercentile(latencyArr, 0.5) * 1000, GetPercentile(latencyArr, 0.9) * 1000, GetPercentile(latencyArr, 0.99) * 1000);
+    DebugPrintf("time to first token p50 %g ms, p90 %g ms, p99 %g ms\n",
+        GetPercentile(firstTokenArr, 0.5) * 1000, GetPercentile(firstTokenArr, 0.9) * 1000, GetPercentile(firstTokenArr, 0.99) * 1000);
+    for (const TString &name : registry.GetModelNames()) {
+        TIntrusivePtr<TCPUSampler> model = registry.GetModel(name);
+        model->Scheduler->Stop();
+        DebugPrintf("model %s: avrg batch %g", name.c_str(), model->Scheduler->GetAvrgBatch());
+        if (draftLen > 0) {
+            DebugPrintf(", draft length %g, accepted %g%% of draft tokens", draftLen * 1., model->Scheduler->GetAcceptRate() * 100);
+        }
+        DebugPrintf("\n");
+    }
+    const NCPUInfer::TPrefixCache *prefixCache = registry.GetPrefixCache();
+    if (prefixCache) {
+        DebugPrintf("prefix cache %g blocks, %g mb, %g%% of prompt positions found\n",
+            prefixCache->GetBlockCount() * 1., prefixCache->GetBytes() / 1e6, prefixCache->GetHitRate() * 100);
+    }
+    DebugPrintf("weight store %g mb, %g matrices\n", registry.GetWeightStore().GetBytes() / 1e6, registry.GetWeightStore().GetMatrixCount() * 1.);
     return 0;
 }
@@ -0,0 +1,314 @@
+#include "stdafx.h"
+#include "model_registry.h"
+#include <lib/file/dir.h>
+#include <util/string.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static bool HasSize(const TArray2D<float> &matr, yint xSize, yint ySize)
+{
+    return matr.GetXSize() == xSize && matr.GetYSize() == ySize;
+}
+
+
+// matrix sizes match model dims, model read from damaged file can pass deserialization but fail here
+static bool IsConsistentModel(const TModelParams &modelParams)
+{
+    const TModelDim &dims = modelParams.ModelDim;
+    if (!HasSize(modelParams.LabelEmbed.GetMatrix(), dims.Dim, dims.LabelCount) || !HasSize(modelParams.FinalLayer.GetMatrix(), dims.Dim, dims.VocabSize)) {
+        return false;
+    }
+    if (YSize(modelParams.Bias) != dims.VocabSize || YSize(modelParams.LayerArr) != YSize(dims.Layers)) {
+        return false;
+    }
+    for (yint d = 0; d < YSize(dims.Layers); ++d) {
+        if (YSize(modelParams.LayerArr[d]) != YSize(dims.Layers[d])) {
+            return false;
+        }
+        for (yint k = 0; k < YSize(dims.Layers[d]); ++k) {
+            const TModelParams::TAttentionMatrices &att = modelParams.LayerArr[d][k];
+            yint widthId = dims.Layers[d][k].AttentionWidthId;
+            if (widthId < 0 || widthId >= YSize(dims.AttentionWidthArr)) {
+                return false;
+            }
+            if (!HasSize(att.QK, dims.Dim, dims.QDim) || !HasSize(att.QV, dims.Dim, dims.QDim) || !HasSize(att.K, dims.Dim, dims.TTDim) ||
+                !HasSize(att.V, dims.Dim, dims.TTDim) || !HasSize(att.Combiner, GetCombinerWidth(dims.TTDim), dims.Dim))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+bool CanServeModel(const TModelParams &modelParams, const TTokenizer &tokenizer, TString *pErr)
+{
+    // context length is kept by kv cache of layers, alibi v3 with depth below 5 has no layers
+    if (modelParams.ModelDim.Layers.empty()) {
+        *pErr = "model has no layers";
+        return false;
+    }
+    for (const TVector<TModelDim::TAttentionPosParams> &layer : modelParams.ModelDim.Layers) {
+        for (const TModelDim::TAttentionPosParams &pos : layer) {
+            if (pos.AlibiHyper != 0 || pos.AlibiSlope != 0 || (pos.AttentionWidthId & (ATT_ID_CREATE_WIDE_FLAG | ATT_ID_USE_WIDE_FLAG)) != 0) {
+                *pErr = "alibi and wide attention are not supported by cpu inference";
+                return false;
+            }
+        }
+    }
+    if (!IsConsistentModel(modelParams)) {
+        *pErr = "model matrix sizes do not match model dims";
+        return false;
+    }
+    if (modelParams.ModelDim.HasFlag(MPF_PPM)) {
+        *pErr = "ppm is not supported by cpu inference";
+        return false;
+    }
+    if (tokenizer.GetVocabSize() != modelParams.ModelDim.VocabSize) {
+        *pErr = Sprintf("model vocab size %d does not match tokenizer vocab size %d", (int)modelParams.ModelDim.VocabSize, (int)tokenizer.GetVocabSize());
+        return false;
+    }
+    return true;
+}
+
+
+void TCPUSampler::Init(TModelParams &modelParams, TModelParams *draftModelParams, const TTokenizer &tokenizer, yint maxBatch,
+    TThreadPool *pool, NCPUInfer::TPrefixCache *prefixCache, NCPUInfer::TWeightStore *weightStore)
+{
+    Y_VERIFY(!modelParams.ModelDim.HasFlag(MPF_PPM) && "ppm is not supported by cpu inference");
+    Y_VERIFY(tokenizer.GetVocabSize() == modelParams.ModelDim.VocabSize);
+    NCPUInfer::ConvertModel(modelParams, &Params);
+    OwnBytes = NCPUInfer::CalcModelBytes(Params);
+    if (weightStore) {
+        OwnBytes = weightStore->AddModel(&Params);
+    }
+    Tokenizer = tokenizer;
+    if (draftModelParams) {
+        Y_VERIFY(!draftModelParams->ModelDim.HasFlag(MPF_PPM) && "ppm is not supported by cpu inference");
+        Y_VERIFY(draftModelParams->ModelDim.VocabSize == modelParams.ModelDim.VocabSize && "draft model vocab mismatch");
+        NCPUInfer::ConvertModel(*draftModelParams, &DraftParams);
+        if (weightStore) {
+            OwnBytes += weightStore->AddModel(&DraftParams);
+        } else {
+            OwnBytes += NCPUInfer::CalcModelBytes(DraftParams);
+        }
+    }
+    Scheduler = new TDecodeScheduler(Params, maxBatch, PREFILL_CHUNK, pool, draftModelParams ? &DraftParams : nullptr, prefixCache);
+}
+
+
+TIntrusivePtr<TGenerateRequest> TCPUSampler::MakeRequest(const TString &prompt, yint maxTokens, const TSamplingParams &sp, ui32 seed) const
+{
+    TIntrusivePtr<TGenerateRequest> req = new TGenerateRequest();
+    TVector<char> text(prompt.begin(), prompt.end());
+    TVector<TBPEToken> tokens;
+    Tokenizer.GenWords(text, 0, YSize(text), &tokens);
+    req->Prompt.resize(1);
+    req->Prompt[0].push_back(0);
+    for (TBPEToken x : tokens) {
+        req->Prompt.resize(YSize(req->Prompt) + 1);
+        req->Prompt.back().push_back(x + 1 + 1);
+    }
+    req->MaxTokens = maxTokens;
+    req->StopToken = Tokenizer.HasDocStartToken() ? Tokenizer.GetDocStartToken() : -1;
+    req->Sampling = sp;
+    req->Seed = seed;
+    return req;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// missing, damaged files and unsupported models are reported, server keeps running
+void TModelRegistry::TLoad::WorkerThread()
+{
+    TTokenizer tokenizer = DefaultTokenizer;
+    if (!TokenizerFilename.empty()) {
+        if (!DoesFileExist(TokenizerFilename)) {
+            Error = Sprintf("tokenizer %s not found", TokenizerFilename.c_str());
+            Done = true;
+            return;
+        }
+        if (!SerializeChecked(TokenizerFilename, tokenizer)) {
+            Error = Sprintf("tokenizer %s is damaged", TokenizerFilename.c_str());
+            Done = true;
+            return;
+        }
+    }
+    if (!DoesFileExist(ModelFilename)) {
+        Error = Sprintf("model %s not found", ModelFilename.c_str());
+        Done = true;
+        return;
+    }
+    TModelParams modelParams;
+    if (!SerializeChecked(ModelFilename, modelParams)) {
+        Error = Sprintf("model %s is truncated or damaged", ModelFilename.c_str());
+        Done = true;
+        return;
+    }
+    if (CanServeModel(modelParams, tokenizer, &Error)) {
+        Res = new TCPUSampler();
+        Res->Init(modelParams, nullptr, tokenizer, MaxBatch, Pool.Get(), PrefixCache.Get(), WeightStore.Get());
+    }
+    Done = true;
+}
+
+
+TModelRegistry::TModelRegistry(const TTokenizer &defaultTokenizer, yint maxBatch, yint prefixCacheBytes)
+    : DefaultTokenizer(defaultTokenizer), MaxBatch(maxBatch)
+{
+    Pool = new TThreadPool(Max<yint>(1, GetCpuCount() - 1));
+    if (prefixCacheBytes > 0) {
+        PrefixCache = new NCPUInfer::TPrefixCache(PREFIX_BLOCK_LEN, prefixCacheBytes);
+    }
+    WeightStore = new NCPUInfer::TWeightStore();
+}
+
+
+TModelRegistry::~TModelRegistry()
+{
+    for (TIntrusivePtr<TLoad> &load : Loading) {
+        load->Thr.Join();
+    }
+}
+
+
+void TModelRegistry::Install(const TString &name, TIntrusivePtr<TCPUSampler> model)
+{
+    auto it = Models.find(name);
+    if (it != Models.end()) {
+        Retired.push_back(it->second);
+    }
+    Models[name] = model;
+    LoadErrors.erase(name);
+    DebugPrintf("model %s: %g mb, %g mb not shared with other models, weight store %g mb\n",
+        name.c_str(), NCPUInfer::CalcModelBytes(model->Params) / 1e6, model->OwnBytes / 1e6, WeightStore->GetBytes() / 1e6);
+}
+
+
+void TModelRegistry::Add(const TString &name, TModelParams &modelParams, TModelParams *draftModelParams)
+{
+    TIntrusivePtr<TCPUSampler> model = new TCPUSampler();
+    model->Init(modelParams, draftModelParams, DefaultTokenizer, MaxBatch, Pool.Get(), PrefixCache.Get(), WeightStore.Get());
+    Install(name, model);
+}
+
+
+void TModelRegistry::StartLoad(const TString &name, const TString &modelFilename, const TString &tokenizerFilename)
+{
+    TIntrusivePtr<TLoad> load = new TLoad();
+    load->Name = name;
+    load->ModelFilename = modelFilename;
+    load->TokenizerFilename = tokenizerFilename;
+    load->DefaultTokenizer = DefaultTokenizer;
+    load->MaxBatch = MaxBatch;
+    load->Pool = Pool;
+    load->PrefixCache = PrefixCache;
+    load->WeightStore = WeightStore;
+    load->Thr.Create(load.Get());
+    Loading.push_back(load);
+}
+
+
+bool TModelRegistry::Unload(const TString &name)
+{
+    auto it = Models.find(name);
+    if (it == Models.end()) {
+        return false;
+    }
+    Retired.push_back(it->second);
+    Models.erase(it);
+    return true;
+}
+
+
+void TModelRegistry::Update()
+{
+    yint dst = 0;
+    for (yint k = 0; k < YSize(Loading); ++k) {
+        TIntrusivePtr<TLoad> load = Loading[k];
+        if (!load->Done) {
+            Loading[dst++] = load;
+            continue;
+        }
+        load->Thr.Join();
+        if (load->Res.Get()) {
+            Install(load->Name, load->Res);
+        } else {
+            DebugPrintf("model %s: load failed, %s\n", load->Name.c_str(), load->Error.c_str());
+            LoadErrors[load->Name] = load->Error;
+        }
+    }
+    Loading.resize(dst);
+    // retired model is referenced by registry only when its requests are finished
+    bool hasDestroyed = false;
+    dst = 0;
+    for (yint k = 0; k < YSize(Retired); ++k) {
+        if (Retired[k].RefCount() == 1) {
+            hasDestroyed = true;
+        } else {
+            Retired[dst++] = Retired[k];
+        }
+    }
+    Retired.resize(dst);
+    if (hasDestroyed) {
+        WeightStore->Collect();
+    }
+}
+
+
+TIntrusivePtr<TCPUSampler> TModelRegistry::GetModel(const TString &name) const
+{
+    auto it = Models.find(name);
+    if (it == Models.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+
+TVector<TString> TModelRegistry::GetModelNames() const
+{
+    TVector<TString> res;
+    for (auto it = Models.begin(); it != Models.end(); ++it) {
+        res.push_back(it->first);
+    }
+    Sort(res.begin(), res.end());
+    return res;
+}
+
+
+TString TModelRegistry::RenderJSON() const
+{
+    TString res = "{\"models\":[";
+    TVector<TString> nameArr = GetModelNames();
+    for (yint k = 0; k < YSize(nameArr); ++k) {
+        const TCPUSampler &model = *Models.find(nameArr[k])->second;
+        res += (k == 0) ? "{" : ",{";
+        res += Sprintf("\"name\":\"%s\",", nameArr[k].c_str());
+        res += Sprintf("\"mb\":%g,", NCPUInfer::CalcModelBytes(model.Params) / 1e6);
+        res += Sprintf("\"own_mb\":%g}", model.OwnBytes / 1e6);
+    }
+    res += "],\"loading\":[";
+    for (yint k = 0; k < YSize(Loading); ++k) {
+        res += Sprintf(k == 0 ? "\"%s\"" : ",\"%s\"", Loading[k]->Name.c_str());
+    }
+    res += "],\"errors\":{";
+    TVector<TString> errNameArr;
+    for (auto it = LoadErrors.begin(); it != LoadErrors.end(); ++it) {
+        errNameArr.push_back(it->first);
+    }
+    Sort(errNameArr.begin(), errNameArr.end());
+    for (yint k = 0; k < YSize(errNameArr); ++k) {
+        res += Sprintf(k == 0 ? "\"%s\":" : ",\"%s\":", errNameArr[k].c_str());
+        res += Sprintf("\"%s\"", EncodeJSON(LoadErrors.find(errNameArr[k])->second).c_str());
+    }
+    res += "},";
+    res += Sprintf("\"retired\":%d,", (int)YSize(Retired));
+    if (PrefixCache.Get()) {
+        res += Sprintf("\"prefix_cache_mb\":%g,", PrefixCache->GetBytes() / 1e6);
+    }
+    res += Sprintf("\"weight_store_mb\":%g,", WeightStore->GetBytes() / 1e6);
+    res += Sprintf("\"weight_store_matrices\":%d}", (int)WeightStore->GetMatrixCount());
+    return res;
+}
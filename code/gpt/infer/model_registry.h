@@ -0,0 +1,88 @@
+#pragma once
+#include "decode_scheduler.h"
+#include <gpt/cpu_infer/weight_store.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// cpu inference with continuous batching
+const yint PREFILL_CHUNK = 64;
+const yint PREFIX_BLOCK_LEN = 32;
+
+struct TCPUSampler : public TThrRefBase
+{
+    NCPUInfer::TCPUModelParams Params;
+    NCPUInfer::TCPUModelParams DraftParams;
+    TTokenizer Tokenizer;
+    TIntrusivePtr<TDecodeScheduler> Scheduler;
+    yint OwnBytes = 0; // weight bytes not shared with models loaded earlier
+
+    // draftModelParams is optional draft model for speculative decoding
+    // pool and prefixCache are shared with other models, prefixCache is optional
+    // with weightStore matrices identical to matrices of other models are shared
+    void Init(TModelParams &modelParams, TModelParams *draftModelParams, const TTokenizer &tokenizer, yint maxBatch,
+        TThreadPool *pool, NCPUInfer::TPrefixCache *prefixCache, NCPUInfer::TWeightStore *weightStore);
+    TIntrusivePtr<TGenerateRequest> MakeRequest(const TString &prompt, yint maxTokens, const TSamplingParams &sp, ui32 seed) const;
+};
+
+// model can be served by cpu inference with this tokenizer, pErr gets reason otherwise
+bool CanServeModel(const TModelParams &modelParams, const TTokenizer &tokenizer, TString *pErr);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// models served by name, models are loaded, replaced and unloaded while serving
+// model files are loaded and converted in background threads, identical matrices of all models are stored once
+// all models share one thread pool and one prefix cache with common memory budget
+// unloaded or replaced model is destroyed when requests holding it are finished
+// all methods are called from one thread
+class TModelRegistry
+{
+    struct TLoad : public TThrRefBase
+    {
+        TString Name;
+        TString ModelFilename;
+        TString TokenizerFilename; // default tokenizer if empty
+        TTokenizer DefaultTokenizer;
+        yint MaxBatch = 0;
+        TIntrusivePtr<TThreadPool> Pool;
+        TIntrusivePtr<NCPUInfer::TPrefixCache> PrefixCache;
+        TIntrusivePtr<NCPUInfer::TWeightStore> WeightStore;
+        TIntrusivePtr<TCPUSampler> Res;
+        TString Error;
+        std::atomic<bool> Done;
+        TThread Thr;
+
+        TLoad() : Done(false) {}
+        void WorkerThread();
+    };
+
+    TTokenizer DefaultTokenizer;
+    yint MaxBatch = 0;
+    TIntrusivePtr<TThreadPool> Pool;
+    TIntrusivePtr<NCPUInfer::TPrefixCache> PrefixCache; // null if disabled
+    TIntrusivePtr<NCPUInfer::TWeightStore> WeightStore;
+    THashMap<TString, TIntrusivePtr<TCPUSampler>> Models;
+    TVector<TIntrusivePtr<TLoad>> Loading;
+    TVector<TIntrusivePtr<TCPUSampler>> Retired; // unloaded models, kept while requests hold them
+    THashMap<TString, TString> LoadErrors; // last failed load of each name, cleared by successful load
+
+    void Install(const TString &name, TIntrusivePtr<TCPUSampler> model);
+
+public:
+    // prefix cache is disabled with zero budget
+    TModelRegistry(const TTokenizer &defaultTokenizer, yint maxBatch, yint prefixCacheBytes);
+    ~TModelRegistry();
+    // blocking load of already read model
+    void Add(const TString &name, TModelParams &modelParams, TModelParams *draftModelParams);
+    // model file is loaded in background, model with the same name is replaced when loading is complete
+    void StartLoad(const TString &name, const TString &modelFilename, const TString &tokenizerFilename);
+    bool Unload(const TString &name);
+    // installs loaded models, reports load errors, destroys retired models without requests in flight
+    // failed load does not affect served model with the same name
+    void Update();
+    TIntrusivePtr<TCPUSampler> GetModel(const TString &name) const;
+    TVector<TString> GetModelNames() const;
+    bool IsLoading() const { return !Loading.empty(); }
+    const NCPUInfer::TWeightStore &GetWeightStore() const { return *WeightStore; }
+    const NCPUInfer::TPrefixCache *GetPrefixCache() const { return PrefixCache.Get(); }
+    TString RenderJSON() const;
+};
@@ -1,6 +1,9 @@
 #include "stdafx.h"
 #include "sample_model.h"
 #include <gpt/data/data.h>
+#include <gpt/model_params/sse_utils.h>
+#include <lib/hp_timer/hp_timer.h>
+#include <algorithm>
 
 
 //static const char *PREFIX = "the future will ";
@@ -9,32 +12,302 @@
 //static const char *PREFIX = "\n176 * 871 ="; // 153296, arith test
 
 
-static int SampleFromDistr(TXRng &rng, const TVector<float> &distr, float temperature)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// vectorized sampling
+// gumbel max trick, argmax of log(p) / T - log(-log(u)), computed in log2 units for 8 tokens at once
+// uniform u is hash of token index and per call key drawn from rng, so result is deterministic given rng
+const float LOG2_ZERO = -1e30f; // zero probability and padding
+
+// dst[i] = log2(src[i]), LOG2_ZERO for zero probabilities, sz is multiple of 8
+static void ComputeLog2(const float *src, yint sz, float *dst)
 {
-    // use gumbel max trick
-    float best = -1e38f;
-    yint res = 0;
-    for (yint k = 0; k < YSize(distr); ++k) {
-        //float score = distr[k] / -log(rng.GenRandReal3());
-        float score = log(distr[k]) / temperature - log(-log(rng.GenRandReal3()));
-        if (score > best) {
-            best = score;
-            res = k;
+    IsaKernels.Log2Array(src, sz, dst, LOG2_ZERO);
+}
+
+// index of max logit * invTemperature + gumbel noise, sz is multiple of 8
+static yint GumbelArgMax(const float *logit, yint sz, float invTemperature, ui32 key)
+{
+    return IsaKernels.GumbelArgMax(logit, sz, invTemperature, key);
+}
+
+
+// candidate tokens with log2 probabilities, logit array is padded to multiple of 8 with LOG2_ZERO
+struct TSampleCandidates
+{
+    TVector<float> Logit;
+    TVector<int> Token; // empty if candidates are all tokens in order
+    yint Count = 0;
+
+    void Init(yint count)
+    {
+        Count = count;
+        Logit.resize(0);
+        Logit.resize(DivCeil(count, 8) * 8, LOG2_ZERO);
+        Token.resize(0);
+    }
+    int GetToken(yint i) const { return Token.empty() ? i : Token[i]; }
+    // keep candidates from indexArr in given order
+    void Select(const TVector<int> &indexArr)
+    {
+        TSampleCandidates res;
+        res.Init(YSize(indexArr));
+        res.Token.resize(YSize(indexArr));
+        for (yint i = 0; i < YSize(indexArr); ++i) {
+            res.Logit[i] = Logit[indexArr[i]];
+            res.Token[i] = GetToken(indexArr[i]);
         }
+        Logit.swap(res.Logit);
+        Token.swap(res.Token);
+        Count = res.Count;
     }
-    return res;
+};
+
+
+static void ApplyRepetitionPenalty(TSampleCandidates *p, const TSamplingParams &sp, const TVector<int> &history)
+{
+    if (sp.RepetitionPenalty == 1 || history.empty()) {
+        return;
+    }
+    TVector<int> recent(history.begin() + Max<yint>(0, YSize(history) - sp.RepetitionWindow), history.end());
+    Sort(recent.begin(), recent.end());
+    yint dst = 0;
+    for (yint i = 0; i < YSize(recent); ++i) {
+        if (dst == 0 || recent[i] != recent[dst - 1]) {
+            recent[dst++] = recent[i];
+        }
+    }
+    recent.resize(dst);
+    float delta = log2(sp.RepetitionPenalty);
+    if (p->Token.empty()) {
+        for (int token : recent) {
+            if (token >= 0 && token < p->Count && p->Logit[token] != LOG2_ZERO) {
+                p->Logit[token] -= delta;
+            }
+        }
+    } else {
+        for (yint i = 0; i < p->Count; ++i) {
+            auto it = lower_bound(recent.begin(), recent.end(), p->Token[i]);
+            if (it != recent.end() && *it == p->Token[i]) {
+                p->Logit[i] -= delta;
+            }
+        }
+    }
+}
+
+
+// topK largest logits, single pass with min heap, blocks of 8 below heap min are skipped
+static void SelectTopK(TSampleCandidates *p, yint topK)
+{
+    struct TLogitIndex
+    {
+        float Logit;
+        int Index;
+    };
+    TVector<TLogitIndex> heap;
+    auto byLogit = [](const TLogitIndex &a, const TLogitIndex &b) { return a.Logit > b.Logit; };
+    float heapMin = -INFINITY;
+    for (yint base = 0; base < YSize(p->Logit); base += 8) {
+        const float *x = p->Logit.data() + base;
+        float blockMax = x[0];
+        for (yint k = 1; k < 8; ++k) {
+            blockMax = Max(blockMax, x[k]);
+        }
+        if (blockMax <= heapMin) {
+            continue;
+        }
+        for (yint i = base; i < Min<yint>(base + 8, p->Count); ++i) {
+            float logit = p->Logit[i];
+            if (YSize(heap) < topK) {
+                heap.push_back(TLogitIndex{ logit, (int)i });
+                std::push_heap(heap.begin(), heap.end(), byLogit);
+            } else if (logit > heapMin) {
+                std::pop_heap(heap.begin(), heap.end(), byLogit);
+                heap.back() = TLogitIndex{ logit, (int)i };
+                std::push_heap(heap.begin(), heap.end(), byLogit);
+            }
+            if (YSize(heap) == topK) {
+                heapMin = heap[0].Logit;
+            }
+        }
+    }
+    TVector<int> indexArr;
+    for (const TLogitIndex &x : heap) {
+        indexArr.push_back(x.Index);
+    }
+    p->Select(indexArr);
+}
+
+
+// smallest set of most probable candidates with total probability >= topP, probabilities are exp2(logit * invTemperature)
+// candidates are bucketed by float bits of probability, 8 buckets per octave, only boundary bucket is sorted
+static void SelectTopP(TSampleCandidates *p, float topP, float invTemperature)
+{
+    const yint BUCKET_COUNT = 1024;
+    yint count = p->Count;
+    TVector<float> weight;
+    weight.resize(YSize(p->Logit));
+    float maxValue = LOG2_ZERO;
+    for (yint i = 0; i < YSize(weight); ++i) {
+        weight[i] = p->Logit[i] * invTemperature;
+        maxValue = Max<float>(maxValue, weight[i]);
+    }
+    // weight in (0, 1] after exp2, padding adds exp2(-127) each
+    float target = IsaKernels.Exp2Sum(weight.data(), YSize(weight), maxValue) * topP;
+    auto getBucket = [](float w) {
+        ui32 bits;
+        memcpy(&bits, &w, sizeof(bits));
+        return Min<yint>(BUCKET_COUNT - 1, (0x3f800000 - (i64)bits) >> 20);
+    };
+    TVector<float> bucketSum;
+    ClearPodArray(&bucketSum, BUCKET_COUNT);
+    for (yint i = 0; i < count; ++i) {
+        bucketSum[getBucket(weight[i])] += weight[i];
+    }
+    yint boundary = 0;
+    float cum = 0;
+    while (boundary < BUCKET_COUNT - 1 && cum + bucketSum[boundary] < target) {
+        cum += bucketSum[boundary++];
+    }
+    TVector<int> indexArr;
+    TVector<int> boundaryArr;
+    for (yint i = 0; i < count; ++i) {
+        yint b = getBucket(weight[i]);
+        if (b < boundary) {
+            indexArr.push_back(i);
+        } else if (b == boundary) {
+            boundaryArr.push_back(i);
+        }
+    }
+    Sort(boundaryArr.begin(), boundaryArr.end(), [&](int a, int b) { return weight[a] > weight[b]; });
+    for (int i : boundaryArr) {
+        indexArr.push_back(i);
+        cum += weight[i];
+        if (cum >= target) {
+            break;
+        }
+    }
+    p->Select(indexArr);
+}
+
+
+// apply penalty and keep candidates allowed by sampling params, returns index of greedy choice or -1
+static yint FilterCandidates(TSampleCandidates *p, const TSamplingParams &sp, const TVector<int> &history)
+{
+    ApplyRepetitionPenalty(p, sp, history);
+    if (sp.Temperature <= 0) {
+        yint best = 0;
+        for (yint i = 1; i < p->Count; ++i) {
+            if (p->Logit[i] > p->Logit[best]) {
+                best = i;
+            }
+        }
+        return best;
+    }
+    float invTemperature = 1 / sp.Temperature;
+    if (sp.TopK > 0 && sp.TopK < p->Count) {
+        SelectTopK(p, sp.TopK);
+    }
+    if (sp.TopP < 1) {
+        SelectTopP(p, sp.TopP, invTemperature);
+    }
+    return -1;
+}
+
+
+static int SampleCandidates(TXRng &rng, TSampleCandidates *p, const TSamplingParams &sp, const TVector<int> &history)
+{
+    yint best = FilterCandidates(p, sp, history);
+    if (best >= 0) {
+        return p->GetToken(best);
+    }
+    yint res = GumbelArgMax(p->Logit.data(), YSize(p->Logit), 1 / sp.Temperature, rng.GenRand());
+    return p->GetToken(res);
+}
+
+
+static void InitCandidates(const TVector<float> &distr, TSampleCandidates *p)
+{
+    yint count = YSize(distr);
+    p->Init(count);
+    yint tail = count & ~7ll;
+    ComputeLog2(distr.data(), tail, p->Logit.data());
+    if (tail < count) {
+        float buf[8] = { 0 };
+        for (yint i = tail; i < count; ++i) {
+            buf[i - tail] = distr[i];
+        }
+        ComputeLog2(buf, 8, buf);
+        for (yint i = tail; i < count; ++i) {
+            p->Logit[i] = buf[i - tail];
+        }
+    }
+}
+
+
+int SampleToken(TXRng &rng, const TVector<float> &distr, const TSamplingParams &sp, const TVector<int> &history)
+{
+    TSampleCandidates cand;
+    InitCandidates(distr, &cand);
+    return SampleCandidates(rng, &cand, sp, history);
 }
 
 
-TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix)
+void ComputeSampleDistr(const TVector<float> &distr, const TSamplingParams &sp, const TVector<int> &history, TVector<float> *pRes)
 {
-    //const float TEMPERATURE = 0.2f;
-    //const float TEMPERATURE = 0.8f;
-    const float TEMPERATURE = 1;
+    TSampleCandidates cand;
+    InitCandidates(distr, &cand);
+    yint best = FilterCandidates(&cand, sp, history);
+    ClearPodArray(pRes, YSize(distr));
+    if (best >= 0) {
+        (*pRes)[cand.GetToken(best)] = 1;
+        return;
+    }
+    float invTemperature = 1 / sp.Temperature;
+    TVector<float> weight;
+    weight.resize(YSize(cand.Logit));
+    float maxValue = LOG2_ZERO;
+    for (yint i = 0; i < YSize(weight); ++i) {
+        weight[i] = cand.Logit[i] * invTemperature;
+        maxValue = Max<float>(maxValue, weight[i]);
+    }
+    IsaKernels.Exp2Sum(weight.data(), YSize(weight), maxValue);
+    float sum = 0;
+    for (yint i = 0; i < cand.Count; ++i) {
+        sum += weight[i];
+    }
+    for (yint i = 0; i < cand.Count; ++i) {
+        (*pRes)[cand.GetToken(i)] = weight[i] / sum;
+    }
+}
+
+
+// penalty is applied before top-k, penalty > 1 lowers at most RepetitionWindow tokens
+// so top-k after penalty is among TopK + RepetitionWindow most probable tokens, penalty < 1 can raise any token
+yint GetTopCandidateCount(const TSamplingParams &sp)
+{
+    if (sp.TopK <= 0 || sp.RepetitionPenalty < 1) {
+        return 0;
+    }
+    return sp.TopK + (sp.RepetitionPenalty > 1 ? sp.RepetitionWindow : 0);
+}
+
+
+int SampleToken(TXRng &rng, const TVector<NCPUInfer::TTokenProb> &top, const TSamplingParams &sp, const TVector<int> &history)
+{
+    Y_ASSERT(!top.empty());
+    TSampleCandidates cand;
+    cand.Init(YSize(top));
+    cand.Token.resize(YSize(top));
+    for (yint i = 0; i < YSize(top); ++i) {
+        cand.Token[i] = top[i].Token;
+        cand.Logit[i] = top[i].Prob > 0 ? log2(top[i].Prob) : LOG2_ZERO;
+    }
+    return SampleCandidates(rng, &cand, sp, history);
+}
 
-    yint fragLen = YSize(prefix) + 1;
-    yint tokenCount = 0;
 
+TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix, const TSamplingParams &sp)
+{
     TVector<char> text;
     for (char c : prefix) {
         text.push_back(c);
@@ -44,8 +317,10 @@ TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix
     model.Tokenizer.GenWords(text, 0, YSize(text), &prompt);
 
     TFragmentGen fgen(model.UsePPM);
+    TVector<int> history;
     for (TBPEToken &x : prompt) {
         fgen.AddToken(x);
+        history.push_back(x);
     }
     // generate token or correct utf8 letter
     TString res;
@@ -64,7 +339,7 @@ TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix
         model.Ctx->ComputeFragmentPredictions(&predArr);
 
         for (;;) {
-            int letter = SampleFromDistr(rng, predArr.back(), TEMPERATURE);
+            int letter = SampleToken(rng, predArr.back(), sp, history);
             DebugPrintf("letter %g, %s\n", letter * 1., model.Tokenizer.GetWord(letter).c_str());
             if (letter == model.Tokenizer.GetCapitalWordToken()) {
                 if (letterHasStarted) {
@@ -93,6 +368,7 @@ TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix
                 res += cc;
             }
             fgen.AddToken(letter);
+            history.push_back(letter);
             break;
         }
         if (letterHasStarted && --utf8len == 0) {
@@ -104,3 +380,234 @@ TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix
     }
     return res;
 }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// sampler checks
+// target distribution in double precision with the same order of transforms
+static void CalcTargetDistr(const TVector<float> &distr, const TSamplingParams &sp, const TVector<int> &history, TVector<double> *pRes)
+{
+    yint vocabSize = YSize(distr);
+    TVector<int> recent(history.begin() + Max<yint>(0, YSize(history) - sp.RepetitionWindow), history.end());
+    TVector<double> score;
+    score.resize(vocabSize);
+    TVector<int> order;
+    for (yint k = 0; k < vocabSize; ++k) {
+        if (distr[k] <= 0) {
+            continue;
+        }
+        bool isRecent = false;
+        for (int token : recent) {
+            isRecent |= (token == k);
+        }
+        score[k] = (log2((double)distr[k]) - (isRecent ? log2((double)sp.RepetitionPenalty) : 0)) / sp.Temperature;
+        order.push_back(k);
+    }
+    Sort(order.begin(), order.end(), [&](int a, int b) { return score[a] > score[b]; });
+    if (sp.TopK > 0 && sp.TopK < YSize(order)) {
+        order.resize(sp.TopK);
+    }
+    double maxScore = score[order[0]];
+    double sum = 0;
+    for (int k : order) {
+        sum += exp2(score[k] - maxScore);
+    }
+    if (sp.TopP < 1) {
+        double cum = 0;
+        for (yint i = 0; i < YSize(order); ++i) {
+            cum += exp2(score[order[i]] - maxScore);
+            if (cum >= sum * sp.TopP) {
+                order.resize(i + 1);
+                sum = cum;
+                break;
+            }
+        }
+    }
+    ClearPodArray(pRes, vocabSize);
+    for (int k : order) {
+        (*pRes)[k] = exp2(score[k] - maxScore) / sum;
+    }
+}
+
+
+// chi square test over tokens with expected count >= 5, rare tokens are merged in one bin
+// fails if normal approximation z = (chi2 - df) / sqrt(2 df) is 3 or more, one sided since only too large chi2 means mismatch
+// tokens outside of support must never be sampled
+bool CheckSampleFrequencies(const char *name, const TVector<double> &target, const TVector<yint> &counts, yint sampleCount)
+{
+    double chi2 = 0;
+    yint binCount = 0;
+    double restExpected = 0;
+    yint restObserved = 0;
+    yint outsideCount = 0;
+    double tvDist = 0;
+    for (yint k = 0; k < YSize(target); ++k) {
+        double expected = target[k] * sampleCount;
+        tvDist += fabs(counts[k] / double(sampleCount) - target[k]) / 2;
+        if (target[k] == 0) {
+            outsideCount += counts[k];
+        } else if (expected >= 5) {
+            chi2 += Sqr(counts[k] - expected) / expected;
+            ++binCount;
+        } else {
+            restExpected += expected;
+            restObserved += counts[k];
+        }
+    }
+    if (restExpected >= 5) {
+        chi2 += Sqr(restObserved - restExpected) / restExpected;
+        ++binCount;
+    }
+    yint df = Max<yint>(1, binCount - 1);
+    double z = (chi2 - df) / sqrt(2. * df);
+    bool ok = (z < 3) && outsideCount == 0;
+    DebugPrintf("%-28s chi2 %8.1f, df %4d, z %5.2f, tv distance %.4f, outside support %d: %s\n",
+        name, chi2, (int)df, z, tvDist, (int)outsideCount, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+void MakeTestDistr(TXRng &rng, yint vocabSize, TVector<float> *pRes)
+{
+    TVector<float> &distr = *pRes;
+    distr.resize(vocabSize);
+    double sum = 0;
+    for (yint k = 0; k < vocabSize; ++k) {
+        distr[k] = pow(k + 1., -1.1) * (0.5 + rng.GenRandReal3());
+        sum += distr[k];
+    }
+    for (yint k = 0; k < vocabSize; ++k) {
+        distr[k] /= sum;
+    }
+    for (yint k = vocabSize - 1; k > 0; --k) {
+        DoSwap(distr[k], distr[rng.Uniform(k + 1)]);
+    }
+}
+
+
+yint CheckSampler()
+{
+    const yint VOCAB_SIZE = 1000;
+    const yint SAMPLE_COUNT = 200000;
+    TXRng rng(1313);
+    TVector<float> distr;
+    MakeTestDistr(rng, VOCAB_SIZE, &distr);
+    // zero probability tokens
+    for (yint k = 0; k < 10; ++k) {
+        distr[rng.Uniform(VOCAB_SIZE)] = 0;
+    }
+    // history of probable tokens
+    TVector<int> order;
+    for (yint k = 0; k < VOCAB_SIZE; ++k) {
+        order.push_back(k);
+    }
+    Sort(order.begin(), order.end(), [&](int a, int b) { return distr[a] > distr[b]; });
+    TVector<int> history;
+    for (yint k = 0; k < 40; ++k) {
+        history.push_back(order[rng.Uniform(100)]);
+    }
+    struct TTest
+    {
+        const char *Name;
+        float Temperature;
+        yint TopK;
+        float TopP;
+        float RepetitionPenalty;
+        bool UseTop;
+    };
+    TTest testArr[] = {
+        { "plain", 1, 0, 1, 1, false },
+        { "temperature 0.7, top-k 50", 0.7f, 50, 1, 1, false },
+        { "temperature 1.3, top-p 0.9", 1.3f, 0, 0.9f, 1, false },
+        { "top-k 100, top-p 0.8, penalty", 1, 100, 0.8f, 1.5f, false },
+        { "temperature 0.5, penalty 2", 0.5f, 0, 1, 2, false },
+        { "top-k 40 list, penalty 2", 0.8f, 40, 0.95f, 2, true },
+    };
+    yint errCount = 0;
+    for (const TTest &tt : testArr) {
+        TSamplingParams sp;
+        sp.Temperature = tt.Temperature;
+        sp.TopK = tt.TopK;
+        sp.TopP = tt.TopP;
+        sp.RepetitionPenalty = tt.RepetitionPenalty;
+        // top list is taken from full distribution like in decode scheduler, target is computed from full distribution
+        TVector<NCPUInfer::TTokenProb> top;
+        if (tt.UseTop) {
+            yint topCount = GetTopCandidateCount(sp);
+            Y_VERIFY(topCount > 0);
+            float topSum = 0;
+            for (yint k = 0; k < topCount; ++k) {
+                NCPUInfer::TTokenProb tp;
+                tp.Token = order[k];
+                tp.Prob = distr[order[k]];
+                topSum += tp.Prob;
+                top.push_back(tp);
+            }
+            for (NCPUInfer::TTokenProb &tp : top) {
+                tp.Prob /= topSum;
+            }
+        }
+        TVector<double> target;
+        CalcTargetDistr(distr, sp, history, &target);
+        TVector<yint> counts;
+        ClearPodArray(&counts, VOCAB_SIZE);
+        for (yint k = 0; k < SAMPLE_COUNT; ++k) {
+            int token = tt.UseTop ? SampleToken(rng, top, sp, history) : SampleToken(rng, distr, sp, history);
+            counts[token] += 1;
+        }
+        errCount += !CheckSampleFrequencies(tt.Name, target, counts, SAMPLE_COUNT);
+    }
+    // greedy picks most probable token after penalty
+    {
+        TSamplingParams sp;
+        sp.Temperature = 0;
+        sp.RepetitionPenalty = 1e6;
+        TVector<double> target;
+        TSamplingParams refSp = sp;
+        refSp.Temperature = 1;
+        CalcTargetDistr(distr, refSp, history, &target);
+        yint best = 0;
+        for (yint k = 1; k < VOCAB_SIZE; ++k) {
+            if (target[k] > target[best]) {
+                best = k;
+            }
+        }
+        bool ok = (SampleToken(rng, distr, sp, history) == best);
+        DebugPrintf("%-28s %s\n", "greedy, penalty", ok ? "ok" : "FAILED");
+        errCount += !ok;
+    }
+    return errCount;
+}
+
+
+void BenchSampler()
+{
+    const yint VOCAB_SIZE = 50257;
+    const yint SAMPLE_COUNT = 1000;
+    TXRng rng(1313);
+    TVector<float> distr;
+    MakeTestDistr(rng, VOCAB_SIZE, &distr);
+    TVector<int> history;
+    for (yint k = 0; k < 64; ++k) {
+        history.push_back(rng.Uniform(VOCAB_SIZE));
+    }
+    volatile yint sink = 0;
+    auto bench = [&](const char *name, auto func) {
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        for (yint k = 0; k < SAMPLE_COUNT; ++k) {
+            sink += func();
+        }
+        DebugPrintf("%-36s %8.2f us per token\n", name, NHPTimer::GetTimePassed(&tStart) / SAMPLE_COUNT * 1e6);
+    };
+    DebugPrintf("sampling from vocab of %d tokens\n", (int)VOCAB_SIZE);
+    bench("scalar gumbel", [&]() { return NCPUInfer::SampleFromDistr(rng, distr, 1); });
+    TSamplingParams sp;
+    bench("vectorized gumbel", [&]() { return SampleToken(rng, distr, sp, history); });
+    sp.Temperature = 0.8f;
+    sp.TopP = 0.9f;
+    bench("temperature, top-p 0.9", [&]() { return SampleToken(rng, distr, sp, history); });
+    sp.TopK = 40;
+    sp.RepetitionPenalty = 1.2f;
+    bench("top-k 40, top-p 0.9, penalty", [&]() { return SampleToken(rng, distr, sp, history); });
+}
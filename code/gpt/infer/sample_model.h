@@ -3,6 +3,7 @@
 #include <gpt/model_params/model_params.h>
 #include <gpt/compute/gpt_cuda.cuh>
 #include <gpt/att/sliding_window.h>
+#include <gpt/cpu_infer/cpu_infer.h>
 
 
 struct TSamplingModel
@@ -23,6 +24,35 @@ struct TSamplingModel
     }
 };
 
-TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// per request sampling parameters
+// applied in order: repetition penalty, temperature, top-k, top-p
+struct TSamplingParams
+{
+    float Temperature = 1; // 0 for greedy
+    yint TopK = 0; // 0 for no limit
+    float TopP = 1; // keep smallest set of most probable tokens with total probability >= TopP
+    float RepetitionPenalty = 1; // probability of tokens present in last RepetitionWindow tokens is divided by penalty
+    yint RepetitionWindow = 64;
+};
+
+// vectorized gumbel max sampling, history is tokens of context for repetition penalty
+int SampleToken(TXRng &rng, const TVector<float> &distr, const TSamplingParams &sp, const TVector<int> &history);
+// top is GetTopCandidateCount() most probable tokens with probabilities normalized over them
+int SampleToken(TXRng &rng, const TVector<NCPUInfer::TTokenProb> &top, const TSamplingParams &sp, const TVector<int> &history);
+// most probable tokens SampleToken() needs to sample exactly with top-k, 0 if full distribution is needed
+yint GetTopCandidateCount(const TSamplingParams &sp);
+// explicit distribution SampleToken() draws from, pRes has vocab size, greedy gives one-hot
+void ComputeSampleDistr(const TVector<float> &distr, const TSamplingParams &sp, const TVector<int> &history, TVector<float> *pRes);
+// compare sample frequencies with target distribution for set of sampling params, returns number of failed checks
+yint CheckSampler();
+// chi square test of sample counts against target distribution, prints result line
+bool CheckSampleFrequencies(const char *name, const TVector<double> &target, const TVector<yint> &counts, yint sampleCount);
+// random zipf like distribution with shuffled tokens
+void MakeTestDistr(TXRng &rng, yint vocabSize, TVector<float> *pRes);
+void BenchSampler();
+
+TString SampleFromModel(TXRng &rng, TSamplingModel &model, const TString &prefix, const TSamplingParams &sp);
 //TString GenerateFromModel(TXRng &rng, TTrainContext *pTrainCtx, const TModelParams &params, yint genLen, yint limitWindow, yint fragLen);
 //TString BeamSampleFromModel(TXRng &rng, TTrainContext *pTrainCtx, const TModelParams &params, yint genLen, yint limitWindow, yint fragLen);
@@ -0,0 +1,269 @@
+#include "stdafx.h"
+#include "speculative.h"
+
+using namespace NCPUInfer;
+
+
+bool ParseDraftType(const TString &name, EDraftType *p)
+{
+    if (name == "none") {
+        *p = DRAFT_NONE;
+    } else if (name == "ppm") {
+        *p = DRAFT_PPM;
+    } else if (name == "model") {
+        *p = DRAFT_MODEL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+// inverse cdf, distr does not have to be normalized
+static int SampleDistr(TXRng &rng, const TVector<float> &distr)
+{
+    double sum = 0;
+    for (float x : distr) {
+        sum += x;
+    }
+    double r = rng.GenRandReal3() * sum;
+    yint last = -1;
+    for (yint k = 0; k < YSize(distr); ++k) {
+        if (distr[k] > 0) {
+            last = k;
+            r -= distr[k];
+            if (r < 0) {
+                return k;
+            }
+        }
+    }
+    Y_VERIFY(last >= 0);
+    return last;
+}
+
+
+static bool IsEqual(const TVector<TLabelIndex> &a, const TVector<TLabelIndex> &b)
+{
+    if (YSize(a) != YSize(b)) {
+        return false;
+    }
+    for (yint k = 0; k < YSize(a); ++k) {
+        if (a[k] != b[k]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void TPPMDraft::AddToken(int token)
+{
+    Text.push_back(token);
+    Index.IndexPos(Text, YSize(Text) - 1, &BestLen, &BestPos);
+}
+
+
+void TPPMDraft::Propose(yint draftLen, TDraft *p) const
+{
+    p->Tokens.resize(0);
+    p->Distr.resize(0);
+    if (BestLen < MIN_MATCH_LEN) {
+        return;
+    }
+    yint len = YSize(Text);
+    for (yint j = 0; j < draftLen; ++j) {
+        yint src = BestPos + 1 + j;
+        // match can overlap its continuation, then draft repeats the period
+        int token = (src < len) ? Text[src] : p->Tokens[src - len];
+        p->Tokens.push_back(token);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TModelDraft::TModelDraft(const TCPUModelParams &params) : Params(params)
+{
+    Ctx.Init(params);
+}
+
+
+void TModelDraft::Propose(TThreadPool *pool, TXRng &rng, const TSamplingParams &sp, const TVector<int> &history, yint draftLen, TDraft *p)
+{
+    Y_VERIFY(!Target.empty());
+    p->Tokens.resize(0);
+    p->Distr.resize(0);
+    if (draftLen == 0) {
+        return;
+    }
+    // keep common prefix, last target position is fed again to get prediction
+    yint common = 0;
+    yint limit = Min<yint>(YSize(Fed), YSize(Target) - 1);
+    while (common < limit && IsEqual(Fed[common], Target[common])) {
+        ++common;
+    }
+    Ctx.Truncate(common);
+    Fed.resize(common);
+    TVector<TVector<TLabelIndex>> tail(Target.begin() + common, Target.end());
+    TVector<float> pred;
+    ComputePrefill(pool, Params, tail, &Ctx, &pred);
+    Fed.insert(Fed.end(), tail.begin(), tail.end());
+
+    TVector<int> draftHistory(history.begin() + Max<yint>(0, YSize(history) - sp.RepetitionWindow), history.end());
+    p->Distr.resize(draftLen);
+    for (yint j = 0; j < draftLen; ++j) {
+        ComputeSampleDistr(pred, sp, draftHistory, &p->Distr[j]);
+        int token = SampleDistr(rng, p->Distr[j]);
+        p->Tokens.push_back(token);
+        draftHistory.push_back(token);
+        if (j + 1 < draftLen) {
+            TVector<TLabelIndex> labels;
+            labels.push_back(token + 1 + 1);
+            ComputePrediction(Params, labels, &Ctx, &pred);
+            Fed.push_back(labels);
+        }
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+yint AcceptDraft(TXRng &rng, const TDraft &draft, const TVector<TVector<float>> &targetArr, TVector<int> *pRes)
+{
+    yint draftLen = YSize(draft.Tokens);
+    Y_VERIFY(YSize(targetArr) > draftLen);
+    Y_VERIFY(draft.Distr.empty() || YSize(draft.Distr) == draftLen);
+    bool isDeterministic = draft.Distr.empty();
+    pRes->resize(0);
+    for (yint j = 0; j < draftLen; ++j) {
+        const TVector<float> &p = targetArr[j];
+        int token = draft.Tokens[j];
+        float q = isDeterministic ? 1 : draft.Distr[j][token];
+        if (rng.GenRandReal3() * q < p[token]) {
+            pRes->push_back(token);
+            continue;
+        }
+        // rejected, sample from residual
+        TVector<float> residual = p;
+        float sum = 0;
+        if (isDeterministic) {
+            residual[token] = 0;
+            sum = 1;
+        } else {
+            const TVector<float> &qDistr = draft.Distr[j];
+            for (yint k = 0; k < YSize(residual); ++k) {
+                residual[k] = Max<float>(0, residual[k] - qDistr[k]);
+                sum += residual[k];
+            }
+        }
+        pRes->push_back(SampleDistr(rng, sum > 0 ? residual : p));
+        return j;
+    }
+    pRes->push_back(SampleDistr(rng, targetArr[draftLen]));
+    return draftLen;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// speculative sampling checks
+// first emitted token must follow target distribution at position 0, second one (if emitted) at position 1
+template <class TMakeDraft>
+static bool CheckAccept(TXRng &rng, const char *name, const TVector<TVector<float>> &targetArr, TMakeDraft makeDraft)
+{
+    const yint SAMPLE_COUNT = 200000;
+    yint vocabSize = YSize(targetArr[0]);
+    TVector<yint> counts0;
+    TVector<yint> counts1;
+    ClearPodArray(&counts0, vocabSize);
+    ClearPodArray(&counts1, vocabSize);
+    yint secondCount = 0;
+    yint acceptCount = 0;
+    yint draftCount = 0;
+    for (yint k = 0; k < SAMPLE_COUNT; ++k) {
+        TDraft draft;
+        makeDraft(&draft);
+        TVector<int> res;
+        acceptCount += AcceptDraft(rng, draft, targetArr, &res);
+        draftCount += YSize(draft.Tokens);
+        counts0[res[0]] += 1;
+        if (YSize(res) > 1) {
+            counts1[res[1]] += 1;
+            ++secondCount;
+        }
+    }
+    DebugPrintf("%s, accepted %.1f%% of draft tokens\n", name, acceptCount * 100. / draftCount);
+    TVector<double> target0(targetArr[0].begin(), targetArr[0].end());
+    TVector<double> target1(targetArr[1].begin(), targetArr[1].end());
+    bool ok = CheckSampleFrequencies("  first token", target0, counts0, SAMPLE_COUNT);
+    ok &= CheckSampleFrequencies("  second token", target1, counts1, secondCount);
+    return ok;
+}
+
+
+yint CheckSpeculative()
+{
+    const yint VOCAB_SIZE = 200;
+    TXRng rng(1717);
+    TSamplingParams sp;
+    sp.TopK = 100;
+    TVector<TVector<float>> targetArr(3);
+    TVector<TVector<float>> draftArr(2);
+    for (yint k = 0; k < 3; ++k) {
+        TVector<float> distr;
+        MakeTestDistr(rng, VOCAB_SIZE, &distr);
+        ComputeSampleDistr(distr, sp, TVector<int>(), &targetArr[k]);
+    }
+    // draft is close to target
+    for (yint k = 0; k < 2; ++k) {
+        TVector<float> distr;
+        MakeTestDistr(rng, VOCAB_SIZE, &distr);
+        draftArr[k].resize(VOCAB_SIZE);
+        for (yint i = 0; i < VOCAB_SIZE; ++i) {
+            draftArr[k][i] = 0.7f * targetArr[k][i] + 0.3f * distr[i];
+        }
+    }
+    auto argMax = [](const TVector<float> &distr) {
+        yint res = 0;
+        for (yint i = 1; i < YSize(distr); ++i) {
+            if (distr[i] > distr[res]) {
+                res = i;
+            }
+        }
+        return (int)res;
+    };
+
+    yint errCount = 0;
+    errCount += !CheckAccept(rng, "model draft", targetArr, [&](TDraft *p) {
+        p->Distr = draftArr;
+        p->Tokens.resize(0);
+        for (const TVector<float> &q : draftArr) {
+            p->Tokens.push_back(SampleDistr(rng, q));
+        }
+    });
+    errCount += !CheckAccept(rng, "deterministic draft", targetArr, [&](TDraft *p) {
+        p->Tokens.resize(0);
+        p->Tokens.push_back(argMax(targetArr[0]));
+        p->Tokens.push_back(argMax(draftArr[1]));
+    });
+    errCount += !CheckAccept(rng, "deterministic unlikely draft", targetArr, [&](TDraft *p) {
+        p->Tokens.resize(0);
+        p->Tokens.push_back(SampleDistr(rng, draftArr[0]));
+    });
+    // greedy target gives greedy tokens
+    {
+        TSamplingParams greedy;
+        greedy.Temperature = 0;
+        TVector<TVector<float>> greedyArr(3);
+        for (yint k = 0; k < 3; ++k) {
+            ComputeSampleDistr(targetArr[k], greedy, TVector<int>(), &greedyArr[k]);
+        }
+        TDraft draft;
+        draft.Tokens.push_back(argMax(targetArr[0]));
+        draft.Tokens.push_back((argMax(targetArr[1]) + 1) % VOCAB_SIZE);
+        TVector<int> res;
+        yint accepted = AcceptDraft(rng, draft, greedyArr, &res);
+        bool ok = accepted == 1 && YSize(res) == 2 && res[0] == argMax(targetArr[0]) && res[1] == argMax(targetArr[1]);
+        DebugPrintf("%-28s %s\n", "greedy draft", ok ? "ok" : "FAILED");
+        errCount += !ok;
+    }
+    return errCount;
+}
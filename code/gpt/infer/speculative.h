@@ -0,0 +1,67 @@
+#pragma once
+#include "sample_model.h"
+#include <gpt/data/ppm_window.h>
+#include <gpt/cpu_infer/cpu_infer.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// speculative decoding
+// cheap draft proposes several tokens, target model scores them all with one batched pass
+// draft token x is accepted with probability min(1, p(x) / q(x)), on first rejection token is sampled from norm(max(p - q, 0))
+// if all draft tokens are accepted one more token is sampled from target, output has exactly the target distribution
+enum EDraftType
+{
+    DRAFT_NONE,
+    DRAFT_PPM,
+    DRAFT_MODEL,
+};
+
+bool ParseDraftType(const TString &name, EDraftType *p);
+
+
+struct TDraft
+{
+    TVector<int> Tokens;
+    TVector<TVector<float>> Distr; // draft distribution of each token, empty for deterministic draft
+};
+
+
+// continuation of the longest earlier match of context suffix, deterministic
+class TPPMDraft : public TThrRefBase
+{
+    enum {
+        MIN_MATCH_LEN = 2,
+    };
+    TWindowPPMIndex Index;
+    TVector<TBPEToken> Text;
+    yint BestLen = 0;
+    yint BestPos = 0;
+
+public:
+    void AddToken(int token);
+    void Propose(yint draftLen, TDraft *p) const;
+};
+
+
+// small model with the same vocabulary, its context follows target context and diverged tail is truncated
+class TModelDraft : public TThrRefBase
+{
+    const NCPUInfer::TCPUModelParams &Params;
+    NCPUInfer::TCPUInferContext Ctx;
+    TVector<TVector<TLabelIndex>> Fed; // positions in Ctx
+    TVector<TVector<TLabelIndex>> Target; // positions accepted by target
+
+public:
+    TModelDraft(const NCPUInfer::TCPUModelParams &params);
+    void AddPosition(const TVector<TLabelIndex> &labels) { Target.push_back(labels); }
+    // history is target tokens for repetition penalty
+    void Propose(TThreadPool *pool, TXRng &rng, const TSamplingParams &sp, const TVector<int> &history, yint draftLen, TDraft *p);
+};
+
+
+// targetArr[k] is sampling distribution after k draft tokens (see ComputeSampleDistr()), at least draft size + 1 entries
+// pRes gets accepted draft tokens and one more token, returns number of accepted draft tokens
+yint AcceptDraft(TXRng &rng, const TDraft &draft, const TVector<TVector<float>> &targetArr, TVector<int> *pRes);
+
+// sampled tokens follow target distribution for random, deterministic and greedy drafts, returns number of failed checks
+yint CheckSpeculative();
@@ -0,0 +1,207 @@
+#include "stdafx.h"
+#include "checkpoint_chain.h"
+#include "checkpoint_writer.h"
+#include <lib/file/dir.h>
+#include <util/mem_io.h>
+
+
+const TString CHAIN_INDEX_FILE = "chain.idx";
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static void ApplyDelta(TModelParams *pParams, const TModelParams &delta)
+{
+    AddScaled(pParams, delta, 1, 0);
+    pParams->Bias = delta.Bias;
+    pParams->LabelEmbed.SetRowDisp(delta.LabelEmbed.GetRowDisp(), delta.LabelEmbed.GetSumWeight());
+    pParams->FinalLayer.SetRowDisp(delta.FinalLayer.GetRowDisp(), delta.FinalLayer.GetSumWeight());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TString TCheckpointChain::GetFileName(const TCheckpointChainEntry &e) const
+{
+    return Sprintf("%sckpt_%d%s", Folder.c_str(), (int)e.Id, e.IsFull ? ".full" : ".delta");
+}
+
+
+void TCheckpointChain::WriteIndex()
+{
+    TVector<ui8> buf;
+    SerializeMem(false, &buf, Index);
+    WriteFileAtomic(Folder + CHAIN_INDEX_FILE, buf);
+}
+
+
+void TCheckpointChain::WriteFull(const TCheckpointChainEntry &e, TModelParams &params)
+{
+    TVector<ui8> buf;
+    SerializeMem(false, &buf, params);
+    WriteFileAtomic(GetFileName(e), buf);
+}
+
+
+void TCheckpointChain::Open(const TString &folder, yint fullInterval)
+{
+    Folder = folder;
+    if (!Folder.empty() && !EndsWith(Folder, "/")) {
+        Folder += '/';
+    }
+    FullInterval = Max<yint>(1, fullInterval);
+    Index.resize(0);
+    Last = TModelParams();
+    HasLast = false;
+    TString indexFile = Folder + CHAIN_INDEX_FILE;
+    if (DoesFileExist(indexFile)) {
+        Serialize(true, indexFile, Index);
+    }
+}
+
+
+void TCheckpointChain::Save(yint id, const TModelParams &params)
+{
+    Y_VERIFY(Index.empty() || id > GetLastId());
+    yint sinceFull = 0;
+    for (yint k = YSize(Index) - 1; k >= 0 && !Index[k].IsFull; --k) {
+        ++sinceFull;
+    }
+    TCheckpointChainEntry e;
+    e.Id = id;
+    e.IsFull = Index.empty() || sinceFull + 1 >= FullInterval;
+    if (!e.IsFull && !HasLast) {
+        Y_VERIFY(Load(GetLastId(), &Last));
+    }
+    HasLast = true;
+    if (e.IsFull) {
+        Last = params;
+        WriteFull(e, Last);
+    } else {
+        TModelParams diff = params;
+        AddScaled(&diff, Last, -1, 0);
+        TMemStream mem;
+        {
+            TBufferedStream f(mem, false);
+            PackModelParamsCompact(f, diff);
+        }
+        TVector<ui8> buf;
+        mem.Swap(&buf);
+        WriteFileAtomic(GetFileName(e), buf);
+        // reconstruct exactly what loader will get
+        mem.Swap(&buf);
+        {
+            TBufferedStream f(mem, true);
+            UnpackModelParamsCompact(&diff, f);
+        }
+        ApplyDelta(&Last, diff);
+    }
+    Index.push_back(e);
+    WriteIndex();
+}
+
+
+bool TCheckpointChain::Load(yint id, TModelParams *pParams) const
+{
+    TCheckpointChainReader reader(*this, id);
+    yint resId = 0;
+    const TModelParams *res = 0;
+    if (reader.Next(&resId, &res) && resId == id) {
+        *pParams = *res;
+        return true;
+    }
+    return false;
+}
+
+
+// chain is cut at full checkpoints only, deltas are never rewritten, older checkpoints of the segment containing firstId are kept
+void TCheckpointChain::Compact(yint firstId)
+{
+    yint keepPtr = 0;
+    for (yint k = 0; k < YSize(Index) && Index[k].Id <= firstId; ++k) {
+        if (Index[k].IsFull) {
+            keepPtr = k;
+        }
+    }
+    if (keepPtr == 0) {
+        return;
+    }
+    TVector<TString> obsoleteFiles;
+    for (yint k = 0; k < keepPtr; ++k) {
+        obsoleteFiles.push_back(GetFileName(Index[k]));
+    }
+    Index.erase(Index.begin(), Index.begin() + keepPtr);
+    WriteIndex();
+    for (const TString &fname : obsoleteFiles) {
+        EraseFile(fname);
+    }
+}
+
+
+void TCheckpointChain::EraseAfter(yint lastId)
+{
+    yint keepCount = 0;
+    while (keepCount < YSize(Index) && Index[keepCount].Id <= lastId) {
+        ++keepCount;
+    }
+    if (keepCount == YSize(Index)) {
+        return;
+    }
+    TVector<TString> obsoleteFiles;
+    for (yint k = keepCount; k < YSize(Index); ++k) {
+        obsoleteFiles.push_back(GetFileName(Index[k]));
+    }
+    Index.resize(keepCount);
+    WriteIndex();
+    for (const TString &fname : obsoleteFiles) {
+        EraseFile(fname);
+    }
+    Last = TModelParams();
+    HasLast = false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TCheckpointChainReader::TCheckpointChainReader(const TCheckpointChain &chain, yint startId) : Chain(chain)
+{
+    const TVector<TCheckpointChainEntry> &index = Chain.GetIndex();
+    TargetPtr = 0;
+    while (TargetPtr < YSize(index) && index[TargetPtr].Id < startId) {
+        ++TargetPtr;
+    }
+    Ptr = Max<yint>(0, Min<yint>(TargetPtr, YSize(index) - 1));
+    while (Ptr > 0 && !index[Ptr].IsFull) {
+        --Ptr;
+    }
+}
+
+
+void TCheckpointChainReader::ReadEntry(yint ptr)
+{
+    const TCheckpointChainEntry &e = Chain.GetIndex()[ptr];
+    if (e.IsFull) {
+        Serialize(true, Chain.GetFileName(e), Cur);
+    } else {
+        TFileStream file(true, Chain.GetFileName(e));
+        Y_VERIFY(file.IsValid() && "checkpoint chain file not found");
+        TBufferedStream f(file, true);
+        TModelParams delta;
+        UnpackModelParamsCompact(&delta, f);
+        ApplyDelta(&Cur, delta);
+    }
+}
+
+
+bool TCheckpointChainReader::Next(yint *pId, const TModelParams **pParams)
+{
+    const TVector<TCheckpointChainEntry> &index = Chain.GetIndex();
+    while (Ptr < TargetPtr) {
+        ReadEntry(Ptr++);
+    }
+    if (Ptr >= YSize(index)) {
+        return false;
+    }
+    ReadEntry(Ptr);
+    *pId = index[Ptr].Id;
+    *pParams = &Cur;
+    ++Ptr;
+    return true;
+}
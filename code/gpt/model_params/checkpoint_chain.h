@@ -0,0 +1,53 @@
+#pragma once
+#include "model_params.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// checkpoint chain
+// every FullInterval-th checkpoint is a full float snapshot, others store quantized difference from the previous checkpoint
+// difference is taken against reconstructed previous checkpoint, so quantization error does not accumulate along the chain
+struct TCheckpointChainEntry
+{
+    yint Id = 0;
+    bool IsFull = false;
+    SAVELOAD(Id, IsFull);
+};
+
+
+class TCheckpointChain
+{
+    TString Folder;
+    yint FullInterval = 10;
+    TVector<TCheckpointChainEntry> Index;
+    TModelParams Last; // reconstructed last checkpoint
+    bool HasLast = false;
+
+    void WriteIndex();
+    void WriteFull(const TCheckpointChainEntry &e, TModelParams &params);
+
+public:
+    void Open(const TString &folder, yint fullInterval);
+    bool IsEmpty() const { return Index.empty(); }
+    yint GetLastId() const { return Index.back().Id; }
+    const TVector<TCheckpointChainEntry> &GetIndex() const { return Index; }
+    TString GetFileName(const TCheckpointChainEntry &e) const;
+    void Save(yint id, const TModelParams &params);
+    bool Load(yint id, TModelParams *pParams) const;
+    void Compact(yint firstId); // erase whole segments before firstId, checkpoints from firstId stay loadable
+    void EraseAfter(yint lastId); // erase checkpoints after lastId, used to restart training from earlier point
+};
+
+
+// streams through the chain, each checkpoint file is read once
+class TCheckpointChainReader
+{
+    const TCheckpointChain &Chain;
+    yint Ptr = 0;
+    yint TargetPtr = 0;
+    TModelParams Cur;
+
+    void ReadEntry(yint ptr);
+public:
+    TCheckpointChainReader(const TCheckpointChain &chain, yint startId);
+    bool Next(yint *pId, const TModelParams **pParams);
+};
@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include "checkpoint_writer.h"
+#include <lib/file/dir.h>
+#include <lib/hp_timer/hp_timer.h>
+#include <lib/prof/prof.h>
+#include <util/mem_io.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void WriteFileAtomic(const TString &fname, const TVector<ui8> &data)
+{
+    TString tmpName = fname + ".tmp";
+    {
+        TFileStream f(false, tmpName);
+        Y_VERIFY(f.IsValid() && "can not create checkpoint file");
+        f.Write(data.data(), YSize(data));
+        Y_VERIFY(!f.IsFailed());
+        Y_VERIFY(f.Flush());
+    }
+    // existing file is replaced by rename, there is always complete old or new file
+    RenameFileReplace(tmpName, fname);
+    yint slash = YSize(fname) - 1;
+    while (slash >= 0 && fname[slash] != '/' && fname[slash] != '\\') {
+        --slash;
+    }
+    SyncDirectory(slash < 0 ? TString(".") : fname.substr(0, slash + 1));
+}
+
+
+void TModelParamsWriteJob::Run()
+{
+    TVector<ui8> buf;
+    SerializeMem(false, &buf, Params->Params);
+    WriteFileAtomic(FileName, buf);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TCheckpointWriter::TCheckpointWriter(yint maxPending) : PendingCount(0), MaxPending(maxPending)
+{
+    if (MaxPending > 0) {
+        Thr.Create(this);
+    }
+}
+
+
+TCheckpointWriter::~TCheckpointWriter()
+{
+    Wait();
+    Exit = true;
+    Thr.Join();
+}
+
+
+void TCheckpointWriter::WorkerThread()
+{
+    NProf::SetThreadName("checkpoint writer");
+    while (!Exit) {
+        TVector<TIntrusivePtr<ICheckpointJob>> jobArr;
+        if (JobQueue.DequeueAll(&jobArr)) {
+            // DequeueAll() returns newest first
+            for (yint k = YSize(jobArr) - 1; k >= 0; --k) {
+                NHPTimer::STime tStart;
+                NHPTimer::GetTime(&tStart);
+                PROF_SCOPE("checkpoint_write");
+                jobArr[k]->Run();
+                jobArr[k] = 0;
+                SumWriteTime += NHPTimer::GetTimePassed(&tStart);
+                PendingCount.fetch_add(-1);
+            }
+        } else {
+            SleepSeconds(0.01);
+        }
+    }
+}
+
+
+void TCheckpointWriter::Save(TIntrusivePtr<ICheckpointJob> job)
+{
+    NHPTimer::STime tStart;
+    NHPTimer::GetTime(&tStart);
+    if (MaxPending == 0) {
+        job->Run();
+    } else {
+        // back pressure, do not keep more than MaxPending snapshots in memory
+        while (PendingCount.load() >= MaxPending) {
+            SleepSeconds(0.001);
+        }
+        PendingCount.fetch_add(1);
+        JobQueue.Enqueue(job);
+    }
+    LastStallTime = NHPTimer::GetTimePassed(&tStart);
+    SumStallTime += LastStallTime;
+}
+
+
+void TCheckpointWriter::Wait()
+{
+    while (PendingCount.load() > 0) {
+        SleepSeconds(0.001);
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include "checkpoint_chain.h"
+#include <util/thread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// write to temp file, fsync, rename over existing file and fsync directory, so readers never see partially written file
+void WriteFileAtomic(const TString &fname, const TVector<ui8> &data);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct ICheckpointJob : public TThrRefBase
+{
+    virtual void Run() = 0;
+};
+
+struct TFileWriteJob : public ICheckpointJob
+{
+    TString FileName;
+    TVector<ui8> Data;
+
+    TFileWriteJob(const TString &fname, TVector<ui8> *data) : FileName(fname) { Data.swap(*data); }
+    void Run() override { WriteFileAtomic(FileName, Data); }
+};
+
+struct TModelParamsWriteJob : public ICheckpointJob
+{
+    TString FileName;
+    TIntrusivePtr<TModelParamsHolder> Params;
+
+    TModelParamsWriteJob(const TString &fname, TIntrusivePtr<TModelParamsHolder> params) : FileName(fname), Params(params) {}
+    void Run() override;
+};
+
+struct TCheckpointChainWriteJob : public ICheckpointJob
+{
+    TCheckpointChain *Chain = 0;
+    yint Id = 0;
+    TIntrusivePtr<TModelParamsHolder> Params;
+
+    TCheckpointChainWriteJob(TCheckpointChain *chain, yint id, TIntrusivePtr<TModelParamsHolder> params) : Chain(chain), Id(id), Params(params) {}
+    void Run() override { Chain->Save(Id, Params->Params); }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// runs checkpoint jobs on background thread in submission order
+// caller hands over snapshot and continues, Save() blocks only if maxPending jobs are queued already
+// maxPending == 0 makes writer synchronous
+class TCheckpointWriter : public TThrRefBase
+{
+    TSingleConsumerJobQueue<TIntrusivePtr<ICheckpointJob>> JobQueue;
+    TThread Thr;
+    std::atomic<yint> PendingCount;
+    yint MaxPending = 0;
+    volatile bool Exit = false;
+    double LastStallTime = 0;
+    double SumStallTime = 0;
+    double SumWriteTime = 0; // accessed by writer thread only
+
+    ~TCheckpointWriter();
+
+public:
+    TCheckpointWriter(yint maxPending);
+    void Save(TIntrusivePtr<ICheckpointJob> job);
+    void Wait();
+    double GetLastStallTime() const { return LastStallTime; } // time spent in last Save() by caller thread
+    double GetSumStallTime() const { return SumStallTime; }
+
+public:
+    void WorkerThread();
+};
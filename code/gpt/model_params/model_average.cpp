@@ -0,0 +1,259 @@
+#include "stdafx.h"
+#include "model_average.h"
+#include <util/thread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void GetAverageWeights(yint count, float emaDecay, TVector<float> *pRes)
+{
+    pRes->resize(count);
+    double sum = 0;
+    double w = 1;
+    for (yint k = count - 1; k >= 0; --k) {
+        (*pRes)[k] = w;
+        sum += w;
+        if (emaDecay > 0) {
+            w *= emaDecay;
+        }
+    }
+    for (float &x : *pRes) {
+        x /= sum;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// reads serialized TModelParams piece by piece, pieces should be read in SAVELOAD order
+class TModelParamsFileReader : public TThrRefBase
+{
+    TFileStream File;
+    TBufferedStream BufIO;
+    IBinSaver Saver;
+    TModelDim ModelDim;
+
+public:
+    TModelParamsFileReader(const TString &fname) : File(true, fname), BufIO(File, true), Saver(BufIO)
+    {
+        Y_VERIFY(File.IsValid() && "checkpoint not found");
+        Saver.Add(&ModelDim);
+    }
+    const TModelDim &GetModelDim() const { return ModelDim; }
+    void ReadRowDispMatrix(TModelMatrixRowDisp *p)
+    {
+        Saver.Add(p);
+    }
+    void ReadLayerMatrix(yint d, yint k, yint idx, TArray2D<float> *p)
+    {
+        if (k == 0 && idx == 0) {
+            yint sz = 0;
+            if (d == 0) {
+                Saver.Add(&sz);
+                Y_VERIFY(sz == YSize(ModelDim.Layers));
+            }
+            Saver.Add(&sz);
+            Y_VERIFY(sz == YSize(ModelDim.Layers[d]));
+        }
+        Saver.Add(p);
+    }
+    void ReadBias(TVector<float> *p)
+    {
+        Saver.Add(p);
+    }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// files are processed in windows of one file per worker, next window is opened after previous is closed
+class TStreamingModelAverager
+{
+    enum {
+        ATT_MATRIX_COUNT = 5, // QK, QV, K, V, Combiner
+    };
+    enum EUnit {
+        UNIT_ROW_DISP,
+        UNIT_LAYER,
+    };
+
+    struct TWorker : public TThrRefBase
+    {
+        TStreamingModelAverager *Owner = 0;
+        TThread Thr;
+        yint FileId = -1;
+        TIntrusivePtr<TModelParamsFileReader> Reader;
+        TArray2D<float> Buf;
+        TModelMatrixRowDisp RowDispBuf;
+        TVector<float> FileRowDisp;
+        float FileSumWeight = 0;
+        TArray2D<float> Sum;
+    };
+
+    TVector<TString> FileArr;
+    TVector<float> Weights;
+    TVector<TIntrusivePtr<TWorker>> WorkerArr;
+    TModelDim ModelDim;
+    yint WindowStart = 0;
+    // current unit
+    EUnit Unit = UNIT_ROW_DISP;
+    yint LayerD = 0;
+    yint LayerK = 0;
+    yint LayerIdx = 0;
+
+    static void ProcessUnitThread(void *p)
+    {
+        TWorker *w = (TWorker *)p;
+        w->Owner->ProcessUnit(w);
+    }
+
+    void ProcessUnit(TWorker *w)
+    {
+        TModelParamsFileReader &rd = *w->Reader;
+        const TArray2D<float> *src = &w->Buf;
+        if (Unit == UNIT_LAYER) {
+            rd.ReadLayerMatrix(LayerD, LayerK, LayerIdx, &w->Buf);
+        } else {
+            rd.ReadRowDispMatrix(&w->RowDispBuf);
+            w->FileRowDisp = w->RowDispBuf.GetRowDisp();
+            w->FileSumWeight = w->RowDispBuf.GetSumWeight();
+            src = &w->RowDispBuf.GetMatrix();
+        }
+        yint xSize = src->GetXSize();
+        yint ySize = src->GetYSize();
+        w->Sum.SetSizes(xSize, ySize);
+        float weight = Weights[w->FileId];
+        for (yint y = 0; y < ySize; ++y) {
+            float *dst = &w->Sum[y][0];
+            const float *srcRow = &(*src)[y][0];
+            for (yint x = 0; x < xSize; ++x) {
+                dst[x] = srcRow[x] * weight;
+            }
+        }
+    }
+
+    void OpenWindow()
+    {
+        for (yint workerId = 0; workerId < YSize(WorkerArr); ++workerId) {
+            TWorker &w = *WorkerArr[workerId];
+            yint fileId = WindowStart + workerId;
+            if (fileId < YSize(FileArr)) {
+                w.FileId = fileId;
+                w.Reader = new TModelParamsFileReader(FileArr[fileId]);
+                if (fileId == 0) {
+                    ModelDim = w.Reader->GetModelDim();
+                }
+                Y_VERIFY(w.Reader->GetModelDim() == ModelDim);
+            } else {
+                w.FileId = -1;
+            }
+        }
+    }
+
+    void CloseWindow()
+    {
+        for (TIntrusivePtr<TWorker> &w : WorkerArr) {
+            w->FileId = -1;
+            w->Reader = 0;
+        }
+    }
+
+    // read current unit from window files, add per worker results to pRes in fixed order
+    void RunUnit(TArray2D<float> *pRes)
+    {
+        for (TIntrusivePtr<TWorker> &w : WorkerArr) {
+            if (w->FileId >= 0) {
+                w->Thr.Create(ProcessUnitThread, w.Get());
+            }
+        }
+        for (TIntrusivePtr<TWorker> &w : WorkerArr) {
+            if (w->FileId >= 0) {
+                w->Thr.Join();
+            }
+        }
+        for (yint workerId = 0; workerId < YSize(WorkerArr); ++workerId) {
+            const TWorker &w = *WorkerArr[workerId];
+            if (w.FileId < 0) {
+                continue;
+            }
+            if (w.FileId == 0) {
+                *pRes = w.Sum;
+                continue;
+            }
+            Y_VERIFY(pRes->GetXSize() == w.Sum.GetXSize() && pRes->GetYSize() == w.Sum.GetYSize());
+            for (yint y = 0; y < pRes->GetYSize(); ++y) {
+                for (yint x = 0; x < pRes->GetXSize(); ++x) {
+                    (*pRes)[y][x] += w.Sum[y][x];
+                }
+            }
+        }
+    }
+
+    void RunRowDispUnit(TModelMatrixRowDisp *pRes)
+    {
+        Unit = UNIT_ROW_DISP;
+        if (WindowStart == 0) {
+            TArray2D<float> sum;
+            RunUnit(&sum);
+            pRes->SetMatrix(sum);
+        } else {
+            RunUnit(&pRes->GetMatrix());
+        }
+        for (TIntrusivePtr<TWorker> &w : WorkerArr) {
+            if (w->FileId >= 0) {
+                pRes->AddRowDisp(w->FileRowDisp, w->FileSumWeight, Weights[w->FileId]);
+            }
+        }
+    }
+
+public:
+    TStreamingModelAverager(const TVector<TString> &fileArr, float emaDecay, yint threadCount) : FileArr(fileArr)
+    {
+        Y_VERIFY(!fileArr.empty());
+        yint fileCount = YSize(fileArr);
+        GetAverageWeights(fileCount, emaDecay, &Weights);
+        threadCount = Max<yint>(1, Min<yint>(threadCount, fileCount));
+        WorkerArr.resize(threadCount);
+        for (yint workerId = 0; workerId < threadCount; ++workerId) {
+            WorkerArr[workerId] = new TWorker();
+            WorkerArr[workerId]->Owner = this;
+        }
+    }
+
+    void Run(TModelParams *pRes)
+    {
+        for (WindowStart = 0; WindowStart < YSize(FileArr); WindowStart += YSize(WorkerArr)) {
+            OpenWindow();
+            pRes->ModelDim = ModelDim;
+            RunRowDispUnit(&pRes->LabelEmbed);
+            yint depth = YSize(ModelDim.Layers);
+            pRes->LayerArr.resize(depth);
+            Unit = UNIT_LAYER;
+            Y_VERIFY(depth > 0);
+            for (yint d = 0; d < depth; ++d) {
+                Y_VERIFY(!ModelDim.Layers[d].empty());
+                pRes->LayerArr[d].resize(YSize(ModelDim.Layers[d]));
+                for (yint k = 0; k < YSize(ModelDim.Layers[d]); ++k) {
+                    TModelParams::TAttentionMatrices &att = pRes->LayerArr[d][k];
+                    TArray2D<float> *matrArr[ATT_MATRIX_COUNT] = { &att.QK, &att.QV, &att.K, &att.V, &att.Combiner };
+                    for (yint idx = 0; idx < ATT_MATRIX_COUNT; ++idx) {
+                        LayerD = d;
+                        LayerK = k;
+                        LayerIdx = idx;
+                        RunUnit(matrArr[idx]);
+                    }
+                }
+            }
+            RunRowDispUnit(&pRes->FinalLayer);
+            if (WindowStart == 0) {
+                WorkerArr[0]->Reader->ReadBias(&pRes->Bias);
+            }
+            CloseWindow();
+        }
+    }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void ComputeAverageModel(TModelParams *pRes, const TVector<TString> &fileArr, float emaDecay, yint threadCount)
+{
+    TStreamingModelAverager avrg(fileArr, emaDecay, threadCount);
+    avrg.Run(pRes);
+}
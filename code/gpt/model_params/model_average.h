@@ -0,0 +1,12 @@
+#pragma once
+#include "model_params.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// model averaging
+// checkpoints saved with Serialize() are read matrix by matrix in parallel, one file per thread,
+// at most threadCount files are open at once, next files are opened after previous are closed
+// memory use is result model plus two matrix buffers per thread regardless of checkpoint count
+// emaDecay == 0 gives uniform weights, otherwise checkpoint k of n has weight proportional to emaDecay^(n - 1 - k)
+void GetAverageWeights(yint count, float emaDecay, TVector<float> *pRes);
+void ComputeAverageModel(TModelParams *pRes, const TVector<TString> &fileArr, float emaDecay, yint threadCount);
@@ -38,6 +38,7 @@ const ui64 MPF_SIM_QUANT_4BIT = 0x80;
 const ui64 MPF_GROK_BINARY_OP = 0x100;
 const ui64 MPF_COMBINE_LAYERS = 0x200;
 const ui64 MPF_MLM_BERT = 0x400;
+const ui64 MPF_SIM_QUANT_158BIT = 0x800;
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "model_params.h"
 #include "sse_utils.h"
+#include "rans.h"
+#include <lib/hp_timer/hp_timer.h>
 #include <lib/random/rand_utils.h>
 
 
@@ -323,7 +325,7 @@ void UnpackModelParams(TModelParams *pParams, TBufferedStream &f)
         if (discrScale == 0) {
             p->FillZero();
         } else {
-            __m256 mult = _mm256_set1_ps(discrScale);
+            float mult = discrScale;
             row.resize(xSize);
             for (yint y = 0; y < ySize; ++y) {
                 f.Read(row.data(), xSize);
@@ -365,7 +367,7 @@ void AddPackedModelParamsScaled(TModelParams *pParams, TBufferedStream &f, float
         float discrScale = 0;
         f.Read(&discrScale, sizeof(discrScale));
         if (discrScale != 0) {
-            __m256 mult = _mm256_set1_ps(discrScale * scale);
+            float mult = discrScale * scale;
             row.resize(xSize);
             for (yint y = 0; y < ySize; ++y) {
                 f.Read(row.data(), xSize);
@@ -387,3 +389,252 @@ void AddPackedModelParamsScaled(TModelParams *pParams, TBufferedStream &f, float
         }
     }
 }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// compact pack/unpack, each nonzero matrix is stored as rANS block of its int8 values
+static void WriteRowDisp(TBufferedStream &f, TModelParams &params)
+{
+    TVector<const TModelMatrixRowDisp *> rdMatrices;
+    GetRowDispMatrices(&params, &rdMatrices);
+    for (const TModelMatrixRowDisp *p : rdMatrices) {
+        const TVector<float> &rowDisp = p->GetRowDisp();
+        f.Write(rowDisp.data(), YSize(rowDisp) * sizeof(rowDisp[0]));
+        float sumWeight = p->GetSumWeight();
+        f.Write(&sumWeight, sizeof(sumWeight));
+    }
+}
+
+static void ReadRowDisp(TModelParams *pParams, TBufferedStream &f)
+{
+    TVector<TModelMatrixRowDisp *> rdMatrices;
+    GetRowDispMatrices(pParams, &rdMatrices);
+    for (TModelMatrixRowDisp *p : rdMatrices) {
+        TVector<float> rowDisp;
+        rowDisp.resize(p->GetYSize());
+        f.Read(rowDisp.data(), YSize(rowDisp) * sizeof(rowDisp[0]));
+        float sumWeight;
+        f.Read(&sumWeight, sizeof(sumWeight));
+        p->SetRowDisp(rowDisp, sumWeight);
+    }
+}
+
+
+void PackModelParamsCompact(TBufferedStream &f, TModelParams &params)
+{
+    WriteStruct(f, params.ModelDim);
+    WriteStruct(f, params.Bias);
+    TVector<i8> matr;
+    TVector<ui8> block;
+    TVector<const TArray2D<float> *> allMatrices;
+    GetParamMatrices(&params, &allMatrices);
+    for (const TArray2D<float> *p : allMatrices) {
+        yint xSize = p->GetXSize();
+        yint ySize = p->GetYSize();
+        float sko = sqrt(CalcMatrixSum2(*p) / (xSize * ySize));
+        if (sko == 0) {
+            f.Write(&sko, sizeof(sko));
+        } else {
+            float discrScale = sko * MODEL_DISCR_SCALE;
+            f.Write(&discrScale, sizeof(discrScale));
+            __m256 mult = _mm256_set1_ps(1 / discrScale);
+            matr.yresize(xSize * ySize);
+            for (yint y = 0; y < ySize; ++y) {
+                ConvertArray(matr.data() + y * xSize, &(*p)[y][0], xSize, mult);
+            }
+            RansEncode(&block, matr.data(), xSize * ySize);
+            ui32 blockSize = YSize(block);
+            f.Write(&blockSize, sizeof(blockSize));
+            f.Write(block.data(), blockSize);
+        }
+    }
+    WriteRowDisp(f, params);
+}
+
+
+void UnpackModelParamsCompact(TModelParams *pParams, TBufferedStream &f)
+{
+    TModelDim modelDim;
+    ReadStruct(f, modelDim);
+    AllocateModel(pParams, modelDim);
+    ReadStruct(f, pParams->Bias);
+    TVector<i8> row;
+    TVector<ui8> block;
+    TRansDecoder decoder;
+    TVector<TArray2D<float> *> allMatrices;
+    GetParamMatrices(pParams, &allMatrices);
+    for (TArray2D<float> *p : allMatrices) {
+        yint xSize = p->GetXSize();
+        yint ySize = p->GetYSize();
+        float discrScale = 0;
+        f.Read(&discrScale, sizeof(discrScale));
+        if (discrScale == 0) {
+            p->FillZero();
+        } else {
+            ui32 blockSize = 0;
+            f.Read(&blockSize, sizeof(blockSize));
+            block.yresize(blockSize + RANS_BLOCK_PADDING);
+            f.Read(block.data(), blockSize);
+            decoder.Init(block.data(), blockSize);
+            float mult = discrScale;
+            row.resize(xSize);
+            for (yint y = 0; y < ySize; ++y) {
+                decoder.Decode(row.data(), xSize);
+                UnpackArray(&(*p)[y][0], row.data(), xSize, mult);
+            }
+        }
+    }
+    ReadRowDisp(pParams, f);
+}
+
+
+// compare compact format with PackModelParams() one
+void BenchmarkCompactModelParams(TModelParams &params)
+{
+    const yint ITER_COUNT = 5;
+    yint paramCount = CountModelSize(params);
+    TMemStream plain;
+    {
+        TBufferedStream f(plain, false);
+        PackModelParams(f, params);
+    }
+    TMemStream compact;
+    {
+        TBufferedStream f(compact, false);
+        PackModelParamsCompact(f, params);
+    }
+    TModelParams plainRes;
+    TModelParams compactRes;
+    double plainTime = 1e38;
+    double compactTime = 1e38;
+    for (yint iter = 0; iter < ITER_COUNT; ++iter) {
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        plain.Seek(0);
+        {
+            TBufferedStream f(plain, true);
+            UnpackModelParams(&plainRes, f);
+        }
+        plainTime = Min(plainTime, NHPTimer::GetTimePassed(&tStart));
+        compact.Seek(0);
+        {
+            TBufferedStream f(compact, true);
+            UnpackModelParamsCompact(&compactRes, f);
+        }
+        compactTime = Min(compactTime, NHPTimer::GetTimePassed(&tStart));
+    }
+    // both formats should produce the same params
+    TVector<TArray2D<float> *> plainMatrices;
+    GetParamMatrices(&plainRes, &plainMatrices);
+    TVector<TArray2D<float> *> compactMatrices;
+    GetParamMatrices(&compactRes, &compactMatrices);
+    yint mismatchCount = 0;
+    for (yint k = 0; k < YSize(plainMatrices); ++k) {
+        const TArray2D<float> &a = *plainMatrices[k];
+        const TArray2D<float> &b = *compactMatrices[k];
+        for (yint y = 0; y < a.GetYSize(); ++y) {
+            mismatchCount += (memcmp(&a[y][0], &b[y][0], a.GetXSize() * sizeof(float)) != 0);
+        }
+    }
+    DebugPrintf("%g params\n", paramCount * 1.);
+    DebugPrintf("plain: %g bytes/param, decode %g GB/sec, %g Gparams/sec\n",
+        plain.GetLength() * 1. / paramCount, plain.GetLength() / plainTime / 1e9, paramCount / plainTime / 1e9);
+    DebugPrintf("compact: %g bytes/param, decode %g GB/sec, %g Gparams/sec\n",
+        compact.GetLength() * 1. / paramCount, compact.GetLength() / compactTime / 1e9, paramCount / compactTime / 1e9);
+    DebugPrintf("mismatched rows %g (should be 0)\n", mismatchCount * 1.);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// packed model params index
+void GetModelMatrices(TModelParams *pParams, TVector<TArray2D<float> *> *pRes)
+{
+    GetParamMatrices(pParams, pRes);
+}
+
+
+void IndexPackedModelParams(TPackedModelParamsIndex *pRes, const TModelParams &params, TVector<ui8> *pBuf, yint startOffset)
+{
+    // header has variable size, parse it with stream
+    yint pos = 0;
+    {
+        TMemStream mem(pBuf);
+        mem.Seek(startOffset);
+        {
+            TBufferedStream f(mem, true);
+            TModelDim modelDim;
+            ReadStruct(f, modelDim);
+            Y_VERIFY(modelDim == params.ModelDim);
+            TVector<float> bias;
+            ReadStruct(f, bias);
+            Y_VERIFY(bias == params.Bias);
+        }
+        pos = mem.GetPos();
+        mem.Swap(pBuf);
+    }
+    // model matrices
+    const ui8 *buf = pBuf->data();
+    yint bufSize = YSize(*pBuf);
+    pRes->MatrixArr.resize(0);
+    TVector<const TArray2D<float> *> allMatrices;
+    GetParamMatrices(&params, &allMatrices);
+    for (const TArray2D<float> *p : allMatrices) {
+        TPackedModelParamsIndex::TMatrix packed;
+        packed.XSize = p->GetXSize();
+        packed.YSize = p->GetYSize();
+        Y_VERIFY(pos + yint(sizeof(float)) <= bufSize);
+        memcpy(&packed.DiscrScale, buf + pos, sizeof(float));
+        pos += sizeof(float);
+        packed.Offset = pos;
+        if (packed.DiscrScale != 0) {
+            pos += packed.XSize * packed.YSize;
+        }
+        pRes->MatrixArr.push_back(packed);
+    }
+    // row disp matrices
+    pRes->RowDispOffset.resize(0);
+    TVector<const TModelMatrixRowDisp *> rdMatrices;
+    GetRowDispMatrices(&params, &rdMatrices);
+    for (const TModelMatrixRowDisp *p : rdMatrices) {
+        pRes->RowDispOffset.push_back(pos);
+        pos += (p->GetYSize() + 1) * sizeof(float);
+    }
+    Y_VERIFY(pos <= bufSize && "truncated packed model params");
+}
+
+
+void AddPackedMatrixRowsScaled(TArray2D<float> *p, const TPackedModelParamsIndex::TMatrix &packed, const ui8 *buf, yint yFrom, yint yTo, float scale)
+{
+    Y_ASSERT(p->GetXSize() == packed.XSize && p->GetYSize() == packed.YSize);
+    if (packed.DiscrScale == 0) {
+        return;
+    }
+    yint xSize = packed.XSize;
+    float mult = packed.DiscrScale * scale;
+    const i8 *src = (const i8 *)(buf + packed.Offset) + yFrom * xSize;
+    for (yint y = yFrom; y < yTo; ++y) {
+        AddPackedArray(&(*p)[y][0], src, xSize, mult);
+        src += xSize;
+    }
+}
+
+
+void AddPackedRowDispScaled(TModelParams *pParams, const TPackedModelParamsIndex &index, const ui8 *buf, float scale, float rowDispScale)
+{
+    if (scale <= 0) {
+        return;
+    }
+    TVector<TModelMatrixRowDisp *> rdMatrices;
+    GetRowDispMatrices(pParams, &rdMatrices);
+    Y_VERIFY(YSize(rdMatrices) == YSize(index.RowDispOffset));
+    for (yint k = 0; k < YSize(rdMatrices); ++k) {
+        TModelMatrixRowDisp *p = rdMatrices[k];
+        const ui8 *src = buf + index.RowDispOffset[k];
+        TVector<float> rowDisp;
+        rowDisp.resize(p->GetYSize());
+        memcpy(rowDisp.data(), src, YSize(rowDisp) * sizeof(float));
+        float sumWeight;
+        memcpy(&sumWeight, src + YSize(rowDisp) * sizeof(float), sizeof(float));
+        p->AddRowDisp(rowDisp, sumWeight, rowDispScale);
+    }
+}
@@ -64,3 +64,28 @@ double CalcSum2(const TModelParams &params);
 void PackModelParams(TBufferedStream &f, TModelParams &params);
 void UnpackModelParams(TModelParams *pParams, TBufferedStream &f);
 void AddPackedModelParamsScaled(TModelParams *pParams, TBufferedStream &f, float scale, float rowDispScale);
+// same int8 values as PackModelParams(), entropy coded
+void PackModelParamsCompact(TBufferedStream &f, TModelParams &params);
+void UnpackModelParamsCompact(TModelParams *pParams, TBufferedStream &f);
+void BenchmarkCompactModelParams(TModelParams &params);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// packed model params layout, allows to process parts of packed params independently
+struct TPackedModelParamsIndex
+{
+    struct TMatrix
+    {
+        yint XSize = 0;
+        yint YSize = 0;
+        float DiscrScale = 0; // 0 for zero matrix, no rows are stored then
+        yint Offset = 0; // offset of the first int8 row
+    };
+    TVector<TMatrix> MatrixArr; // in GetModelMatrices() order
+    TVector<yint> RowDispOffset; // row disp floats followed by sum weight
+};
+
+void GetModelMatrices(TModelParams *pParams, TVector<TArray2D<float> *> *pRes);
+void IndexPackedModelParams(TPackedModelParamsIndex *pRes, const TModelParams &params, TVector<ui8> *pBuf, yint startOffset);
+void AddPackedMatrixRowsScaled(TArray2D<float> *p, const TPackedModelParamsIndex::TMatrix &packed, const ui8 *buf, yint yFrom, yint yTo, float scale);
+void AddPackedRowDispScaled(TModelParams *pParams, const TPackedModelParamsIndex &index, const ui8 *buf, float scale, float rowDispScale);
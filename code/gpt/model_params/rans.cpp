@@ -0,0 +1,204 @@
+#include "stdafx.h"
+#include "rans.h"
+#include <immintrin.h>
+
+
+const ui32 RANS_L = 1 << 16; // lower bound of normalized state, state is renormalized by 16 bit words
+const ui32 RANS_SCALE = 1 << RANS_SCALE_BITS;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// scale counts to sum up to RANS_SCALE keeping every present symbol
+static void NormalizeFreq(const yint *counts, yint total, ui32 *freq)
+{
+    yint sum = 0;
+    yint maxSym = 0;
+    for (yint s = 0; s < 256; ++s) {
+        if (counts[s] > 0) {
+            freq[s] = Max<yint>(1, counts[s] * RANS_SCALE / total);
+        } else {
+            freq[s] = 0;
+        }
+        sum += freq[s];
+        if (freq[s] > freq[maxSym]) {
+            maxSym = s;
+        }
+    }
+    // fix rounding error on the most frequent symbol, steal from other symbols if it is not enough
+    while (sum != RANS_SCALE) {
+        if (sum < RANS_SCALE) {
+            freq[maxSym] += RANS_SCALE - sum;
+            sum = RANS_SCALE;
+        } else {
+            yint excess = sum - RANS_SCALE;
+            if (freq[maxSym] > excess) {
+                freq[maxSym] -= excess;
+                sum = RANS_SCALE;
+            } else {
+                for (yint s = 0; s < 256 && sum > RANS_SCALE; ++s) {
+                    if (freq[s] > 1) {
+                        --freq[s];
+                        --sum;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+template <class T>
+static void Append(TVector<ui8> *pRes, const T &x)
+{
+    yint ptr = YSize(*pRes);
+    pRes->resize(ptr + sizeof(T));
+    memcpy(pRes->data() + ptr, &x, sizeof(T));
+}
+
+
+void RansEncode(TVector<ui8> *pRes, const i8 *src, yint count)
+{
+    Y_VERIFY((count % RANS_LANES) == 0);
+    pRes->resize(0);
+
+    // symbol stats
+    yint counts[256];
+    Zero(counts);
+    for (yint i = 0; i < count; ++i) {
+        counts[(ui8)src[i]] += 1;
+    }
+    ui32 freq[256];
+    ui32 start[256];
+    NormalizeFreq(counts, Max<yint>(1, count), freq);
+    ui32 cumFreq = 0;
+    ui16 symCount = 0;
+    for (yint s = 0; s < 256; ++s) {
+        start[s] = cumFreq;
+        cumFreq += freq[s];
+        symCount += (freq[s] > 0);
+    }
+
+    // header
+    Append(pRes, symCount);
+    for (yint s = 0; s < 256; ++s) {
+        if (freq[s] > 0) {
+            Append(pRes, (ui8)s);
+            Append(pRes, (ui16)(freq[s] - 1));
+        }
+    }
+
+    // encode each lane backwards, decoder reads words in reverse order
+    TVector<TVector<ui16>> laneArr;
+    laneArr.resize(RANS_LANES);
+    for (yint lane = 0; lane < RANS_LANES; ++lane) {
+        TVector<ui16> &words = laneArr[lane];
+        ui64 x = RANS_L;
+        for (yint i = count - RANS_LANES + lane; i >= 0; i -= RANS_LANES) {
+            ui32 s = (ui8)src[i];
+            ui64 f = freq[s];
+            ui64 xMax = ((RANS_L >> RANS_SCALE_BITS) << 16) * f;
+            if (x >= xMax) {
+                words.push_back(x & 0xffff);
+                x >>= 16;
+            }
+            x = ((x / f) << RANS_SCALE_BITS) + (x % f) + start[s];
+        }
+        words.push_back(x & 0xffff);
+        words.push_back(x >> 16);
+        Reverse(words.begin(), words.end());
+    }
+    for (yint lane = 0; lane < RANS_LANES; ++lane) {
+        Append(pRes, (ui32)YSize(laneArr[lane]));
+    }
+    for (yint lane = 0; lane < RANS_LANES; ++lane) {
+        const TVector<ui16> &words = laneArr[lane];
+        yint ptr = YSize(*pRes);
+        pRes->resize(ptr + YSize(words) * sizeof(ui16));
+        memcpy(pRes->data() + ptr, words.data(), YSize(words) * sizeof(ui16));
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TRansDecoder::TRansDecoder()
+{
+    Zero(State);
+    Zero(Offset);
+}
+
+
+void TRansDecoder::Init(const ui8 *block, yint blockSize)
+{
+    const ui8 *ptr = block;
+    ui16 symCount = 0;
+    memcpy(&symCount, ptr, sizeof(symCount));
+    ptr += sizeof(symCount);
+    SlotTable.yresize(RANS_SCALE);
+    ui32 slot = 0;
+    for (yint k = 0; k < symCount; ++k) {
+        ui8 sym = ptr[0];
+        ui16 freqMinusOne = 0;
+        memcpy(&freqMinusOne, ptr + 1, sizeof(freqMinusOne));
+        ptr += 3;
+        ui32 freq = freqMinusOne + 1;
+        Y_VERIFY(slot + freq <= RANS_SCALE);
+        for (ui32 j = 0; j < freq; ++j) {
+            SlotTable[slot + j] = (ui32(sym) << 24) | (ui32(freqMinusOne) << 12) | j;
+        }
+        slot += freq;
+    }
+    Y_VERIFY(slot == RANS_SCALE);
+    ui32 laneWords[RANS_LANES];
+    memcpy(laneWords, ptr, sizeof(laneWords));
+    ptr += sizeof(laneWords);
+    Base = block;
+    yint offset = ptr - block;
+    for (yint lane = 0; lane < RANS_LANES; ++lane) {
+        ui16 hi = 0;
+        ui16 lo = 0;
+        memcpy(&hi, block + offset, sizeof(hi));
+        memcpy(&lo, block + offset + 2, sizeof(lo));
+        State[lane] = (ui32(hi) << 16) | lo;
+        Offset[lane] = offset + 4;
+        offset += laneWords[lane] * sizeof(ui16);
+    }
+    Y_VERIFY(offset <= blockSize);
+}
+
+
+void TRansDecoder::Decode(i8 *dst, yint count)
+{
+    Y_ASSERT((count % RANS_LANES) == 0);
+    const __m256i slotMask = _mm256_set1_epi32(RANS_SCALE - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    const __m256i wordMask = _mm256_set1_epi32(0xffff);
+    const __m256i zero = _mm256_setzero_si256();
+    // take high byte of every dword, then gather bytes from both 128 bit lanes
+    const __m256i symShuffle = _mm256_setr_epi8(
+        3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i symPerm = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+    const int *table = (const int *)SlotTable.data();
+    const int *base = (const int *)Base;
+
+    __m256i x = _mm256_load_si256((const __m256i *)State);
+    __m256i offset = _mm256_load_si256((const __m256i *)Offset);
+    for (yint i = 0; i < count; i += RANS_LANES) {
+        __m256i slot = _mm256_and_si256(x, slotMask);
+        __m256i e = _mm256_i32gather_epi32(table, slot, 4);
+        __m256i freq = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(e, 12), slotMask), one);
+        __m256i bias = _mm256_and_si256(e, slotMask);
+        x = _mm256_add_epi32(_mm256_mullo_epi32(freq, _mm256_srli_epi32(x, RANS_SCALE_BITS)), bias);
+        // renormalize, at most one word per step
+        __m256i needWord = _mm256_cmpeq_epi32(_mm256_srli_epi32(x, 16), zero);
+        __m256i word = _mm256_and_si256(_mm256_i32gather_epi32(base, offset, 1), wordMask);
+        x = _mm256_blendv_epi8(x, _mm256_or_si256(_mm256_slli_epi32(x, 16), word), needWord);
+        offset = _mm256_add_epi32(offset, _mm256_and_si256(needWord, two));
+        // output symbols
+        __m256i sym = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(e, symShuffle), symPerm);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm256_castsi256_si128(sym));
+    }
+    _mm256_store_si256((__m256i *)State, x);
+    _mm256_store_si256((__m256i *)Offset, offset);
+}
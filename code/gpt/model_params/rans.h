@@ -0,0 +1,29 @@
+#pragma once
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// interleaved rANS coder for int8 arrays
+// values are split into RANS_LANES independent streams (value i goes to stream i % RANS_LANES),
+// decoder advances all streams at once with AVX2 gathers
+// block format:
+//   ui16 symbol count, (ui8 symbol, ui16 freq) per symbol
+//   ui32 word count per stream
+//   ui16 words of each stream
+const yint RANS_LANES = 8;
+const yint RANS_SCALE_BITS = 12;
+const yint RANS_BLOCK_PADDING = 4; // decoder reads up to this many bytes past block end
+
+void RansEncode(TVector<ui8> *pRes, const i8 *src, yint count);
+
+
+class TRansDecoder
+{
+    TVector<ui32> SlotTable; // (symbol << 24) | ((freq - 1) << 12) | (slot - start)
+    const ui8 *Base = 0;
+    alignas(32) ui32 State[RANS_LANES];
+    alignas(32) ui32 Offset[RANS_LANES];
+public:
+    TRansDecoder();
+    void Init(const ui8 *block, yint blockSize); // block should have RANS_BLOCK_PADDING readable bytes after its end
+    void Decode(i8 *dst, yint count); // count should be multiple of RANS_LANES
+};
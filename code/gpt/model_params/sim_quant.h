@@ -0,0 +1,37 @@
+#pragma once
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// simulated low bit quantization, int8 matrix value is rounded to one of few levels
+// used by training forward pass and by cpu inference to get the same weights
+inline i8 SimQuant158bit(i8 x)
+{
+    // -1 / 0 / 1
+    if (x < -15) {
+        return -32;
+    } else if (x > 15) {
+        return 32;
+    } else {
+        return 0;
+    }
+}
+
+inline i8 SimQuant2bit(i8 x)
+{
+    if (x < -24) {
+        return -36;
+    } else if (x < 0) {
+        return -12;
+    } else if (x <= 24) {
+        return 12;
+    } else {
+        return 36;
+    }
+}
+
+inline i8 SimQuant4bit(i8 x)
+{
+    yint xx = x;
+    yint bitVal = ClampVal<yint>((xx + 4 + 9 * 8) / 9, 0, 15); // 4.88512
+    return bitVal * 9 + 4 - 9 * 8;
+}
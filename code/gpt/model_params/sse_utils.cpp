@@ -1,3 +1,1432 @@
 #include "stdafx.h"
 #include "sse_utils.h"
+#include <gpt/rng/xrng.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ISA_TARGET(x)
+#else
+#include <cpuid.h>
+#define ISA_TARGET(x) __attribute__((target(x)))
+#endif
 
+
+// kernels are compiled with per function target, so they do not depend on build flags
+// all isa give equal results except exp2 rounding (no fma in sse4.1) and float summation order
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// sse4.1
+ISA_TARGET("sse4.1")
+static inline __m128i DotStepSse41(__m128i a, __m128i b, __m128i sum)
+{
+    // |a| * (b * sign(a)), pair sums fit i16 since values are in [-127, 127]
+    __m128i prod = _mm_maddubs_epi16(_mm_sign_epi8(a, a), _mm_sign_epi8(b, a));
+    return _mm_add_epi32(sum, _mm_madd_epi16(prod, _mm_set1_epi16(1)));
+}
+
+ISA_TARGET("sse4.1")
+static inline i32 HorizontalSumSse41(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+ISA_TARGET("sse4.1")
+static i32 DotInt8Sse41(const i8 *aData, const i8 *bData, yint sz)
+{
+    __m128i sum = _mm_setzero_si128();
+    for (yint i = 0; i < sz; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(aData + i));
+        sum = DotStepSse41(a, _mm_loadu_si128((const __m128i *)(bData + i)), sum);
+    }
+    return HorizontalSumSse41(sum);
+}
+
+ISA_TARGET("sse4.1")
+static void DotInt8x4Sse41(const i8 *aData, const i8 *b0, const i8 *b1, const i8 *b2, const i8 *b3, yint sz, i32 *res)
+{
+    __m128i sum0 = _mm_setzero_si128();
+    __m128i sum1 = _mm_setzero_si128();
+    __m128i sum2 = _mm_setzero_si128();
+    __m128i sum3 = _mm_setzero_si128();
+    for (yint i = 0; i < sz; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(aData + i));
+        sum0 = DotStepSse41(a, _mm_loadu_si128((const __m128i *)(b0 + i)), sum0);
+        sum1 = DotStepSse41(a, _mm_loadu_si128((const __m128i *)(b1 + i)), sum1);
+        sum2 = DotStepSse41(a, _mm_loadu_si128((const __m128i *)(b2 + i)), sum2);
+        sum3 = DotStepSse41(a, _mm_loadu_si128((const __m128i *)(b3 + i)), sum3);
+    }
+    res[0] = HorizontalSumSse41(sum0);
+    res[1] = HorizontalSumSse41(sum1);
+    res[2] = HorizontalSumSse41(sum2);
+    res[3] = HorizontalSumSse41(sum3);
+}
+
+// exp avx by Imperator@, same polynomial for all isa
+ISA_TARGET("sse4.1")
+static float Exp2SumSse41(float *data, yint sz, float maxValue)
+{
+    __m128 sum = _mm_setzero_ps();
+    __m128 maxVec = _mm_set1_ps(maxValue);
+    for (yint i = 0; i < sz; i += 4) {
+        __m128 x = _mm_sub_ps(_mm_loadu_ps(data + i), maxVec);
+        x = _mm_max_ps(x, _mm_set1_ps(-127));
+        __m128 xf = _mm_floor_ps(x);
+        x = _mm_sub_ps(x, xf);
+        __m128i xfi = _mm_cvtps_epi32(xf);
+
+        __m128 x2 = _mm_mul_ps(x, x);
+        __m128 c0 = _mm_set1_ps(-3.069678791803394491901405992213472390777e-1f);
+        __m128 c1 = _mm_set1_ps(-6.558811624324781017147952441210509604385e-2f);
+        __m128 c2 = _mm_set1_ps(-1.355574723481491770403079319055785445381e-2f);
+        __m128 res = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(c2, x), c1), x), c0);
+
+        __m128 x_by_1_minus_x = _mm_sub_ps(x, x2);
+        res = _mm_add_ps(_mm_mul_ps(res, x_by_1_minus_x), x);
+        res = _mm_add_ps(res, _mm_set1_ps(1));
+
+        xfi = _mm_slli_epi32(xfi, 23);
+        res = _mm_castsi128_ps(_mm_add_epi32(xfi, _mm_castps_si128(res)));
+        _mm_storeu_ps(data + i, res);
+        sum = _mm_add_ps(sum, res);
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x1));
+    return _mm_cvtss_f32(sum);
+}
+
+ISA_TARGET("sse4.1")
+static void ConvertArraySse41(i8 *dst, const float *src, yint xSize, float mult)
+{
+    __m128 multVec = _mm_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 16) {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + x), multVec));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + x + 4), multVec));
+        __m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + x + 8), multVec));
+        __m128i d = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + x + 12), multVec));
+        __m128i ab = _mm_packs_epi32(a, b);
+        __m128i cd = _mm_packs_epi32(c, d);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packs_epi16(ab, cd));
+    }
+}
+
+// packed weights, indices are unpacked to values with pshufb lookup in levels table
+// 16 packed bytes give values [0, 16) and [32, 48) of 4 bit chunk
+ISA_TARGET("sse4.1")
+static void DotPacked4x4Sse41(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m128i lut = _mm_loadu_si128((const __m128i *)levels);
+    __m128i mask = _mm_set1_epi8(0xf);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m128i sum[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        for (yint h = 0; h < 32; h += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(aData + i + h));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(aData + i + h + 32));
+            for (yint z = 0; z < 4; ++z) {
+                __m128i b = _mm_loadu_si128((const __m128i *)(rows[z] + i / 2 + h));
+                sum[z] = DotStepSse41(a0, _mm_shuffle_epi8(lut, _mm_and_si128(b, mask)), sum[z]);
+                sum[z] = DotStepSse41(a1, _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 4), mask)), sum[z]);
+            }
+        }
+    }
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumSse41(sum[z]);
+    }
+}
+
+ISA_TARGET("sse4.1")
+static void DotPacked2x4Sse41(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m128i lut = _mm_loadu_si128((const __m128i *)levels);
+    __m128i mask = _mm_set1_epi8(3);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m128i sum[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        for (yint h = 0; h < 32; h += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(aData + i + h));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(aData + i + h + 32));
+            __m128i a2 = _mm_loadu_si128((const __m128i *)(aData + i + h + 64));
+            __m128i a3 = _mm_loadu_si128((const __m128i *)(aData + i + h + 96));
+            for (yint z = 0; z < 4; ++z) {
+                __m128i b = _mm_loadu_si128((const __m128i *)(rows[z] + i / 4 + h));
+                sum[z] = DotStepSse41(a0, _mm_shuffle_epi8(lut, _mm_and_si128(b, mask)), sum[z]);
+                sum[z] = DotStepSse41(a1, _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 2), mask)), sum[z]);
+                sum[z] = DotStepSse41(a2, _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 4), mask)), sum[z]);
+                sum[z] = DotStepSse41(a3, _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 6), mask)), sum[z]);
+            }
+        }
+    }
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumSse41(sum[z]);
+    }
+}
+
+// 16 packed bytes give values [0, 16) and [32, 48) of 4 bit chunk, next 16 bytes give [16, 32) and [48, 64)
+ISA_TARGET("sse4.1")
+static void UnpackIndices4Sse41(i8 *dst, const ui8 *src, const i8 *levels, yint sz)
+{
+    __m128i lut = _mm_loadu_si128((const __m128i *)levels);
+    __m128i mask = _mm_set1_epi8(0xf);
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        for (yint h = 0; h < 32; h += 16) {
+            __m128i b = _mm_loadu_si128((const __m128i *)(src + i / 2 + h));
+            _mm_storeu_si128((__m128i *)(dst + i + h), _mm_shuffle_epi8(lut, _mm_and_si128(b, mask)));
+            _mm_storeu_si128((__m128i *)(dst + i + h + 32), _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 4), mask)));
+        }
+    }
+}
+
+ISA_TARGET("sse4.1")
+static void UnpackIndices2Sse41(i8 *dst, const ui8 *src, const i8 *levels, yint sz)
+{
+    __m128i lut = _mm_loadu_si128((const __m128i *)levels);
+    __m128i mask = _mm_set1_epi8(3);
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        for (yint h = 0; h < 32; h += 16) {
+            __m128i b = _mm_loadu_si128((const __m128i *)(src + i / 4 + h));
+            _mm_storeu_si128((__m128i *)(dst + i + h), _mm_shuffle_epi8(lut, _mm_and_si128(b, mask)));
+            _mm_storeu_si128((__m128i *)(dst + i + h + 32), _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 2), mask)));
+            _mm_storeu_si128((__m128i *)(dst + i + h + 64), _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 4), mask)));
+            _mm_storeu_si128((__m128i *)(dst + i + h + 96), _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 6), mask)));
+        }
+    }
+}
+
+// pairs of rows are interleaved to i16 and multiplied by pair of weights with madd
+ISA_TARGET("sse4.1")
+static void AddWeightedRowsInt8Sse41(const i8 *weight, const i8 *rows, yint rowCount, yint rowSize, i32 *acc)
+{
+    for (yint r = 0; r < rowCount; r += 2) {
+        const i8 *row1 = rows + r * rowSize;
+        bool hasSecond = (r + 1 < rowCount);
+        const i8 *row2 = hasSecond ? row1 + rowSize : row1;
+        i16 w1 = weight[r];
+        i16 w2 = hasSecond ? weight[r + 1] : 0;
+        __m128i wPair = _mm_set1_epi32((ui16)w1 | ((ui32)(ui16)w2 << 16));
+        for (yint x = 0; x < rowSize; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(row1 + x));
+            __m128i b = _mm_loadu_si128((const __m128i *)(row2 + x));
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            __m128i prod[4] = {
+                _mm_madd_epi16(_mm_cvtepi8_epi16(lo), wPair),
+                _mm_madd_epi16(_mm_cvtepi8_epi16(_mm_srli_si128(lo, 8)), wPair),
+                _mm_madd_epi16(_mm_cvtepi8_epi16(hi), wPair),
+                _mm_madd_epi16(_mm_cvtepi8_epi16(_mm_srli_si128(hi, 8)), wPair),
+            };
+            for (yint k = 0; k < 4; ++k) {
+                __m128i *dst = (__m128i *)(acc + x + k * 4);
+                _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), prod[k]));
+            }
+        }
+    }
+}
+
+// xSize is multiple of 8
+ISA_TARGET("sse4.1")
+static void UnpackArraySse41(float *dst, const i8 *src, yint xSize, float mult)
+{
+    __m128 multVec = _mm_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 4) {
+        i32 src4;
+        memcpy(&src4, src + x, 4);
+        __m128 srcVal = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(src4)));
+        _mm_storeu_ps(dst + x, _mm_mul_ps(srcVal, multVec));
+    }
+}
+
+ISA_TARGET("sse4.1")
+static void AddPackedArraySse41(float *dst, const i8 *src, yint xSize, float mult)
+{
+    __m128 multVec = _mm_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 4) {
+        i32 src4;
+        memcpy(&src4, src + x, 4);
+        __m128 srcVal = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(src4)));
+        _mm_storeu_ps(dst + x, _mm_add_ps(_mm_loadu_ps(dst + x), _mm_mul_ps(srcVal, multVec)));
+    }
+}
+
+// sampling, x > 0, mantissa is moved to [sqrt(0.5), sqrt(2)), log2(1 + t) = t * P(t), P is degree 6 chebyshev fit, abs error 6e-7
+static const float LOG2_POLY[7] = { 0.17212873f, -0.26950627f, 0.29563360f, -0.35935065f, 0.48062915f, -0.72136404f, 1.44269643f };
+
+ISA_TARGET("sse4.1")
+static inline __m128 FastLog2Sse41(__m128 x)
+{
+    const __m128i sqrtHalf = _mm_set1_epi32(0x3f3504f3);
+    __m128i shifted = _mm_sub_epi32(_mm_castps_si128(x), sqrtHalf);
+    __m128 e = _mm_cvtepi32_ps(_mm_srai_epi32(shifted, 23));
+    __m128 m = _mm_castsi128_ps(_mm_add_epi32(_mm_and_si128(shifted, _mm_set1_epi32(0x7fffff)), sqrtHalf));
+    __m128 t = _mm_sub_ps(m, _mm_set1_ps(1));
+    __m128 poly = _mm_set1_ps(LOG2_POLY[0]);
+    for (yint k = 1; k < 7; ++k) {
+        poly = _mm_add_ps(_mm_mul_ps(poly, t), _mm_set1_ps(LOG2_POLY[k]));
+    }
+    return _mm_add_ps(e, _mm_mul_ps(poly, t));
+}
+
+// uniform noise of gumbel max is hash of token index and key
+ISA_TARGET("sse4.1")
+static inline __m128i HashIndexSse41(__m128i idx, __m128i key)
+{
+    __m128i x = _mm_xor_si128(_mm_mullo_epi32(idx, _mm_set1_epi32(0x9e3779b9)), key);
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(0x85ebca6b));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 13));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(0xc2b2ae35));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    return x;
+}
+
+ISA_TARGET("sse4.1")
+static void Log2ArraySse41(const float *src, yint sz, float *dst, float zeroValue)
+{
+    for (yint i = 0; i < sz; i += 4) {
+        __m128 x = _mm_loadu_ps(src + i);
+        __m128 isZero = _mm_cmple_ps(x, _mm_setzero_ps());
+        __m128 res = FastLog2Sse41(_mm_max_ps(x, _mm_set1_ps(1e-37f)));
+        _mm_storeu_ps(dst + i, _mm_blendv_ps(res, _mm_set1_ps(zeroValue), isZero));
+    }
+}
+
+ISA_TARGET("sse4.1")
+static yint GumbelArgMaxSse41(const float *logit, yint sz, float invTemperature, ui32 key)
+{
+    __m128 invTemp = _mm_set1_ps(invTemperature);
+    __m128i keyVec = _mm_set1_epi32(key);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    __m128 best = _mm_set1_ps(-INFINITY);
+    __m128i bestIdx = _mm_setzero_si128();
+    for (yint i = 0; i < sz; i += 4) {
+        // u in (0, 1)
+        __m128i h = HashIndexSse41(idx, keyVec);
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_srli_epi32(h, 8)), _mm_set1_ps(0.5f)), _mm_set1_ps(1.f / (1 << 24)));
+        __m128 negLog2u = _mm_sub_ps(_mm_setzero_ps(), FastLog2Sse41(u));
+        __m128 score = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(logit + i), invTemp), FastLog2Sse41(negLog2u));
+        __m128 isBetter = _mm_cmpgt_ps(score, best);
+        best = _mm_blendv_ps(best, score, isBetter);
+        bestIdx = _mm_blendv_epi8(bestIdx, idx, _mm_castps_si128(isBetter));
+        idx = _mm_add_epi32(idx, _mm_set1_epi32(4));
+    }
+    float bestArr[4];
+    int bestIdxArr[4];
+    _mm_storeu_ps(bestArr, best);
+    _mm_storeu_si128((__m128i *)bestIdxArr, bestIdx);
+    yint res = 0;
+    for (yint k = 1; k < 4; ++k) {
+        if (bestArr[k] > bestArr[res] || (bestArr[k] == bestArr[res] && bestIdxArr[k] < bestIdxArr[res])) {
+            res = k;
+        }
+    }
+    return bestIdxArr[res];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// avx2
+ISA_TARGET("avx2")
+static inline __m256i DotStepAvx2(__m256i a, __m256i b, __m256i sum)
+{
+    __m256i prod = _mm256_maddubs_epi16(_mm256_sign_epi8(a, a), _mm256_sign_epi8(b, a));
+    return _mm256_add_epi32(sum, _mm256_madd_epi16(prod, _mm256_set1_epi16(1)));
+}
+
+ISA_TARGET("avx2")
+static inline i32 HorizontalSumAvx2(__m256i v)
+{
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+ISA_TARGET("avx2")
+static i32 DotInt8Avx2(const i8 *aData, const i8 *bData, yint sz)
+{
+    __m256i sum = _mm256_setzero_si256();
+    for (yint i = 0; i < sz; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(aData + i));
+        sum = DotStepAvx2(a, _mm256_loadu_si256((const __m256i *)(bData + i)), sum);
+    }
+    return HorizontalSumAvx2(sum);
+}
+
+ISA_TARGET("avx2")
+static void DotInt8x4Avx2(const i8 *aData, const i8 *b0, const i8 *b1, const i8 *b2, const i8 *b3, yint sz, i32 *res)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    __m256i sum2 = _mm256_setzero_si256();
+    __m256i sum3 = _mm256_setzero_si256();
+    for (yint i = 0; i < sz; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(aData + i));
+        sum0 = DotStepAvx2(a, _mm256_loadu_si256((const __m256i *)(b0 + i)), sum0);
+        sum1 = DotStepAvx2(a, _mm256_loadu_si256((const __m256i *)(b1 + i)), sum1);
+        sum2 = DotStepAvx2(a, _mm256_loadu_si256((const __m256i *)(b2 + i)), sum2);
+        sum3 = DotStepAvx2(a, _mm256_loadu_si256((const __m256i *)(b3 + i)), sum3);
+    }
+    res[0] = HorizontalSumAvx2(sum0);
+    res[1] = HorizontalSumAvx2(sum1);
+    res[2] = HorizontalSumAvx2(sum2);
+    res[3] = HorizontalSumAvx2(sum3);
+}
+
+ISA_TARGET("avx2,fma")
+static float Exp2SumAvx2(float *data, yint sz, float maxValue)
+{
+    __m256 sum = _mm256_setzero_ps();
+    __m256 maxVec = _mm256_set1_ps(maxValue);
+    for (yint i = 0; i < sz; i += 8) {
+        __m256 x = _mm256_sub_ps(_mm256_loadu_ps(data + i), maxVec);
+        x = _mm256_max_ps(x, _mm256_set1_ps(-127));
+        __m256 xf = _mm256_floor_ps(x);
+        x = _mm256_sub_ps(x, xf);
+        __m256i xfi = _mm256_cvtps_epi32(xf);
+
+        __m256 x2 = _mm256_mul_ps(x, x);
+        __m256 c0 = _mm256_set1_ps(-3.069678791803394491901405992213472390777e-1f);
+        __m256 c1 = _mm256_set1_ps(-6.558811624324781017147952441210509604385e-2f);
+        __m256 c2 = _mm256_set1_ps(-1.355574723481491770403079319055785445381e-2f);
+        __m256 res = _mm256_fmadd_ps(_mm256_fmadd_ps(c2, x, c1), x, c0);
+
+        __m256 x_by_1_minus_x = _mm256_sub_ps(x, x2);
+        res = _mm256_fmadd_ps(res, x_by_1_minus_x, x);
+        res = _mm256_add_ps(res, _mm256_set1_ps(1)); //adding ymm_x and 1 separately in the end improves accuracy
+
+        xfi = _mm256_slli_epi32(xfi, 23);
+        res = _mm256_castsi256_ps(_mm256_add_epi32(xfi, _mm256_castps_si256(res)));
+        _mm256_storeu_ps(data + i, res);
+        sum = _mm256_add_ps(sum, res);
+    }
+    __m128 sumQuad = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    sumQuad = _mm_add_ps(sumQuad, _mm_movehl_ps(sumQuad, sumQuad));
+    sumQuad = _mm_add_ss(sumQuad, _mm_shuffle_ps(sumQuad, sumQuad, 0x1));
+    return _mm_cvtss_f32(sumQuad);
+}
+
+// https://stackoverflow.com/questions/51778721/how-to-convert-32-bit-float-to-8-bit-signed-char-41-packing-of-int32-to-int8
+ISA_TARGET("avx2")
+static void ConvertArrayAvx2(i8 *dst, const float *src, yint xSize, float mult)
+{
+    __m256 multVec = _mm256_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 32) {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x), multVec));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x + 8), multVec));
+        __m256i c = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x + 16), multVec));
+        __m256i d = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x + 24), multVec));
+        __m256i ab = _mm256_packs_epi32(a, b); // 16x int16_t
+        __m256i cd = _mm256_packs_epi32(c, d);
+        __m256i abcd = _mm256_packs_epi16(ab, cd); // 32x int8_t in [ a_lo, b_lo, c_lo, d_lo | a_hi, b_hi, c_hi, d_hi ] order
+        __m256i lanefix = _mm256_permutevar8x32_epi32(abcd, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)(dst + x), lanefix);
+    }
+}
+
+// 32 packed bytes give whole 4 bit or 2 bit chunk, each shift of them is in the order of values
+ISA_TARGET("avx2")
+static void DotPacked4x4Avx2(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)levels));
+    __m256i mask = _mm256_set1_epi8(0xf);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        for (yint z = 0; z < 4; ++z) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(rows[z] + i / 2));
+            sum[z] = DotStepAvx2(a0, _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)), sum[z]);
+            sum[z] = DotStepAvx2(a1, _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)), sum[z]);
+        }
+    }
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumAvx2(sum[z]);
+    }
+}
+
+ISA_TARGET("avx2")
+static void DotPacked2x4Avx2(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)levels));
+    __m256i mask = _mm256_set1_epi8(3);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(aData + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(aData + i + 96));
+        for (yint z = 0; z < 4; ++z) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(rows[z] + i / 4));
+            sum[z] = DotStepAvx2(a0, _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)), sum[z]);
+            sum[z] = DotStepAvx2(a1, _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 2), mask)), sum[z]);
+            sum[z] = DotStepAvx2(a2, _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)), sum[z]);
+            sum[z] = DotStepAvx2(a3, _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 6), mask)), sum[z]);
+        }
+    }
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumAvx2(sum[z]);
+    }
+}
+
+ISA_TARGET("avx2")
+static void UnpackIndices4Avx2(i8 *dst, const ui8 *src, const i8 *levels, yint sz)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)levels));
+    __m256i mask = _mm256_set1_epi8(0xf);
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i / 2));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)));
+    }
+}
+
+ISA_TARGET("avx2")
+static void UnpackIndices2Avx2(i8 *dst, const ui8 *src, const i8 *levels, yint sz)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)levels));
+    __m256i mask = _mm256_set1_epi8(3);
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i / 4));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 2), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 6), mask)));
+    }
+}
+
+ISA_TARGET("avx2")
+static void AddWeightedRowsInt8Avx2(const i8 *weight, const i8 *rows, yint rowCount, yint rowSize, i32 *acc)
+{
+    for (yint r = 0; r < rowCount; r += 2) {
+        const i8 *row1 = rows + r * rowSize;
+        bool hasSecond = (r + 1 < rowCount);
+        const i8 *row2 = hasSecond ? row1 + rowSize : row1;
+        i16 w1 = weight[r];
+        i16 w2 = hasSecond ? weight[r + 1] : 0;
+        __m256i wPair = _mm256_set1_epi32((ui16)w1 | ((ui32)(ui16)w2 << 16));
+        for (yint x = 0; x < rowSize; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(row1 + x));
+            __m128i b = _mm_loadu_si128((const __m128i *)(row2 + x));
+            __m256i lo = _mm256_cvtepi8_epi16(_mm_unpacklo_epi8(a, b));
+            __m256i hi = _mm256_cvtepi8_epi16(_mm_unpackhi_epi8(a, b));
+            __m256i *dst = (__m256i *)(acc + x);
+            _mm256_storeu_si256(dst, _mm256_add_epi32(_mm256_loadu_si256(dst), _mm256_madd_epi16(lo, wPair)));
+            _mm256_storeu_si256(dst + 1, _mm256_add_epi32(_mm256_loadu_si256(dst + 1), _mm256_madd_epi16(hi, wPair)));
+        }
+    }
+}
+
+ISA_TARGET("avx2")
+static void UnpackArrayAvx2(float *dst, const i8 *src, yint xSize, float mult)
+{
+    __m256 multVec = _mm256_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 8) {
+        __m128i src8 = _mm_loadl_epi64((const __m128i *)(src + x));
+        __m256 srcVal = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(src8));
+        _mm256_storeu_ps(dst + x, _mm256_mul_ps(srcVal, multVec));
+    }
+}
+
+ISA_TARGET("avx2")
+static void AddPackedArrayAvx2(float *dst, const i8 *src, yint xSize, float mult)
+{
+    __m256 multVec = _mm256_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 8) {
+        __m128i src8 = _mm_loadl_epi64((const __m128i *)(src + x));
+        __m256 srcVal = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(src8));
+        _mm256_storeu_ps(dst + x, _mm256_add_ps(_mm256_loadu_ps(dst + x), _mm256_mul_ps(srcVal, multVec)));
+    }
+}
+
+ISA_TARGET("avx2")
+static inline __m256 FastLog2Avx2(__m256 x)
+{
+    const __m256i sqrtHalf = _mm256_set1_epi32(0x3f3504f3);
+    __m256i shifted = _mm256_sub_epi32(_mm256_castps_si256(x), sqrtHalf);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_srai_epi32(shifted, 23));
+    __m256 m = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_and_si256(shifted, _mm256_set1_epi32(0x7fffff)), sqrtHalf));
+    __m256 t = _mm256_sub_ps(m, _mm256_set1_ps(1));
+    __m256 poly = _mm256_set1_ps(LOG2_POLY[0]);
+    for (yint k = 1; k < 7; ++k) {
+        poly = _mm256_add_ps(_mm256_mul_ps(poly, t), _mm256_set1_ps(LOG2_POLY[k]));
+    }
+    return _mm256_add_ps(e, _mm256_mul_ps(poly, t));
+}
+
+ISA_TARGET("avx2")
+static inline __m256i HashIndexAvx2(__m256i idx, __m256i key)
+{
+    __m256i x = _mm256_xor_si256(_mm256_mullo_epi32(idx, _mm256_set1_epi32(0x9e3779b9)), key);
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x85ebca6b));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 13));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0xc2b2ae35));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    return x;
+}
+
+ISA_TARGET("avx2")
+static void Log2ArrayAvx2(const float *src, yint sz, float *dst, float zeroValue)
+{
+    for (yint i = 0; i < sz; i += 8) {
+        __m256 x = _mm256_loadu_ps(src + i);
+        __m256 isZero = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LE_OQ);
+        __m256 res = FastLog2Avx2(_mm256_max_ps(x, _mm256_set1_ps(1e-37f)));
+        _mm256_storeu_ps(dst + i, _mm256_blendv_ps(res, _mm256_set1_ps(zeroValue), isZero));
+    }
+}
+
+ISA_TARGET("avx2")
+static yint GumbelArgMaxAvx2(const float *logit, yint sz, float invTemperature, ui32 key)
+{
+    __m256 invTemp = _mm256_set1_ps(invTemperature);
+    __m256i keyVec = _mm256_set1_epi32(key);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 best = _mm256_set1_ps(-INFINITY);
+    __m256i bestIdx = _mm256_setzero_si256();
+    for (yint i = 0; i < sz; i += 8) {
+        __m256i h = HashIndexAvx2(idx, keyVec);
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(h, 8)), _mm256_set1_ps(0.5f)), _mm256_set1_ps(1.f / (1 << 24)));
+        __m256 negLog2u = _mm256_sub_ps(_mm256_setzero_ps(), FastLog2Avx2(u));
+        __m256 score = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(logit + i), invTemp), FastLog2Avx2(negLog2u));
+        __m256 isBetter = _mm256_cmp_ps(score, best, _CMP_GT_OQ);
+        best = _mm256_blendv_ps(best, score, isBetter);
+        bestIdx = _mm256_blendv_epi8(bestIdx, idx, _mm256_castps_si256(isBetter));
+        idx = _mm256_add_epi32(idx, _mm256_set1_epi32(8));
+    }
+    float bestArr[8];
+    int bestIdxArr[8];
+    _mm256_storeu_ps(bestArr, best);
+    _mm256_storeu_si256((__m256i *)bestIdxArr, bestIdx);
+    yint res = 0;
+    for (yint k = 1; k < 8; ++k) {
+        if (bestArr[k] > bestArr[res] || (bestArr[k] == bestArr[res] && bestIdxArr[k] < bestIdxArr[res])) {
+            res = k;
+        }
+    }
+    return bestIdxArr[res];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// avx-vnni
+// glorious Intel does not support VNNI in 12xxx - 14xxx cpus, no signed x signed dpbssd, use sign trick
+ISA_TARGET("avx2,avxvnni")
+static inline __m256i DotStepAvxVnni(__m256i a, __m256i b, __m256i sum)
+{
+    return _mm256_dpbusd_avx_epi32(sum, _mm256_sign_epi8(a, a), _mm256_sign_epi8(b, a));
+}
+
+// two accumulators to hide dpbusd latency
+ISA_TARGET("avx2,avxvnni")
+static i32 DotInt8AvxVnni(const i8 *aData, const i8 *bData, yint sz)
+{
+    __m256i sum1 = _mm256_setzero_si256();
+    __m256i sum2 = _mm256_setzero_si256();
+    yint i = 0;
+    for (; i + 64 <= sz; i += 64) {
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        sum1 = DotStepAvxVnni(a1, _mm256_loadu_si256((const __m256i *)(bData + i)), sum1);
+        sum2 = DotStepAvxVnni(a2, _mm256_loadu_si256((const __m256i *)(bData + i + 32)), sum2);
+    }
+    if (i < sz) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(aData + i));
+        sum1 = DotStepAvxVnni(a, _mm256_loadu_si256((const __m256i *)(bData + i)), sum1);
+    }
+    return HorizontalSumAvx2(_mm256_add_epi32(sum1, sum2));
+}
+
+ISA_TARGET("avx2,avxvnni")
+static void DotInt8x4AvxVnni(const i8 *aData, const i8 *b0, const i8 *b1, const i8 *b2, const i8 *b3, yint sz, i32 *res)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    __m256i sum2 = _mm256_setzero_si256();
+    __m256i sum3 = _mm256_setzero_si256();
+    for (yint i = 0; i < sz; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(aData + i));
+        sum0 = DotStepAvxVnni(a, _mm256_loadu_si256((const __m256i *)(b0 + i)), sum0);
+        sum1 = DotStepAvxVnni(a, _mm256_loadu_si256((const __m256i *)(b1 + i)), sum1);
+        sum2 = DotStepAvxVnni(a, _mm256_loadu_si256((const __m256i *)(b2 + i)), sum2);
+        sum3 = DotStepAvxVnni(a, _mm256_loadu_si256((const __m256i *)(b3 + i)), sum3);
+    }
+    res[0] = HorizontalSumAvx2(sum0);
+    res[1] = HorizontalSumAvx2(sum1);
+    res[2] = HorizontalSumAvx2(sum2);
+    res[3] = HorizontalSumAvx2(sum3);
+}
+
+// vnni packed kernels look up unsigned level + 128 and need no sign trick, 128 * sum(a) is subtracted in the end
+ISA_TARGET("sse4.1")
+static inline __m128i PackedLevelsU8(const i8 *levels)
+{
+    return _mm_add_epi8(_mm_loadu_si128((const __m128i *)levels), _mm_set1_epi8(-128));
+}
+
+ISA_TARGET("avx2,avxvnni")
+static void DotPacked4x4AvxVnni(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(PackedLevelsU8(levels));
+    __m256i mask = _mm256_set1_epi8(0xf);
+    __m256i ones = _mm256_set1_epi8(1);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m256i sumA = _mm256_setzero_si256();
+    __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        sumA = _mm256_dpbusd_avx_epi32(sumA, ones, a0);
+        sumA = _mm256_dpbusd_avx_epi32(sumA, ones, a1);
+        for (yint z = 0; z < 4; ++z) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(rows[z] + i / 2));
+            sum[z] = _mm256_dpbusd_avx_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)), a0);
+            sum[z] = _mm256_dpbusd_avx_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)), a1);
+        }
+    }
+    i32 offset = HorizontalSumAvx2(sumA) * 128;
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumAvx2(sum[z]) - offset;
+    }
+}
+
+ISA_TARGET("avx2,avxvnni")
+static void DotPacked2x4AvxVnni(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(PackedLevelsU8(levels));
+    __m256i mask = _mm256_set1_epi8(3);
+    __m256i ones = _mm256_set1_epi8(1);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m256i sumA = _mm256_setzero_si256();
+    __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(aData + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(aData + i + 96));
+        sumA = _mm256_dpbusd_avx_epi32(sumA, ones, a0);
+        sumA = _mm256_dpbusd_avx_epi32(sumA, ones, a1);
+        sumA = _mm256_dpbusd_avx_epi32(sumA, ones, a2);
+        sumA = _mm256_dpbusd_avx_epi32(sumA, ones, a3);
+        for (yint z = 0; z < 4; ++z) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(rows[z] + i / 4));
+            sum[z] = _mm256_dpbusd_avx_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)), a0);
+            sum[z] = _mm256_dpbusd_avx_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 2), mask)), a1);
+            sum[z] = _mm256_dpbusd_avx_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)), a2);
+            sum[z] = _mm256_dpbusd_avx_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 6), mask)), a3);
+        }
+    }
+    i32 offset = HorizontalSumAvx2(sumA) * 128;
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumAvx2(sum[z]) - offset;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// avx512-vnni
+// gcc 12 avx512 headers build some intrinsics from _mm512_undefined_*() and warn about uninitialized '__Y'
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+// no sign_epi8 in avx512, b is negated where a is negative with mask
+ISA_TARGET("avx512f,avx512bw,avx512vnni")
+static inline __m512i DotStepAvx512Vnni(__m512i a, __m512i b, __m512i sum)
+{
+    __mmask64 aNeg = _mm512_movepi8_mask(a);
+    __m512i sb = _mm512_mask_sub_epi8(b, aNeg, _mm512_setzero_si512(), b);
+    return _mm512_dpbusd_epi32(sum, _mm512_abs_epi8(a), sb);
+}
+
+// sz is multiple of 32, two accumulators to hide dpbusd latency, odd 32 bytes are left to avx2
+ISA_TARGET("avx512f,avx512bw,avx512vnni")
+static i32 DotInt8Avx512Vnni(const i8 *aData, const i8 *bData, yint sz)
+{
+    __m512i sum1 = _mm512_setzero_si512();
+    __m512i sum2 = _mm512_setzero_si512();
+    yint i = 0;
+    for (; i + 128 <= sz; i += 128) {
+        __m512i a1 = _mm512_loadu_si512(aData + i);
+        __m512i a2 = _mm512_loadu_si512(aData + i + 64);
+        sum1 = DotStepAvx512Vnni(a1, _mm512_loadu_si512(bData + i), sum1);
+        sum2 = DotStepAvx512Vnni(a2, _mm512_loadu_si512(bData + i + 64), sum2);
+    }
+    for (; i + 64 <= sz; i += 64) {
+        __m512i a = _mm512_loadu_si512(aData + i);
+        sum1 = DotStepAvx512Vnni(a, _mm512_loadu_si512(bData + i), sum1);
+    }
+    i32 res = _mm512_reduce_add_epi32(_mm512_add_epi32(sum1, sum2));
+    if (i < sz) {
+        res += DotInt8Avx2(aData + i, bData + i, sz - i);
+    }
+    return res;
+}
+
+ISA_TARGET("avx512f,avx512bw,avx512vnni")
+static void DotInt8x4Avx512Vnni(const i8 *aData, const i8 *b0, const i8 *b1, const i8 *b2, const i8 *b3, yint sz, i32 *res)
+{
+    __m512i sum0 = _mm512_setzero_si512();
+    __m512i sum1 = _mm512_setzero_si512();
+    __m512i sum2 = _mm512_setzero_si512();
+    __m512i sum3 = _mm512_setzero_si512();
+    yint i = 0;
+    for (; i + 64 <= sz; i += 64) {
+        __m512i a = _mm512_loadu_si512(aData + i);
+        sum0 = DotStepAvx512Vnni(a, _mm512_loadu_si512(b0 + i), sum0);
+        sum1 = DotStepAvx512Vnni(a, _mm512_loadu_si512(b1 + i), sum1);
+        sum2 = DotStepAvx512Vnni(a, _mm512_loadu_si512(b2 + i), sum2);
+        sum3 = DotStepAvx512Vnni(a, _mm512_loadu_si512(b3 + i), sum3);
+    }
+    res[0] = _mm512_reduce_add_epi32(sum0);
+    res[1] = _mm512_reduce_add_epi32(sum1);
+    res[2] = _mm512_reduce_add_epi32(sum2);
+    res[3] = _mm512_reduce_add_epi32(sum3);
+    if (i < sz) {
+        i32 tail[4];
+        DotInt8x4Avx2(aData + i, b0 + i, b1 + i, b2 + i, b3 + i, sz - i, tail);
+        for (yint z = 0; z < 4; ++z) {
+            res[z] += tail[z];
+        }
+    }
+}
+
+// odd packed chunks use 256 bit registers
+ISA_TARGET("avx2,avx512vl,avx512vnni")
+static void DotPacked4x4Avx512Vl(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(PackedLevelsU8(levels));
+    __m256i mask = _mm256_set1_epi8(0xf);
+    __m256i ones = _mm256_set1_epi8(1);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m256i sumA = _mm256_setzero_si256();
+    __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        sumA = _mm256_dpbusd_epi32(sumA, ones, a0);
+        sumA = _mm256_dpbusd_epi32(sumA, ones, a1);
+        for (yint z = 0; z < 4; ++z) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(rows[z] + i / 2));
+            sum[z] = _mm256_dpbusd_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)), a0);
+            sum[z] = _mm256_dpbusd_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)), a1);
+        }
+    }
+    i32 offset = HorizontalSumAvx2(sumA) * 128;
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumAvx2(sum[z]) - offset;
+    }
+}
+
+ISA_TARGET("avx2,avx512vl,avx512vnni")
+static void DotPacked2x4Avx512Vl(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m256i lut = _mm256_broadcastsi128_si256(PackedLevelsU8(levels));
+    __m256i mask = _mm256_set1_epi8(3);
+    __m256i ones = _mm256_set1_epi8(1);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m256i sumA = _mm256_setzero_si256();
+    __m256i sum[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(aData + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(aData + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(aData + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(aData + i + 96));
+        sumA = _mm256_dpbusd_epi32(sumA, ones, a0);
+        sumA = _mm256_dpbusd_epi32(sumA, ones, a1);
+        sumA = _mm256_dpbusd_epi32(sumA, ones, a2);
+        sumA = _mm256_dpbusd_epi32(sumA, ones, a3);
+        for (yint z = 0; z < 4; ++z) {
+            __m256i b = _mm256_loadu_si256((const __m256i *)(rows[z] + i / 4));
+            sum[z] = _mm256_dpbusd_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(b, mask)), a0);
+            sum[z] = _mm256_dpbusd_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 2), mask)), a1);
+            sum[z] = _mm256_dpbusd_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), mask)), a2);
+            sum[z] = _mm256_dpbusd_epi32(sum[z], _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 6), mask)), a3);
+        }
+    }
+    i32 offset = HorizontalSumAvx2(sumA) * 128;
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = HorizontalSumAvx2(sum[z]) - offset;
+    }
+}
+
+// 64 packed bytes hold two chunks, lanes of each unpacked part get matching halves of activations
+ISA_TARGET("avx512f,avx512bw,avx512vnni")
+static inline __m512i LoadTwoHalves(const i8 *a0, const i8 *a1)
+{
+    __m512i res = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)a0));
+    return _mm512_inserti64x4(res, _mm256_loadu_si256((const __m256i *)a1), 1);
+}
+
+ISA_TARGET("avx512f,avx512bw,avx512vnni")
+static void DotPacked4x4Avx512Vnni(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m512i lut = _mm512_broadcast_i32x4(PackedLevelsU8(levels));
+    __m512i mask = _mm512_set1_epi8(0xf);
+    __m512i ones = _mm512_set1_epi8(1);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m512i sumA = _mm512_setzero_si512();
+    __m512i sum[4] = { _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512() };
+    yint i = 0;
+    for (; i + 2 * PACK4_CHUNK <= sz; i += 2 * PACK4_CHUNK) {
+        __m512i a0 = LoadTwoHalves(aData + i, aData + i + 64);
+        __m512i a1 = LoadTwoHalves(aData + i + 32, aData + i + 96);
+        sumA = _mm512_dpbusd_epi32(sumA, ones, a0);
+        sumA = _mm512_dpbusd_epi32(sumA, ones, a1);
+        for (yint z = 0; z < 4; ++z) {
+            __m512i b = _mm512_loadu_si512(rows[z] + i / 2);
+            sum[z] = _mm512_dpbusd_epi32(sum[z], _mm512_shuffle_epi8(lut, _mm512_and_si512(b, mask)), a0);
+            sum[z] = _mm512_dpbusd_epi32(sum[z], _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(b, 4), mask)), a1);
+        }
+    }
+    i32 offset = _mm512_reduce_add_epi32(sumA) * 128;
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = _mm512_reduce_add_epi32(sum[z]) - offset;
+    }
+    if (i < sz) {
+        i32 tail[4];
+        DotPacked4x4Avx512Vl(aData + i, b0 + i / 2, b1 + i / 2, b2 + i / 2, b3 + i / 2, levels, sz - i, tail);
+        for (yint z = 0; z < 4; ++z) {
+            res[z] += tail[z];
+        }
+    }
+}
+
+ISA_TARGET("avx512f,avx512bw,avx512vnni")
+static void DotPacked2x4Avx512Vnni(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    __m512i lut = _mm512_broadcast_i32x4(PackedLevelsU8(levels));
+    __m512i mask = _mm512_set1_epi8(3);
+    __m512i ones = _mm512_set1_epi8(1);
+    const ui8 *rows[4] = { b0, b1, b2, b3 };
+    __m512i sumA = _mm512_setzero_si512();
+    __m512i sum[4] = { _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512() };
+    yint i = 0;
+    for (; i + 2 * PACK2_CHUNK <= sz; i += 2 * PACK2_CHUNK) {
+        __m512i a0 = LoadTwoHalves(aData + i, aData + i + 128);
+        __m512i a1 = LoadTwoHalves(aData + i + 32, aData + i + 160);
+        __m512i a2 = LoadTwoHalves(aData + i + 64, aData + i + 192);
+        __m512i a3 = LoadTwoHalves(aData + i + 96, aData + i + 224);
+        sumA = _mm512_dpbusd_epi32(sumA, ones, a0);
+        sumA = _mm512_dpbusd_epi32(sumA, ones, a1);
+        sumA = _mm512_dpbusd_epi32(sumA, ones, a2);
+        sumA = _mm512_dpbusd_epi32(sumA, ones, a3);
+        for (yint z = 0; z < 4; ++z) {
+            __m512i b = _mm512_loadu_si512(rows[z] + i / 4);
+            sum[z] = _mm512_dpbusd_epi32(sum[z], _mm512_shuffle_epi8(lut, _mm512_and_si512(b, mask)), a0);
+            sum[z] = _mm512_dpbusd_epi32(sum[z], _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(b, 2), mask)), a1);
+            sum[z] = _mm512_dpbusd_epi32(sum[z], _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(b, 4), mask)), a2);
+            sum[z] = _mm512_dpbusd_epi32(sum[z], _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(b, 6), mask)), a3);
+        }
+    }
+    i32 offset = _mm512_reduce_add_epi32(sumA) * 128;
+    for (yint z = 0; z < 4; ++z) {
+        res[z] = _mm512_reduce_add_epi32(sum[z]) - offset;
+    }
+    if (i < sz) {
+        i32 tail[4];
+        DotPacked2x4Avx512Vl(aData + i, b0 + i / 4, b1 + i / 4, b2 + i / 4, b3 + i / 4, levels, sz - i, tail);
+        for (yint z = 0; z < 4; ++z) {
+            res[z] += tail[z];
+        }
+    }
+}
+
+// sz is multiple of 8, odd 8 floats are left to avx2
+ISA_TARGET("avx512f")
+static float Exp2SumAvx512(float *data, yint sz, float maxValue)
+{
+    __m512 sum = _mm512_setzero_ps();
+    __m512 maxVec = _mm512_set1_ps(maxValue);
+    yint i = 0;
+    for (; i + 16 <= sz; i += 16) {
+        __m512 x = _mm512_sub_ps(_mm512_loadu_ps(data + i), maxVec);
+        x = _mm512_max_ps(x, _mm512_set1_ps(-127));
+        __m512 xf = _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        x = _mm512_sub_ps(x, xf);
+        __m512i xfi = _mm512_cvtps_epi32(xf);
+
+        __m512 x2 = _mm512_mul_ps(x, x);
+        __m512 c0 = _mm512_set1_ps(-3.069678791803394491901405992213472390777e-1f);
+        __m512 c1 = _mm512_set1_ps(-6.558811624324781017147952441210509604385e-2f);
+        __m512 c2 = _mm512_set1_ps(-1.355574723481491770403079319055785445381e-2f);
+        __m512 res = _mm512_fmadd_ps(_mm512_fmadd_ps(c2, x, c1), x, c0);
+
+        __m512 x_by_1_minus_x = _mm512_sub_ps(x, x2);
+        res = _mm512_fmadd_ps(res, x_by_1_minus_x, x);
+        res = _mm512_add_ps(res, _mm512_set1_ps(1));
+
+        xfi = _mm512_slli_epi32(xfi, 23);
+        res = _mm512_castsi512_ps(_mm512_add_epi32(xfi, _mm512_castps_si512(res)));
+        _mm512_storeu_ps(data + i, res);
+        sum = _mm512_add_ps(sum, res);
+    }
+    float res = _mm512_reduce_add_ps(sum);
+    if (i < sz) {
+        res += Exp2SumAvx2(data + i, sz - i, maxValue);
+    }
+    return res;
+}
+
+// vpmovsdb saturates i32 to i8 same way as two packs in avx2 version
+ISA_TARGET("avx512f")
+static void ConvertArrayAvx512(i8 *dst, const float *src, yint xSize, float mult)
+{
+    __m512 multVec = _mm512_set1_ps(mult);
+    for (yint x = 0; x < xSize; x += 16) {
+        __m512i a = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_loadu_ps(src + x), multVec));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm512_cvtsepi32_epi8(a));
+    }
+}
+
+ISA_TARGET("avx512f")
+static inline __m512 FastLog2Avx512(__m512 x)
+{
+    const __m512i sqrtHalf = _mm512_set1_epi32(0x3f3504f3);
+    __m512i shifted = _mm512_sub_epi32(_mm512_castps_si512(x), sqrtHalf);
+    __m512 e = _mm512_cvtepi32_ps(_mm512_srai_epi32(shifted, 23));
+    __m512 m = _mm512_castsi512_ps(_mm512_add_epi32(_mm512_and_si512(shifted, _mm512_set1_epi32(0x7fffff)), sqrtHalf));
+    __m512 t = _mm512_sub_ps(m, _mm512_set1_ps(1));
+    __m512 poly = _mm512_set1_ps(LOG2_POLY[0]);
+    for (yint k = 1; k < 7; ++k) {
+        poly = _mm512_add_ps(_mm512_mul_ps(poly, t), _mm512_set1_ps(LOG2_POLY[k]));
+    }
+    return _mm512_add_ps(e, _mm512_mul_ps(poly, t));
+}
+
+ISA_TARGET("avx512f")
+static inline __m512i HashIndexAvx512(__m512i idx, __m512i key)
+{
+    __m512i x = _mm512_xor_si512(_mm512_mullo_epi32(idx, _mm512_set1_epi32(0x9e3779b9)), key);
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x85ebca6b));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 13));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0xc2b2ae35));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    return x;
+}
+
+// sz is multiple of 8, odd 8 floats are masked
+ISA_TARGET("avx512f")
+static void Log2ArrayAvx512(const float *src, yint sz, float *dst, float zeroValue)
+{
+    for (yint i = 0; i < sz; i += 16) {
+        __mmask16 mask = (i + 16 <= sz) ? 0xffff : 0xff;
+        __m512 x = _mm512_maskz_loadu_ps(mask, src + i);
+        __mmask16 isZero = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_LE_OQ);
+        __m512 res = FastLog2Avx512(_mm512_max_ps(x, _mm512_set1_ps(1e-37f)));
+        _mm512_mask_storeu_ps(dst + i, mask, _mm512_mask_blend_ps(isZero, res, _mm512_set1_ps(zeroValue)));
+    }
+}
+
+ISA_TARGET("avx512f")
+static yint GumbelArgMaxAvx512(const float *logit, yint sz, float invTemperature, ui32 key)
+{
+    __m512 invTemp = _mm512_set1_ps(invTemperature);
+    __m512i keyVec = _mm512_set1_epi32(key);
+    __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512 best = _mm512_set1_ps(-INFINITY);
+    __m512i bestIdx = _mm512_setzero_si512();
+    for (yint i = 0; i < sz; i += 16) {
+        // odd 8 lanes get -inf logit and never win
+        __mmask16 mask = (i + 16 <= sz) ? 0xffff : 0xff;
+        __m512 x = _mm512_mask_loadu_ps(_mm512_set1_ps(-INFINITY), mask, logit + i);
+        __m512i h = HashIndexAvx512(idx, keyVec);
+        __m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(h, 8)), _mm512_set1_ps(0.5f)), _mm512_set1_ps(1.f / (1 << 24)));
+        __m512 negLog2u = _mm512_sub_ps(_mm512_setzero_ps(), FastLog2Avx512(u));
+        __m512 score = _mm512_sub_ps(_mm512_mul_ps(x, invTemp), FastLog2Avx512(negLog2u));
+        __mmask16 isBetter = _mm512_cmp_ps_mask(score, best, _CMP_GT_OQ);
+        best = _mm512_mask_blend_ps(isBetter, best, score);
+        bestIdx = _mm512_mask_blend_epi32(isBetter, bestIdx, idx);
+        idx = _mm512_add_epi32(idx, _mm512_set1_epi32(16));
+    }
+    float bestArr[16];
+    int bestIdxArr[16];
+    _mm512_storeu_ps(bestArr, best);
+    _mm512_storeu_si512(bestIdxArr, bestIdx);
+    yint res = 0;
+    for (yint k = 1; k < 16; ++k) {
+        if (bestArr[k] > bestArr[res] || (bestArr[k] == bestArr[res] && bestIdxArr[k] < bestIdxArr[res])) {
+            res = k;
+        }
+    }
+    return bestIdxArr[res];
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// dispatch
+static const TIsaKernels KernelsArr[ISA_COUNT] = {
+    { DotInt8Sse41, DotInt8x4Sse41, Exp2SumSse41, ConvertArraySse41, DotPacked4x4Sse41, DotPacked2x4Sse41,
+        UnpackIndices4Sse41, UnpackIndices2Sse41, AddWeightedRowsInt8Sse41, UnpackArraySse41, AddPackedArraySse41, Log2ArraySse41, GumbelArgMaxSse41 },
+    { DotInt8Avx2, DotInt8x4Avx2, Exp2SumAvx2, ConvertArrayAvx2, DotPacked4x4Avx2, DotPacked2x4Avx2,
+        UnpackIndices4Avx2, UnpackIndices2Avx2, AddWeightedRowsInt8Avx2, UnpackArrayAvx2, AddPackedArrayAvx2, Log2ArrayAvx2, GumbelArgMaxAvx2 },
+    { DotInt8AvxVnni, DotInt8x4AvxVnni, Exp2SumAvx2, ConvertArrayAvx2, DotPacked4x4AvxVnni, DotPacked2x4AvxVnni,
+        UnpackIndices4Avx2, UnpackIndices2Avx2, AddWeightedRowsInt8Avx2, UnpackArrayAvx2, AddPackedArrayAvx2, Log2ArrayAvx2, GumbelArgMaxAvx2 },
+    // unpack and accumulate kernels are memory bound, avx2 versions are used
+    { DotInt8Avx512Vnni, DotInt8x4Avx512Vnni, Exp2SumAvx512, ConvertArrayAvx512, DotPacked4x4Avx512Vnni, DotPacked2x4Avx512Vnni,
+        UnpackIndices4Avx2, UnpackIndices2Avx2, AddWeightedRowsInt8Avx2, UnpackArrayAvx2, AddPackedArrayAvx2, Log2ArrayAvx512, GumbelArgMaxAvx512 },
+};
+
+static const char *IsaNameArr[ISA_COUNT] = { "sse41", "avx2", "avx_vnni", "avx512_vnni" };
+
+// constant initialized, kernels are valid even if called from other static constructors
+TIsaKernels IsaKernels = { DotInt8Sse41, DotInt8x4Sse41, Exp2SumSse41, ConvertArraySse41, DotPacked4x4Sse41, DotPacked2x4Sse41,
+    UnpackIndices4Sse41, UnpackIndices2Sse41, AddWeightedRowsInt8Sse41, UnpackArraySse41, AddPackedArraySse41, Log2ArraySse41, GumbelArgMaxSse41 };
+static ECpuIsa CurrentIsa = ISA_SSE41;
+
+
+static void CpuId(int leaf, int subLeaf, ui32 *res)
+{
+#ifdef _MSC_VER
+    __cpuidex((int *)res, leaf, subLeaf);
+#else
+    __cpuid_count(leaf, subLeaf, res[0], res[1], res[2], res[3]);
+#endif
+}
+
+// os support of register state, valid only if OSXSAVE is set
+static ui64 GetXCR0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    ui32 lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((ui64)hi << 32) | lo;
+#endif
+}
+
+static ui32 GetSupportedIsaMask()
+{
+    ui32 r0[4];
+    ui32 r1[4];
+    ui32 r7[4] = { 0, 0, 0, 0 };
+    ui32 r71[4] = { 0, 0, 0, 0 };
+    CpuId(0, 0, r0);
+    CpuId(1, 0, r1);
+    if (r0[0] >= 7) {
+        CpuId(7, 0, r7);
+        CpuId(7, 1, r71);
+    }
+    bool sse41 = (r1[2] >> 19) & 1;
+    bool osxsave = (r1[2] >> 27) & 1;
+    ui64 xcr0 = osxsave ? GetXCR0() : 0;
+    bool osAvx = (xcr0 & 0x6) == 0x6;
+    bool osAvx512 = (xcr0 & 0xe6) == 0xe6;
+    bool avx = osAvx && ((r1[2] >> 28) & 1);
+    bool fma = (r1[2] >> 12) & 1;
+    bool avx2 = avx && fma && ((r7[1] >> 5) & 1);
+    bool avxVnni = avx2 && ((r71[0] >> 4) & 1);
+    bool avx512f = osAvx512 && ((r7[1] >> 16) & 1);
+    bool avx512bw = (r7[1] >> 30) & 1;
+    bool avx512vl = (r7[1] >> 31) & 1;
+    bool avx512Vnni = avx2 && avx512f && avx512bw && avx512vl && ((r7[2] >> 11) & 1);
+
+    ui32 res = 0;
+    res |= sse41 ? (1 << ISA_SSE41) : 0;
+    res |= avx2 ? (1 << ISA_AVX2) : 0;
+    res |= avxVnni ? (1 << ISA_AVX_VNNI) : 0;
+    res |= avx512Vnni ? (1 << ISA_AVX512_VNNI) : 0;
+    return res;
+}
+
+bool IsCpuIsaSupported(ECpuIsa isa)
+{
+    static ui32 mask = GetSupportedIsaMask();
+    return (mask >> isa) & 1;
+}
+
+ECpuIsa DetectCpuIsa()
+{
+    for (yint isa = ISA_COUNT - 1; isa > ISA_SSE41; --isa) {
+        if (IsCpuIsaSupported((ECpuIsa)isa)) {
+            return (ECpuIsa)isa;
+        }
+    }
+    return ISA_SSE41;
+}
+
+ECpuIsa GetCpuIsa()
+{
+    return CurrentIsa;
+}
+
+bool SetCpuIsa(ECpuIsa isa)
+{
+    if (isa < 0 || isa >= ISA_COUNT || !IsCpuIsaSupported(isa)) {
+        return false;
+    }
+    CurrentIsa = isa;
+    IsaKernels = KernelsArr[isa];
+    return true;
+}
+
+const char *GetCpuIsaName(ECpuIsa isa)
+{
+    Y_VERIFY(isa >= 0 && isa < ISA_COUNT);
+    return IsaNameArr[isa];
+}
+
+bool ParseCpuIsa(const TString &name, ECpuIsa *p)
+{
+    for (yint isa = 0; isa < ISA_COUNT; ++isa) {
+        if (name == IsaNameArr[isa]) {
+            *p = (ECpuIsa)isa;
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct TIsaInit
+{
+    TIsaInit()
+    {
+        SetCpuIsa(DetectCpuIsa());
+    }
+} IsaInit;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// kernels check against scalar reference
+static yint CheckKernels(const TIsaKernels &kernels, const char *isaName)
+{
+    TXRng rng(1313);
+    yint errCount = 0;
+    for (yint sz : { 32, 64, 96, 128, 1024 }) {
+        TVector<i8> a;
+        TVector<i8> b[4];
+        for (yint k = 0; k < sz; ++k) {
+            a.push_back(rng.Uniform(255) - 127);
+            for (yint z = 0; z < 4; ++z) {
+                b[z].push_back(rng.Uniform(255) - 127);
+            }
+        }
+        i32 ref[4];
+        for (yint z = 0; z < 4; ++z) {
+            ref[z] = 0;
+            for (yint k = 0; k < sz; ++k) {
+                ref[z] += a[k] * b[z][k];
+            }
+        }
+        i32 res4[4];
+        kernels.DotInt8x4(a.data(), b[0].data(), b[1].data(), b[2].data(), b[3].data(), sz, res4);
+        for (yint z = 0; z < 4; ++z) {
+            i32 res = kernels.DotInt8(a.data(), b[z].data(), sz);
+            if (res != ref[z] || res4[z] != ref[z]) {
+                DebugPrintf("%s: DotInt8 size %d, result %d / %d, expected %d\n", isaName, (int)sz, res, res4[z], ref[z]);
+                ++errCount;
+            }
+        }
+    }
+    for (yint sz : { 64, 128, 192, 384, 1024 }) {
+        TVector<i8> a;
+        for (yint k = 0; k < sz; ++k) {
+            a.push_back(rng.Uniform(255) - 127);
+        }
+        for (yint bits : { 4, 2 }) {
+            if (bits == 2 && (sz % PACK2_CHUNK) != 0) {
+                continue;
+            }
+            yint levelCount = 1 << bits;
+            TVector<i8> levels;
+            ClearPodArray(&levels, 16);
+            for (yint k = 0; k < levelCount; ++k) {
+                levels[k] = rng.Uniform(255) - 127;
+            }
+            TVector<ui8> idx[4];
+            TVector<ui8> packed[4];
+            i32 ref[4];
+            for (yint z = 0; z < 4; ++z) {
+                ClearPodArray(&packed[z], sz * bits / 8);
+                ref[z] = 0;
+                for (yint k = 0; k < sz; ++k) {
+                    idx[z].push_back(rng.Uniform(levelCount));
+                    ref[z] += a[k] * levels[idx[z][k]];
+                }
+                if (bits == 4) {
+                    PackIndices4(packed[z].data(), idx[z].data(), sz);
+                } else {
+                    PackIndices2(packed[z].data(), idx[z].data(), sz);
+                }
+            }
+            i32 res4[4];
+            auto dotPacked = (bits == 4) ? kernels.DotPacked4x4 : kernels.DotPacked2x4;
+            dotPacked(a.data(), packed[0].data(), packed[1].data(), packed[2].data(), packed[3].data(), levels.data(), sz, res4);
+            for (yint z = 0; z < 4; ++z) {
+                if (res4[z] != ref[z]) {
+                    DebugPrintf("%s: DotPacked%dx4 size %d, result %d, expected %d\n", isaName, (int)bits, (int)sz, res4[z], ref[z]);
+                    ++errCount;
+                }
+            }
+            TVector<i8> unpacked;
+            unpacked.resize(sz);
+            auto unpackIndices = (bits == 4) ? kernels.UnpackIndices4 : kernels.UnpackIndices2;
+            unpackIndices(unpacked.data(), packed[0].data(), levels.data(), sz);
+            for (yint k = 0; k < sz; ++k) {
+                if (unpacked[k] != levels[idx[0][k]]) {
+                    DebugPrintf("%s: UnpackIndices%d value %d, result %d, expected %d\n", isaName, (int)bits, (int)k, (int)unpacked[k], (int)levels[idx[0][k]]);
+                    ++errCount;
+                    break;
+                }
+            }
+        }
+    }
+    for (yint sz : { 8, 24, 1000 }) {
+        TVector<float> data;
+        float maxValue = 0;
+        for (yint k = 0; k < sz; ++k) {
+            data.push_back(rng.GenRandReal3() * 40 - 30);
+            maxValue = Max(maxValue, data.back());
+        }
+        TVector<float> res = data;
+        float sum = kernels.Exp2Sum(res.data(), sz, maxValue);
+        double refSum = 0;
+        for (yint k = 0; k < sz; ++k) {
+            double ref = exp2(Max(data[k] - maxValue, -127.f));
+            refSum += ref;
+            if (fabs(res[k] - ref) > ref * 1e-5) {
+                DebugPrintf("%s: Exp2Sum exp2(%g) = %g, expected %g\n", isaName, data[k] - maxValue, res[k], ref);
+                ++errCount;
+                break;
+            }
+        }
+        if (fabs(sum - refSum) > refSum * 1e-5) {
+            DebugPrintf("%s: Exp2Sum size %d, sum %g, expected %g\n", isaName, (int)sz, sum, refSum);
+            ++errCount;
+        }
+    }
+    for (yint sz : { 32, 96, 512 }) {
+        TVector<float> src;
+        for (yint k = 0; k < sz; ++k) {
+            src.push_back(rng.GenRandReal3() * 4 - 2); // some values are out of i8 range
+        }
+        float mult = 100;
+        TVector<i8> res;
+        res.resize(sz);
+        kernels.ConvertArray(res.data(), src.data(), sz, mult);
+        for (yint k = 0; k < sz; ++k) {
+            i8 ref = ClampVal<int>(_mm_cvtss_si32(_mm_set_ss(src[k] * mult)), -128, 127);
+            if (res[k] != ref) {
+                DebugPrintf("%s: ConvertArray %g, result %d, expected %d\n", isaName, src[k] * mult, (int)res[k], (int)ref);
+                ++errCount;
+                break;
+            }
+        }
+    }
+    for (yint rowCount : { 1, 2, 5 }) {
+        yint rowSize = 48;
+        TVector<i8> weight;
+        TVector<i8> rows;
+        for (yint k = 0; k < rowCount; ++k) {
+            weight.push_back(rng.Uniform(255) - 127);
+        }
+        for (yint k = 0; k < rowCount * rowSize; ++k) {
+            rows.push_back(rng.Uniform(255) - 127);
+        }
+        TVector<i32> acc;
+        TVector<i32> ref;
+        for (yint x = 0; x < rowSize; ++x) {
+            acc.push_back(rng.Uniform(1000) - 500);
+            ref.push_back(acc.back());
+            for (yint r = 0; r < rowCount; ++r) {
+                ref[x] += weight[r] * rows[r * rowSize + x];
+            }
+        }
+        kernels.AddWeightedRowsInt8(weight.data(), rows.data(), rowCount, rowSize, acc.data());
+        for (yint x = 0; x < rowSize; ++x) {
+            if (acc[x] != ref[x]) {
+                DebugPrintf("%s: AddWeightedRowsInt8 %d rows, result %d, expected %d\n", isaName, (int)rowCount, acc[x], ref[x]);
+                ++errCount;
+                break;
+            }
+        }
+    }
+    for (yint sz : { 8, 24, 512 }) {
+        TVector<i8> src;
+        TVector<float> add;
+        for (yint k = 0; k < sz; ++k) {
+            src.push_back(rng.Uniform(255) - 127);
+            add.push_back(rng.GenRandReal3() * 2 - 1);
+        }
+        float mult = 0.01f;
+        TVector<float> res;
+        res.resize(sz);
+        kernels.UnpackArray(res.data(), src.data(), sz, mult);
+        TVector<float> sum = add;
+        kernels.AddPackedArray(sum.data(), src.data(), sz, mult);
+        for (yint k = 0; k < sz; ++k) {
+            float ref = src[k] * mult;
+            if (res[k] != ref || fabs(sum[k] - (add[k] + ref)) > 1e-6f) {
+                DebugPrintf("%s: UnpackArray %d, result %g / %g, expected %g / %g\n", isaName, (int)src[k], res[k], sum[k], ref, add[k] + ref);
+                ++errCount;
+                break;
+            }
+        }
+    }
+    for (yint sz : { 8, 24, 1000 }) {
+        TVector<float> src;
+        for (yint k = 0; k < sz; ++k) {
+            src.push_back((k % 7 == 0) ? 0 : exp2(rng.GenRandReal3() * 60 - 50));
+        }
+        TVector<float> res;
+        res.resize(sz);
+        kernels.Log2Array(src.data(), sz, res.data(), -1e30f);
+        for (yint k = 0; k < sz; ++k) {
+            double ref = (src[k] == 0) ? -1e30 : log2(src[k]);
+            if (fabs(res[k] - ref) > 1e-5 * Max(1., fabs(ref))) {
+                DebugPrintf("%s: Log2Array log2(%g) = %g, expected %g\n", isaName, src[k], res[k], ref);
+                ++errCount;
+                break;
+            }
+        }
+        // returned token has best score up to log2 approximation error
+        TVector<float> logit;
+        for (yint k = 0; k < sz; ++k) {
+            logit.push_back(rng.GenRandReal3() * 4);
+        }
+        for (yint iter = 0; iter < 10; ++iter) {
+            ui32 key = rng.GenRand();
+            yint best = kernels.GumbelArgMax(logit.data(), sz, 0.5f, key);
+            auto calcScore = [&](yint k) {
+                ui32 x = (ui32(k) * 0x9e3779b9u) ^ key;
+                x ^= x >> 16;
+                x *= 0x85ebca6bu;
+                x ^= x >> 13;
+                x *= 0xc2b2ae35u;
+                x ^= x >> 16;
+                double u = ((x >> 8) + 0.5) / (1 << 24);
+                return logit[k] * 0.5 - log2(-log2(u));
+            };
+            double bestScore = -1e30;
+            for (yint k = 0; k < sz; ++k) {
+                bestScore = Max(bestScore, calcScore(k));
+            }
+            if (best < 0 || best >= sz || calcScore(best) < bestScore - 1e-4) {
+                DebugPrintf("%s: GumbelArgMax size %d, result %d, score %g, expected %g\n", isaName, (int)sz, (int)best,
+                    (best >= 0 && best < sz) ? calcScore(best) : 0., bestScore);
+                ++errCount;
+                break;
+            }
+        }
+    }
+    return errCount;
+}
+
+yint CheckIsaKernels()
+{
+    yint errCount = 0;
+    for (yint isa = 0; isa < ISA_COUNT; ++isa) {
+        if (IsCpuIsaSupported((ECpuIsa)isa)) {
+            errCount += CheckKernels(KernelsArr[isa], IsaNameArr[isa]);
+        } else {
+            DebugPrintf("%s: not supported by cpu, skipped\n", IsaNameArr[isa]);
+        }
+    }
+    return errCount;
+}
@@ -3,56 +3,89 @@
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-// https://stackoverflow.com/questions/51778721/how-to-convert-32-bit-float-to-8-bit-signed-char-41-packing-of-int32-to-int8
-inline __m256i PackFloatToInt8(const __m256 *src, __m256 mult)
+// runtime isa dispatch
+// int8 and packed weights dot products, softmax exp2 and float to i8 conversion are picked once at startup by cpuid
+// build baseline is x86-64-v3 (avx2, fma, f16c), avx-vnni and avx512 are used by these kernels only
+enum ECpuIsa
 {
-    // _mm256_loadu_ps() not needed, we expect aligned addresses
-    __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(src[0], mult));
-    __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(src[1], mult));
-    __m256i c = _mm256_cvtps_epi32(_mm256_mul_ps(src[2], mult));
-    __m256i d = _mm256_cvtps_epi32(_mm256_mul_ps(src[3], mult));
-    __m256i ab = _mm256_packs_epi32(a, b);        // 16x int16_t
-    __m256i cd = _mm256_packs_epi32(c, d);
-    __m256i abcd = _mm256_packs_epi16(ab, cd);   // 32x int8_t
-    // packed to one vector, but in [ a_lo, b_lo, c_lo, d_lo | a_hi, b_hi, c_hi, d_hi ] order
-    // if you can deal with that in-memory format (e.g. for later in-lane unpack), great, you're done
+    ISA_SSE41,
+    ISA_AVX2,
+    ISA_AVX_VNNI,
+    ISA_AVX512_VNNI,
+    ISA_COUNT,
+};
 
-    // but if you need sequential order, then vpermd:
-    __m256i lanefix = _mm256_permutevar8x32_epi32(abcd, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
-    return lanefix;
-}
+struct TIsaKernels
+{
+    i32 (*DotInt8)(const i8 *aData, const i8 *bData, yint sz);
+    void (*DotInt8x4)(const i8 *aData, const i8 *b0, const i8 *b1, const i8 *b2, const i8 *b3, yint sz, i32 *res);
+    float (*Exp2Sum)(float *data, yint sz, float maxValue); // data[i] = exp2(data[i] - maxValue), returns sum
+    void (*ConvertArray)(i8 *dst, const float *src, yint xSize, float mult);
+    // rows of packed indices to levels table, see PackIndices4() and PackIndices2()
+    void (*DotPacked4x4)(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res);
+    void (*DotPacked2x4)(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res);
+    void (*UnpackIndices4)(i8 *dst, const ui8 *src, const i8 *levels, yint sz);
+    void (*UnpackIndices2)(i8 *dst, const ui8 *src, const i8 *levels, yint sz);
+    void (*AddWeightedRowsInt8)(const i8 *weight, const i8 *rows, yint rowCount, yint rowSize, i32 *acc);
+    void (*UnpackArray)(float *dst, const i8 *src, yint xSize, float mult);
+    void (*AddPackedArray)(float *dst, const i8 *src, yint xSize, float mult);
+    // sampling, see gpt/infer/sample_model.cpp, sz is multiple of 8
+    void (*Log2Array)(const float *src, yint sz, float *dst, float zeroValue); // dst[i] = log2(src[i]), zeroValue if src[i] <= 0
+    yint (*GumbelArgMax)(const float *logit, yint sz, float invTemperature, ui32 key); // argmax of logit * invTemperature + gumbel noise
+};
 
-inline void ConvertArray(i8 *dst, const float *src, yint xSize, __m256 mult)
+extern TIsaKernels IsaKernels;
+
+ECpuIsa DetectCpuIsa();
+ECpuIsa GetCpuIsa();
+bool IsCpuIsaSupported(ECpuIsa isa);
+// override detected isa, returns false if cpu does not support it
+bool SetCpuIsa(ECpuIsa isa);
+const char *GetCpuIsaName(ECpuIsa isa);
+bool ParseCpuIsa(const TString &name, ECpuIsa *p);
+// compare kernels of all supported isa with scalar reference, returns number of failed checks
+yint CheckIsaKernels();
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// xSize is multiple of 32
+inline void ConvertArray(i8 *dst, const float *src, yint xSize, float mult)
 {
-    for (yint x = 0; x < xSize; x += 32) {
-        *(__m256i *)(dst + x) = PackFloatToInt8((const __m256 *)(src + x), mult);
-    }
+    IsaKernels.ConvertArray(dst, src, xSize, mult);
 }
 
-
-inline void UnpackArray(float *dst, const i8 *src, yint xSize, __m256 mult)
+// xSize is multiple of 8
+inline void UnpackArray(float *dst, const i8 *src, yint xSize, float mult)
 {
-    for (yint x = 0; x < xSize; x += 8) {
-        __m128i src8 = _mm_cvtsi64_si128(*(const i64*)(src + x));
-        __m256i src32 = _mm256_cvtepi8_epi32(src8);
-        __m256 srcVal = _mm256_cvtepi32_ps(src32);
-        *(__m256 *)(dst + x) = _mm256_mul_ps(srcVal, mult);
-    }
+    IsaKernels.UnpackArray(dst, src, xSize, mult);
 }
 
-inline void AddPackedArray(float *dst, const i8 *src, yint xSize, __m256 mult)
+inline void AddPackedArray(float *dst, const i8 *src, yint xSize, float mult)
 {
-    for (yint x = 0; x < xSize; x += 8) {
-        __m128i src8 = _mm_cvtsi64_si128(*(const i64 *)(src + x));
-        __m256i src32 = _mm256_cvtepi8_epi32(src8);
-        __m256 srcVal = _mm256_cvtepi32_ps(src32);
-        __m256 *dstPtr = (__m256 *)(dst + x);
-        *dstPtr = _mm256_add_ps(*dstPtr, _mm256_mul_ps(srcVal, mult));
-    }
+    IsaKernels.AddPackedArray(dst, src, xSize, mult);
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
+// training helpers, inlined into avx2 loops of training code, need build baseline isa
+
+// mult is broadcast value, direct call on training hot paths
+// https://stackoverflow.com/questions/51778721/how-to-convert-32-bit-float-to-8-bit-signed-char-41-packing-of-int32-to-int8
+inline void ConvertArray(i8 *dst, const float *src, yint xSize, __m256 mult)
+{
+    for (yint x = 0; x < xSize; x += 32) {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x), mult));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x + 8), mult));
+        __m256i c = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x + 16), mult));
+        __m256i d = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + x + 24), mult));
+        __m256i ab = _mm256_packs_epi32(a, b); // 16x int16_t
+        __m256i cd = _mm256_packs_epi32(c, d);
+        __m256i abcd = _mm256_packs_epi16(ab, cd); // 32x int8_t in [ a_lo, b_lo, c_lo, d_lo | a_hi, b_hi, c_hi, d_hi ] order
+        __m256i lanefix = _mm256_permutevar8x32_epi32(abcd, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)(dst + x), lanefix);
+    }
+}
+
 // x = ( x7, x6, x5, x4, x3, x2, x1, x0 )
 inline float HorizontalSum(__m256 x)
 {
@@ -97,3 +130,123 @@ static float CalcMatrixSum2(const TMatrix &matr)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// int8 dot product, sz is multiple of 32
+inline i32 DotInt8(const i8 *aData, const i8 *bData, yint sz)
+{
+    return IsaKernels.DotInt8(aData, bData, sz);
+}
+
+// 4 dot products of one vector, vector is loaded once for 4 matrix rows
+inline void DotInt8x4(const i8 *aData, const i8 *b0, const i8 *b1, const i8 *b2, const i8 *b3, yint sz, i32 *res)
+{
+    IsaKernels.DotInt8x4(aData, b0, b1, b2, b3, sz, res);
+}
+
+// acc[x] += sum_r weight[r] * rows[r * rowSize + x], rowSize is multiple of 16
+inline void AddWeightedRowsInt8(const i8 *weight, const i8 *rows, yint rowCount, yint rowSize, i32 *acc)
+{
+    IsaKernels.AddWeightedRowsInt8(weight, rows, rowCount, rowSize, acc);
+}
+
+inline i32 DotInt8(const TVector<i8> &a, const TVector<i8> &b)
+{
+    yint sz = YSize(a);
+    Y_ASSERT(sz == YSize(b));
+    return DotInt8(a.data(), b.data(), sz);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// packed weights, value is levels[index], levels table has 16 entries in [-127, 127]
+// 4 bit: chunk of 64 values takes 32 bytes, byte j has index of value j in low nibble and index of value j + 32 in high nibble
+// 2 bit: chunk of 128 values takes 32 bytes, byte j has indices of values j, j + 32, j + 64, j + 96 from low bits to high
+// shift and mask of 32 bytes give 32 consecutive indices, they are looked up with pshufb and multiplied like int8
+const yint PACK4_CHUNK = 64;
+const yint PACK2_CHUNK = 128;
+
+// sz is multiple of PACK4_CHUNK, dst gets sz / 2 bytes
+inline void PackIndices4(ui8 *dst, const ui8 *idx, yint sz)
+{
+    for (yint i = 0; i < sz; i += PACK4_CHUNK) {
+        for (yint j = 0; j < 32; ++j) {
+            Y_ASSERT(idx[i + j] < 16 && idx[i + j + 32] < 16);
+            *dst++ = idx[i + j] | (idx[i + j + 32] << 4);
+        }
+    }
+}
+
+// sz is multiple of PACK2_CHUNK, dst gets sz / 4 bytes
+inline void PackIndices2(ui8 *dst, const ui8 *idx, yint sz)
+{
+    for (yint i = 0; i < sz; i += PACK2_CHUNK) {
+        for (yint j = 0; j < 32; ++j) {
+            ui8 x = 0;
+            for (yint z = 0; z < 4; ++z) {
+                Y_ASSERT(idx[i + j + z * 32] < 4);
+                x |= idx[i + j + z * 32] << (z * 2);
+            }
+            *dst++ = x;
+        }
+    }
+}
+
+// dst gets sz values of packed row
+inline void UnpackIndices4(i8 *dst, const ui8 *src, const i8 *levels, yint sz)
+{
+    IsaKernels.UnpackIndices4(dst, src, levels, sz);
+}
+
+inline void UnpackIndices2(i8 *dst, const ui8 *src, const i8 *levels, yint sz)
+{
+    IsaKernels.UnpackIndices2(dst, src, levels, sz);
+}
+
+// 4 dot products with packed rows, sz is multiple of PACK4_CHUNK
+inline void DotPacked4x4(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    IsaKernels.DotPacked4x4(aData, b0, b1, b2, b3, levels, sz, res);
+}
+
+// sz is multiple of PACK2_CHUNK
+inline void DotPacked2x4(const i8 *aData, const ui8 *b0, const ui8 *b1, const ui8 *b2, const ui8 *b3, const i8 *levels, yint sz, i32 *res)
+{
+    IsaKernels.DotPacked2x4(aData, b0, b1, b2, b3, levels, sz, res);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// softmax with exp2
+struct TSoftMaxBuf
+{
+    TVector<float> Buf;
+    yint Ptr = 0;
+    float MaxValue = 0;
+    float Scale = 0;
+
+    TSoftMaxBuf()
+    {
+        Buf.resize(8, -1e38f);
+    }
+
+    void Clear()
+    {
+        Ptr = 0;
+        MaxValue = 0;
+    }
+
+    void Add(float x)
+    {
+        if (Ptr == YSize(Buf)) {
+            Buf.resize(YSize(Buf) * 2, -1e38f);
+        }
+        Buf[Ptr++] = x;
+        MaxValue = Max<float>(MaxValue, x);
+    }
+
+    void SoftMax()
+    {
+        yint sz = (Ptr + 7) / 8 * 8;
+        Scale = 1 / IsaKernels.Exp2Sum(Buf.data(), sz, MaxValue);
+    }
+};
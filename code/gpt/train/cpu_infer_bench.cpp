@@ -0,0 +1,588 @@
+#include "stdafx.h"
+#include "cpu_infer_bench.h"
+#include <gpt/cpu_infer/cpu_infer.h>
+#include <gpt/cpu_infer/prefix_cache.h>
+#include <gpt/data/data.h>
+#include <gpt/model_params/sse_utils.h>
+#include <gpt/compute/model.h>
+#include <gpt/compute/gpt_cpu.h>
+#include <gpt/compute/gpt_cuda.cuh>
+#include <gpt/att/sliding_window.h>
+#include <lib/hp_timer/hp_timer.h>
+#include <lib/math/matrix_utils.h>
+#ifndef _MSC_VER
+#include <sys/resource.h>
+#endif
+
+
+namespace NCPUInfer
+{
+static double GetPeakRSS()
+{
+#ifdef _MSC_VER
+    return 0; // not reported
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024.;
+#endif
+}
+
+// compare predictions with reference cpu implementation of the training graph
+// cpu inference quantizes activations and attention weights, so predictions are close but not equal
+const double ACCURACY_MAX_LOSS_DIFF = 0.05; // per token
+const double ACCURACY_MAX_PROB_DIFF = 0.1;
+// log2 scale, int8 value lookup gives up to 0.82 on 30 layer models, worst case is on tiny probabilities
+const double ACCURACY_MAX_LOGIT_DIFF = 1;
+
+static void CheckAccuracy(const TModelParams &params, const TCPUModelParams &cpuParams, const TVector<TBPEToken> &text)
+{
+    yint len = YSize(text);
+    Y_VERIFY(len > 0);
+    TIntrusivePtr<IModel> refModel = CreateModel(1, params);
+    TIntrusivePtr<IComputeContext> refCtx = NCPU_GPT::CreateContext(refModel, GetNodeCount(len));
+    TFragment frag;
+    frag.Text = text;
+    TVector<TFragment> xxFrag;
+    xxFrag.push_back(frag);
+    MakeTest(xxFrag, refCtx.Get(), MAIN_DEVICE);
+    TVector<TVector<float>> refPredArr;
+    refCtx->ComputeFragmentPredictions(&refPredArr);
+    Y_VERIFY(YSize(refPredArr) == len + 1);
+
+    TCPUInferContext cpuCtx;
+    cpuCtx.Init(cpuParams);
+    double maxDiff = 0;
+    double maxLogitDiff = 0;
+    double refLoss = 0;
+    double cpuLoss = 0;
+    for (yint t = 0; t < len; ++t) {
+        TVector<TLabelIndex> labelArr;
+        labelArr.push_back(t == 0 ? 0 : text[t - 1] + 1 + 1);
+        TVector<float> cpuDistr;
+        ComputePrediction(cpuParams, labelArr, &cpuCtx, &cpuDistr);
+        const TVector<float> &refDistr = refPredArr[t];
+        for (yint k = 0; k < YSize(cpuDistr); ++k) {
+            maxDiff = Max<double>(maxDiff, fabs(cpuDistr[k] - refDistr[k]));
+            // softmax logits are log2 scale
+            maxLogitDiff = Max<double>(maxLogitDiff, fabs(log2(cpuDistr[k]) - log2(refDistr[k])));
+        }
+        cpuLoss -= log(cpuDistr[text[t]]);
+        refLoss -= log(refDistr[text[t]]);
+    }
+    DebugPrintf("accuracy check on %g tokens: cpu infer loss %g, reference loss %g, max prob diff %g, max logit diff %g\n",
+        len * 1., cpuLoss / len, refLoss / len, maxDiff, maxLogitDiff);
+    Y_VERIFY(fabs(cpuLoss - refLoss) / len < ACCURACY_MAX_LOSS_DIFF && maxDiff < ACCURACY_MAX_PROB_DIFF && maxLogitDiff < ACCURACY_MAX_LOGIT_DIFF && "cpu inference predictions differ from reference");
+}
+
+
+static bool IsEqual(const TVector<float> &a, const TVector<float> &b)
+{
+    return YSize(a) == YSize(b) && (a.empty() || memcmp(a.data(), b.data(), YSize(a) * sizeof(float)) == 0);
+}
+
+static bool IsEqual(const TCPUInferContext &a, const TCPUInferContext &b)
+{
+    for (yint d = 0; d < YSize(a.KVcacheArr); ++d) {
+        for (yint z = 0; z < YSize(a.KVcacheArr[d]); ++z) {
+            const TAttentionVecHistory &ha = a.KVcacheArr[d][z];
+            const TAttentionVecHistory &hb = b.KVcacheArr[d][z];
+            if (ha.QVState != hb.QVState || ha.VState != hb.VState || !IsEqual(ha.QVStateScale, hb.QVStateScale)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// batched prefill must produce exactly the same kv cache and prediction as token by token feeding
+// prompt is prefilled in two parts to cover appending to non empty context
+static void CheckPrefill(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr)
+{
+    yint len = YSize(labelsArr);
+    TCPUInferContext seqCtx;
+    seqCtx.Init(params);
+    TVector<float> seqDistr;
+    for (yint t = 0; t < len; ++t) {
+        ComputePrediction(params, labelsArr[t], &seqCtx, (t == len - 1) ? &seqDistr : nullptr);
+    }
+
+    yint split = len / 2;
+    TVector<TVector<TLabelIndex>> head(labelsArr.begin(), labelsArr.begin() + split);
+    TVector<TVector<TLabelIndex>> tail(labelsArr.begin() + split, labelsArr.end());
+    TCPUInferContext batchCtx;
+    batchCtx.Init(params);
+    TVector<float> batchDistr;
+    ComputePrefill(pool, params, head, &batchCtx, nullptr);
+    ComputePrefill(pool, params, tail, &batchCtx, &batchDistr);
+
+    bool ok = IsEqual(seqCtx, batchCtx) && IsEqual(seqDistr, batchDistr);
+    DebugPrintf("prefill check on %g positions: %s\n", len * 1., ok ? "ok" : "MISMATCH");
+    Y_VERIFY(ok && "batched prefill differs from token by token feeding");
+}
+
+
+// batched decoding of several contexts must give the same kv cache and predictions as decoding them one by one
+// contexts have different lengths, one of them starts from empty context
+static void CheckDecodeBatch(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr)
+{
+    const yint STEP_COUNT = 3;
+    yint len = YSize(labelsArr);
+    TVector<yint> prefixLenArr;
+    prefixLenArr.push_back(0);
+    prefixLenArr.push_back(1);
+    prefixLenArr.push_back(len / 4);
+    prefixLenArr.push_back(len / 2);
+    prefixLenArr.push_back(len - STEP_COUNT);
+    yint count = YSize(prefixLenArr);
+    TVector<TCPUInferContext> seqCtx(count);
+    TVector<TCPUInferContext> batchCtx(count);
+    TVector<TCPUInferContext *> batchCtxPtr;
+    for (yint k = 0; k < count; ++k) {
+        TVector<TVector<TLabelIndex>> prefix(labelsArr.begin(), labelsArr.begin() + prefixLenArr[k]);
+        seqCtx[k].Init(params);
+        ComputePrefill(pool, params, prefix, &seqCtx[k], nullptr);
+        batchCtx[k].Init(params);
+        ComputePrefill(pool, params, prefix, &batchCtx[k], nullptr);
+        batchCtxPtr.push_back(&batchCtx[k]);
+    }
+    bool ok = true;
+    for (yint step = 0; step < STEP_COUNT; ++step) {
+        TVector<TVector<TLabelIndex>> stepLabels(count);
+        TVector<TVector<float>> seqDistr(count);
+        for (yint k = 0; k < count; ++k) {
+            stepLabels[k] = labelsArr[prefixLenArr[k] + step];
+            ComputePrediction(params, stepLabels[k], &seqCtx[k], &seqDistr[k]);
+        }
+        TVector<TVector<float>> stateArr;
+        ComputeDecodeBatch(pool, params, stepLabels, batchCtxPtr, &stateArr);
+        TVector<TVector<float>> batchDistr;
+        ComputeFinalPredictionBatch(pool, params, stateArr, &batchDistr);
+        for (yint k = 0; k < count; ++k) {
+            ok = ok && IsEqual(seqCtx[k], batchCtx[k]) && IsEqual(seqDistr[k], batchDistr[k]);
+        }
+    }
+    DebugPrintf("decode batch check on %g contexts, %g steps: %s\n", count * 1., STEP_COUNT * 1., ok ? "ok" : "MISMATCH");
+    Y_VERIFY(ok && "batched decoding differs from one by one decoding");
+}
+
+
+// speculative verification, several positions of one context in decode batch next to other context
+// predictions must match one by one decoding, after truncation of rejected positions kv cache must match too
+static void CheckSpeculativeVerify(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr)
+{
+    const yint DRAFT_LEN = 4;
+    const yint ACCEPT_LEN = 2;
+    yint len = YSize(labelsArr);
+    yint prefixLen = len - DRAFT_LEN - 1;
+    Y_VERIFY(prefixLen > 0);
+    TVector<TVector<TLabelIndex>> prefix(labelsArr.begin(), labelsArr.begin() + prefixLen);
+    TCPUInferContext seqCtx;
+    seqCtx.Init(params);
+    ComputePrefill(pool, params, prefix, &seqCtx, nullptr);
+    TCPUInferContext specCtx;
+    specCtx.Init(params);
+    ComputePrefill(pool, params, prefix, &specCtx, nullptr);
+    TCPUInferContext otherCtx;
+    otherCtx.Init(params);
+    ComputePrefill(pool, params, prefix, &otherCtx, nullptr);
+
+    TVector<TVector<TLabelIndex>> stepLabels;
+    TVector<TCPUInferContext *> ctxPtr;
+    stepLabels.push_back(labelsArr[0]);
+    ctxPtr.push_back(&otherCtx);
+    for (yint t = 0; t <= DRAFT_LEN; ++t) {
+        stepLabels.push_back(labelsArr[prefixLen + t]);
+        ctxPtr.push_back(&specCtx);
+    }
+    TVector<TVector<float>> stateArr;
+    ComputeDecodeBatch(pool, params, stepLabels, ctxPtr, &stateArr);
+    TVector<TVector<float>> specDistr;
+    ComputeFinalPredictionBatch(pool, params, stateArr, &specDistr);
+    bool ok = true;
+    for (yint t = 0; t <= DRAFT_LEN; ++t) {
+        TVector<float> distr;
+        ComputePrediction(params, labelsArr[prefixLen + t], &seqCtx, &distr);
+        ok = ok && IsEqual(distr, specDistr[1 + t]);
+    }
+    // keep accepted positions and the one after them
+    specCtx.Truncate(prefixLen + ACCEPT_LEN + 1);
+    seqCtx.Truncate(prefixLen + ACCEPT_LEN + 1);
+    ok = ok && IsEqual(seqCtx, specCtx);
+    DebugPrintf("speculative verify check, %g draft positions: %s\n", DRAFT_LEN * 1., ok ? "ok" : "MISMATCH");
+    Y_VERIFY(ok && "speculative verification differs from one by one decoding");
+}
+
+
+// context forked from cached prefix and completed with prefill must match context prefilled from scratch
+// prompt diverging in the middle of a block gets prefix of complete matching blocks
+// blocks of different models do not match
+// blocks are evicted in lru order down to memory budget, forked contexts keep their copies of evicted blocks
+static void CheckPrefixCache(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr)
+{
+    const yint BLOCK_LEN = 16;
+    yint len = YSize(labelsArr);
+    TCPUInferContext refCtx;
+    refCtx.Init(params);
+    TVector<float> refDistr;
+    ComputePrefill(pool, params, labelsArr, &refCtx, &refDistr);
+
+    TPrefixCache cache(BLOCK_LEN, 1ll << 40);
+    yint modelKey = cache.AddModel();
+    cache.Add(modelKey, labelsArr, len, refCtx);
+    TCPUInferContext ctx;
+    ctx.Init(params);
+    yint forkLen = cache.Fork(modelKey, labelsArr, len - 1, &ctx);
+    TVector<TVector<TLabelIndex>> rest(labelsArr.begin() + forkLen, labelsArr.end());
+    TVector<float> distr;
+    ComputePrefill(pool, params, rest, &ctx, &distr);
+    bool ok = (forkLen == (len - 1) / BLOCK_LEN * BLOCK_LEN) && IsEqual(refCtx, ctx) && IsEqual(refDistr, distr);
+
+    // diverged prompt
+    yint divergePos = BLOCK_LEN * 2 + BLOCK_LEN / 2;
+    Y_VERIFY(divergePos < len);
+    TVector<TVector<TLabelIndex>> otherLabels = labelsArr;
+    otherLabels[divergePos][0] ^= 1;
+    TCPUInferContext otherCtx;
+    otherCtx.Init(params);
+    ok = ok && cache.Fork(modelKey, otherLabels, len, &otherCtx) == BLOCK_LEN * 2;
+
+    // blocks of other model are not used, removed model blocks are dropped
+    yint otherModelKey = cache.AddModel();
+    TCPUInferContext otherModelCtx;
+    otherModelCtx.Init(params);
+    ok = ok && cache.Fork(otherModelKey, labelsArr, len, &otherModelCtx) == 0;
+    yint blockCount = cache.GetBlockCount();
+    cache.Add(otherModelKey, labelsArr, len, refCtx);
+    ok = ok && cache.GetBlockCount() == blockCount * 2;
+    cache.RemoveModel(otherModelKey);
+    ok = ok && cache.GetBlockCount() == blockCount;
+
+    // budget for 3 blocks
+    yint blockBytes = cache.GetBytes() / cache.GetBlockCount();
+    TPrefixCache smallCache(BLOCK_LEN, blockBytes * 3);
+    yint smallKey = smallCache.AddModel();
+    smallCache.Add(smallKey, labelsArr, len, refCtx);
+    ok = ok && smallCache.GetBlockCount() == 3;
+    TCPUInferContext smallCtx;
+    smallCtx.Init(params);
+    yint smallForkLen = smallCache.Fork(smallKey, labelsArr, len, &smallCtx);
+    ok = ok && smallForkLen == BLOCK_LEN * 3;
+    TCPUInferContext otherRefCtx;
+    otherRefCtx.Init(params);
+    ComputePrefill(pool, params, otherLabels, &otherRefCtx, nullptr);
+    auto forkLength = [&](const TVector<TVector<TLabelIndex>> &prompt) {
+        TCPUInferContext tmpCtx;
+        tmpCtx.Init(params);
+        return smallCache.Fork(smallKey, prompt, len, &tmpCtx);
+    };
+    // third block of the first prompt is least recently used, it is replaced by third block of diverged prompt
+    smallCache.Add(smallKey, otherLabels, len, otherRefCtx);
+    ok = ok && smallCache.GetBytes() <= blockBytes * 3 && forkLength(otherLabels) == BLOCK_LEN * 3 && forkLength(labelsArr) == BLOCK_LEN * 2;
+    // context forked before eviction is not affected
+    TVector<TVector<TLabelIndex>> smallRest(labelsArr.begin() + smallForkLen, labelsArr.end());
+    ComputePrefill(pool, params, smallRest, &smallCtx, nullptr);
+    ok = ok && IsEqual(refCtx, smallCtx);
+    DebugPrintf("prefix cache check, %g of %g positions forked: %s\n", forkLen * 1., len * 1., ok ? "ok" : "MISMATCH");
+    Y_VERIFY(ok && "prefix cache fork differs from prefill");
+}
+
+
+// time of decode step with draftLen extra positions of single context relative to plain decode step
+static double MeasureVerifyCost(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &prompt, yint draftLen, yint stepCount)
+{
+    TXRng rng(1313);
+    yint vocabSize = YSize(params.Bias);
+    TCPUInferContext ctx;
+    ctx.Init(params);
+    ComputePrefill(pool, params, prompt, &ctx, nullptr);
+    yint baseLen = ctx.GetLength();
+    double timeArr[2] = { 0, 0 };
+    for (yint step = 0; step < stepCount; ++step) {
+        for (yint k = 0; k < 2; ++k) {
+            yint posCount = (k == 0) ? 1 : draftLen + 1;
+            TVector<TVector<TLabelIndex>> labelsArr(posCount);
+            TVector<TCPUInferContext *> ctxPtr(posCount, &ctx);
+            for (TVector<TLabelIndex> &labels : labelsArr) {
+                labels.push_back(rng.Uniform(vocabSize) + 1 + 1);
+            }
+            NHPTimer::STime tStart;
+            NHPTimer::GetTime(&tStart);
+            TVector<TVector<float>> stateArr;
+            ComputeDecodeBatch(pool, params, labelsArr, ctxPtr, &stateArr);
+            TVector<TVector<float>> predArr;
+            ComputeFinalPredictionBatch(pool, params, stateArr, &predArr);
+            timeArr[k] += NHPTimer::GetTimePassed(&tStart);
+            ctx.Truncate(baseLen);
+        }
+    }
+    return timeArr[1] / timeArr[0];
+}
+
+
+// decode tokens/sec of batchSize contexts of promptLen tokens decoded together
+static double MeasureDecodeBatch(TThreadPool *pool, const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &prompt, yint batchSize, yint stepCount)
+{
+    TXRng rng(1313);
+    yint vocabSize = YSize(params.Bias);
+    TVector<TCPUInferContext> ctxArr(batchSize);
+    TVector<TCPUInferContext *> ctxPtr;
+    for (TCPUInferContext &ctx : ctxArr) {
+        ctx.Init(params);
+        ComputePrefill(pool, params, prompt, &ctx, nullptr);
+        ctxPtr.push_back(&ctx);
+    }
+    TVector<TVector<TLabelIndex>> labelsArr(batchSize);
+    NHPTimer::STime tStart;
+    NHPTimer::GetTime(&tStart);
+    for (yint step = 0; step < stepCount; ++step) {
+        for (TVector<TLabelIndex> &labels : labelsArr) {
+            labels.resize(0);
+            labels.push_back(rng.Uniform(vocabSize) + 1 + 1);
+        }
+        TVector<TVector<float>> stateArr;
+        ComputeDecodeBatch(pool, params, labelsArr, ctxPtr, &stateArr);
+        TVector<TVector<float>> predArr;
+        ComputeFinalPredictionBatch(pool, params, stateArr, &predArr);
+    }
+    return batchSize * stepCount / NHPTimer::GetTimePassed(&tStart);
+}
+
+
+static double MeasureDecodeLatency(const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &prompt, yint stepCount)
+{
+    TXRng rng(1313);
+    yint vocabSize = YSize(params.Bias);
+    TCPUInferContext ctx;
+    ctx.Init(params);
+    TVector<float> distr;
+    for (const TVector<TLabelIndex> &labels : prompt) {
+        ComputePrediction(params, labels, &ctx, nullptr);
+    }
+    NHPTimer::STime tStart;
+    NHPTimer::GetTime(&tStart);
+    for (yint step = 0; step < stepCount; ++step) {
+        TVector<TLabelIndex> labels;
+        labels.push_back(rng.Uniform(vocabSize) + 1 + 1);
+        ComputePrediction(params, labels, &ctx, &distr);
+    }
+    return NHPTimer::GetTimePassed(&tStart) / stepCount;
+}
+
+
+static TString GetWeightFormatString(const TCPUModelParams &params)
+{
+    TVector<yint> countArr;
+    ClearPodArray(&countArr, 3);
+    for (const TVector<TCPUModelParams::TAttentionMatrices> &layer : params.LayerArr) {
+        for (const TCPUModelParams::TAttentionMatrices &att : layer) {
+            countArr[att.QK.Format] += 1;
+            countArr[att.QV.Format] += 1;
+            countArr[att.K.Format] += 1;
+            countArr[att.V.Format] += 1;
+            countArr[att.Combiner.Format] += 1;
+        }
+    }
+    return Sprintf("%g int8, %g pack4, %g pack2 matrices", countArr[WF_INT8] * 1., countArr[WF_PACK4] * 1., countArr[WF_PACK2] * 1.);
+}
+
+
+// model with simulated quantization flag is converted with packed and with int8 weights
+// weights are the same values so kv cache and predictions must be bit exact, prefill and token by token feeding are compared
+static void BenchmarkPackedWeights(TThreadPool *pool, const TModelParams &params, const TVector<TVector<TLabelIndex>> &prompt, yint stepCount)
+{
+    const char *nameArr[] = { "4 bit", "2 bit", "1.58 bit" };
+    const ui64 flagArr[] = { MPF_SIM_QUANT_4BIT, MPF_SIM_QUANT_2BIT, MPF_SIM_QUANT_158BIT };
+    for (yint k = 0; k < 3; ++k) {
+        TModelParams quantParams = params;
+        quantParams.ModelDim.Flags &= ~(MPF_SIM_QUANT_2BIT | MPF_SIM_QUANT_4BIT | MPF_SIM_QUANT_158BIT);
+        quantParams.ModelDim.Flags |= flagArr[k];
+        TCPUModelParams packed;
+        ConvertModel(quantParams, &packed, true);
+        TCPUModelParams unpacked;
+        ConvertModel(quantParams, &unpacked, false);
+
+        yint split = YSize(prompt) / 2;
+        TVector<TVector<TLabelIndex>> head(prompt.begin(), prompt.begin() + split);
+        TCPUInferContext packedCtx;
+        packedCtx.Init(packed);
+        TCPUInferContext unpackedCtx;
+        unpackedCtx.Init(unpacked);
+        ComputePrefill(pool, packed, head, &packedCtx, nullptr);
+        ComputePrefill(pool, unpacked, head, &unpackedCtx, nullptr);
+        TVector<float> packedDistr;
+        TVector<float> unpackedDistr;
+        for (yint t = split; t < YSize(prompt); ++t) {
+            ComputePrediction(packed, prompt[t], &packedCtx, &packedDistr);
+            ComputePrediction(unpacked, prompt[t], &unpackedCtx, &unpackedDistr);
+        }
+        bool ok = IsEqual(packedCtx, unpackedCtx) && IsEqual(packedDistr, unpackedDistr);
+
+        DebugPrintf("sim quant %s, %s, model %g mb (int8 %g mb), exact check %s\n", nameArr[k], GetWeightFormatString(packed).c_str(),
+            CalcModelBytes(packed) / 1e6, CalcModelBytes(unpacked) / 1e6, ok ? "ok" : "MISMATCH");
+        DebugPrintf("  decode latency %g ms (int8 %g ms), decode batch 16 %g tokens/sec (int8 %g tokens/sec)\n",
+            MeasureDecodeLatency(packed, prompt, stepCount) * 1000, MeasureDecodeLatency(unpacked, prompt, stepCount) * 1000,
+            MeasureDecodeBatch(pool, packed, prompt, 16, stepCount), MeasureDecodeBatch(pool, unpacked, prompt, 16, stepCount));
+        Y_VERIFY(ok && "packed weights differ from int8 weights");
+    }
+}
+
+
+// top-k must select the most probable tokens of full softmax with the same renormalized probabilities
+// sampling frequencies are compared with renormalized full distribution
+static void CheckTopK(const TCPUModelParams &params, const TVector<TVector<TLabelIndex>> &labelsArr, yint topK)
+{
+    const yint SAMPLE_COUNT = 10000;
+    TXRng rng(1313);
+    yint vocabSize = YSize(params.Bias);
+    yint len = YSize(labelsArr);
+    TCPUInferContext ctx;
+    ctx.Init(params);
+    double maxProbDiff = 0;
+    double sumTV = 0;
+    yint mismatchCount = 0;
+    double fullTime = 0;
+    double topTime = 0;
+    for (yint t = 0; t < len; ++t) {
+        TVector<float> state;
+        ComputeFinalState(params, labelsArr[t], &ctx, &state);
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        TVector<float> distr;
+        ComputeFinalPrediction(params, state, &distr);
+        fullTime += NHPTimer::GetTimePassed(&tStart);
+        TVector<TTokenProb> top;
+        ComputeFinalTopK(params, state, topK, &top);
+        topTime += NHPTimer::GetTimePassed(&tStart);
+
+        // k-th largest full prob, tokens above it must be selected
+        TVector<float> sorted = distr;
+        Sort(sorted.begin(), sorted.end(), [](float a, float b) { return a > b; });
+        yint k = Min(topK, vocabSize);
+        float kthProb = sorted[k - 1];
+        double sumTop = 0;
+        for (const TTokenProb &tp : top) {
+            sumTop += distr[tp.Token];
+            if (distr[tp.Token] < kthProb * 0.999f) {
+                ++mismatchCount;
+            }
+        }
+        for (const TTokenProb &tp : top) {
+            maxProbDiff = Max<double>(maxProbDiff, fabs(tp.Prob - distr[tp.Token] / sumTop));
+        }
+
+        // sampling
+        TVector<yint> freq;
+        ClearPodArray(&freq, vocabSize);
+        for (yint z = 0; z < SAMPLE_COUNT; ++z) {
+            freq[SampleFromTopK(rng, top, 1)] += 1;
+        }
+        double tv = 0;
+        for (const TTokenProb &tp : top) {
+            tv += fabs(freq[tp.Token] / (double)SAMPLE_COUNT - distr[tp.Token] / sumTop);
+        }
+        sumTV += tv / 2;
+    }
+    DebugPrintf("top-%g check on %g positions: %g wrong tokens, max prob diff %g, avrg sampling tv distance %g (%g samples)\n",
+        topK * 1., len * 1., mismatchCount * 1., maxProbDiff, sumTV / len, SAMPLE_COUNT * 1.);
+    DebugPrintf("final layer full softmax %g ms, top-%g %g ms\n", fullTime / len * 1000, topK * 1., topTime / len * 1000);
+    Y_VERIFY(mismatchCount == 0 && "top-k selected wrong tokens");
+}
+
+
+void Benchmark(TModelParams &params, yint promptLen, yint decodeLen, yint checkLen)
+{
+    Y_VERIFY(promptLen > 0 && decodeLen >= 0 && checkLen >= 0);
+    TXRng rng(1313);
+    yint vocabSize = params.ModelDim.VocabSize;
+    TCPUModelParams cpuParams;
+    ConvertModel(params, &cpuParams);
+    TIntrusivePtr<TThreadPool> pool = new TThreadPool(Max<yint>(1, GetCpuCount() - 1));
+    DebugPrintf("cpu inference benchmark, %s, vocab %g, prompt %g tokens, decode %g tokens, %g threads, isa %s\n",
+        GetModelDimsString(params.ModelDim).c_str(), vocabSize * 1., promptLen * 1., decodeLen * 1., pool->GetThreadCount() + 1., GetCpuIsaName(GetCpuIsa()));
+
+    // node 0 is start token, prediction is needed after the last prompt token only
+    TVector<TVector<TLabelIndex>> labelsArr;
+    labelsArr.resize(promptLen + 1);
+    labelsArr[0].push_back(0);
+    for (yint t = 0; t < promptLen; ++t) {
+        labelsArr[t + 1].push_back(rng.Uniform(vocabSize) + 1 + 1);
+    }
+
+    // token by token prefill
+    TVector<float> distr;
+    NHPTimer::STime tStart;
+    {
+        TCPUInferContext seqCtx;
+        seqCtx.Init(cpuParams);
+        NHPTimer::GetTime(&tStart);
+        for (yint t = 0; t <= promptLen; ++t) {
+            ComputePrediction(cpuParams, labelsArr[t], &seqCtx, (t == promptLen) ? &distr : nullptr);
+        }
+    }
+    double seqPrefillTime = NHPTimer::GetTimePassed(&tStart);
+
+    // batched prefill
+    TCPUInferContext cpuCtx;
+    cpuCtx.Init(cpuParams);
+    NHPTimer::GetTime(&tStart);
+    ComputePrefill(pool.Get(), cpuParams, labelsArr, &cpuCtx, &distr);
+    double prefillTime = NHPTimer::GetTimePassed(&tStart);
+
+    // decode
+    TVector<double> latencyArr;
+    for (yint t = 0; t < decodeLen; ++t) {
+        NHPTimer::GetTime(&tStart);
+        yint token = SampleFromDistr(rng, distr, 1);
+        TVector<TLabelIndex> labelArr;
+        labelArr.push_back(token + 1 + 1);
+        ComputePrediction(cpuParams, labelArr, &cpuCtx, &distr);
+        latencyArr.push_back(NHPTimer::GetTimePassed(&tStart));
+    }
+
+    DebugPrintf("token by token prefill %g tokens/sec, time to first token %g ms\n", promptLen / seqPrefillTime, seqPrefillTime * 1000);
+    DebugPrintf("batched prefill %g tokens/sec, time to first token %g ms\n", promptLen / prefillTime, prefillTime * 1000);
+    DebugPrintf("decode latency p50 %g ms, p90 %g ms, p99 %g ms, max %g ms\n",
+        GetPercentile(latencyArr, 0.5) * 1000, GetPercentile(latencyArr, 0.9) * 1000,
+        GetPercentile(latencyArr, 0.99) * 1000, GetPercentile(latencyArr, 1) * 1000);
+    DebugPrintf("model %g mb, kv cache %g mb, peak rss %g mb\n",
+        CalcModelBytes(cpuParams) / 1e6, CalcKVCacheBytes(cpuCtx) / 1e6, GetPeakRSS() / 1e6);
+
+    // batched decoding of several sequences
+    {
+        const yint DECODE_PROMPT_LEN = 64;
+        const yint DECODE_STEP_COUNT = 20;
+        TVector<TVector<TLabelIndex>> prompt(labelsArr.begin(), labelsArr.begin() + Min(promptLen, DECODE_PROMPT_LEN) + 1);
+        for (yint batchSize : { 1, 4, 16 }) {
+            DebugPrintf("decode batch %g, %g tokens/sec\n", batchSize * 1., MeasureDecodeBatch(pool.Get(), cpuParams, prompt, batchSize, DECODE_STEP_COUNT));
+        }
+        // speculative decoding gain, with acceptance rate a step gives (1 - a^(k+1)) / (1 - a) tokens
+        for (yint draftLen : { 2, 4, 8 }) {
+            double cost = MeasureVerifyCost(pool.Get(), cpuParams, prompt, draftLen, DECODE_STEP_COUNT);
+            TString gain;
+            for (double accept : { 0.5, 0.8, 0.95 }) {
+                double tokenCount = (1 - pow(accept, draftLen + 1)) / (1 - accept);
+                gain += Sprintf(", accept %g%% speedup %.2f", accept * 100, tokenCount / cost);
+            }
+            DebugPrintf("verify %g draft tokens, step cost %.2f%s\n", draftLen * 1., cost, gain.c_str());
+        }
+        BenchmarkPackedWeights(pool.Get(), params, prompt, DECODE_STEP_COUNT);
+    }
+
+    if (checkLen > 0) {
+        yint len = Min(checkLen, promptLen);
+        TVector<TVector<TLabelIndex>> checkLabels(labelsArr.begin(), labelsArr.begin() + len + 1);
+        CheckPrefill(pool.Get(), cpuParams, checkLabels);
+        CheckDecodeBatch(pool.Get(), cpuParams, checkLabels);
+        CheckSpeculativeVerify(pool.Get(), cpuParams, checkLabels);
+        CheckPrefixCache(pool.Get(), cpuParams, checkLabels);
+        CheckTopK(cpuParams, checkLabels, 40);
+        TVector<TBPEToken> text;
+        for (yint t = 0; t < len; ++t) {
+            text.push_back(labelsArr[t + 1][0] - 1 - 1);
+        }
+        CheckAccuracy(params, cpuParams, text);
+    }
+}
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <gpt/model_params/model_params.h>
+
+namespace NCPUInfer
+{
+// prefill tokens/sec, decode latency percentiles and memory footprint on random prompt
+// first checkLen prompt tokens are used to compare predictions with NCPU_GPT, verifies they agree within tolerance
+void Benchmark(TModelParams &params, yint promptLen, yint decodeLen, yint checkLen);
+}
@@ -3,16 +3,21 @@
 #include "train.h"
 #include "net_train.h"
 #include "fed_sim.h"
-#include "cpu_infer.h"
+#include "cpu_infer_bench.h"
 #include <gpt/data/data.h>
 #include <gpt/data/bpe.h>
 #include <gpt/att/sliding_window.h>
 #include <gpt/compute/gpt_cpu.h>
 #include <gpt/compute/gpt_cuda.cuh>
 #include <gpt/data_config/data_config.h>
+#include <gpt/model_params/checkpoint_writer.h>
+#include <gpt/model_params/model_average.h>
+#include <gpt/model_params/sse_utils.h>
 #include <lib/random/rand_utils.h>
 #include <lib/hp_timer/hp_timer.h>
 #include <lib/config/config.h>
+#include <lib/prof/prof.h>
+#include <util/arena.h>
 
 
 static TString TRAIN_SCRIPT =
@@ -386,27 +391,49 @@ static void ComputeMatrixParamDistr(TModelParams *pParams)
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-static void ComputeAverageModel(TModelParams *p, yint finishIter, yint iterInterval)
+static void ComputeAverageModel(TModelParams *p, yint finishIter, yint iterInterval, const TString &chainFolder, float emaDecay)
 {
-    TString pathTemplate = "D:/eden_gpt_%.8gk.bin";
-    //TString pathTemplate = "D:/models/fed_small/model_%.8g.bin ";
+    const yint READ_THREAD_COUNT = 8;
 
     // model averaging boosts perf on test significantly
     int startIter = finishIter - iterInterval;
-    double modelCount = 1;
-    TModelParams &sumParams = *p;
-    Serialize(true, Sprintf(pathTemplate.c_str(), startIter / 1000.), sumParams);
+    if (!chainFolder.empty()) {
+        // stream through checkpoint chain, every checkpoint in range is used
+        TCheckpointChain chain;
+        chain.Open(chainFolder, 1);
+        yint modelCount = 0;
+        for (const TCheckpointChainEntry &e : chain.GetIndex()) {
+            modelCount += (e.Id >= startIter && e.Id <= finishIter);
+        }
+        Y_VERIFY(modelCount > 0);
+        TVector<float> weights;
+        GetAverageWeights(modelCount, emaDecay, &weights);
+        TCheckpointChainReader reader(chain, startIter);
+        yint id = 0;
+        const TModelParams *params = 0;
+        for (yint k = 0; k < modelCount; ++k) {
+            Y_VERIFY(reader.Next(&id, &params) && id <= finishIter);
+            if (k == 0) {
+                *p = *params;
+                Scale(p, weights[k], weights[k]);
+            } else {
+                AddScaled(p, *params, weights[k], weights[k]);
+            }
+            printf(".");
+        }
+        printf("\n");
+        return;
+    }
+
+    TString pathTemplate = "D:/eden_gpt_%.8gk.bin";
+    //TString pathTemplate = "D:/models/fed_small/model_%.8g.bin ";
     const int STEP = 1000;
     //const int STEP = 100;
-    for (int iter = startIter + STEP; iter <= finishIter; iter += STEP) {
-        TModelParams params;
-        Serialize(true, Sprintf(pathTemplate.c_str(), iter / 1000.), params);
-        AddScaled(&sumParams, params, 1, 1);
-        modelCount += 1;
-        printf(".");
+    TVector<TString> fileArr;
+    for (int iter = startIter; iter <= finishIter; iter += STEP) {
+        fileArr.push_back(Sprintf(pathTemplate.c_str(), iter / 1000.));
     }
-    printf("\n");
-    Scale(&sumParams, 1 / modelCount, 1 / modelCount);
+    ComputeAverageModel(p, fileArr, emaDecay, READ_THREAD_COUNT);
     //ComputeMatrixParamDistr(&startParams);
 }
 
@@ -559,7 +586,7 @@ void CheckCpuGpuMatch(const TTrainConfig &tc, TDataset &data)
     //startParams.ModelDim.Layers.resize(1);
     const yint CHECK_BATCH_SIZE = 1;
     const yint CHECK_FRAG_LEN = 64 - 1;
-    const float CHECK_CHANNEL_DROP = 1;
+    const float CHECK_CHANNEL_DROP = tc.ChannelDrop;
 
     TIntrusivePtr<IModel> cpuModel = CreateModel(1, params);
     TIntrusivePtr<IComputeContext> cpuCtx = NCPU_GPT::CreateContext(cpuModel, CHECK_BATCH_SIZE * GetNodeCount(tc.TrainFragLen));
@@ -610,6 +637,78 @@ void CheckCpuGpuMatch(const TTrainConfig &tc, TDataset &data)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// sampled softmax gradient averaged over samples must match full softmax gradient
+// train same model with full and sampled softmax on the same batches, compare loss on test batch with full softmax
+static void CheckSampledSoftmax(const TTrainConfig &tc, TDataset &data, yint sampleCount, yint iterCount)
+{
+    const yint GRAD_DRAW_COUNT = 100;
+    const double MAX_GRAD_ERR = 0.02;
+    if (sampleCount < data.GetVocabSize()) {
+        double gradErr = NCPU_GPT::CheckSampledSoftmaxGrad(data.GetBias(), sampleCount, GRAD_DRAW_COUNT);
+        DebugPrintf("sampled softmax gradient averaged over %g draws, relative distance to full softmax gradient %g\n", GRAD_DRAW_COUNT * 1., gradErr);
+        Y_VERIFY(gradErr < MAX_GRAD_ERR && "sampled softmax gradient is biased");
+    }
+
+    TXRng chkRng(1313);
+    TModelParams params;
+    yint vocabSize = data.GetVocabSize();
+    yint modelFlags = MPF_TUNE_FINAL_LAYER | MPF_TUNE_EMBED;
+    TString modelDimStr = "e256d6w64";
+    TModelDim modelDim;
+    InitModelDim(&modelDim, modelDimStr, ALIBI_V3, vocabSize, modelFlags);
+    InitModel(&params, chkRng, modelDim, COMBINER_INIT_RANDOM, data.GetBias());
+
+    TIntrusivePtr<IModel> fullModel = CreateModel(1, params);
+    TIntrusivePtr<IComputeContext> fullCtx = NCPU_GPT::CreateContext(fullModel, tc.GetMaxNodeCount());
+    TIntrusivePtr<IModel> sampledModel = CreateModel(1, params);
+    TIntrusivePtr<IComputeContext> sampledCtx = NCPU_GPT::CreateContext(sampledModel, tc.GetMaxNodeCount(), sampleCount);
+
+    TVector<TFragment> testBatch;
+    for (yint k = 0; k < tc.TrainBatchSize; ++k) {
+        TFragment frag;
+        data.MakeFragment(TDataset::TEST, chkRng, tc.TrainFragLen, &frag);
+        testBatch.push_back(frag);
+    }
+
+    DebugPrintf("sampled softmax check, vocab %g, %g samples\n", vocabSize * 1., sampleCount * 1.);
+    double fullTime = 0;
+    double sampledTime = 0;
+    for (yint iter = 0; iter <= iterCount; ++iter) {
+        if ((iter % 10) == 0) {
+            MakeTest(testBatch, fullCtx.Get(), MAIN_DEVICE);
+            float fullScore = fullCtx->ComputeScore();
+            MakeTest(testBatch, sampledCtx.Get(), MAIN_DEVICE);
+            float sampledScore = sampledCtx->ComputeScore();
+            DebugPrintf("iter %g, test loss full %g, sampled %g, train loss full %g, sampled (estimate) %g\n", iter * 1.,
+                -fullScore, -sampledScore, -fullCtx->GetAvrgTrainErr(), -sampledCtx->GetAvrgTrainErr());
+        }
+        if (iter == iterCount) {
+            break;
+        }
+        TVector<TFragment> fragArr;
+        for (yint k = 0; k < tc.TrainBatchSize; ++k) {
+            TFragment frag;
+            data.MakeFragment(TDataset::TRAIN, chkRng, tc.TrainFragLen, &frag);
+            fragArr.push_back(frag);
+        }
+        TTrainingStep step = tc.GetStep(iter, iterCount);
+        TXRng fullRng = chkRng;
+        TXRng sampledRng = chkRng;
+        NHPTimer::STime tStart;
+        NHPTimer::GetTime(&tStart);
+        MakeTrain(fullRng, fragArr, tc.TokenDrop, tc.ChannelDrop, fullCtx.Get(), MAIN_DEVICE);
+        fullCtx->Backprop(step, GRADIENT_APPLY);
+        fullTime += NHPTimer::GetTimePassed(&tStart);
+        MakeTrain(sampledRng, fragArr, tc.TokenDrop, tc.ChannelDrop, sampledCtx.Get(), MAIN_DEVICE);
+        sampledCtx->Backprop(step, GRADIENT_APPLY);
+        sampledTime += NHPTimer::GetTimePassed(&tStart);
+        chkRng = fullRng;
+    }
+    DebugPrintf("train time full %g sec, sampled %g sec\n", fullTime, sampledTime);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 void TrainModel(yint startIteration, yint deviceCount, const TTrainContext &trainCtx, TIntrusivePtr<TModelParamsHolder> pParams)
 {
@@ -627,18 +726,49 @@ void TrainModel(yint startIteration, yint deviceCount, const TTrainContext &trai
     //TIntrusivePtr<IComputeContext> pCtx = NCPU_GPT::CreateContext(pModel, trainCtx.GetMaxNodeCount());
     TIntrusivePtr<IComputeContext> pCtx = NCUDA_GPT::CreateContext(pModel, trainCtx.GetMaxNodeCount());
 
+    // checkpoint chain
+    TCheckpointChain chain;
+    bool useChain = !trainCtx.GetCheckpointChainFolder().empty();
+    if (useChain) {
+        chain.Open(trainCtx.GetCheckpointChainFolder(), trainCtx.GetCheckpointFullInterval());
+        if (startIteration > 0) {
+            // resumed from checkpoint startIteration, later checkpoints belong to abandoned run
+            chain.EraseAfter(startIteration);
+            Y_VERIFY(!chain.IsEmpty() && chain.GetLastId() == startIteration && "start checkpoint is missing in checkpoint chain");
+        } else {
+            Y_VERIFY(chain.IsEmpty() && "checkpoint chain folder is used by another training run");
+        }
+    }
+    TIntrusivePtr<TCheckpointWriter> ckptWriter = new TCheckpointWriter(trainCtx.GetCheckpointQueue());
+
     //TOFStream fTrainLog("d:/train_log.txt");
     NHPTimer::STime tStart;
     NHPTimer::GetTime(&tStart);
     for (yint iter = startIteration; iter <= trainCtx.GetMaxIters(); ++iter) {
         if ((iter % trainCtx.GetEvalInterval()) == 0) {
             if (trainCtx.IsSaveModel()) {
-                TModelParams params;
-                pCtx->GetParams(&params);
-                Serialize(false, Sprintf("d:/eden_gpt_%.8gk.bin", iter / 1000.), params);
+                PROF_SCOPE("checkpoint");
+                NHPTimer::STime tSave;
+                NHPTimer::GetTime(&tSave);
+                TIntrusivePtr<TModelParamsHolder> snapshot = new TModelParamsHolder();
+                pCtx->GetParams(&snapshot->Params);
+                if (useChain) {
+                    // start checkpoint of resumed training is in the chain already
+                    if (startIteration == 0 || iter > startIteration) {
+                        ckptWriter->Save(new TCheckpointChainWriteJob(&chain, iter, snapshot));
+                    }
+                } else {
+                    ckptWriter->Save(new TModelParamsWriteJob(Sprintf("d:/eden_gpt_%.8gk.bin", iter / 1000.), snapshot));
+                }
+                DebugPrintf("checkpoint stall %g sec\n", NHPTimer::GetTimePassed(&tSave));
+            }
+            float trainErr = 0;
+            float testErr = 0;
+            {
+                PROF_SCOPE("eval");
+                trainErr = CalcModelErr(trainCtx.GetScoreTrainBatches(), pCtx.Get()) * trainCtx.GetCompression();
+                testErr = CalcModelErr(trainCtx.GetScoreTestBatches(), pCtx.Get()) * trainCtx.GetCompression();
             }
-            float trainErr = CalcModelErr(trainCtx.GetScoreTrainBatches(), pCtx.Get()) * trainCtx.GetCompression();
-            float testErr = CalcModelErr(trainCtx.GetScoreTestBatches(), pCtx.Get()) * trainCtx.GetCompression();
             if (testErr != 0) {
                 DebugPrintf("iter %.8gk, %g sec, train err %g, test err %g\n", iter / 1000., NHPTimer::GetTimePassed(&tStart), trainErr, testErr); fflush(0);
             } else {
@@ -654,10 +784,17 @@ void TrainModel(yint startIteration, yint deviceCount, const TTrainContext &trai
         TXRng iterRng(iter);
         for (yint deviceId = 0; deviceId < deviceCount; ++deviceId) {
             TVector<TFragment> fragArr;
-            trainCtx.MakeTrainBatches(iterRng, &fragArr);
+            {
+                PROF_SCOPE("batch_gen");
+                trainCtx.MakeTrainBatches(iterRng, &fragArr);
+            }
+            PROF_SCOPE("make_train");
             MakeTrain(iterRng, fragArr, tc.TokenDrop, tc.ChannelDrop, pCtx.Get(), deviceId);
         }
-        pCtx->Backprop(trainCtx.GetStep(iter), addToModel);
+        {
+            PROF_SCOPE("backprop");
+            pCtx->Backprop(trainCtx.GetStep(iter), addToModel);
+        }
 
         //printf("Iter %.8gk\n", iter / 1000.);
         //TestReproducibility(trainCtx, pCtx.Get(), iterRng, fragArr);
@@ -678,6 +815,8 @@ void TrainModel(yint startIteration, yint deviceCount, const TTrainContext &trai
         //    DebugPrintf("loss before %g after %g\n", errBefore, errAfter);
         //}
     }
+    ckptWriter->Wait();
+    DebugPrintf("total checkpoint stall %g sec\n", ckptWriter->GetSumStallTime());
 }
 
 
@@ -704,6 +843,10 @@ class TTrainScriptParser : public TTrainDataConfigParser
     yint MaxIters = 2000000;
     yint EvalInterval = 1000;
     yint EvalBatchCount = 20;
+    TString CheckpointChain;
+    yint CheckpointFullInterval = 10;
+    yint CheckpointQueue = 2;
+    float AverageEmaDecay = 0;
 
 private:
     void ParseScriptOp(const TConfigFile::TOp &op) override
@@ -720,6 +863,18 @@ private:
                 EvalBatchCount = atof(op.Args[0].c_str());
             } else if (op.Dst == "SAVE_MODEL") {
                 SaveModel = (IsYes(op.Args[0]));
+            } else if (op.Dst == "CHECKPOINT_CHAIN") {
+                CheckpointChain = op.Args[0];
+            } else if (op.Dst == "CHECKPOINT_FULL_INTERVAL") {
+                CheckpointFullInterval = atof(op.Args[0].c_str());
+            } else if (op.Dst == "CHECKPOINT_QUEUE") {
+                CheckpointQueue = atof(op.Args[0].c_str());
+            } else if (op.Dst == "AVERAGE_EMA_DECAY") {
+                AverageEmaDecay = atof(op.Args[0].c_str());
+            } else if (op.Dst == "CPU_ISA") {
+                ECpuIsa isa = ISA_SSE41;
+                Y_VERIFY(ParseCpuIsa(op.Args[0], &isa) && "unknown isa");
+                Y_VERIFY(SetCpuIsa(isa) && "isa is not supported by cpu");
             } else {
                 DebugPrintf("unknown config variable %s\n", op.Dst.c_str());
             }
@@ -730,7 +885,13 @@ private:
                 StartIteration = atoi(op.Args[0].c_str());
                 DebugPrintf("Load checkpoint %gk\n", StartIteration / 1000.);
                 Data.StartParams = new TModelParamsHolder();
-                Serialize(true, Sprintf("d:/eden_gpt_%.8gk.bin", StartIteration / 1000.), Data.StartParams->Params);
+                if (!CheckpointChain.empty()) {
+                    TCheckpointChain chain;
+                    chain.Open(CheckpointChain, CheckpointFullInterval);
+                    Y_VERIFY(chain.Load(StartIteration, &Data.StartParams->Params));
+                } else {
+                    Serialize(true, Sprintf("d:/eden_gpt_%.8gk.bin", StartIteration / 1000.), Data.StartParams->Params);
+                }
                 Y_VERIFY(!Data.StartParams->Params.IsEmpty());
 
             // process ops
@@ -740,6 +901,8 @@ private:
                 Data.VerifyVocabSize();
                 TTrainConfig tc(TrainConfig, DropConfig);
                 TTrainContext trainCtx(Data.Data, tc, SaveModel, MaxIters, EvalInterval);
+                trainCtx.SetCheckpointChain(CheckpointChain, CheckpointFullInterval);
+                trainCtx.SetCheckpointQueue(CheckpointQueue);
 
                 DebugPrintf("%s %s %s 0x%x, size %gM\n",
                     GetModelDimsString(Data.StartParams->Params.GetModelDim()).c_str(),
@@ -775,7 +938,7 @@ private:
                 } else {
                     yint finishIter = atoi(op.Args[0].c_str());
                     yint iterInterval = YSize(op.Args) > 1 ? atoi(op.Args[1].c_str()) : 0;
-                    ComputeAverageModel(&params, finishIter, iterInterval);
+                    ComputeAverageModel(&params, finishIter, iterInterval, CheckpointChain, AverageEmaDecay);
                 }
                 ComputeExactTest(Data.Data, params);
 
@@ -784,6 +947,43 @@ private:
                 TTrainConfig tc(TrainConfig, DropConfig);
                 CheckCpuGpuMatch(tc, Data.Data);
 
+            } else if (op.Dst == "check_sampled_softmax") {
+                // check_sampled_softmax(sampleCount, iterCount)
+                Data.FinishDatasetBuild();
+                TTrainConfig tc(TrainConfig, DropConfig);
+                yint sampleCount = (YSize(op.Args) > 0) ? atoi(op.Args[0].c_str()) : 1024;
+                yint iterCount = (YSize(op.Args) > 1) ? atoi(op.Args[1].c_str()) : 100;
+                CheckSampledSoftmax(tc, Data.Data, sampleCount, iterCount);
+
+            } else if (op.Dst == "matrix_add_test") {
+                Y_VERIFY(Data.StartParams.Get() && !Data.StartParams->Params.IsEmpty());
+                yint iterCount = op.Args.empty() ? 100 : atoi(op.Args[0].c_str());
+                NCuda::BenchmarkMatrixAdd(Data.StartParams->Params.ModelDim, DeviceCount, iterCount);
+
+            } else if (op.Dst == "cpu_infer_bench") {
+                // cpu_infer_bench(promptLen, decodeLen, checkLen), random model from MODEL_DIMS unless model is loaded
+                yint promptLen = (YSize(op.Args) > 0) ? atoi(op.Args[0].c_str()) : 1000;
+                yint decodeLen = (YSize(op.Args) > 1) ? atoi(op.Args[1].c_str()) : 100;
+                yint checkLen = (YSize(op.Args) > 2) ? atoi(op.Args[2].c_str()) : 64;
+                // random model is not kept, following ops see loaded model or no model as before
+                TModelParams params;
+                if (Data.StartParams == nullptr) {
+                    Y_VERIFY(Data.VocabSize > 0 && "unknown vocab size, use set_vocab_size()");
+                    TXRng rng(1313);
+                    TModelDim modelDim;
+                    InitModelDim(&modelDim, ModelDimsString, ALIBI_V3, Data.VocabSize, MPF_NOFLAGS);
+                    TVector<float> biasArr;
+                    ClearPodArray(&biasArr, Data.VocabSize);
+                    InitModel(&params, rng, modelDim, COMBINER_INIT_RANDOM, biasArr);
+                } else {
+                    params = Data.StartParams->Params;
+                }
+                NCPUInfer::Benchmark(params, promptLen, decodeLen, checkLen);
+
+            } else if (op.Dst == "save_prof_trace") {
+                Y_VERIFY(YSize(op.Args) == 1);
+                NProf::SaveChromeTrace(op.Args[0]);
+
             } else if (op.Dst == "test_gradient") {
                 Data.FinishDatasetBuild();
                 TTrainConfig tc(TrainConfig, DropConfig);
@@ -807,15 +1007,18 @@ void TestMatMul();
 int main(int argc, char **argv)
 {
     //TestMatMul();
+    //BenchmarkThreadPool();
+    //BenchmarkArena();
+    //BenchmarkFlatHashMap();
     //Repack();
     //GenerateArithmetic();
     //GenerateArithmetic97();
     //NBinClass::Run();
     //NFedSim::Run();
-    //NCPUInfer::Check();
     //return 0;
 
-    TOpt cmdline("c:w:t:", argc, argv);
+    TIntrusivePtr<NProf::TProfHttpServer> profServer;
+    TOpt cmdline("c:w:t:n:p:", argc, argv);
     for (const TOpt::TParam &param : cmdline.Params) {
         if (param.Name == "c") {
             DebugPrintf("Executing script %s\n", param.Args[0].c_str());
@@ -827,6 +1030,12 @@ int main(int argc, char **argv)
             return 0;
         } else if (param.Name == "t") {
             MatrixAddWorkerThreadCount = atoi(param.Args[0].c_str());
+        } else if (param.Name == "n") {
+            // numa placement of host matrices, "none", "local" or "interleave"
+            Y_VERIFY(ParseMatrixAddNuma(param.Args[0], &MatrixAddNuma) && "unknown numa placement, expected none, local or interleave");
+        } else if (param.Name == "p") {
+            // phase profiler report port, should precede -w
+            profServer = new NProf::TProfHttpServer(atoi(param.Args[0].c_str()));
         }
     }
 
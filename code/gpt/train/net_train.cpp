@@ -6,6 +6,7 @@
 #include <gpt/compute/par_matrix.h>
 #include <gpt/att/sliding_window.h>
 #include <lib/hp_timer/hp_timer.h>
+#include <lib/prof/prof.h>
 #include <lib/net/ip_address.h>
 #include <typeinfo>
 #include <emmintrin.h>
@@ -223,6 +224,7 @@ class TMMNetDeltaReduce : public IMMDeltaHook
 
     static void SumDeltas(TReduceLevel *pLevel, TModelMatrixBitDelta *pRes)
     {
+        PROF_SCOPE("net_reduce");
         SumBitDelta(pLevel->LocalSum, pLevel->RemoteSum, &pLevel->Tail, pRes);
         Y_VERIFY(pLevel->ReadyCount.load() == LOCAL_DATA + 1);
         pLevel->ReadyCount = 0;
@@ -262,7 +264,10 @@ class TMMNetDeltaReduce : public IMMDeltaHook
         ModelMatrix->SetOp(TModelMatrix::OP_WAIT);
 
         TModelMatrixBitDelta &localSum = ReduceArr[0]->LocalSum;
-        ModelMatrix->ExtractDelta(&localSum, &DeltaTail);
+        {
+            PROF_SCOPE("compress_delta");
+            ModelMatrix->ExtractDelta(&localSum, &DeltaTail);
+        }
 
         if (CanUseStaleGradient) {
             Y_VERIFY(StaleDeltaState == DELTA_READY);
@@ -393,9 +398,13 @@ public:
         TXRng iterRng(rngSeed);
         const TTrainConfig &tc = TrainConfig;
         for (yint deviceId = 0; deviceId < YSize(FragArr); ++deviceId) {
+            PROF_SCOPE("make_train");
             MakeTrain(iterRng, FragArr[deviceId], tc.TokenDrop, tc.ChannelDrop, p->Ctx.Get(), deviceId);
         }
-        p->Ctx->Backprop(tc.GetStep(Iter, MaxIters), AddToModel);
+        {
+            PROF_SCOPE("backprop");
+            p->Ctx->Backprop(tc.GetStep(Iter, MaxIters), AddToModel);
+        }
         p->Master.SendCopy(CMD_OK);
     }
 };
@@ -660,8 +669,13 @@ void RunMaster(yint startIteration, yint deviceCount, const TVector<TString> &wo
                 WaitData(masterNet.Queue, modelFetchConn, &sz);
                 modelFetch.StartFetch(sz, Sprintf("d:/eden_gpt_%.8gk.bin", iter / 1000.));
             }
-            float trainErr = DistributedCalcModelErr(tc, masterNet, trainCtx.GetScoreTrainBatches()) * trainCtx.GetCompression();
-            float testErr = DistributedCalcModelErr(tc, masterNet, trainCtx.GetScoreTestBatches()) * trainCtx.GetCompression();
+            float trainErr = 0;
+            float testErr = 0;
+            {
+                PROF_SCOPE("eval");
+                trainErr = DistributedCalcModelErr(tc, masterNet, trainCtx.GetScoreTrainBatches()) * trainCtx.GetCompression();
+                testErr = DistributedCalcModelErr(tc, masterNet, trainCtx.GetScoreTestBatches()) * trainCtx.GetCompression();
+            }
             if (testErr != 0) {
                 DebugPrintf("iter %.8gk, %g sec, train err %g, test err %g\n", iter / 1000., NHPTimer::GetTimePassed(&tStart), trainErr, testErr); fflush(0);
             } else {
@@ -683,6 +697,7 @@ void RunMaster(yint startIteration, yint deviceCount, const TVector<TString> &wo
             TVector<TVector<TFragment>> fragArr;
             fragArr.resize(deviceCount);
             for (yint deviceId = 0; deviceId < deviceCount; ++deviceId) {
+                PROF_SCOPE("batch_gen");
                 trainCtx.MakeTrainBatches(iterRng, &fragArr[deviceId]);
             }
             SendCommand(net, it->first, new TBackprop(iter, maxIters, tc, addToModel, fragArr));
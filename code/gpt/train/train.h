@@ -23,6 +23,9 @@ class TTrainContext
     bool SaveModel = false;
     yint MaxIters = 1000;
     yint EvalInterval = 100;
+    TString CheckpointChainFolder; // save full models if empty
+    yint CheckpointFullInterval = 10;
+    yint CheckpointQueue = 2; // max checkpoints written in background, 0 - write synchronously
 
 public:
     TTrainContext(TDataset &data, const TTrainConfig &cfg, bool saveModel, yint maxIters, yint evalInterval)
@@ -38,6 +41,15 @@ public:
     yint GetMaxNodeCount() const { return Config.GetMaxNodeCount(); }
     yint GetMaxIters() const { return MaxIters; }
     yint GetEvalInterval() const { return EvalInterval; }
+    const TString &GetCheckpointChainFolder() const { return CheckpointChainFolder; }
+    yint GetCheckpointFullInterval() const { return CheckpointFullInterval; }
+    yint GetCheckpointQueue() const { return CheckpointQueue; }
+    void SetCheckpointQueue(yint queue) { CheckpointQueue = queue; }
+    void SetCheckpointChain(const TString &folder, yint fullInterval)
+    {
+        CheckpointChainFolder = folder;
+        CheckpointFullInterval = fullInterval;
+    }
     TTrainingStep GetStep(yint iter) const
     {
         return Config.GetStep(iter, MaxIters);
@@ -52,10 +52,22 @@ void RenameFile(const TString &fileName, const TString &newName)
     Y_VERIFY(MoveFileA(fileName.c_str(), newName.c_str()));
 }
 
+void RenameFileReplace(const TString &fileName, const TString &newName)
+{
+    Y_VERIFY(MoveFileExA(fileName.c_str(), newName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+}
+
+void SyncDirectory(const TString &dir)
+{
+    // MOVEFILE_WRITE_THROUGH flushes rename, directories can not be flushed separately
+    (void)dir;
+}
+
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 
 void FindAllFiles(const TString &prefix, TVector<TFindFileResult> *res)
 {
@@ -111,4 +123,18 @@ void RenameFile(const TString &fileName, const TString &newName)
     Y_VERIFY(rename(fileName.c_str(), newName.c_str()) == 0);
 }
 
+void RenameFileReplace(const TString &fileName, const TString &newName)
+{
+    // rename() replaces existing file atomically
+    Y_VERIFY(rename(fileName.c_str(), newName.c_str()) == 0);
+}
+
+void SyncDirectory(const TString &dir)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    Y_VERIFY(fd >= 0 && "can not open directory");
+    Y_VERIFY(fsync(fd) == 0);
+    close(fd);
+}
+
 #endif
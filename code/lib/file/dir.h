@@ -15,3 +15,7 @@ void ChDir(const TString &dir);
 bool DoesFileExist(const TString &fileName);
 void EraseFile(const TString &fileName);
 void RenameFile(const TString &fileName, const TString &newName);
+// atomically replaces newName if it exists
+void RenameFileReplace(const TString &fileName, const TString &newName);
+// flush directory entries (file creation, rename) to disk
+void SyncDirectory(const TString &dir);
@@ -19,6 +19,16 @@ void Normalize(TVector<double> *res)
 }
 
 
+double GetPercentile(TVector<double> arr, double p)
+{
+    if (arr.empty()) {
+        return 0;
+    }
+    Sort(arr.begin(), arr.end());
+    return arr[ClampVal<yint>(yint(YSize(arr) * p), 0, YSize(arr) - 1)];
+}
+
+
 double Dot(const TVector<double> &a, const TVector<double> &b)
 {
     yint sz = YSize(a);
@@ -30,6 +30,8 @@ inline double Shrink(double x, double a)
 
 
 void Normalize(TVector<double> *res);
+// value at fraction p of sorted arr, 0 for empty arr
+double GetPercentile(TVector<double> arr, double p);
 
 double Dot(const TVector<double> &a, const TVector<double> &b);
 void AddScaled(TVector<double> *pRes, const TVector<double> &vec, double x);
@@ -353,6 +353,11 @@ void HttpReplyPlainText(SOCKET s, const string &reply)
     Reply(s, reply, TVector<char>(), "text/plain");
 }
 
+void HttpReplyJSON(SOCKET s, const string &reply)
+{
+    Reply(s, reply, TVector<char>(), "application/json");
+}
+
 void HttpReplyBin(SOCKET s, const TVector<char> &data)
 {
     Reply(s, "", data, "application/octet-stream");
@@ -52,6 +52,7 @@ void CloseConnection(SOCKET s);
 void HttpReplyXML(SOCKET s, const string &reply);
 void HttpReplyHTML(SOCKET s, const string &reply);
 void HttpReplyPlainText(SOCKET s, const string &reply);
+void HttpReplyJSON(SOCKET s, const string &reply);
 void HttpReplyBin(SOCKET s, const TVector<char> &reply);
 void HttpReplyBMP(SOCKET s, const TVector<char> &data);
 }
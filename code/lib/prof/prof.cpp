@@ -0,0 +1,292 @@
+#include "stdafx.h"
+#include "prof.h"
+#include <lib/hp_timer/hp_timer.h>
+#include <lib/net/http_server.h>
+#include <lib/net/http_request.h>
+#include <util/string.h>
+
+
+namespace NProf
+{
+// histogram sums of one phase
+struct TPhaseTotal
+{
+    ui64 Count = 0;
+    ui64 SumCycles = 0;
+    ui64 MaxCycles = 0;
+    ui64 Buckets[HIST_BUCKET_COUNT] = {};
+
+    void Add(const THist &h)
+    {
+        Count += h.Count.load();
+        SumCycles += h.SumCycles.load();
+        MaxCycles = Max<ui64>(MaxCycles, h.MaxCycles.load());
+        for (yint b = 0; b < HIST_BUCKET_COUNT; ++b) {
+            Buckets[b] += h.Buckets[b].load();
+        }
+    }
+};
+
+// thread data is released at thread exit, readers holding it keep it alive
+struct TThreadDataHolder
+{
+    TIntrusivePtr<TThreadData> Data;
+    ~TThreadDataHolder();
+};
+
+static TAtomic ProfLock;
+static TVector<TString> PhaseNames;
+static TVector<TIntrusivePtr<TThreadData>> ThreadArr; // running threads
+static TPhaseTotal RetiredTotal[MAX_PHASE_COUNT]; // histograms of exited threads
+static yint ThreadCounter;
+static thread_local TThreadData *ThisThreadData;
+static thread_local TThreadDataHolder ThisThreadHolder;
+
+
+TThreadData::TThreadData()
+{
+    WritePtr = 0;
+    for (THist &h : Hist) {
+        h.Count = 0;
+        h.SumCycles = 0;
+        h.MaxCycles = 0;
+        for (std::atomic<ui64> &b : h.Buckets) {
+            b = 0;
+        }
+    }
+}
+
+
+yint RegisterPhase(const char *name)
+{
+    TGuard<TAtomic> g(ProfLock);
+    for (yint k = 0; k < YSize(PhaseNames); ++k) {
+        if (PhaseNames[k] == name) {
+            return k;
+        }
+    }
+    Y_VERIFY(YSize(PhaseNames) < MAX_PHASE_COUNT && "too many profiler phases");
+    PhaseNames.push_back(name);
+    return YSize(PhaseNames) - 1;
+}
+
+
+TThreadData *GetThreadData()
+{
+    if (ThisThreadData == nullptr) {
+        TIntrusivePtr<TThreadData> td = new TThreadData();
+        TGuard<TAtomic> g(ProfLock);
+        td->ThreadId = ThreadCounter++;
+        td->Name = Sprintf("thread %d", (int)td->ThreadId);
+        ThreadArr.push_back(td);
+        ThisThreadData = td.Get();
+        ThisThreadHolder.Data = td;
+    }
+    return ThisThreadData;
+}
+
+
+TThreadDataHolder::~TThreadDataHolder()
+{
+    if (Data.Get() == nullptr) {
+        return;
+    }
+    {
+        TGuard<TAtomic> g(ProfLock);
+        for (yint phase = 0; phase < MAX_PHASE_COUNT; ++phase) {
+            RetiredTotal[phase].Add(Data->Hist[phase]);
+        }
+        for (yint k = 0; k < YSize(ThreadArr); ++k) {
+            if (ThreadArr[k] == Data) {
+                ThreadArr.erase(ThreadArr.begin() + k);
+                break;
+            }
+        }
+    }
+    ThisThreadData = nullptr;
+    Data = nullptr;
+}
+
+
+void SetThreadName(const TString &name)
+{
+    TThreadData *td = GetThreadData();
+    TGuard<TAtomic> g(ProfLock);
+    td->Name = name;
+}
+
+
+// thread names and retired totals are copied under lock, ring buffers and histograms are read without it
+struct TSnapshot
+{
+    TVector<TString> PhaseNames;
+    TVector<TIntrusivePtr<TThreadData>> ThreadArr;
+    TVector<TString> ThreadNames;
+    TVector<TPhaseTotal> RetiredTotal;
+};
+
+static void GetSnapshot(TSnapshot *p)
+{
+    TGuard<TAtomic> g(ProfLock);
+    p->PhaseNames = PhaseNames;
+    p->ThreadArr = ThreadArr;
+    p->ThreadNames.resize(0);
+    for (TIntrusivePtr<TThreadData> &td : ThreadArr) {
+        p->ThreadNames.push_back(td->Name);
+    }
+    p->RetiredTotal.resize(0);
+    for (yint phase = 0; phase < YSize(PhaseNames); ++phase) {
+        p->RetiredTotal.push_back(RetiredTotal[phase]);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// report
+static double GetPercentile(const TPhaseTotal &total, double p)
+{
+    ui64 target = total.Count * p;
+    ui64 sum = 0;
+    for (yint b = 0; b < HIST_BUCKET_COUNT; ++b) {
+        sum += total.Buckets[b];
+        if (sum > target) {
+            return GetHistBucketStart(b);
+        }
+    }
+    return GetHistBucketStart(HIST_BUCKET_COUNT - 1);
+}
+
+
+void GetReport(TString *pRes)
+{
+    TSnapshot snap;
+    GetSnapshot(&snap);
+    double msPerCycle = 1000. / NHPTimer::GetClockRate();
+
+    TString &res = *pRes;
+    res = Sprintf("%-24s %10s %12s %10s %10s %10s %10s\n", "phase", "count", "total sec", "avg ms", "p50 ms", "p99 ms", "max ms");
+    for (yint phase = 0; phase < YSize(snap.PhaseNames); ++phase) {
+        TPhaseTotal total = snap.RetiredTotal[phase];
+        for (TIntrusivePtr<TThreadData> &td : snap.ThreadArr) {
+            total.Add(td->Hist[phase]);
+        }
+        if (total.Count == 0) {
+            continue;
+        }
+        res += Sprintf("%-24s %10g %12.3f %10.3f %10.3f %10.3f %10.3f\n", snap.PhaseNames[phase].c_str(), total.Count * 1.,
+            total.SumCycles * msPerCycle / 1000, total.SumCycles * msPerCycle / total.Count,
+            GetPercentile(total, 0.5) * msPerCycle, GetPercentile(total, 0.99) * msPerCycle,
+            total.MaxCycles * msPerCycle);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// chrome trace
+void GetChromeTrace(TString *pRes)
+{
+    TSnapshot snap;
+    GetSnapshot(&snap);
+    double usPerCycle = 1e6 / NHPTimer::GetClockRate();
+    yint threadCount = YSize(snap.ThreadArr);
+
+    // copy events first to find time origin
+    TVector<TVector<TEvent>> eventArr;
+    eventArr.resize(threadCount);
+    ui64 minStart = ~0ull;
+    for (yint t = 0; t < threadCount; ++t) {
+        TThreadData &td = *snap.ThreadArr[t];
+        ui64 fin = td.WritePtr.load(std::memory_order_acquire);
+        ui64 beg = (fin > RING_SIZE) ? fin - RING_SIZE : 0;
+        TVector<TEvent> &dst = eventArr[t];
+        for (ui64 ptr = beg; ptr < fin; ++ptr) {
+            dst.push_back(td.Ring[ptr & (RING_SIZE - 1)]);
+        }
+        // writer at WritePtr w may be overwriting event w - RING_SIZE, events up to it can be torn
+        std::atomic_thread_fence(std::memory_order_acquire);
+        ui64 finAfter = td.WritePtr.load(std::memory_order_relaxed);
+        ui64 validBeg = (finAfter >= RING_SIZE) ? finAfter - RING_SIZE + 1 : 0;
+        if (validBeg > beg) {
+            dst.erase(dst.begin(), dst.begin() + Min<ui64>(validBeg - beg, YSize(dst)));
+        }
+        for (const TEvent &e : dst) {
+            if (e.Finish >= e.Start && e.Phase < YSize(snap.PhaseNames)) {
+                minStart = Min(minStart, e.Start);
+            }
+        }
+    }
+
+    TString &res = *pRes;
+    res = "{\"traceEvents\":[\n";
+    bool first = true;
+    for (yint t = 0; t < threadCount; ++t) {
+        int tid = snap.ThreadArr[t]->ThreadId;
+        res += Sprintf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", tid, EncodeJSON(snap.ThreadNames[t]).c_str());
+        first = false;
+        for (const TEvent &e : eventArr[t]) {
+            if (e.Finish < e.Start || e.Phase >= YSize(snap.PhaseNames)) {
+                continue;
+            }
+            res += Sprintf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                EncodeJSON(snap.PhaseNames[e.Phase]).c_str(), tid, (e.Start - minStart) * usPerCycle, (e.Finish - e.Start) * usPerCycle);
+        }
+    }
+    res += "\n]}\n";
+}
+
+
+void SaveChromeTrace(const TString &fileName)
+{
+    TString trace;
+    GetChromeTrace(&trace);
+    TOFStream f(fileName.c_str());
+    f << trace.c_str();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// http
+using namespace NNet;
+
+TProfHttpServer::TProfHttpServer(int port) : Port(port)
+{
+    Thr.Create(this);
+}
+
+
+TProfHttpServer::~TProfHttpServer()
+{
+    Exit = true;
+    Thr.Join();
+}
+
+
+void TProfHttpServer::WorkerThread()
+{
+    SetThreadName("prof http");
+    THttpServer srv(Port);
+    DebugPrintf("profiler report at http://localhost:%d/, chrome trace at http://localhost:%d/trace\n", srv.GetPort(), srv.GetPort());
+    while (!Exit) {
+        if (!srv.CanAccept(0.1f)) {
+            continue;
+        }
+        THttpRequest req;
+        SOCKET s = srv.AcceptNonBlocking(&req);
+        if (s == INVALID_SOCKET) {
+            continue;
+        }
+        if (req.Req == "") {
+            TString report;
+            GetReport(&report);
+            HttpReplyPlainText(s, report);
+        } else if (req.Req == "trace") {
+            TString trace;
+            GetChromeTrace(&trace);
+            HttpReplyJSON(s, trace);
+        } else {
+            ReplyNotFound(s);
+        }
+    }
+}
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <util/thread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// phase profiler
+// PROF_SCOPE("name") measures enclosing scope with rdtsc, cost is a few dozen cycles
+// each thread records events into own ring buffer and own per phase log2 histograms, no locks or shared writes
+// readers (report, chrome trace) scan all threads, events overwritten while reading are detected by write pointer and dropped
+// thread data is freed at thread exit, histograms of exited threads are kept in totals
+namespace NProf
+{
+const yint MAX_PHASE_COUNT = 64;
+const yint RING_SIZE_LN = 14;
+const yint RING_SIZE = 1ll << RING_SIZE_LN;
+// log2 histogram with 4 sub buckets per power of 2, duration resolution is 25%
+const yint HIST_BUCKET_COUNT = 256;
+
+struct TEvent
+{
+    ui64 Start = 0;
+    ui64 Finish = 0;
+    yint Phase = 0;
+};
+
+struct THist
+{
+    std::atomic<ui64> Count;
+    std::atomic<ui64> SumCycles;
+    std::atomic<ui64> MaxCycles;
+    std::atomic<ui64> Buckets[HIST_BUCKET_COUNT];
+};
+
+struct TThreadData : public TThrRefBase
+{
+    yint ThreadId = 0;
+    TString Name;
+    std::atomic<ui64> WritePtr;
+    TEvent Ring[RING_SIZE];
+    THist Hist[MAX_PHASE_COUNT];
+
+    TThreadData();
+};
+
+inline yint GetHistBucket(ui64 len)
+{
+    if (len < 4) {
+        return len;
+    }
+#ifdef _MSC_VER
+    unsigned long e;
+    _BitScanReverse64(&e, len);
+#else
+    yint e = 63 - __builtin_clzll(len);
+#endif
+    return 4 * (e - 1) + ((len >> (e - 2)) & 3);
+}
+
+inline ui64 GetHistBucketStart(yint bucket)
+{
+    if (bucket < 4) {
+        return bucket;
+    }
+    yint e = bucket / 4 + 1;
+    return (4ull + (bucket & 3)) << (e - 2);
+}
+
+
+yint RegisterPhase(const char *name);
+TThreadData *GetThreadData();
+void SetThreadName(const TString &name);
+
+inline void RecordEvent(yint phase, ui64 start, ui64 finish)
+{
+    TThreadData *td = GetThreadData();
+    // single writer per thread, relaxed load + store is enough
+    ui64 ptr = td->WritePtr.load(std::memory_order_relaxed);
+    // reader seeing this event data sees previous WritePtr store, pairs with acquire fence in reader
+    std::atomic_thread_fence(std::memory_order_release);
+    TEvent &e = td->Ring[ptr & (RING_SIZE - 1)];
+    e.Start = start;
+    e.Finish = finish;
+    e.Phase = phase;
+    td->WritePtr.store(ptr + 1, std::memory_order_release);
+
+    ui64 len = finish - start;
+    THist &h = td->Hist[phase];
+    yint bucket = GetHistBucket(len);
+    h.Count.store(h.Count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.SumCycles.store(h.SumCycles.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+    h.Buckets[bucket].store(h.Buckets[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (len > h.MaxCycles.load(std::memory_order_relaxed)) {
+        h.MaxCycles.store(len, std::memory_order_relaxed);
+    }
+}
+
+
+class TScope : public TNonCopyable
+{
+    yint Phase;
+    ui64 Start;
+public:
+    TScope(yint phase) : Phase(phase), Start(GetCycleCount()) {}
+    ~TScope() { RecordEvent(Phase, Start, GetCycleCount()); }
+};
+
+
+// text table with count, total time and duration percentiles per phase
+void GetReport(TString *pRes);
+// chrome://tracing and perfetto compatible json with recent events of all threads
+void GetChromeTrace(TString *pRes);
+void SaveChromeTrace(const TString &fileName);
+
+
+// serve report at http://host:port/ and trace at http://host:port/trace
+class TProfHttpServer : public TThrRefBase
+{
+    int Port = 0;
+    volatile bool Exit = false;
+    TThread Thr;
+public:
+    TProfHttpServer(int port);
+    ~TProfHttpServer();
+    void WorkerThread();
+};
+}
+
+#define PROF_CONCAT_IMPL(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT_IMPL(a, b)
+#define PROF_SCOPE(name)\
+    static yint PROF_CONCAT(profPhase, __LINE__) = NProf::RegisterPhase(name);\
+    NProf::TScope PROF_CONCAT(profScope, __LINE__)(PROF_CONCAT(profPhase, __LINE__))
@@ -0,0 +1,3 @@
+#pragma once
+
+#include <util/eden_core.h>
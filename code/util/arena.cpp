@@ -0,0 +1,115 @@
+#include "stdafx.h"
+#include "arena.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+TArena::~TArena()
+{
+    for (TChunk &chunk : ChunkArr) {
+        delete[] chunk.Data;
+    }
+}
+
+
+void *TArena::AllocSlow(yint sz, yint align)
+{
+    // advance to next chunk which fits allocation, allocate new chunk if there is none
+    for (;;) {
+        ++CurChunk;
+        if (CurChunk == YSize(ChunkArr)) {
+            TChunk chunk;
+            chunk.Size = Max<yint>(ChunkSize, sz + align);
+            chunk.Data = new char[chunk.Size];
+            ChunkArr.push_back(chunk);
+        }
+        TChunk &chunk = ChunkArr[CurChunk];
+        Ptr = chunk.Data;
+        End = chunk.Data + chunk.Size;
+        char *res = (char *)((((ui64)Ptr) + align - 1) & ~(ui64)(align - 1));
+        if (res + sz <= End) {
+            Ptr = res + sz;
+            AllocatedSize += sz;
+            return res;
+        }
+    }
+}
+
+
+void TArena::Reset()
+{
+    CurChunk = -1;
+    Ptr = nullptr;
+    End = nullptr;
+    AllocatedSize = 0;
+}
+
+
+yint TArena::GetReservedSize() const
+{
+    yint res = 0;
+    for (const TChunk &chunk : ChunkArr) {
+        res += chunk.Size;
+    }
+    return res;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static thread_local TArena *ThreadArena;
+
+TArena *GetThreadArena()
+{
+    return ThreadArena;
+}
+
+
+TArenaScope::TArenaScope(TArena *arena)
+{
+    PrevArena = ThreadArena;
+    ThreadArena = arena;
+}
+
+
+TArenaScope::~TArenaScope()
+{
+    ThreadArena = PrevArena;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// build nested vectors like batch construction does, compare global allocator and arena
+template <class TVec, class TVecVec>
+static ui64 RunArenaBench(TArena *arena, yint iterCount)
+{
+    const yint ROW_COUNT = 4096;
+    ui64 sum = 0;
+    ui64 tStart = GetCycleCount();
+    for (yint iter = 0; iter < iterCount; ++iter) {
+        if (arena) {
+            arena->Reset();
+        }
+        TArenaScope arenaScope(arena);
+        TVecVec rows;
+        rows.resize(ROW_COUNT);
+        for (yint y = 0; y < ROW_COUNT; ++y) {
+            TVec &row = rows[y];
+            for (yint x = 0; x < 1 + (y & 7); ++x) {
+                row.push_back(x + y);
+            }
+        }
+        sum += rows[ROW_COUNT - 1].back();
+    }
+    Y_VERIFY(sum == iterCount * (ROW_COUNT - 1 + 7));
+    return (GetCycleCount() - tStart) / iterCount;
+}
+
+
+void BenchmarkArena()
+{
+    const yint ITER_COUNT = 1000;
+    TArena arena;
+    ui64 tHeap = RunArenaBench<TVector<yint>, TVector<TVector<yint>>>(nullptr, ITER_COUNT);
+    ui64 tArena = RunArenaBench<TArenaVector<yint>, TArenaVector<TArenaVector<yint>>>(&arena, ITER_COUNT);
+    DebugPrintf("nested vectors build, global allocator %g cycles, arena %g cycles, arena reserved %g mb\n",
+        tHeap * 1., tArena * 1., arena.GetReservedSize() / 1e6);
+}
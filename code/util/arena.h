@@ -0,0 +1,99 @@
+#pragma once
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// bump pointer arena for data sharing lifetime (one batch, one iteration)
+// memory is taken from global allocator in huge page sized chunks, hu_alloc serves them from its large blocks
+// individual frees are no-ops, Reset() releases everything at once and keeps chunks for reuse
+const yint ARENA_CHUNK_SIZE = 1ll << 21;
+const yint ARENA_DEFAULT_ALIGN = 16;
+
+class TArena : public TNonCopyable
+{
+    struct TChunk
+    {
+        char *Data = nullptr;
+        yint Size = 0;
+    };
+    TVector<TChunk> ChunkArr;
+    yint ChunkSize = ARENA_CHUNK_SIZE;
+    yint CurChunk = -1;
+    char *Ptr = nullptr;
+    char *End = nullptr;
+    yint AllocatedSize = 0;
+
+    void *AllocSlow(yint sz, yint align);
+
+public:
+    TArena(yint chunkSize = ARENA_CHUNK_SIZE) : ChunkSize(chunkSize) {}
+    ~TArena();
+    void *Alloc(yint sz, yint align = ARENA_DEFAULT_ALIGN)
+    {
+        char *res = (char *)((((ui64)Ptr) + align - 1) & ~(ui64)(align - 1));
+        if (res + sz <= End && Ptr) {
+            Ptr = res + sz;
+            AllocatedSize += sz;
+            return res;
+        }
+        return AllocSlow(sz, align);
+    }
+    void Reset();
+    yint GetAllocatedSize() const { return AllocatedSize; } // since last reset
+    yint GetReservedSize() const;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// per thread arena mode
+// default constructed TArenaAllocator takes arena selected for the current thread with TArenaScope
+// without selected arena it falls back to global allocator
+TArena *GetThreadArena();
+
+class TArenaScope : public TNonCopyable
+{
+    TArena *PrevArena = nullptr;
+public:
+    TArenaScope(TArena *arena);
+    ~TArenaScope();
+};
+
+
+template <class T>
+struct TArenaAllocator
+{
+    typedef T value_type;
+    TArena *Arena = nullptr;
+
+    TArenaAllocator() : Arena(GetThreadArena()) {}
+    TArenaAllocator(TArena *arena) : Arena(arena) {}
+    template <class U> TArenaAllocator(const TArenaAllocator<U> &x) : Arena(x.Arena) {}
+    template <class U> struct rebind { typedef TArenaAllocator<U> other; };
+
+    T *allocate(yint n)
+    {
+        if (Arena) {
+            return (T *)Arena->Alloc(n * sizeof(T), Max<yint>(ARENA_DEFAULT_ALIGN, alignof(T)));
+        } else {
+            return (T *) new char[n * sizeof(T)];
+        }
+    }
+    void deallocate(T *p, yint)
+    {
+        if (!Arena) {
+            delete[]((char *)p);
+        }
+    }
+};
+
+template <class T, class U>
+inline bool operator==(const TArenaAllocator<T> &a, const TArenaAllocator<U> &b) { return a.Arena == b.Arena; }
+template <class T, class U>
+inline bool operator!=(const TArenaAllocator<T> &a, const TArenaAllocator<U> &b) { return a.Arena != b.Arena; }
+
+
+// vector for batch scoped data, should not outlive arena Reset()
+template <class T>
+using TArenaVector = TVector<T, TArenaAllocator<T>>;
+
+
+void BenchmarkArena();
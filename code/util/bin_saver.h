@@ -2,6 +2,7 @@
 #include "fast_io.h"
 
 template <class T> class TArray2D;
+template <class TKey, class TValue, class THash, class TEqual> class TFlatHashMap;
 template<int n> struct TInt2Type {};
 
 
@@ -20,6 +21,8 @@ private:
     static int __cdecl TestDataPath(list<T1>*) { return 0; }
 	template<class T1, class T2, class T3>
     static int __cdecl TestDataPath(THashMap<T1,T2,T3>*) { return 0; }
+	template<class T1, class T2, class T3, class T4>
+    static int __cdecl TestDataPath(TFlatHashMap<T1,T2,T3,T4>*) { return 0; }
 	//
 	template<class T>
 	void __cdecl CallObjectSerialize(T *p, ...)
@@ -40,6 +43,9 @@ private:
 		if (IsReading) {
 			data.clear();
 			Add(&nSize);
+			if (!CheckReadSize(nSize, 1)) {
+				nSize = 0;
+			}
 			data.yresize(nSize);
 		} else {
 			nSize = YSize(data);
@@ -55,6 +61,9 @@ private:
         if (IsReading) {
             data.clear();
             Add(&nSize);
+            if (!CheckReadSize(nSize, sizeof(T))) {
+                nSize = 0;
+            }
             data.yresize(nSize);
         } else {
             nSize = YSize(data);
@@ -70,6 +79,9 @@ private:
 			data.clear();
 			yint nSize;
 			Add(&nSize);
+			if (!CheckReadSize(nSize, 1)) {
+				nSize = 0;
+			}
 			TVector<T1> indices;
 			indices.resize(nSize);
 			for (yint i = 0; i < nSize; ++i) {
@@ -95,12 +107,46 @@ private:
             }
 		}
 	}
+	// TFlatHashMap, same format as THashMap
+	template <class T1, class T2, class T3, class T4>
+	void DoFlatHashMap(TFlatHashMap<T1,T2,T3,T4> &data)
+	{
+		yint nSize = YSize(data);
+		Add(&nSize);
+		if (IsReading) {
+			if (!CheckReadSize(nSize, 1)) {
+				nSize = 0;
+			}
+			data.clear();
+			data.reserve(nSize);
+			TVector<T1> indices;
+			indices.resize(nSize);
+			for (yint i = 0; i < nSize; ++i) {
+				Add(&indices[i]);
+			}
+			for (yint i = 0; i < nSize; ++i) {
+				Add(&data[indices[i]]);
+			}
+		} else {
+			for (auto pos = data.begin(); pos != data.end(); ++pos) {
+				T1 key = pos->first;
+				Add(&key);
+			}
+			for (auto pos = data.begin(); pos != data.end(); ++pos) {
+				Add(&pos->second);
+			}
+		}
+	}
 	template<class T> void Do2DArray(TArray2D<T> &a)
 	{
 		yint nXSize = GetXSize(a), nYSize = GetYSize(a);
 		Add(&nXSize);
 		Add(&nYSize);
 		if (IsReading) {
+            if (!Check2DReadSize(nXSize, nYSize, 1)) {
+                nXSize = 0;
+                nYSize = 0;
+            }
             a.SetSizes(nXSize, nYSize);
         }
         for (yint y = 0; y < nYSize; ++y) {
@@ -115,6 +161,10 @@ private:
         Add(&nXSize);
 	    Add(&nYSize);
         if (IsReading) {
+            if (!Check2DReadSize(nXSize, nYSize, sizeof(T))) {
+                nXSize = 0;
+                nYSize = 0;
+            }
             a.SetSizes(nXSize, nYSize);
         }
         if (nXSize * nYSize > 0) {
@@ -126,6 +176,23 @@ private:
     TBufferedStream &BufIO;
 	bool IsReading;
 
+    // size read from corrupted data can exceed data left in memory stream, such size is replaced with zero
+    bool CheckReadSize(yint count, yint elemSize)
+    {
+        if (count < 0 || count > BufIO.GetUnreadBytes() / elemSize) {
+            BufIO.SetCorrupted();
+            return false;
+        }
+        return true;
+    }
+    bool Check2DReadSize(yint xSize, yint ySize, yint elemSize)
+    {
+        if (!CheckReadSize(xSize, elemSize) || !CheckReadSize(ySize, elemSize)) {
+            return false;
+        }
+        return xSize == 0 || CheckReadSize(ySize, xSize * elemSize);
+    }
+
 	void DataChunk(void *pData, yint size)
 	{
 		if (IsReading) {
@@ -139,6 +206,9 @@ private:
         if (IsReading) {
             int count = 0;
             BufIO.Read(&count, 4);
+            if (!CheckReadSize(count, 1)) {
+                count = 0;
+            }
             if (count > 0) {
                 data.resize(count);
                 BufIO.Read(&data[0], count);
@@ -186,6 +256,11 @@ public:
 	{
 		DoHashMap(*pHash);
 	}
+	template<class T1, class T2, class T3, class T4>
+	void Add(TFlatHashMap<T1,T2,T3,T4> *pHash)
+	{
+		DoFlatHashMap(*pHash);
+	}
 	template<class T1>
 	void Add(TArray2D<T1> *pArr)
 	{
@@ -202,6 +277,9 @@ public:
 		if (IsReading) {
 			yint nSize;
 			Add(&nSize);
+			if (!CheckReadSize(nSize, 1)) {
+				nSize = 0;
+			}
 			data.clear();
 			data.insert(data.begin(), nSize, T1());
 		} else {
@@ -262,5 +340,20 @@ inline void Serialize(bool bRead, const TString &szName, T &c)
 	f.Add(&c);
 }
 
+// reads whole file to memory first, returns false if file is missing, truncated or has inconsistent sizes
+template<class T>
+inline bool SerializeChecked(const TString &szName, T &c)
+{
+    TVector<ui8> data;
+    if (!ReadWholeFile(szName, &data)) {
+        return false;
+    }
+    TMemStream mem(&data);
+    TBufferedStream bufIO(mem, true);
+    IBinSaver f(bufIO);
+    f.Add(&c);
+    return !bufIO.IsCorrupted() && bufIO.GetUnreadBytes() == 0;
+}
+
 #define SAVELOAD(...) int operator&(IBinSaver &f) { f.AddVariadic(__VA_ARGS__); return 0; }
 #define SAVELOAD_OVERRIDE(...) int operator&(IBinSaver &f) override { f.AddVariadic(__VA_ARGS__); return 0; }
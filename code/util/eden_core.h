@@ -165,6 +165,7 @@ typedef std::ofstream TOFStream;
 #include "atomic.h"
 #include "2Darray.h"
 #include "bin_saver.h"
+#include "flat_hash_map.h"
 
 template<class T> struct nstl::hash<TIntrusivePtr<T>>
 {
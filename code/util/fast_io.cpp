@@ -75,14 +75,15 @@ void TBufferedStream::WriteLarge(const void *userBuffer, yint size)
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-bool ReadWholeFile(const TString &szFileName, TVector<char> *res)
+template <class T>
+static bool ReadWholeFileImpl(const TString &szFileName, TVector<T> *res)
 {
     res->resize(0);
     TFileStream fs(true, szFileName);
     if (fs.IsValid()) {
         yint sz = fs.GetLength();
         res->yresize(sz);
-        yint readCount = fs.Read(&(*res)[0], sz);
+        yint readCount = fs.Read(res->data(), sz);
         if (readCount == sz) {
             return true;
         }
@@ -91,3 +92,14 @@ bool ReadWholeFile(const TString &szFileName, TVector<char> *res)
     return false;
 }
 
+
+bool ReadWholeFile(const TString &szFileName, TVector<char> *res)
+{
+    return ReadWholeFileImpl(szFileName, res);
+}
+
+
+bool ReadWholeFile(const TString &szFileName, TVector<ui8> *res)
+{
+    return ReadWholeFileImpl(szFileName, res);
+}
@@ -101,6 +101,11 @@ public:
         i.LowPart = SetFilePointer(hFile, i.LowPart, &i.HighPart, FILE_BEGIN);
         return i.QuadPart;
     }
+    bool Flush()
+    {
+        // write file data to disk
+        return FlushFileBuffers(hFile) != 0;
+    }
     bool IsValid() const { return hFile != INVALID_HANDLE_VALUE; }
     bool IsFailed() const { return bFailed; }
 };
@@ -158,6 +163,11 @@ public:
         fseeko(File, pos, SEEK_SET);
         return ftello(File);
     }
+    bool Flush()
+    {
+        // write file data to disk
+        return File && fflush(File) == 0 && fsync(fileno(File)) == 0;
+    }
     bool IsValid() const { return File != 0; }
     bool IsFailed() const { return File == 0; } // no recovery after fail so we just close the file in such case
 };
@@ -257,6 +267,7 @@ class TBufferedStream : public TNonCopyable
     yint StartStreamSize = 0;
     bool IsReadingFlag = false;
     bool IsEof = false;
+    bool IsCorruptedFlag = false;
 
 private:
     void ReadLarge(void *userBuffer, yint size);
@@ -284,6 +295,23 @@ public:
     {
         return IsReadingFlag;
     }
+    // bytes left to read are known for memory stream only
+    yint GetUnreadBytes() const
+    {
+        if (MemStream) {
+            return IsEof ? 0 : BufSize - Pos;
+        }
+        return PTRDIFF_MAX;
+    }
+    // read past end of data or inconsistent size was found
+    void SetCorrupted()
+    {
+        IsCorruptedFlag = true;
+    }
+    bool IsCorrupted() const
+    {
+        return IsCorruptedFlag || IsEof;
+    }
     inline void Read(void *userBuffer, yint size)
     {
         Y_ASSERT(IsReadingFlag);
@@ -349,3 +377,4 @@ public:
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 bool ReadWholeFile(const TString &szFileName, TVector<char> *res);
+bool ReadWholeFile(const TString &szFileName, TVector<ui8> *res);
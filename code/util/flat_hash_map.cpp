@@ -0,0 +1,76 @@
+#include "stdafx.h"
+#include "flat_hash_map.h"
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// insert keys, lookup keys and same count of missing keys
+// lookup order is shuffled, sequential order favours node based map with nodes allocated in insertion order
+template <class TMap, class TKey>
+static void RunHashBench(const char *name, const TVector<TKey> &keyArr, const TVector<TKey> &missArr, const TVector<yint> &order)
+{
+    const yint ITER_COUNT = 10;
+    ui64 tInsert = 0;
+    ui64 tFind = 0;
+    yint found = 0;
+    for (yint iter = 0; iter < ITER_COUNT; ++iter) {
+        TMap map;
+        ui64 tStart = GetCycleCount();
+        for (yint k = 0; k < YSize(keyArr); ++k) {
+            map[keyArr[k]] = k;
+        }
+        tInsert += GetCycleCount() - tStart;
+        tStart = GetCycleCount();
+        for (yint k : order) {
+            found += (map.find(keyArr[k]) != map.end());
+            found += (map.find(missArr[k]) != map.end());
+        }
+        tFind += GetCycleCount() - tStart;
+    }
+    Y_VERIFY(found == ITER_COUNT * YSize(keyArr));
+    double count = ITER_COUNT * YSize(keyArr);
+    DebugPrintf("%s: insert %g cycles, find %g cycles per key\n", name, tInsert / count, tFind / count / 2);
+}
+
+
+void BenchmarkFlatHashMap()
+{
+    const yint KEY_COUNT = 1 << 18;
+    ui64 rng = 1313;
+    auto nextRand = [&]() {
+        rng = rng * 0x5851f42d4c957f2dULL + 0x14057b7ef767814fULL;
+        return rng >> 33;
+    };
+    TVector<yint> order;
+    for (yint k = 0; k < KEY_COUNT; ++k) {
+        order.push_back(k);
+    }
+    for (yint k = KEY_COUNT - 1; k > 0; --k) {
+        nstl::swap(order[k], order[nextRand() % (k + 1)]);
+    }
+
+    // distinct integer keys, hit and miss sets do not intersect
+    TVector<yint> intKeys;
+    TVector<yint> intMiss;
+    for (yint k = 0; k < KEY_COUNT; ++k) {
+        intKeys.push_back(k * 2 * 0x9e3779b1);
+        intMiss.push_back((k * 2 + 1) * 0x9e3779b1);
+    }
+    RunHashBench<THashMap<yint, yint>>("THashMap<yint>", intKeys, intMiss, order);
+    RunHashBench<TFlatHashMap<yint, yint>>("TFlatHashMap<yint>", intKeys, intMiss, order);
+
+    // word like string keys
+    TVector<TString> strKeys;
+    TVector<TString> strMiss;
+    for (yint k = 0; k < KEY_COUNT; ++k) {
+        TString word;
+        yint len = 2 + nextRand() % 10;
+        for (yint t = 0; t < len; ++t) {
+            word.push_back('a' + nextRand() % 26);
+        }
+        // odd/even suffix separates hit and miss sets
+        strKeys.push_back(word + Sprintf("%d", (int)(k * 2)));
+        strMiss.push_back(word + Sprintf("%d", (int)(k * 2 + 1)));
+    }
+    RunHashBench<THashMap<TString, yint>>("THashMap<TString>", strKeys, strMiss, order);
+    RunHashBench<TFlatHashMap<TString, yint>>("TFlatHashMap<TString>", strKeys, strMiss, order);
+}
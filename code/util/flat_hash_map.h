@@ -0,0 +1,396 @@
+#pragma once
+#include <emmintrin.h>
+#include <new>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// string reference for lookups without building TString
+struct TStringView
+{
+    const char *Data = nullptr;
+    yint Size = 0;
+
+    TStringView() {}
+    TStringView(const char *data, yint size) : Data(data), Size(size) {}
+    TStringView(const TString &str) : Data(str.data()), Size(YSize(str)) {}
+};
+
+inline bool operator==(const TString &a, const TStringView &b)
+{
+    return YSize(a) == b.Size && memcmp(a.data(), b.Data, b.Size) == 0;
+}
+
+
+inline ui64 FlatHashBytes(const char *data, yint len)
+{
+    ui64 h = 0x9ae16a3b2f90404fULL ^ len;
+    for (; len >= 8; data += 8, len -= 8) {
+        ui64 x;
+        memcpy(&x, data, 8);
+        h = (h ^ x) * 0xc949d7c7509e6557ULL;
+        h ^= h >> 32;
+    }
+    if (len > 0) {
+        ui64 x = 0;
+        memcpy(&x, data, len);
+        h = (h ^ x) * 0xc949d7c7509e6557ULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+
+// table mixes hash value, so identity hash for integers is fine
+template <class T>
+struct TFlatHash
+{
+    ui64 operator()(const T &x) const { return nstl::hash<T>()(x); }
+};
+
+template <>
+struct TFlatHash<TString>
+{
+    ui64 operator()(const TString &x) const { return FlatHashBytes(x.data(), YSize(x)); }
+    ui64 operator()(const TStringView &x) const { return FlatHashBytes(x.Data, x.Size); }
+};
+
+
+struct TFlatKeyEqual
+{
+    template <class TKey, class TLookup>
+    bool operator()(const TKey &a, const TLookup &b) const { return a == b; }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// open addressing hash map with swiss table layout
+// control byte per slot holds 7 bits of hash for full slots, groups of 16 control bytes are probed with SSE2
+// probe sequence visits whole groups in triangular order, max load factor is 7/8
+// lookup key can be any type accepted by THash and TEqual (TStringView for TString keys)
+// unlike THashMap pointers to elements are invalidated by insertion
+template <class TKey, class TValue, class THash = TFlatHash<TKey>, class TEqual = TFlatKeyEqual>
+class TFlatHashMap
+{
+public:
+    typedef pair<const TKey, TValue> value_type;
+
+private:
+    enum {
+        GROUP_SIZE = 16,
+        CTRL_EMPTY = -128,
+        CTRL_DELETED = -2,
+    };
+
+    __m128i *Ctrl = nullptr;
+    value_type *Slots = nullptr;
+    yint Capacity = 0; // power of 2, multiple of GROUP_SIZE
+    yint Size = 0;
+    yint GrowthLeft = 0; // empty slots we can fill before rehash
+
+    static ui64 Mix(ui64 h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+    static i8 H2(ui64 h) { return (i8)(h >> 57); }
+    static yint FirstBit(ui32 mask)
+    {
+#ifdef _MSC_VER
+        unsigned long res;
+        _BitScanForward(&res, mask);
+        return res;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+    i8 *GetCtrl() const { return (i8 *)Ctrl; }
+    bool IsFull(yint idx) const { return GetCtrl()[idx] >= 0; }
+
+    template <class TLookup>
+    yint FindIndex(const TLookup &key, ui64 h) const
+    {
+        if (Capacity == 0) {
+            return -1;
+        }
+        __m128i match = _mm_set1_epi8(H2(h));
+        __m128i empty = _mm_set1_epi8((char)CTRL_EMPTY);
+        yint groupMask = Capacity / GROUP_SIZE - 1;
+        yint g = h & groupMask;
+        for (yint step = 1;; ++step) {
+            __m128i ctrl = _mm_load_si128(Ctrl + g);
+            ui32 bits = _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, match));
+            while (bits) {
+                yint idx = g * GROUP_SIZE + FirstBit(bits);
+                if (TEqual()(Slots[idx].first, key)) {
+                    return idx;
+                }
+                bits &= bits - 1;
+            }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, empty))) {
+                return -1;
+            }
+            g = (g + step) & groupMask;
+        }
+    }
+
+    // first empty or deleted slot in probe sequence
+    yint FindFreeIndex(ui64 h) const
+    {
+        yint groupMask = Capacity / GROUP_SIZE - 1;
+        yint g = h & groupMask;
+        for (yint step = 1;; ++step) {
+            // full slots have high bit clear
+            ui32 bits = _mm_movemask_epi8(_mm_load_si128(Ctrl + g));
+            if (bits) {
+                return g * GROUP_SIZE + FirstBit(bits);
+            }
+            g = (g + step) & groupMask;
+        }
+    }
+
+    void Allocate(yint capacity)
+    {
+        Capacity = capacity;
+        Size = 0;
+        GrowthLeft = capacity - capacity / 8;
+        Ctrl = new __m128i[capacity / GROUP_SIZE];
+        memset(Ctrl, CTRL_EMPTY, capacity);
+        Slots = (value_type *) new char[capacity * sizeof(value_type)];
+    }
+
+    void Free()
+    {
+        for (yint idx = 0; idx < Capacity; ++idx) {
+            if (IsFull(idx)) {
+                Slots[idx].~value_type();
+            }
+        }
+        delete[] Ctrl;
+        delete[]((char *)Slots);
+        Ctrl = nullptr;
+        Slots = nullptr;
+        Capacity = 0;
+        Size = 0;
+        GrowthLeft = 0;
+    }
+
+    static yint CalcCapacity(yint count)
+    {
+        yint res = GROUP_SIZE;
+        while (res - res / 8 < count) {
+            res *= 2;
+        }
+        return res;
+    }
+
+    void Rehash(yint capacity)
+    {
+        __m128i *oldCtrl = Ctrl;
+        value_type *oldSlots = Slots;
+        yint oldCapacity = Capacity;
+        Allocate(capacity);
+        for (yint idx = 0; idx < oldCapacity; ++idx) {
+            if (((i8 *)oldCtrl)[idx] >= 0) {
+                value_type &src = oldSlots[idx];
+                ui64 h = Mix(THash()(src.first));
+                yint dst = FindFreeIndex(h);
+                GetCtrl()[dst] = H2(h);
+                new (&Slots[dst]) value_type(src);
+                src.~value_type();
+                ++Size;
+                --GrowthLeft;
+            }
+        }
+        delete[] oldCtrl;
+        delete[]((char *)oldSlots);
+    }
+
+    // returns slot index, *pNew is set if slot is not constructed yet
+    yint FindOrPrepareInsert(const TKey &key, bool *pNew)
+    {
+        ui64 h = Mix(THash()(key));
+        yint idx = FindIndex(key, h);
+        if (idx >= 0) {
+            *pNew = false;
+            return idx;
+        }
+        if (Capacity == 0) {
+            Allocate(GROUP_SIZE);
+        }
+        idx = FindFreeIndex(h);
+        if (GetCtrl()[idx] == CTRL_EMPTY && GrowthLeft == 0) {
+            // grow if table is full of live elements, otherwise just drop deleted slots
+            yint newCapacity = (Size * 2 >= Capacity - Capacity / 8) ? Capacity * 2 : Capacity;
+            Rehash(newCapacity);
+            idx = FindFreeIndex(h);
+        }
+        if (GetCtrl()[idx] == CTRL_EMPTY) {
+            --GrowthLeft;
+        }
+        GetCtrl()[idx] = H2(h);
+        ++Size;
+        *pNew = true;
+        return idx;
+    }
+
+    void EraseIndex(yint idx)
+    {
+        Slots[idx].~value_type();
+        --Size;
+        // probing stops at groups with empty slots, so slot can become empty if its group has one
+        yint g = idx / GROUP_SIZE;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(Ctrl + g), _mm_set1_epi8((char)CTRL_EMPTY)))) {
+            GetCtrl()[idx] = CTRL_EMPTY;
+            ++GrowthLeft;
+        } else {
+            GetCtrl()[idx] = CTRL_DELETED;
+        }
+    }
+
+public:
+    template <class TMap, class TElem>
+    class TIteratorBase
+    {
+        friend class TFlatHashMap;
+        TMap *Map = nullptr;
+        yint Idx = 0;
+
+        void SkipEmpty()
+        {
+            while (Idx < Map->Capacity && !Map->IsFull(Idx)) {
+                ++Idx;
+            }
+        }
+    public:
+        TIteratorBase() {}
+        TIteratorBase(TMap *map, yint idx) : Map(map), Idx(idx) {}
+        template <class TOtherMap, class TOtherElem>
+        TIteratorBase(const TIteratorBase<TOtherMap, TOtherElem> &x) : Map(x.Map), Idx(x.Idx) {}
+        TElem &operator*() const { return Map->Slots[Idx]; }
+        TElem *operator->() const { return &Map->Slots[Idx]; }
+        TIteratorBase &operator++()
+        {
+            ++Idx;
+            SkipEmpty();
+            return *this;
+        }
+        bool operator==(const TIteratorBase &x) const { return Idx == x.Idx; }
+        bool operator!=(const TIteratorBase &x) const { return Idx != x.Idx; }
+
+        template <class, class> friend class TIteratorBase;
+    };
+    typedef TIteratorBase<TFlatHashMap, value_type> iterator;
+    typedef TIteratorBase<const TFlatHashMap, const value_type> const_iterator;
+
+private:
+    template <class TIter, class TMap>
+    static TIter Begin(TMap *map)
+    {
+        TIter res(map, 0);
+        res.SkipEmpty();
+        return res;
+    }
+
+public:
+    TFlatHashMap() {}
+    TFlatHashMap(const TFlatHashMap &x)
+    {
+        *this = x;
+    }
+    ~TFlatHashMap()
+    {
+        Free();
+    }
+    TFlatHashMap &operator=(const TFlatHashMap &x)
+    {
+        if (this != &x) {
+            clear();
+            reserve(x.size());
+            for (const value_type &v : x) {
+                insert(v);
+            }
+        }
+        return *this;
+    }
+    void swap(TFlatHashMap &x)
+    {
+        nstl::swap(Ctrl, x.Ctrl);
+        nstl::swap(Slots, x.Slots);
+        nstl::swap(Capacity, x.Capacity);
+        nstl::swap(Size, x.Size);
+        nstl::swap(GrowthLeft, x.GrowthLeft);
+    }
+
+    yint size() const { return Size; }
+    bool empty() const { return Size == 0; }
+    void clear() { Free(); }
+    void reserve(yint count)
+    {
+        yint capacity = CalcCapacity(count);
+        if (capacity > Capacity) {
+            Rehash(capacity);
+        }
+    }
+
+    iterator begin() { return Begin<iterator>(this); }
+    iterator end() { return iterator(this, Capacity); }
+    const_iterator begin() const { return Begin<const_iterator>(this); }
+    const_iterator end() const { return const_iterator(this, Capacity); }
+
+    template <class TLookup>
+    iterator find(const TLookup &key)
+    {
+        yint idx = FindIndex(key, Mix(THash()(key)));
+        return iterator(this, idx >= 0 ? idx : Capacity);
+    }
+    template <class TLookup>
+    const_iterator find(const TLookup &key) const
+    {
+        yint idx = FindIndex(key, Mix(THash()(key)));
+        return const_iterator(this, idx >= 0 ? idx : Capacity);
+    }
+    template <class TLookup>
+    yint count(const TLookup &key) const
+    {
+        return FindIndex(key, Mix(THash()(key))) >= 0 ? 1 : 0;
+    }
+
+    pair<iterator, bool> insert(const value_type &x)
+    {
+        bool isNew = false;
+        yint idx = FindOrPrepareInsert(x.first, &isNew);
+        if (isNew) {
+            new (&Slots[idx]) value_type(x);
+        }
+        return pair<iterator, bool>(iterator(this, idx), isNew);
+    }
+    TValue &operator[](const TKey &key)
+    {
+        bool isNew = false;
+        yint idx = FindOrPrepareInsert(key, &isNew);
+        if (isNew) {
+            new (&Slots[idx]) value_type(key, TValue());
+        }
+        return Slots[idx].second;
+    }
+
+    void erase(iterator it)
+    {
+        EraseIndex(it.Idx);
+    }
+    template <class TLookup>
+    yint erase(const TLookup &key)
+    {
+        yint idx = FindIndex(key, Mix(THash()(key)));
+        if (idx < 0) {
+            return 0;
+        }
+        EraseIndex(idx);
+        return 1;
+    }
+};
+
+
+void BenchmarkFlatHashMap();
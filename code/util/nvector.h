@@ -32,16 +32,38 @@
 namespace nstl
 {
 
-template <class _Tp >
-class vector
+// default vector storage, global operator new
+template <class _Tp>
+struct vector_allocator
+{
+    typedef _Tp value_type;
+    vector_allocator() {}
+    template <class _Up> vector_allocator(const vector_allocator<_Up> &) {}
+    _Tp *allocate(yint __n) { return (_Tp *) new char[__n * sizeof(_Tp)]; }
+    void deallocate(_Tp *p, yint) { delete[]((char *)p); }
+};
+
+template <class _Tp, class _Up>
+inline bool operator==(const vector_allocator<_Tp> &, const vector_allocator<_Up> &) { return true; }
+template <class _Tp, class _Up>
+inline bool operator!=(const vector_allocator<_Tp> &, const vector_allocator<_Up> &) { return false; }
+
+
+// allocator is stored as base class to keep sizeof(vector) for stateless allocators
+// copy constructor copies allocator, assignment keeps it, swap exchanges it
+template <class _Tp, class _Alloc = vector_allocator<_Tp> >
+class vector : private _Alloc
 {
 private:
     _Tp *_M_start;
     _Tp *_M_finish;
     _Tp *_M_end_of_storage;
-    _Tp *alloc(yint __n) { return (_Tp *) new char[__n * sizeof(_Tp)]; }
-    void free(_Tp *p) { delete[]((char *)p); }
+    _Tp *alloc(yint __n) { return _Alloc::allocate(__n); }
+    void free(_Tp *p) { _Alloc::deallocate(p, _M_end_of_storage - p); }
 public:
+    typedef _Alloc allocator_type;
+    allocator_type get_allocator() const { return *this; }
+
     typedef _Tp value_type;
     typedef value_type *pointer;
     typedef const value_type *const_pointer;
@@ -121,22 +143,23 @@ public:
     const_reference back() const { return *(end() - 1); }
 
     explicit vector() : _M_start(0), _M_finish(0), _M_end_of_storage(0) {}
+    explicit vector(const _Alloc &__a) : _Alloc(__a), _M_start(0), _M_finish(0), _M_end_of_storage(0) {}
 
-    vector(yint __n, const _Tp &__val)
+    vector(yint __n, const _Tp &__val, const _Alloc &__a = _Alloc()) : _Alloc(__a)
     {
         _M_start = alloc(__n);//_M_end_of_storage.allocate(__n);
         _M_end_of_storage = _M_start + __n;
         this->_M_finish = uninitialized_fill_n(this->_M_start, __n, __val);
     }
 
-    explicit vector(yint __n)
+    explicit vector(yint __n, const _Alloc &__a = _Alloc()) : _Alloc(__a)
     {
         _M_start = alloc(__n);//_M_end_of_storage.allocate(__n);
         _M_end_of_storage = _M_start + __n;
         _M_finish = uninitialized_fill_n(this->_M_start, __n);
     }
 
-    vector(const vector<_Tp> &__x)
+    vector(const vector<_Tp, _Alloc> &__x) : _Alloc(__x)
     {
         _M_start = alloc(__x.size());//_M_end_of_storage.allocate(__n);
         _M_end_of_storage = _M_start + __x.size();
@@ -160,7 +183,7 @@ public:
             free(_M_start);//_M_end_of_storage.deallocate(_M_start, _M_end_of_storage._M_data - _M_start); 
     }
 
-    vector<_Tp> &operator=(const vector<_Tp> &__x);
+    vector<_Tp, _Alloc> &operator=(const vector<_Tp, _Alloc> &__x);
 
     void reserve(yint __n);
 
@@ -181,7 +204,8 @@ public:
             _M_insert_overflow(this->_M_finish, __x, 1UL, true);
     }
 
-    void swap(vector<_Tp> &__x) {
+    void swap(vector<_Tp, _Alloc> &__x) {
+        nstl::swap(static_cast<_Alloc &>(*this), static_cast<_Alloc &>(__x));
         nstl::swap(this->_M_start, __x._M_start);
         nstl::swap(this->_M_finish, __x._M_finish);
         nstl::swap(this->_M_end_of_storage, __x._M_end_of_storage);
@@ -294,8 +318,8 @@ protected:
 };
 
 
-template <class _Tp>
-void inline vector<_Tp>::reserve(yint __n)
+template <class _Tp, class _Alloc>
+void inline vector<_Tp, _Alloc>::reserve(yint __n)
 {
     if (capacity() < __n) {
         const yint __old_size = size();
@@ -311,8 +335,8 @@ void inline vector<_Tp>::reserve(yint __n)
 }
 
 
-template <class _Tp>
-void inline vector<_Tp>::_M_fill_insert(iterator __position, yint __n, const _Tp &__x)
+template <class _Tp, class _Alloc>
+void inline vector<_Tp, _Alloc>::_M_fill_insert(iterator __position, yint __n, const _Tp &__x)
 {
     if (__n != 0) {
         if (yint(this->_M_end_of_storage - this->_M_finish) >= __n) {
@@ -337,8 +361,8 @@ void inline vector<_Tp>::_M_fill_insert(iterator __position, yint __n, const _Tp
 }
 
 
-template <class _Tp>
-void inline vector<_Tp>::_M_fill_insert(iterator __position, yint __n)
+template <class _Tp, class _Alloc>
+void inline vector<_Tp, _Alloc>::_M_fill_insert(iterator __position, yint __n)
 {
     if (__n != 0) {
         if (yint(this->_M_end_of_storage - this->_M_finish) >= __n) {
@@ -361,8 +385,8 @@ void inline vector<_Tp>::_M_fill_insert(iterator __position, yint __n)
     }
 }
 
-template <class _Tp>
-inline vector<_Tp> &vector<_Tp>::operator=(const vector<_Tp> &__x)
+template <class _Tp, class _Alloc>
+inline vector<_Tp, _Alloc> &vector<_Tp, _Alloc>::operator=(const vector<_Tp, _Alloc> &__x)
 {
     if (&__x != this) {
         const yint __xlen = __x.size();
@@ -384,11 +408,11 @@ inline vector<_Tp> &vector<_Tp>::operator=(const vector<_Tp> &__x)
 }
 
 
-template <class _Tp>
-inline void vector<_Tp>::_M_fill_assign(yint __n, const _Tp &__val)
+template <class _Tp, class _Alloc>
+inline void vector<_Tp, _Alloc>::_M_fill_assign(yint __n, const _Tp &__val)
 {
     if (__n > capacity()) {
-        vector<_Tp> __tmp(__n, __val);
+        vector<_Tp, _Alloc> __tmp(__n, __val, *this);
         __tmp.swap(*this);
     } else if (__n > size()) {
         fill(begin(), end(), __val);
@@ -398,15 +422,15 @@ inline void vector<_Tp>::_M_fill_assign(yint __n, const _Tp &__val)
 }
 
 
-template <class _Tp>
-inline bool  operator==(const vector<_Tp> &__x, const vector<_Tp> &__y)
+template <class _Tp, class _Alloc>
+inline bool  operator==(const vector<_Tp, _Alloc> &__x, const vector<_Tp, _Alloc> &__y)
 {
     return __x.size() == __y.size() &&
         equal(__x.begin(), __x.end(), __y.begin());
 }
 
-template <class T>
-inline bool operator!=(const vector<T> &a, const vector<T> &b)
+template <class T, class A>
+inline bool operator!=(const vector<T, A> &a, const vector<T, A> &b)
 {
     return !(a == b);
 }
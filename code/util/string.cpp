@@ -143,6 +143,24 @@ char Unicode2Win(yint key)
 }
 
 
+// quotes, backslashes and control chars are escaped, other bytes are copied as is
+TString EncodeJSON(const TString &str)
+{
+    TString res;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if ((ui8)c < 0x20) {
+            res += Sprintf("\\u%04x", (int)(ui8)c);
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
+
+
 //#include <codecvt>
 //#include <locale>
 //void BuildTable()
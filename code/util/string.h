@@ -3,3 +3,5 @@
 TString Utf2Win(const TString &utf8);
 TString Win2Utf(const TString &cp1251);
 char Unicode2Win(yint key);
+// string literal contents for json
+TString EncodeJSON(const TString &str);
@@ -1,5 +1,9 @@
 #include "stdafx.h"
 #include "thread.h"
+#include <immintrin.h>
+#ifndef _MSC_VER
+#include <sys/syscall.h>
+#endif
 
 #ifdef _MSC_VER
 void SetIdlePriority()
@@ -10,4 +14,411 @@ void SetIdlePriority()
 void SetIdlePriority()
 {
 }
-#endif
\ No newline at end of file
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// cpu affinity
+#ifdef _MSC_VER
+yint GetCpuCount()
+{
+    return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+}
+
+yint GetNumaNodeCount()
+{
+    ULONG highestNode = 0;
+    if (!GetNumaHighestNodeNumber(&highestNode)) {
+        return 1;
+    }
+    return highestNode + 1;
+}
+
+void GetNumaNodeCpuList(yint node, TVector<int> *pRes)
+{
+    pRes->resize(0);
+    GROUP_AFFINITY ga;
+    Zero(ga);
+    if (!GetNumaNodeProcessorMaskEx((USHORT)node, &ga)) {
+        return;
+    }
+    for (yint k = 0; k < 64; ++k) {
+        if (ga.Mask & (1ull << k)) {
+            pRes->push_back(ga.Group * 64 + k);
+        }
+    }
+}
+
+void SetThreadAffinity(const TVector<int> &cpuList)
+{
+    // thread can belong to single processor group only, use group of the first cpu
+    if (cpuList.empty()) {
+        return;
+    }
+    GROUP_AFFINITY ga;
+    Zero(ga);
+    ga.Group = cpuList[0] / 64;
+    for (int cpu : cpuList) {
+        if (cpu / 64 == ga.Group) {
+            ga.Mask |= 1ull << (cpu % 64);
+        }
+    }
+    SetThreadGroupAffinity(GetCurrentThread(), &ga, nullptr);
+}
+
+// memory can not be moved after allocation on windows, rely on first touch
+void SetMemoryNumaNode(void *p, yint sz, yint node)
+{
+    (void)p;
+    (void)sz;
+    (void)node;
+}
+
+void SetMemoryInterleaved(void *p, yint sz)
+{
+    (void)p;
+    (void)sz;
+}
+
+#else
+static bool ParseCpuList(const TString &fname, TVector<int> *pRes)
+{
+    // format is like "0-3,8-11"
+    pRes->resize(0);
+    FILE *f = fopen(fname.c_str(), "r");
+    if (f == nullptr) {
+        return false;
+    }
+    char buf[4096];
+    bool ok = (fgets(buf, sizeof(buf), f) != nullptr);
+    fclose(f);
+    if (!ok) {
+        return false;
+    }
+    const char *ptr = buf;
+    while (*ptr >= '0' && *ptr <= '9') {
+        char *next = nullptr;
+        int from = strtol(ptr, &next, 10);
+        int to = from;
+        ptr = next;
+        if (*ptr == '-') {
+            to = strtol(ptr + 1, &next, 10);
+            ptr = next;
+        }
+        for (int cpu = from; cpu <= to; ++cpu) {
+            pRes->push_back(cpu);
+        }
+        if (*ptr == ',') {
+            ++ptr;
+        }
+    }
+    return true;
+}
+
+yint GetCpuCount()
+{
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+yint GetNumaNodeCount()
+{
+    TVector<int> nodeList;
+    if (!ParseCpuList("/sys/devices/system/node/online", &nodeList) || nodeList.empty()) {
+        return 1;
+    }
+    return nodeList.back() + 1;
+}
+
+void GetNumaNodeCpuList(yint node, TVector<int> *pRes)
+{
+    if (!ParseCpuList(Sprintf("/sys/devices/system/node/node%d/cpulist", (int)node), pRes)) {
+        // no numa info, single node with all cpus
+        pRes->resize(0);
+        if (node == 0) {
+            for (yint cpu = 0; cpu < GetCpuCount(); ++cpu) {
+                pRes->push_back(cpu);
+            }
+        }
+    }
+}
+
+void SetThreadAffinity(const TVector<int> &cpuList)
+{
+    if (cpuList.empty()) {
+        return;
+    }
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (int cpu : cpuList) {
+        CPU_SET(cpu, &cpuSet);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+}
+
+// mbind() without libnuma dependency
+static void MBind(void *p, yint sz, int mode, ui64 nodeMask)
+{
+    const yint PAGE_SIZE = 4096;
+    yint beg = ((yint)p + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    yint fin = ((yint)p + sz) & ~(PAGE_SIZE - 1);
+    if (fin <= beg) {
+        return;
+    }
+    const int MPOL_MF_MOVE_FLAG = 2;
+    syscall(SYS_mbind, beg, fin - beg, mode, &nodeMask, 64, MPOL_MF_MOVE_FLAG);
+}
+
+void SetMemoryNumaNode(void *p, yint sz, yint node)
+{
+    const int MPOL_BIND_MODE = 2;
+    if (node < 64) {
+        MBind(p, sz, MPOL_BIND_MODE, 1ull << node);
+    }
+}
+
+void SetMemoryInterleaved(void *p, yint sz)
+{
+    const int MPOL_INTERLEAVE_MODE = 3;
+    yint nodeCount = Min<yint>(64, GetNumaNodeCount());
+    if (nodeCount > 1) {
+        MBind(p, sz, MPOL_INTERLEAVE_MODE, (nodeCount == 64) ? ~0ull : ((1ull << nodeCount) - 1));
+    }
+}
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// thread pool
+TThreadPool::TThreadPool(yint threadCount, EThreadPin pin, yint numaNode) : Queue(QUEUE_SIZE), ThreadCount(0), ParkedCount(0), Exit(false)
+{
+    TVector<int> cpuList;
+    if (numaNode >= 0) {
+        GetNumaNodeCpuList(numaNode, &cpuList);
+    } else {
+        for (yint cpu = 0; cpu < GetCpuCount(); ++cpu) {
+            cpuList.push_back(cpu);
+        }
+    }
+    ThreadCpuList.resize(threadCount);
+    for (yint k = 0; k < threadCount; ++k) {
+        if (cpuList.empty()) {
+            continue;
+        }
+        if (pin == PIN_CORE) {
+            ThreadCpuList[k].push_back(cpuList[k % YSize(cpuList)]);
+        } else if (pin == PIN_NUMA_NODE) {
+            ThreadCpuList[k] = cpuList;
+        }
+    }
+    ThreadArr.resize(threadCount);
+    for (yint k = 0; k < threadCount; ++k) {
+        ThreadArr[k] = new TPoolThread();
+        ThreadArr[k]->Thr.Create(this);
+    }
+}
+
+
+TThreadPool::~TThreadPool()
+{
+    Exit = true;
+    {
+        std::lock_guard<std::mutex> lock(ParkLock);
+        ParkCond.notify_all();
+    }
+    for (TIntrusivePtr<TPoolThread> &thr : ThreadArr) {
+        thr->Thr.Join();
+    }
+    while (RunOneJob()) {
+        ;
+    }
+}
+
+
+void TThreadPool::Submit(IThreadPoolJob *job)
+{
+    job->Ref();
+    while (!Queue.Enqueue(job)) {
+        RunOneJob();
+    }
+    // pairs with fence in Park(), either parking worker finds the job or we see it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ParkedCount.load() > 0) {
+        std::lock_guard<std::mutex> lock(ParkLock);
+        ParkCond.notify_one();
+    }
+}
+
+
+bool TThreadPool::RunOneJob()
+{
+    IThreadPoolJob *job = nullptr;
+    if (Queue.Dequeue(&job)) {
+        job->Run();
+        job->UnRef();
+        return true;
+    }
+    return false;
+}
+
+
+// job submitted after the check is signalled since parked count is visible to Submit()
+void TThreadPool::Park()
+{
+    std::unique_lock<std::mutex> lock(ParkLock);
+    ParkedCount.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    IThreadPoolJob *job = nullptr;
+    if (!Exit && !Queue.Dequeue(&job)) {
+        ParkCond.wait(lock);
+    }
+    ParkedCount.fetch_add(-1);
+    lock.unlock();
+    if (job) {
+        job->Run();
+        job->UnRef();
+    }
+}
+
+
+void TThreadPool::WorkerThread()
+{
+    yint threadId = ThreadCount.fetch_add(1);
+    SetThreadAffinity(ThreadCpuList[threadId]);
+    yint idleCount = 0;
+    while (!Exit) {
+        if (RunOneJob()) {
+            idleCount = 0;
+        } else if (++idleCount < SPIN_COUNT) {
+            _mm_pause();
+        } else if (idleCount < SPIN_COUNT + YIELD_COUNT) {
+            SchedYield();
+        } else {
+            Park();
+            idleCount = 0;
+        }
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// queue microbenchmarks
+struct TQueueBenchCtx
+{
+    TSingleConsumerJobQueue<yint> ScQueue;
+    TMPMCQueue<yint> MPMCQueue;
+    std::atomic<yint> StartCount;
+    std::atomic<yint> ConsumedCount;
+    std::atomic<yint> Sum;
+    yint ItemCount = 0;
+    bool UseMPMC = false;
+
+    TQueueBenchCtx(yint itemCount) : MPMCQueue(1 << 16), StartCount(0), ConsumedCount(0), Sum(0), ItemCount(itemCount) {}
+};
+
+static void QueueBenchProducer(void *p)
+{
+    TQueueBenchCtx &ctx = *(TQueueBenchCtx *)p;
+    ctx.StartCount.fetch_add(1);
+    for (yint i = 1; i <= ctx.ItemCount; ++i) {
+        if (ctx.UseMPMC) {
+            while (!ctx.MPMCQueue.Enqueue(i)) {
+                SchedYield();
+            }
+        } else {
+            ctx.ScQueue.Enqueue(i);
+        }
+    }
+}
+
+static void QueueBenchConsumer(void *p)
+{
+    TQueueBenchCtx &ctx = *(TQueueBenchCtx *)p;
+    yint sum = 0;
+    yint count = 0;
+    yint total = ctx.ItemCount * 2;
+    TVector<yint> items;
+    while (ctx.ConsumedCount.load() < total) {
+        if (ctx.UseMPMC) {
+            yint val = 0;
+            if (ctx.MPMCQueue.Dequeue(&val)) {
+                sum += val;
+                ctx.ConsumedCount.fetch_add(1);
+                ++count;
+            }
+        } else {
+            items.resize(0);
+            if (ctx.ScQueue.DequeueAll(&items)) {
+                for (yint x : items) {
+                    sum += x;
+                }
+                ctx.ConsumedCount.fetch_add(YSize(items));
+            }
+        }
+    }
+    ctx.Sum.fetch_add(sum);
+}
+
+// 2 producers, consumerCount consumers, returns cycles per item
+static double RunQueueBench(bool useMPMC, yint consumerCount, yint itemCount)
+{
+    TQueueBenchCtx ctx(itemCount);
+    ctx.UseMPMC = useMPMC;
+    ui64 tStart = GetCycleCount();
+    {
+        TThread producer[2];
+        TThread consumer[8];
+        Y_VERIFY(consumerCount <= ARRAY_SIZE(consumer));
+        for (yint k = 0; k < consumerCount; ++k) {
+            consumer[k].Create(QueueBenchConsumer, &ctx);
+        }
+        for (TThread &thr : producer) {
+            thr.Create(QueueBenchProducer, &ctx);
+        }
+    }
+    ui64 t = GetCycleCount() - tStart;
+    Y_VERIFY(ctx.Sum.load() == itemCount * (itemCount + 1));
+    return t / (itemCount * 2.);
+}
+
+void BenchmarkThreadPool()
+{
+    const yint ITEM_COUNT = 1000000;
+    DebugPrintf("single consumer queue, 2 producers: %g cycles per item\n", RunQueueBench(false, 1, ITEM_COUNT));
+    for (yint consumerCount : { 1, 2, 4 }) {
+        DebugPrintf("mpmc queue, 2 producers, %g consumers: %g cycles per item\n", consumerCount * 1., RunQueueBench(true, consumerCount, ITEM_COUNT));
+    }
+
+    // parallel for overhead
+    TIntrusivePtr<TThreadPool> pool = new TThreadPool(Max<yint>(1, GetCpuCount() - 1));
+    const yint ARR_SIZE = 1 << 20;
+    TVector<float> arr;
+    ClearPodArray(&arr, ARR_SIZE);
+    const yint ITER_COUNT = 100;
+    ui64 tStart = GetCycleCount();
+    for (yint iter = 0; iter < ITER_COUNT; ++iter) {
+        ParallelFor(pool.Get(), 0, ARR_SIZE, [&](yint i) { arr[i] += 1; }, 4096);
+    }
+    ui64 tFor = GetCycleCount() - tStart;
+    tStart = GetCycleCount();
+    Y_VERIFY(arr[ARR_SIZE - 1] == ITER_COUNT);
+    TVector<TFuture<yint>> futureArr;
+    for (yint k = 0; k < 10000; ++k) {
+        futureArr.push_back(Async<yint>(pool.Get(), [k]() { return k * k; }));
+    }
+    yint sum = 0;
+    for (TFuture<yint> &f : futureArr) {
+        sum += f.Get();
+    }
+    ui64 tAsync = GetCycleCount() - tStart;
+    Y_VERIFY(sum == 9999ll * 10000 * 19999 / 6);
+    DebugPrintf("thread pool, %g threads, parallel for %g cycles per 1M elements, async %g cycles per job\n",
+        pool->GetThreadCount() * 1., tFor / ITER_COUNT * 1., tAsync / 10000.);
+
+    // idle workers park and wake up on submit
+    std::clock_t cpuStart = std::clock();
+    SleepSeconds(0.5);
+    double idleCpu = (std::clock() - cpuStart) / double(CLOCKS_PER_SEC) / 0.5;
+    Y_VERIFY(Async<yint>(pool.Get(), []() { return 1; }).Get() == 1);
+    ParallelFor(pool.Get(), 0, ARR_SIZE, [&](yint i) { arr[i] += 1; }, 4096);
+    Y_VERIFY(arr[0] == ITER_COUNT + 1);
+    DebugPrintf("idle thread pool uses %g cpus\n", idleCpu);
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <mutex>
+#include <condition_variable>
 
 
 void SetIdlePriority();
@@ -126,6 +128,11 @@ struct TSingleConsumerJobQueue
         Head = 0;
     }
 
+    bool IsEmpty() const
+    {
+        return Head.load() == 0;
+    }
+
     void Enqueue(const T &val)
     {
         TNode *pNode = new TNode(val);
@@ -187,3 +194,392 @@ struct TSingleConsumerJobQueue
         }
     }
 };
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// bounded work stealing deque (Chase-Lev)
+// owner thread pushes and pops from the bottom, any other thread can steal from the top, owner can take from the top too
+// T should be trivially copyable
+template <class T, int LOG_SIZE>
+class TWorkStealingDeque
+{
+    enum {
+        SIZE = 1 << LOG_SIZE,
+        MASK = SIZE - 1,
+    };
+    alignas(64) std::atomic<yint> Top;
+    alignas(64) std::atomic<yint> Bottom;
+    T Buf[SIZE];
+
+public:
+    TWorkStealingDeque() : Top(0), Bottom(0) {}
+
+    // owner only, returns false if deque is full
+    bool Push(const T &val)
+    {
+        yint b = Bottom.load(std::memory_order_relaxed);
+        yint t = Top.load(std::memory_order_acquire);
+        if (b - t >= SIZE) {
+            return false;
+        }
+        Buf[b & MASK] = val;
+        std::atomic_thread_fence(std::memory_order_release);
+        Bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // owner only, retrieves the most recently pushed element
+    bool Pop(T *res)
+    {
+        yint b = Bottom.load(std::memory_order_relaxed) - 1;
+        Bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        yint t = Top.load(std::memory_order_relaxed);
+        if (t > b) {
+            Bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        *res = Buf[b & MASK];
+        if (t == b) {
+            // last element, race with thieves
+            bool ok = Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            Bottom.store(b + 1, std::memory_order_relaxed);
+            return ok;
+        }
+        return true;
+    }
+
+    // any thread, retrieves the oldest element, can fail spuriously on contention
+    bool Steal(T *res)
+    {
+        yint t = Top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        yint b = Bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        *res = Buf[t & MASK];
+        return Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // owner only, retrieves the oldest element like thieves do, returns false if deque is empty
+    bool PopOldest(T *res)
+    {
+        for (;;) {
+            yint t = Top.load(std::memory_order_acquire);
+            yint b = Bottom.load(std::memory_order_relaxed);
+            if (t >= b) {
+                return false;
+            }
+            *res = Buf[t & MASK];
+            if (Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// bounded lock free multi producer multi consumer queue (Vyukov)
+// capacity is rounded up to power of 2, items are retrieved in FIFO order, no allocations after construction
+template <class T>
+class TMPMCQueue : public TNonCopyable
+{
+    struct TCell
+    {
+        std::atomic<yint> Seq;
+        T Val;
+    };
+    TCell *Buf = nullptr;
+    yint Mask = 0;
+    alignas(64) std::atomic<yint> EnqueuePos;
+    alignas(64) std::atomic<yint> DequeuePos;
+
+public:
+    TMPMCQueue(yint capacity) : EnqueuePos(0), DequeuePos(0)
+    {
+        yint sz = 2;
+        while (sz < capacity) {
+            sz *= 2;
+        }
+        Buf = new TCell[sz];
+        Mask = sz - 1;
+        for (yint i = 0; i < sz; ++i) {
+            Buf[i].Seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~TMPMCQueue()
+    {
+        delete[] Buf;
+    }
+
+    // returns false if queue is full
+    bool Enqueue(const T &val)
+    {
+        yint pos = EnqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            TCell &cell = Buf[pos & Mask];
+            yint seq = cell.Seq.load(std::memory_order_acquire);
+            yint dif = seq - pos;
+            if (dif == 0) {
+                if (EnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.Val = val;
+                    cell.Seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = EnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // returns false if queue is empty
+    bool Dequeue(T *res)
+    {
+        yint pos = DequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            TCell &cell = Buf[pos & Mask];
+            yint seq = cell.Seq.load(std::memory_order_acquire);
+            yint dif = seq - (pos + 1);
+            if (dif == 0) {
+                if (DequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *res = cell.Val;
+                    cell.Seq.store(pos + Mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = DequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// cpu affinity
+enum EThreadPin
+{
+    PIN_NONE,
+    PIN_CORE, // each thread is bound to a single cpu
+    PIN_NUMA_NODE, // threads are bound to all cpus of numa node
+};
+
+yint GetCpuCount();
+yint GetNumaNodeCount();
+void GetNumaNodeCpuList(yint node, TVector<int> *pRes);
+void SetThreadAffinity(const TVector<int> &cpuList); // bind current thread
+
+// memory placement, pages fully inside [p, p + sz) are moved to the node(s), no-op if not supported
+void SetMemoryNumaNode(void *p, yint sz, yint node);
+void SetMemoryInterleaved(void *p, yint sz);
+
+
+template <class TFunc>
+struct TRunOnNumaNodeCtx
+{
+    const TFunc *Func;
+    yint Node;
+
+    static void Run(void *p)
+    {
+        TRunOnNumaNodeCtx &ctx = *(TRunOnNumaNodeCtx *)p;
+        TVector<int> cpuList;
+        GetNumaNodeCpuList(ctx.Node, &cpuList);
+        SetThreadAffinity(cpuList);
+        (*ctx.Func)();
+    }
+};
+
+// run func() on a thread bound to the numa node, first touch memory allocations done by func() are placed on this node
+template <class TFunc>
+void RunOnNumaNode(yint node, const TFunc &func)
+{
+    TRunOnNumaNodeCtx<TFunc> ctx;
+    ctx.Func = &func;
+    ctx.Node = node;
+    TThread thr;
+    thr.Create(TRunOnNumaNodeCtx<TFunc>::Run, &ctx);
+    thr.Join();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// fixed size thread pool
+// idle workers spin for a while, then park on condition variable until job is submitted
+struct IThreadPoolJob : public TThrRefBase
+{
+    virtual void Run() = 0;
+};
+
+
+class TThreadPool : public TThrRefBase
+{
+    enum {
+        QUEUE_SIZE = 1 << 14,
+        SPIN_COUNT = 1000,
+        YIELD_COUNT = 100,
+    };
+    struct TPoolThread : public TThrRefBase
+    {
+        TThread Thr;
+    };
+    TMPMCQueue<IThreadPoolJob *> Queue;
+    TVector<TIntrusivePtr<TPoolThread>> ThreadArr;
+    TVector<TVector<int>> ThreadCpuList;
+    std::atomic<yint> ThreadCount;
+    std::atomic<yint> ParkedCount;
+    std::mutex ParkLock;
+    std::condition_variable ParkCond;
+    std::atomic<bool> Exit;
+
+    ~TThreadPool();
+    void Park();
+public:
+    // numaNode < 0 means all cpus
+    TThreadPool(yint threadCount, EThreadPin pin = PIN_NONE, yint numaNode = -1);
+    yint GetThreadCount() const { return YSize(ThreadArr); }
+    void Submit(IThreadPoolJob *job); // waits running queued jobs if queue is full
+    bool RunOneJob(); // run queued job on the calling thread, returns false if there are none
+    void WorkerThread();
+};
+
+
+template <class T>
+struct TFutureState : public TThrRefBase
+{
+    std::atomic<bool> IsReady;
+    T Val;
+
+    TFutureState() : IsReady(false) {}
+};
+
+
+template <class T>
+class TFuture
+{
+    TIntrusivePtr<TThreadPool> Pool;
+    TIntrusivePtr<TFutureState<T>> State;
+public:
+    TFuture() {}
+    TFuture(TThreadPool *pool, TFutureState<T> *state) : Pool(pool), State(state) {}
+    bool IsReady() const { return State->IsReady.load(); }
+    // caller runs pool jobs while waiting, so waiting inside pool job does not deadlock
+    const T &Get()
+    {
+        while (!State->IsReady.load()) {
+            if (!Pool->RunOneJob()) {
+                SchedYield();
+            }
+        }
+        return State->Val;
+    }
+};
+
+
+template <class T, class TFunc>
+struct TAsyncJob : public IThreadPoolJob
+{
+    TFunc Func;
+    TIntrusivePtr<TFutureState<T>> State;
+
+    TAsyncJob(const TFunc &func, TFutureState<T> *state) : Func(func), State(state) {}
+    void Run() override
+    {
+        State->Val = Func();
+        State->IsReady = true;
+    }
+};
+
+
+// run func() on the pool, result is returned via future
+template <class T, class TFunc>
+TFuture<T> Async(TThreadPool *pool, const TFunc &func)
+{
+    TFutureState<T> *state = new TFutureState<T>();
+    TFuture<T> res(pool, state);
+    pool->Submit(new TAsyncJob<T, TFunc>(func, state));
+    return res;
+}
+
+
+template <class TFunc>
+struct TParallelForJob : public IThreadPoolJob
+{
+    struct TState : public TThrRefBase
+    {
+        std::atomic<yint> NextBlock;
+        std::atomic<yint> DoneBlocks;
+        TState() : NextBlock(0), DoneBlocks(0) {}
+    };
+    TIntrusivePtr<TState> State;
+    const TFunc *Func = nullptr;
+    yint Beg = 0;
+    yint End = 0;
+    yint BlockSize = 0;
+    yint BlockCount = 0;
+
+    // returns true if some blocks were processed
+    bool RunBlocks()
+    {
+        bool res = false;
+        for (;;) {
+            yint block = State->NextBlock.fetch_add(1);
+            if (block >= BlockCount) {
+                return res;
+            }
+            yint from = Beg + block * BlockSize;
+            yint to = Min(End, from + BlockSize);
+            for (yint i = from; i < to; ++i) {
+                (*Func)(i);
+            }
+            State->DoneBlocks.fetch_add(1);
+            res = true;
+        }
+    }
+    void Run() override
+    {
+        RunBlocks();
+    }
+};
+
+
+// calls func(i) for i in [beg, end) split into blocks of blockSize, calling thread participates
+// returns after all calls are complete
+template <class TFunc>
+void ParallelFor(TThreadPool *pool, yint beg, yint end, const TFunc &func, yint blockSize = 1)
+{
+    if (end <= beg) {
+        return;
+    }
+    typedef TParallelForJob<TFunc> TJob;
+    TIntrusivePtr<typename TJob::TState> state = new typename TJob::TState();
+    yint blockCount = DivCeil(end - beg, blockSize);
+    yint helperCount = Min<yint>(pool->GetThreadCount(), blockCount - 1);
+    TIntrusivePtr<TJob> job = new TJob();
+    job->State = state;
+    job->Func = &func;
+    job->Beg = beg;
+    job->End = end;
+    job->BlockSize = blockSize;
+    job->BlockCount = blockCount;
+    // helper jobs can start after completion, they find no blocks then and do not touch func
+    for (yint k = 0; k < helperCount; ++k) {
+        TJob *helper = new TJob(*job);
+        pool->Submit(helper);
+    }
+    job->RunBlocks();
+    while (state->DoneBlocks.load() < blockCount) {
+        if (!pool->RunOneJob()) {
+            SchedYield();
+        }
+    }
+}
+
+
+void BenchmarkThreadPool();
@@ -1,8 +1,8 @@
 #pragma once
 #include <math.h>
 
-template<class T>
-void ClearPodArray(vector<T> *res, yint count)
+template<class T, class TAlloc>
+void ClearPodArray(vector<T, TAlloc> *res, yint count)
 {
     res->yresize(count);
     memset(res->data(), 0, sizeof(T) * count);
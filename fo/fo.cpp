@@ -1023,7 +1023,8 @@ void GenerateCMake(const TVector<TSourceFolder> &projArr, const TString &slnName
     TOFStream f(targetFolder + "/CMakeLists.txt");
     f << "cmake_minimum_required(VERSION 3.22)\n";
     //#set(CMAKE_CXX_FLAGS "-Wno-error=unused-command-line-argument")
-    f << "add_compile_options(-march=native)\n";
+    // x86-64-v3 (avx2, fma, f16c) baseline, faster isa are used by runtime dispatch only, see gpt/model_params/sse_utils.h
+    f << "add_compile_options(-march=x86-64-v3)\n";
     f << "include_directories(" << pathToProj.c_str() << ")\n";
     if (allowCuda) {
         f << "project(" << slnName << " LANGUAGES CXX CUDA)\n";